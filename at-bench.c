@@ -0,0 +1,1872 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at-bench.c
+ * @brief Benchmarks for the modem code paths
+ *
+ * Runs without a modem or a display: "make bench".
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <sys/select.h>
+#include <glib.h>
+
+#include "at_parser.h"
+#include "at_text.h"
+#include "at_queue.h"
+#include "at_trace.h"
+#include "serial.h"
+#include "status.h"
+#include "sms.h"
+#include "sms_tx.h"
+#include "modem_sim.h"
+#include "probe.h"
+#include "tone.h"
+
+/* EG25 traffic captured around an incoming call, a status query and a
+ * +QIND flood after network registration. */
+static const char recorded_session[] =
+    "\r\nRDY\r\n"
+    "\r\n+CFUN: 1\r\n"
+    "\r\n+CPIN: READY\r\n"
+    "\r\n+QUSIM: 1\r\n"
+    "\r\n+QIND: SMS DONE\r\n"
+    "\r\n+QIND: PB DONE\r\n"
+    "ATZ\r\r\nOK\r\n"
+    "AT+CSQ\r\r\n+CSQ: 22,99\r\n\r\nOK\r\n"
+    "AT+CREG?\r\r\n+CREG: 0,1\r\n\r\nOK\r\n"
+    "AT+COPS?\r\r\n+COPS: 0,0,\"Rhizomatica ROAMING\",7\r\n\r\nOK\r\n"
+    "\r\n+QIND: \"csq\",22,99\r\n"
+    "\r\n+QIND: \"act\",\"LTE\"\r\n"
+    "\r\nRING\r\n"
+    "\r\n+CLIP: \"+5511999990000\",145,,,,0\r\n"
+    "\r\nRING\r\n"
+    "\r\n+CLIP: \"+5511999990000\",145,,,,0\r\n"
+    "ATA\r\r\nOK\r\n"
+    "AT+CLCC\r\r\n+CLCC: 1,1,0,0,0,\"+5511999990000\",145\r\n\r\nOK\r\n"
+    "\r\nNO CARRIER\r\n"
+    "\r\n+QIND: \"csq\",21,99\r\n"
+    "AT+QCFG=\"usbnet\"\r\r\n+QCFG: \"usbnet\",0\r\n\r\nOK\r\n"
+    "\r\n+CMTI: \"ME\",3\r\n"
+    "AT+CMGF=0\r\r\nOK\r\n"
+    "AT+CPAS\r\r\n+CPAS: 0\r\n\r\nOK\r\n"
+    "ATD+5511999990000;\r\r\nOK\r\n"
+    "\r\nBUSY\r\n"
+    "AT+CMGD=9\r\r\n+CMS ERROR: 321\r\n";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char *load_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *data;
+    long size;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, f) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *len = size;
+    return data;
+}
+
+/* ---- parser throughput ---- */
+
+struct parser_counts {
+    uint64_t rings;
+    uint64_t finals;
+};
+
+static void count_line(const struct at_line *line, void *user)
+{
+    struct parser_counts *c = user;
+
+    if (line->token == AT_TOK_RING || line->token == AT_TOK_CRING)
+        c->rings++;
+    else if (at_token_flags(line->token) & AT_FLAG_FINAL)
+        c->finals++;
+}
+
+/* Feed the trace in read()-sized pieces of varying length, so lines get
+ * split across reads the way they do on the tty. */
+static void parse_trace(struct at_parser *p, const char *trace, size_t len,
+                        unsigned int max_chunk)
+{
+    uint32_t seed = 12345;
+    size_t off = 0, chunk, space;
+    char *dst;
+
+    while (off < len) {
+        seed = seed * 1103515245 + 12345;
+        chunk = 1 + (seed >> 16) % max_chunk;
+        if (chunk > len - off)
+            chunk = len - off;
+        dst = at_parser_write_ptr(p, &space);
+        if (chunk > space)
+            chunk = space;
+        memcpy(dst, trace + off, chunk);
+        at_parser_commit(p, chunk);
+        off += chunk;
+    }
+}
+
+static int bench_parser(const char *trace, size_t len, unsigned int iterations)
+{
+    static struct at_parser parser;
+    struct parser_counts whole = {0}, split = {0};
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    /* reference result: whole trace in a single feed */
+    at_parser_init(&parser, count_line, &whole);
+    at_parser_feed(&parser, trace, len);
+
+    at_parser_init(&parser, count_line, &split);
+    parse_trace(&parser, trace, len, 7);
+    if (split.rings != whole.rings || split.finals != whole.finals) {
+        fprintf(stderr, "parser: split reads changed the result (RING %llu/%llu)\n",
+                (unsigned long long) split.rings, (unsigned long long) whole.rings);
+        return EXIT_FAILURE;
+    }
+
+    memset(&split, 0, sizeof(split));
+    at_parser_init(&parser, count_line, &split);
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        parse_trace(&parser, trace, len, 512);
+    elapsed = now_ns() - start;
+
+    printf("parser: %u x %zu bytes, %llu lines, %llu RING, %llu final\n",
+           iterations, len, (unsigned long long) parser.lines,
+           (unsigned long long) split.rings, (unsigned long long) split.finals);
+    printf("parser: %.1f MB/s, %.1f ns/line\n",
+           (double) parser.bytes * 1000.0 / elapsed,
+           (double) elapsed / parser.lines);
+    return EXIT_SUCCESS;
+}
+
+/* ---- replay of a capture made with "dialer -t" ---- */
+
+static int bench_replay(const char *path, bool realtime)
+{
+    static struct at_parser parser;
+    struct parser_counts counts = {0};
+    struct at_replay_stats st;
+
+    at_parser_init(&parser, count_line, &counts);
+    if (!at_trace_replay(path, &parser, realtime, &st)) {
+        fprintf(stderr, "replay: %s is not a complete trace\n", path);
+        return EXIT_FAILURE;
+    }
+
+    printf("replay: %llu records in %llu sessions, %llu bytes RX, %llu bytes TX\n",
+           (unsigned long long) st.records, (unsigned long long) st.sessions,
+           (unsigned long long) st.rx_bytes, (unsigned long long) st.tx_bytes);
+    printf("replay: %llu lines, %llu RING, %llu final in %.1f ms",
+           (unsigned long long) parser.lines, (unsigned long long) counts.rings,
+           (unsigned long long) counts.finals, st.elapsed_ns / 1e6);
+    if (realtime)
+        printf(", at most %.1f us late\n", st.max_late_ns / 1000.0);
+    else
+        printf(", %.1f MB/s\n", (double) st.rx_bytes * 1000.0 / st.elapsed_ns);
+    return EXIT_SUCCESS;
+}
+
+/* ---- classifier vs. the old is_final_result() ---- */
+
+#define STARTS_WITH(a, b) ( strncmp((a), (b), strlen(b)) == 0)
+
+/* at.c before the table driven classifier. It was an extern function
+ * there, so it is not inlined here either. */
+__attribute__((noinline))
+static bool legacy_is_final_result(const char * const response)
+{
+    switch (response[0]) {
+    case '+':
+        if (STARTS_WITH(&response[1], "CME ERROR:")) {
+            return true;
+        }
+        if (STARTS_WITH(&response[1], "CMS ERROR:")) {
+            return true;
+        }
+        return false;
+    case 'B':
+        if (strcmp(&response[1], "USY\r\n") == 0) {
+            return true;
+        }
+        return false;
+    case 'E':
+        if (strcmp(&response[1], "RROR\r\n") == 0) {
+            return true;
+        }
+        return false;
+    case 'N':
+        if (strcmp(&response[1], "O ANSWER\r\n") == 0) {
+            return true;
+        }
+        if (strcmp(&response[1], "O CARRIER\r\n") == 0) {
+            return true;
+        }
+        if (strcmp(&response[1], "O DIALTONE\r\n") == 0) {
+            return true;
+        }
+        return false;
+    case 'O':
+        if (strcmp(&response[1], "K\r\n") == 0) {
+            return true;
+        }
+        return false;
+    case 'R':
+        if (strcmp(&response[1], "ING\r\n") == 0) {
+            return true;
+        }
+        /* no break */
+    default:
+        return false;
+    }
+}
+
+#define MAX_BENCH_LINES 4096
+#define CLASSIFY_ROUNDS 5
+
+struct line_set {
+    char *text[MAX_BENCH_LINES];    /* NUL terminated, with CR LF */
+    size_t len[MAX_BENCH_LINES];    /* without CR LF */
+    unsigned int count;
+};
+
+static void collect_line(const struct at_line *line, void *user)
+{
+    struct line_set *set = user;
+    char *copy;
+
+    if (set->count == MAX_BENCH_LINES)
+        return;
+    copy = malloc(line->len + 3);
+    memcpy(copy, line->data, line->len);
+    memcpy(copy + line->len, "\r\n", 3);
+    set->text[set->count] = copy;
+    set->len[set->count] = line->len;
+    set->count++;
+}
+
+static int bench_classify(const char *trace, size_t len, unsigned int iterations)
+{
+    static struct at_parser parser;
+    static struct line_set set;
+    unsigned int i, n, round, legacy_finals = 0, finals = 0, typed = 0;
+    uint64_t start, elapsed, legacy_ns = 0, table_ns = 0;
+    enum at_token token;
+
+    /* the keyword hash is computed ahead of time, check every slot */
+    for (token = AT_TOK_OK; token < AT_TOK_COUNT; token++) {
+        const char *key = at_token_name(token);
+        char with_args[32];
+
+        snprintf(with_args, sizeof(with_args), "%s: 1", key);
+        if (at_line_classify(key, strlen(key)) != token ||
+            (token != AT_TOK_CONNECT && strlen(key) >= 4 &&
+             at_line_classify(with_args, strlen(with_args)) != token)) {
+            fprintf(stderr, "classify: \"%s\" is not found in its slot\n", key);
+            return EXIT_FAILURE;
+        }
+    }
+
+    at_parser_init(&parser, collect_line, &set);
+    at_parser_feed(&parser, trace, len);
+    if (set.count == 0)
+        return EXIT_SUCCESS;
+
+    /* best of a few alternating rounds, a single one is at the mercy of
+     * the clock governor */
+    for (round = 0; round < CLASSIFY_ROUNDS; round++) {
+        legacy_finals = finals = typed = 0;
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            for (n = 0; n < set.count; n++)
+                legacy_finals += legacy_is_final_result(set.text[n]);
+        elapsed = now_ns() - start;
+        if (round == 0 || elapsed < legacy_ns)
+            legacy_ns = elapsed;
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            for (n = 0; n < set.count; n++) {
+                token = at_line_classify(set.text[n], set.len[n]);
+                finals += (at_token_flags(token) & AT_FLAG_FINAL) != 0;
+                typed += token != AT_TOK_UNKNOWN;
+            }
+        }
+        elapsed = now_ns() - start;
+        if (round == 0 || elapsed < table_ns)
+            table_ns = elapsed;
+    }
+
+    printf("classify: %u lines, old is_final_result() %.1f ns/line, %u final\n",
+           set.count, (double) legacy_ns / ((uint64_t) iterations * set.count),
+           legacy_finals / iterations);
+    printf("classify: table %.1f ns/line, %u final, %u of %u lines typed\n",
+           (double) table_ns / ((uint64_t) iterations * set.count),
+           finals / iterations, typed / iterations, set.count);
+
+    for (n = 0; n < set.count; n++)
+        free(set.text[n]);
+    set.count = 0;
+    return EXIT_SUCCESS;
+}
+
+/* ---- line scanning and log sanitizing, vector kernels vs. the old loops ---- */
+
+/* at.c and at_parser.c before at_text.c */
+static void legacy_strip_cr(char *s)
+{
+    char *from, *to;
+    from = to = s;
+    while (*from != '\0') {
+        if (*from == '\r') {
+            from++;
+            continue;
+        }
+        *to++ = *from++;
+    }
+    *to = '\0';
+}
+
+static void legacy_safe_output(unsigned char *buf, int cc)
+{
+    int i, c;
+
+    for (i = 0; i < cc; i++) {
+        c = buf[i];
+        if (c == '\r' || c == '\n' || c == '\t' || c == '\b') {
+            continue;
+        }
+        if (c & 0x80) {
+            c &= 0x7F;
+        }
+        if (c < 0x20) {
+            buf[i] = '^';
+        } else if (c == 0x7F) {
+            buf[i] = '?';
+        }
+    }
+}
+
+static size_t legacy_find_eol(const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\r' || s[i] == '\n')
+            break;
+    }
+    return i;
+}
+
+static const char *text_impls[] = { "scalar", "sse2", "avx2", "neon" };
+
+#define TEXT_CHECK_ROUNDS 20000
+#define TEXT_CHECK_MAX 200
+
+/* mostly text, with plenty of line ends, control bytes and high bit set */
+static unsigned char random_byte(void)
+{
+    static const unsigned char special[] = {
+        '\r', '\n', '\t', '\b', 0, 0x1B, 0x1F, 0x7F, 0x80, 0x8D, 0x8A, 0x9F, 0xFF, 0xA0,
+    };
+    int r = rand();
+
+    if (r % 4 == 0)
+        return special[(r >> 4) % sizeof(special)];
+    return (r >> 4) & 0xFF;
+}
+
+/* the kernel set in use against the old loops, at every length and
+ * alignment up to a few vectors */
+static bool text_equivalent(void)
+{
+    unsigned char in[TEXT_CHECK_MAX + 64], a[TEXT_CHECK_MAX + 64], b[TEXT_CHECK_MAX + 64];
+    unsigned int round;
+    size_t len, off, i;
+
+    for (round = 0; round < TEXT_CHECK_ROUNDS; round++) {
+        len = rand() % TEXT_CHECK_MAX;
+        off = rand() % 32;
+        for (i = 0; i < len; i++)
+            in[off + i] = random_byte();
+
+        memcpy(a, in, sizeof(in));
+        memcpy(b, in, sizeof(in));
+        legacy_safe_output(a + off, len);
+        at_safe_output(b + off, len);
+        if (memcmp(a, b, sizeof(a)) != 0)
+            return false;
+
+        if (legacy_find_eol((char *) in + off, len) != at_find_eol((char *) in + off, len))
+            return false;
+
+        // strip_cr() works on strings
+        for (i = 0; i < len; i++)
+            if (in[off + i] == 0)
+                in[off + i] = 'x';
+        in[off + len] = 0;
+        memcpy(a, in, sizeof(in));
+        memcpy(b, in, sizeof(in));
+        legacy_strip_cr((char *) a + off);
+        at_strip_cr((char *) b + off);
+        if (memcmp(a, b, sizeof(a)) != 0)
+            return false;
+    }
+    return true;
+}
+
+#define TEXT_BENCH_SIZE 65536
+/* best of, the numbers are for comparing kernel sets */
+#define TEXT_ROUNDS 5
+
+/* what AT+QCFG=? and the debug URCs look like: long lines, few line ends */
+static const char qcfg_dump[] =
+    "+QCFG: \"nwscanmode\",(0-3,5),(0,1)\r\n"
+    "+QCFG: \"band\",(0-1ff),(0-7fffffffffffffff),(0-7fffffffffffffff),(0,1)\r\n"
+    "+QCFG: \"ims\",(0,1),(0,1)\r\n"
+    "+QIND: \"csq\",\"timeout\",\"pdp\",\"FOTA\",\"HTTPSTART\",\"HTTPEND\",100\r\n"
+    "+QCFG: \"urc/ri/ring\",(\"off\",\"pulse\",\"always\",\"auto\",\"wave\"),(1-2000),(1-10000),(1-5),(\"off\",\"on\"),(0,1)\r\n"
+    "+QCFG: \"risignaltype\",(\"respective\",\"physical\")\r\n";
+
+static double mb_per_s(size_t bytes, unsigned int rounds, uint64_t ns)
+{
+    return (double) bytes * rounds * 1000.0 / ns;
+}
+
+struct text_run {
+    const char *name;
+    unsigned char tiled[TEXT_BENCH_SIZE];
+    unsigned char work[TEXT_BENCH_SIZE + 1];
+    unsigned int rounds;
+};
+
+static void text_fill(struct text_run *t, const char *name, const char *data, size_t len)
+{
+    size_t i, n;
+
+    t->name = name;
+    // a long stretch of output: the sample over and over
+    for (i = 0; i < TEXT_BENCH_SIZE; i += n) {
+        n = len < TEXT_BENCH_SIZE - i ? len : TEXT_BENCH_SIZE - i;
+        memcpy(t->tiled + i, data, n);
+    }
+}
+
+/* ns for safe_output, find_eol over every line and strip_cr, with the
+ * old loops or the kernel set in use */
+static void text_measure_once(struct text_run *t, bool legacy, uint64_t ns[3])
+{
+    uint64_t start;
+    unsigned int r;
+    size_t pos;
+
+    start = now_ns();
+    for (r = 0; r < t->rounds; r++) {
+        memcpy(t->work, t->tiled, TEXT_BENCH_SIZE);
+        if (legacy)
+            legacy_safe_output(t->work, TEXT_BENCH_SIZE);
+        else
+            at_safe_output(t->work, TEXT_BENCH_SIZE);
+    }
+    ns[0] = now_ns() - start;
+
+    start = now_ns();
+    for (r = 0; r < t->rounds; r++) {
+        for (pos = 0; pos < TEXT_BENCH_SIZE; pos++) {
+            if (legacy)
+                pos += legacy_find_eol((char *) t->tiled + pos, TEXT_BENCH_SIZE - pos);
+            else
+                pos += at_find_eol((char *) t->tiled + pos, TEXT_BENCH_SIZE - pos);
+        }
+    }
+    ns[1] = now_ns() - start;
+
+    start = now_ns();
+    for (r = 0; r < t->rounds; r++) {
+        memcpy(t->work, t->tiled, TEXT_BENCH_SIZE);
+        t->work[TEXT_BENCH_SIZE] = 0;
+        if (legacy)
+            legacy_strip_cr((char *) t->work);
+        else
+            at_strip_cr((char *) t->work);
+    }
+    ns[2] = now_ns() - start;
+}
+
+/* MB/s, best of TEXT_ROUNDS */
+static void text_measure(struct text_run *t, bool legacy, double mbs[3])
+{
+    uint64_t best[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX }, ns[3];
+    unsigned int round, i;
+
+    for (round = 0; round < TEXT_ROUNDS; round++) {
+        text_measure_once(t, legacy, ns);
+        for (i = 0; i < 3; i++)
+            if (ns[i] < best[i])
+                best[i] = ns[i];
+    }
+    for (i = 0; i < 3; i++)
+        mbs[i] = mb_per_s(TEXT_BENCH_SIZE, t->rounds, best[i]);
+}
+
+static void text_print(const char *input, const char *impl, const double mbs[3])
+{
+    printf("text: %-6s %-12s safe_output %5.0f MB/s, find_eol %5.0f MB/s, strip_cr %5.0f MB/s\n",
+           input, impl, mbs[0], mbs[1], mbs[2]);
+}
+
+static int bench_text(const char *trace, size_t len, unsigned int iterations)
+{
+    static struct text_run runs[2];
+    const char *best = at_text_impl();
+    char label[32];
+    double mbs[3];
+    unsigned int impl, i;
+
+    if (len == 0)
+        return EXIT_SUCCESS;
+    text_fill(&runs[0], "trace", trace, len);
+    text_fill(&runs[1], "qcfg", qcfg_dump, sizeof(qcfg_dump) - 1);
+    for (i = 0; i < 2; i++) {
+        runs[i].rounds = iterations / 20 ? iterations / 20 : 1;
+        text_measure(&runs[i], true, mbs);
+        text_print(runs[i].name, "old loops", mbs);
+    }
+
+    for (impl = 0; impl < sizeof(text_impls) / sizeof(text_impls[0]); impl++) {
+        if (!at_text_select(text_impls[impl]))
+            continue;
+        if (!text_equivalent()) {
+            fprintf(stderr, "text: %s differs from the old loops\n", text_impls[impl]);
+            at_text_select(best);
+            return EXIT_FAILURE;
+        }
+        snprintf(label, sizeof(label), "%s%s", text_impls[impl],
+                 strcmp(text_impls[impl], best) == 0 ? " (used)" : "");
+        for (i = 0; i < 2; i++) {
+            text_measure(&runs[i], false, mbs);
+            text_print(runs[i].name, label, mbs);
+        }
+    }
+    printf("text: every kernel set matches the old loops on %u random buffers\n",
+           TEXT_CHECK_ROUNDS);
+
+    at_text_select(best);
+    return EXIT_SUCCESS;
+}
+
+/* ---- probe overhead ---- */
+
+static int bench_probes(unsigned int iterations)
+{
+#ifdef ENABLE_PROBES
+    uint64_t start, elapsed, stamp;
+    unsigned int i;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        PROBE_START(stamp);
+        PROBE_END(PROBE_RX_PARSE, stamp);
+    }
+    elapsed = now_ns() - start;
+    probe_reset();
+
+    printf("probe: %.1f ns per start/end pair\n", (double) elapsed / iterations);
+#endif
+    return EXIT_SUCCESS;
+}
+
+/* ---- end to end, through a pty to the simulated EG25 ---- */
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *what, uint64_t *ns, unsigned int n)
+{
+    if (n == 0) {
+        printf("%s: no samples\n", what);
+        return;
+    }
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    printf("%s: n=%u p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", what, n,
+           ns[n / 2] / 1000.0, ns[n * 9 / 10] / 1000.0, ns[n * 99 / 100] / 1000.0,
+           ns[n - 1] / 1000.0);
+}
+
+struct e2e_run {
+    struct modem_sim sim;
+    atomic_bool stop;
+
+    struct at_parser parser;
+    struct at_queue queue;
+
+    uint64_t *samples;
+    unsigned int count;
+    unsigned int wanted;
+    uint64_t submitted_ns;
+    unsigned int errors;
+
+    /* throughput: keep the queue full of long commands */
+    bool flood;
+    unsigned int submitted;
+    uint64_t write_calls;
+    uint64_t rejected;
+
+    struct at_trace *capture;
+};
+
+static void e2e_capture_tx(const char *data, size_t len, void *user)
+{
+    at_trace_record(user, AT_TRACE_TX, data, len);
+}
+
+static int sim_thread(void *arg)
+{
+    struct e2e_run *r = arg;
+
+    while (!atomic_load(&r->stop))
+        modem_sim_step(&r->sim, 20);
+    return 0;
+}
+
+static void e2e_line(const struct at_line *line, void *user)
+{
+    struct e2e_run *r = user;
+    unsigned int seen;
+
+    if (at_queue_line(&r->queue, line))
+        return;
+    if (line->token == AT_TOK_RING && r->count < r->wanted) {
+        seen = r->count;
+        r->samples[r->count++] = modem_sim_now_ns() -
+            r->sim.ring_stamp[seen & (SIM_STAMPS - 1)];
+    }
+}
+
+static const char *rtt_commands[] = { "ATZ", "AT+CSQ", "ATD+5511999990000;", "ATH", "AT+CREG?" };
+
+/* about the size of a concatenated SMS PDU, so the tty write path has
+ * something to chew on */
+static char flood_command[AT_CMD_MAX - 1];
+
+static void e2e_done(const struct at_command *cmd, enum at_token result,
+                     const char *response, void *user);
+
+static void flood_submit(struct e2e_run *r)
+{
+    while (r->submitted < r->wanted &&
+           at_queue_submit(&r->queue, flood_command, AT_PRIO_BACKGROUND, 0, e2e_done, r))
+        r->submitted++;
+}
+
+static void e2e_done(const struct at_command *cmd, enum at_token result,
+                     const char *response, void *user)
+{
+    struct e2e_run *r = user;
+
+    if (at_token_flags(result) & AT_FLAG_ERROR || result == AT_RESULT_TIMEOUT)
+        r->errors++;
+    if (r->flood) {
+        r->count++;
+        flood_submit(r);
+        return;
+    }
+    r->samples[r->count++] = modem_sim_now_ns() - r->submitted_ns;
+    if (r->count < r->wanted) {
+        r->submitted_ns = modem_sim_now_ns();
+        at_queue_submit(&r->queue, rtt_commands[r->count % 5], AT_PRIO_NORMAL, 0, e2e_done, r);
+    }
+}
+
+/* Drive the dialer side exactly like at.c does: open_serial_port(), the
+ * parser fed by read(), the command queue with its timeouts. */
+static int e2e_run(struct e2e_run *r, const struct modem_sim_config *cfg, bool commands)
+{
+    struct pollfd pfd;
+    thrd_t thread;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    int fd, ms;
+    uint64_t give_up;
+
+    if (!modem_sim_open(&r->sim, cfg, NULL)) {
+        perror("modem_sim_open");
+        return EXIT_FAILURE;
+    }
+    atomic_store(&r->stop, false);
+    thrd_create(&thread, sim_thread, r);
+
+    fd = open_serial_port(r->sim.slave_path);
+    set_fixed_baudrate("115200", fd);
+    at_parser_init(&r->parser, e2e_line, r);
+    at_queue_init(&r->queue, fd);
+    if (r->capture)
+        at_queue_set_tx_tap(&r->queue, e2e_capture_tx, r->capture);
+
+    r->submitted = 0;
+    r->errors = 0;
+    if (r->flood) {
+        flood_submit(r);
+    } else if (commands) {
+        r->submitted_ns = modem_sim_now_ns();
+        at_queue_submit(&r->queue, rtt_commands[0], AT_PRIO_NORMAL, 0, e2e_done, r);
+    }
+
+    give_up = modem_sim_now_ns() + 60 * 1000000000ull;
+    while (r->count < r->wanted && modem_sim_now_ns() < give_up) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (at_queue_output_pending(&r->queue))
+            pfd.events |= POLLOUT;
+        ms = at_queue_next_timeout(&r->queue);
+        if (ms < 0 || ms > 100)
+            ms = 100;
+        if (poll(&pfd, 1, ms) > 0) {
+            if (pfd.revents & POLLOUT)
+                at_queue_output_ready(&r->queue);
+            if (pfd.revents & POLLIN) {
+                rx_ptr = at_parser_write_ptr(&r->parser, &rx_space);
+                cc = read(fd, rx_ptr, rx_space);
+                if (cc > 0 && r->capture)
+                    at_trace_record(r->capture, AT_TRACE_RX, rx_ptr, cc);
+                if (cc > 0)
+                    at_parser_commit(&r->parser, cc);
+            }
+        }
+        at_queue_check_timeouts(&r->queue);
+    }
+    r->write_calls = r->queue.write_calls;
+    r->rejected = r->queue.rejected;
+
+    atomic_store(&r->stop, true);
+    thrd_join(thread, NULL);
+    at_queue_destroy(&r->queue);
+    close(fd);
+    modem_sim_close(&r->sim);
+
+    return r->count == r->wanted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int bench_end_to_end(unsigned int urcs, unsigned int commands, const char *capture)
+{
+    static struct e2e_run run;
+    static struct at_trace trace;
+    struct modem_sim_config cfg;
+    int ret;
+
+    if (capture) {
+        if (!at_trace_open(&trace, capture)) {
+            perror(capture);
+            return EXIT_FAILURE;
+        }
+        run.capture = &trace;
+    }
+
+    run.samples = calloc(urcs > commands ? urcs : commands, sizeof(uint64_t));
+
+    /* command round trip, no incoming calls in the way */
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 0;
+    run.count = 0;
+    run.wanted = commands;
+    ret = e2e_run(&run, &cfg, true);
+    run.capture = NULL;
+    at_trace_close(&trace);
+    print_percentiles("command round trip", run.samples, run.count);
+    if (run.errors)
+        printf("command round trip: %u commands failed\n", run.errors);
+
+    /* a phone that keeps ringing every 2 ms */
+    if (ret == EXIT_SUCCESS) {
+        cfg.ring_interval_ms = 2;
+        cfg.rings_per_call = 0;
+        run.count = 0;
+        run.wanted = urcs;
+        ret = e2e_run(&run, &cfg, false);
+        print_percentiles("RING to handler", run.samples, run.count);
+    }
+
+    /* throughput: as many ~500 byte commands as the queue takes */
+    if (ret == EXIT_SUCCESS) {
+        uint64_t start, elapsed;
+        size_t len;
+
+        len = snprintf(flood_command, sizeof(flood_command), "AT+QCFG=\"bench\",\"");
+        memset(flood_command + len, '0', sizeof(flood_command) - len - 2);
+        flood_command[sizeof(flood_command) - 2] = '"';
+        flood_command[sizeof(flood_command) - 1] = 0;
+
+        cfg.ring_interval_ms = 0;
+        run.count = 0;
+        run.wanted = commands;
+        run.flood = true;
+        start = modem_sim_now_ns();
+        ret = e2e_run(&run, &cfg, true);
+        elapsed = modem_sim_now_ns() - start;
+        run.flood = false;
+        printf("command throughput: %u x %zu bytes in %.1f ms, %.0f commands/s, "
+               "%.2f writes/command, %llu submits refused\n",
+               run.count, strlen(flood_command) + 1, elapsed / 1e6,
+               run.count / (elapsed / 1e9),
+               run.count ? (double) run.write_calls / run.count : 0.0,
+               (unsigned long long) run.rejected);
+        if (run.errors)
+            printf("command throughput: %u commands failed\n", run.errors);
+    }
+
+    free(run.samples);
+    return ret;
+}
+
+/* ---- RING to handler: the old select() thread against a GLib watch ---- */
+
+/* Before the modem moved into the main loop at.c read it from a detached
+ * thread blocked in select(); now a GIOChannel watch in the loop gtk_main()
+ * runs drains it. Same simulated modem, same parser, only the wakeup
+ * differs. */
+
+#define RX_TICK_MS 100
+
+static GMainLoop *ring_loop;
+
+static int ring_select_thread(void *arg)
+{
+    struct e2e_run *r = arg;
+    fd_set fds;
+    struct timeval tv;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    uint64_t give_up = modem_sim_now_ns() + 60 * 1000000000ull;
+    int ms;
+
+    while (r->count < r->wanted && modem_sim_now_ns() < give_up) {
+        FD_ZERO(&fds);
+        FD_SET(r->queue.fd, &fds);
+        ms = at_queue_next_timeout(&r->queue);
+        if (ms < 0 || ms > RX_TICK_MS)
+            ms = RX_TICK_MS;
+        tv.tv_sec = ms / 1000;
+        tv.tv_usec = (ms % 1000) * 1000;
+        if (select(r->queue.fd + 1, &fds, NULL, NULL, &tv) > 0) {
+            rx_ptr = at_parser_write_ptr(&r->parser, &rx_space);
+            cc = read(r->queue.fd, rx_ptr, rx_space);
+            if (cc > 0)
+                at_parser_commit(&r->parser, cc);
+        }
+        at_queue_check_timeouts(&r->queue);
+    }
+    return 0;
+}
+
+static gboolean on_ring_io(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    struct e2e_run *r = data;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+
+    if (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+        g_main_loop_quit(ring_loop);
+        return FALSE;
+    }
+    // as on_modem_io() does, drain the O_NONBLOCK tty
+    for (;;) {
+        rx_ptr = at_parser_write_ptr(&r->parser, &rx_space);
+        cc = read(r->queue.fd, rx_ptr, rx_space);
+        if (cc <= 0)
+            break;
+        at_parser_commit(&r->parser, cc);
+        if ((size_t) cc < rx_space)
+            break;
+    }
+    if (r->count >= r->wanted)
+        g_main_loop_quit(ring_loop);
+    return TRUE;
+}
+
+static gboolean on_ring_give_up(gpointer data)
+{
+    g_main_loop_quit(ring_loop);
+    return FALSE;
+}
+
+static int ring_run(struct e2e_run *r, const struct modem_sim_config *cfg, bool glib)
+{
+    GIOChannel *channel;
+    thrd_t sim, reader;
+    guint watch, timer;
+    int fd;
+
+    if (!modem_sim_open(&r->sim, cfg, NULL)) {
+        perror("modem_sim_open");
+        return EXIT_FAILURE;
+    }
+    atomic_store(&r->stop, false);
+    thrd_create(&sim, sim_thread, r);
+
+    fd = open_serial_port(r->sim.slave_path);
+    set_fixed_baudrate("115200", fd);
+    at_parser_init(&r->parser, e2e_line, r);
+    at_queue_init(&r->queue, fd);
+    r->count = 0;
+
+    if (glib) {
+        ring_loop = g_main_loop_new(NULL, FALSE);
+        channel = g_io_channel_unix_new(fd);
+        watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, on_ring_io, r);
+        timer = g_timeout_add(60 * 1000, on_ring_give_up, NULL);
+        g_main_loop_run(ring_loop);
+        g_source_remove(timer);
+        g_source_remove(watch);
+        g_io_channel_unref(channel);
+        g_main_loop_unref(ring_loop);
+    } else {
+        thrd_create(&reader, ring_select_thread, r);
+        thrd_join(reader, NULL);
+    }
+
+    atomic_store(&r->stop, true);
+    thrd_join(sim, NULL);
+    at_queue_destroy(&r->queue);
+    close(fd);
+    modem_sim_close(&r->sim);
+
+    return r->count == r->wanted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int bench_ring_wakeup(unsigned int rings)
+{
+    static struct e2e_run run;
+    struct modem_sim_config cfg;
+    int ret;
+
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 1;
+    cfg.rings_per_call = 0;
+    run.samples = calloc(rings, sizeof(uint64_t));
+    run.wanted = rings;
+
+    ret = ring_run(&run, &cfg, false);
+    print_percentiles("RING to handler, select() thread", run.samples, run.count);
+    if (ret == EXIT_SUCCESS) {
+        ret = ring_run(&run, &cfg, true);
+        print_percentiles("RING to handler, GLib watch", run.samples, run.count);
+    }
+
+    free(run.samples);
+    return ret;
+}
+
+/* ---- simulated modems driven the way dialer.c drives the real ones ---- */
+
+struct bench_modem {
+    struct modem_sim sim;
+    atomic_bool stop;
+    thrd_t thread;
+
+    int fd;
+    struct at_parser parser;
+    struct at_queue queue;
+    unsigned int done;
+    unsigned int wanted;
+};
+
+static int bench_modem_thread(void *arg)
+{
+    struct bench_modem *bm = arg;
+
+    while (!atomic_load(&bm->stop))
+        modem_sim_step(&bm->sim, 20);
+    return 0;
+}
+
+static void bench_modem_line(const struct at_line *line, void *user)
+{
+    struct bench_modem *bm = user;
+
+    at_queue_line(&bm->queue, line);
+}
+
+static bool bench_modem_open(struct bench_modem *bm, const struct modem_sim_config *cfg)
+{
+    if (!modem_sim_open(&bm->sim, cfg, NULL)) {
+        perror("modem_sim_open");
+        return false;
+    }
+    atomic_store(&bm->stop, false);
+    thrd_create(&bm->thread, bench_modem_thread, bm);
+    bm->fd = open_serial_port(bm->sim.slave_path);
+    set_fixed_baudrate("115200", bm->fd);
+    at_parser_init(&bm->parser, bench_modem_line, bm);
+    at_queue_init(&bm->queue, bm->fd);
+    bm->done = 0;
+    return true;
+}
+
+static void bench_modem_close(struct bench_modem *bm)
+{
+    atomic_store(&bm->stop, true);
+    thrd_join(bm->thread, NULL);
+    at_queue_destroy(&bm->queue);
+    close(bm->fd);
+    modem_sim_close(&bm->sim);
+}
+
+/* ---- status poller, batched vs. one command per line ---- */
+
+struct status_run {
+    struct bench_modem *bm;
+    struct status_poller poller;
+    unsigned int published;
+};
+
+static void status_submit(struct status_run *sr);
+
+static void bench_status_done(const struct at_command *cmd, enum at_token result,
+                              const char *response, void *user)
+{
+    struct status_run *sr = user;
+
+    switch (status_response(&sr->poller, cmd->text, result, response)) {
+    case STATUS_RESEND:
+        status_submit(sr);
+        break;
+    case STATUS_PUBLISHED:
+        sr->published++;
+        break;
+    case STATUS_PENDING:
+        break;
+    }
+}
+
+static void status_submit(struct status_run *sr)
+{
+    const char *cmds[STATUS_MAX_COMMANDS];
+    unsigned int n, i;
+
+    n = status_begin(&sr->poller, cmds);
+    for (i = 0; i < n; i++)
+        at_queue_submit(&sr->bm->queue, cmds[i], AT_PRIO_BACKGROUND, 0, bench_status_done, sr);
+}
+
+static int bench_status(unsigned int rounds)
+{
+    static struct bench_modem modem;
+    static struct status_run sr;
+    struct bench_modem *bm = &modem;
+    struct modem_sim_config cfg;
+    const struct modem_status *st;
+    struct pollfd pfd;
+    uint64_t start, elapsed;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    int split, ret = EXIT_SUCCESS;
+
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 0;
+    if (!bench_modem_open(bm, &cfg))
+        return EXIT_FAILURE;
+
+    for (split = 0; split < 2 && ret == EXIT_SUCCESS; split++) {
+        sr.bm = bm;
+        status_init(&sr.poller, 1000, NULL);
+        sr.poller.split = split;
+        sr.published = 0;
+
+        start = modem_sim_now_ns();
+        while (sr.published < rounds) {
+            if (at_queue_idle(&bm->queue))
+                status_submit(&sr);
+            pfd.fd = bm->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 100) <= 0)
+                break;
+            rx_ptr = at_parser_write_ptr(&bm->parser, &rx_space);
+            cc = read(bm->fd, rx_ptr, rx_space);
+            if (cc > 0)
+                at_parser_commit(&bm->parser, cc);
+        }
+        elapsed = modem_sim_now_ns() - start;
+
+        st = status_get(&sr.poller);
+        if (sr.published < rounds || !st || st->rssi != 22 || st->registration != 1 ||
+            strcmp(st->operator, "Rhizomatica") != 0 || st->activity != 0 || !st->imsi[0]) {
+            fprintf(stderr, "status: snapshot is wrong or incomplete\n");
+            ret = EXIT_FAILURE;
+            break;
+        }
+        printf("status: %s, %.1f us per refresh\n",
+               split ? "one command per line" : "AT+CSQ;+CREG?;+COPS?;+CPAS",
+               elapsed / 1000.0 / rounds);
+    }
+
+    bench_modem_close(bm);
+    return ret;
+}
+
+/* ---- several modems, one poll loop ---- */
+
+#define BENCH_MODEMS 4
+
+static void bench_modem_done(const struct at_command *cmd, enum at_token result,
+                             const char *response, void *user)
+{
+    struct bench_modem *bm = user;
+
+    if (++bm->done < bm->wanted)
+        at_queue_submit(&bm->queue, "AT+CSQ", AT_PRIO_NORMAL, 0, bench_modem_done, bm);
+}
+
+/* Each simulated modem takes 1 ms per command, like the real ones take
+ * their time. One thread drives them all the way dialer.c does. */
+static int bench_multi(unsigned int commands)
+{
+    static struct bench_modem modems[BENCH_MODEMS];
+    struct pollfd pfd[BENCH_MODEMS];
+    struct modem_sim_config cfg;
+    struct bench_modem *bm;
+    unsigned int n, i, finished = 0;
+    uint64_t start, elapsed, give_up;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 0;
+    cfg.reply_delay_ms = 1;
+
+    for (n = 1; n <= BENCH_MODEMS; n *= 2) {
+        for (i = 0; i < n; i++) {
+            if (!bench_modem_open(&modems[i], &cfg))
+                return EXIT_FAILURE;
+            modems[i].wanted = commands;
+        }
+
+        start = modem_sim_now_ns();
+        give_up = start + 60 * 1000000000ull;
+        for (i = 0; i < n; i++)
+            at_queue_submit(&modems[i].queue, "AT+CSQ", AT_PRIO_NORMAL, 0,
+                            bench_modem_done, &modems[i]);
+
+        do {
+            for (i = 0; i < n; i++) {
+                pfd[i].fd = modems[i].fd;
+                pfd[i].events = POLLIN;
+            }
+            if (poll(pfd, n, 100) < 0)
+                break;
+            finished = 0;
+            for (i = 0; i < n; i++) {
+                bm = &modems[i];
+                if (pfd[i].revents & POLLIN) {
+                    rx_ptr = at_parser_write_ptr(&bm->parser, &rx_space);
+                    cc = read(bm->fd, rx_ptr, rx_space);
+                    if (cc > 0)
+                        at_parser_commit(&bm->parser, cc);
+                }
+                at_queue_check_timeouts(&bm->queue);
+                if (bm->done >= bm->wanted)
+                    finished++;
+            }
+        } while (finished < n && modem_sim_now_ns() < give_up);
+        elapsed = modem_sim_now_ns() - start;
+
+        printf("multi: %u modem%s x %u commands, %.0f commands/s, %.0f per modem\n",
+               n, n > 1 ? "s" : "", commands, (double) n * commands / (elapsed / 1e9),
+               commands / (elapsed / 1e9));
+
+        for (i = 0; i < n; i++)
+            bench_modem_close(&modems[i]);
+        if (finished < n)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---- SMS: draining the SIM, and the message store ---- */
+
+#define BENCH_SMS_ON_SIM 200
+
+struct sms_run {
+    struct bench_modem *bm;
+    struct sms_rx rx;
+    struct sms_store store;
+    unsigned int pending;         /* commands not answered yet */
+    unsigned int next;            /* one by one: index to read next */
+    bool failed;
+};
+
+static void sms_list_line(const struct at_line *line, void *user)
+{
+    struct sms_run *sr = user;
+
+    sms_rx_list_line(&sr->rx, line);
+}
+
+static void sms_deleted(const struct at_command *cmd, enum at_token result,
+                        const char *response, void *user)
+{
+    struct sms_run *sr = user;
+
+    if (result != AT_TOK_OK)
+        sr->failed = true;
+    sr->pending--;
+}
+
+static void sms_listed(const struct at_command *cmd, enum at_token result,
+                       const char *response, void *user)
+{
+    struct sms_run *sr = user;
+    char del[AT_CMD_MAX - 1];
+
+    if (result != AT_TOK_OK || !sms_rx_commit(&sr->rx))
+        sr->failed = true;
+    else
+        while (sms_rx_delete_command(&sr->rx, del, sizeof(del)))
+            if (at_queue_submit(&sr->bm->queue, del, AT_PRIO_NORMAL, 0, sms_deleted, sr))
+                sr->pending++;
+    sr->pending--;
+}
+
+/* the obvious way: read, store and sync, delete, one message at a time */
+static void sms_read_one(struct sms_run *sr);
+
+static void sms_read_done(const struct at_command *cmd, enum at_token result,
+                          const char *response, void *user)
+{
+    struct sms_run *sr = user;
+    const char *pdu = strchr(response, '\n');
+    struct sms msg;
+    char del[32];
+
+    sr->pending--;
+    if (result != AT_TOK_OK || !pdu) {
+        sr->failed = true;
+        return;
+    }
+    pdu++;
+    if (sms_pdu_decode(pdu, strcspn(pdu, "\n"), &msg) &&
+        sms_store_append(&sr->store, &msg, time(NULL)) >= 0 && sms_store_sync(&sr->store)) {
+        snprintf(del, sizeof(del), "AT+CMGD=%u", sr->next);
+        if (at_queue_submit(&sr->bm->queue, del, AT_PRIO_NORMAL, 0, sms_deleted, sr))
+            sr->pending++;
+    } else {
+        sr->failed = true;
+    }
+    sr->next++;
+    sms_read_one(sr);
+}
+
+static void sms_read_one(struct sms_run *sr)
+{
+    char cmd[32];
+
+    if (sr->next >= BENCH_SMS_ON_SIM)
+        return;
+    snprintf(cmd, sizeof(cmd), "AT+CMGR=%u", sr->next);
+    if (at_queue_submit(&sr->bm->queue, cmd, AT_PRIO_NORMAL, 0, sms_read_done, sr))
+        sr->pending++;
+}
+
+static bool count_message(const struct sms *msg, int64_t received, void *user)
+{
+    (*(unsigned int *) user)++;
+    return true;
+}
+
+static bool count_sender(const struct sms *msg, int64_t received, void *user)
+{
+    if (strcmp(msg->sender, "+5511900000007") == 0)
+        (*(unsigned int *) user)++;
+    return true;
+}
+
+static int bench_sms_store(const char *path, unsigned int messages)
+{
+    struct sms_store store;
+    struct sms msg;
+    uint64_t start, append_ns, open_ns, sender_ns, scan_ns, range_ns;
+    unsigned int i, by_sender = 0, scanned = 0, in_range = 0;
+    int64_t base = 1600000000;
+
+    unlink(path);
+    if (!sms_store_open(&store, path)) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    start = modem_sim_now_ns();
+    for (i = 0; i < messages; i++) {
+        memset(&msg, 0, sizeof(msg));
+        snprintf(msg.sender, sizeof(msg.sender), "+55119000000%02u", i % 100);
+        snprintf(msg.text, sizeof(msg.text), "Message %u, on its way through the store", i);
+        msg.time = base + i * 60;
+        if (sms_store_append(&store, &msg, msg.time) != 1) {
+            fprintf(stderr, "sms: append failed\n");
+            sms_store_close(&store);
+            return EXIT_FAILURE;
+        }
+    }
+    sms_store_sync(&store);
+    append_ns = modem_sim_now_ns() - start;
+    sms_store_close(&store);
+
+    start = modem_sim_now_ns();
+    if (!sms_store_open(&store, path) || sms_store_count(&store) != messages) {
+        fprintf(stderr, "sms: store did not reopen with %u messages\n", messages);
+        sms_store_close(&store);
+        return EXIT_FAILURE;
+    }
+    open_ns = modem_sim_now_ns() - start;
+
+    start = modem_sim_now_ns();
+    sms_store_by_sender(&store, "+5511900000007", count_message, &by_sender);
+    sender_ns = modem_sim_now_ns() - start;
+
+    start = modem_sim_now_ns();
+    sms_store_by_time(&store, INT64_MIN, INT64_MAX, count_sender, &scanned);
+    scan_ns = modem_sim_now_ns() - start;
+
+    start = modem_sim_now_ns();
+    sms_store_by_time(&store, base + messages / 2 * 60, base + messages / 2 * 60 + 3600,
+                      count_message, &in_range);
+    range_ns = modem_sim_now_ns() - start;
+
+    // appending what is there already must not grow the store
+    msg.time = base + (messages - 1) * 60;
+    snprintf(msg.sender, sizeof(msg.sender), "+55119000000%02u", (messages - 1) % 100);
+    snprintf(msg.text, sizeof(msg.text), "Message %u, on its way through the store", messages - 1);
+    if (by_sender != scanned || by_sender != messages / 100 || in_range != 60 ||
+        sms_store_append(&store, &msg, msg.time) != 0) {
+        fprintf(stderr, "sms: store lists %u/%u by sender, %u by time, or kept a duplicate\n",
+                by_sender, scanned, in_range);
+        sms_store_close(&store);
+        return EXIT_FAILURE;
+    }
+    sms_store_close(&store);
+    unlink(path);
+
+    printf("sms store: %u messages appended in %.1f ms, reopened in %.2f ms\n",
+           messages, append_ns / 1e6, open_ns / 1e6);
+    printf("sms store: one sender's %u, %.1f us by index, %.1f us scanning; an hour, %.1f us\n",
+           by_sender, sender_ns / 1e3, scan_ns / 1e3, range_ns / 1e3);
+    return EXIT_SUCCESS;
+}
+
+/* The simulated modem takes 1 ms per command, like the real one. */
+static int bench_sms(unsigned int messages)
+{
+    static struct bench_modem modem;
+    static struct sms_run sr;
+    struct bench_modem *bm = &modem;
+    struct modem_sim_config cfg;
+    struct pollfd pfd;
+    uint64_t start, elapsed, give_up;
+    char path[] = "/tmp/at-bench-sms.XXXXXX";
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    int fd, bulk, ret = EXIT_SUCCESS;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 0;
+    cfg.reply_delay_ms = 1;
+    cfg.sms_stored = BENCH_SMS_ON_SIM;
+
+    for (bulk = 1; bulk >= 0 && ret == EXIT_SUCCESS; bulk--) {
+        unlink(path);
+        memset(&sr, 0, sizeof(sr));
+        sr.bm = bm;
+        if (!sms_store_open(&sr.store, path) || !bench_modem_open(bm, &cfg)) {
+            sms_store_close(&sr.store);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        sms_rx_init(&sr.rx, &sr.store, NULL, NULL);
+
+        start = modem_sim_now_ns();
+        give_up = start + 60 * 1000000000ull;
+        if (bulk) {
+            sms_rx_begin(&sr.rx);
+            if (at_queue_submit_stream(&bm->queue, "AT+CMGL=4", AT_PRIO_NORMAL, AT_TIMEOUT_LIST,
+                                       sms_list_line, sms_listed, &sr))
+                sr.pending++;
+        } else {
+            sms_read_one(&sr);
+        }
+        while (sr.pending > 0 && !sr.failed && modem_sim_now_ns() < give_up) {
+            pfd.fd = bm->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 100) < 0)
+                break;
+            rx_ptr = at_parser_write_ptr(&bm->parser, &rx_space);
+            cc = read(bm->fd, rx_ptr, rx_space);
+            if (cc > 0)
+                at_parser_commit(&bm->parser, cc);
+            at_queue_check_timeouts(&bm->queue);
+        }
+        elapsed = modem_sim_now_ns() - start;
+
+        if (sr.failed || sr.pending > 0 || bm->sim.sms_count != 0 ||
+            sms_store_count(&sr.store) != BENCH_SMS_ON_SIM) {
+            fprintf(stderr, "sms: %u stored, %u left on the SIM\n",
+                    sms_store_count(&sr.store), bm->sim.sms_count);
+            ret = EXIT_FAILURE;
+        } else {
+            printf("sms: %u messages off the SIM, %s, %.1f ms, %.2f ms each\n",
+                   BENCH_SMS_ON_SIM,
+                   bulk ? "AT+CMGL=4 and batched AT+CMGD" : "AT+CMGR and AT+CMGD each",
+                   elapsed / 1e6, elapsed / 1e6 / BENCH_SMS_ON_SIM);
+        }
+        bench_modem_close(bm);
+        sms_store_close(&sr.store);
+    }
+
+    if (ret == EXIT_SUCCESS)
+        ret = bench_sms_store(path, messages);
+    unlink(path);
+    return ret;
+}
+
+/* ---- SMS out: one batch vs. a fresh command sequence per message ---- */
+
+struct send_run {
+    struct bench_modem *bm;
+    struct sms_tx tx;
+    struct sms_submit pdu;        /* one by one: the same message each time */
+    unsigned int left;
+    bool failed;
+};
+
+static void send_pump(struct send_run *sr);
+
+static void send_batch_done(const struct at_command *cmd, enum at_token result,
+                            const char *response, void *user)
+{
+    struct send_run *sr = user;
+
+    sms_tx_done(&sr->tx, result, response, cmd->payload_sent);
+    send_pump(sr);
+}
+
+static void send_pump(struct send_run *sr)
+{
+    struct sms_tx_cmd cmd;
+
+    while (sms_tx_next(&sr->tx, &cmd)) {
+        if (!at_queue_submit_prompt(&sr->bm->queue, cmd.text,
+                                    cmd.payload[0] ? cmd.payload : NULL, AT_PRIO_NORMAL, 0,
+                                    send_batch_done, sr)) {
+            sms_tx_unsubmit(&sr->tx);
+            break;
+        }
+    }
+}
+
+static void send_one_done(const struct at_command *cmd, enum at_token result,
+                          const char *response, void *user);
+
+static void send_one(struct send_run *sr)
+{
+    char text[24], payload[SMS_PDU_HEX + 1];
+
+    snprintf(text, sizeof(text), "AT+CMGS=%u", sr->pdu.tpdu_len);
+    snprintf(payload, sizeof(payload), "%s\x1a", sr->pdu.hex);
+    if (!at_queue_submit_prompt(&sr->bm->queue, text, payload, AT_PRIO_NORMAL, 0,
+                                send_one_done, sr))
+        sr->failed = true;
+}
+
+static void send_one_done(const struct at_command *cmd, enum at_token result,
+                          const char *response, void *user)
+{
+    struct send_run *sr = user;
+
+    if (result != AT_TOK_OK)
+        sr->failed = true;
+    else if (--sr->left > 0)
+        send_one(sr);
+}
+
+static bool send_finished(struct send_run *sr, bool batch)
+{
+    return sr->failed || (batch ? sms_tx_finished(&sr->tx) : sr->left == 0);
+}
+
+/* The simulated network takes 5 ms per message plus 20 ms to bring the
+ * link up, which AT+CMMS saves for all but the first. */
+static int bench_sms_send(unsigned int messages)
+{
+    static struct bench_modem modem;
+    static struct send_run sr;
+    static const char *how[] = {
+        "one AT+CMGS at a time", "AT+CMMS and queued AT+CMGS",
+        "the same, every 10th failing",
+    };
+    struct bench_modem *bm = &modem;
+    struct modem_sim_config cfg;
+    struct pollfd pfd;
+    uint64_t start, elapsed, give_up;
+    char number[SMS_ADDR_MAX];
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    unsigned int i, sent;
+    int run, ret = EXIT_SUCCESS;
+
+    modem_sim_default_config(&cfg);
+    cfg.ring_interval_ms = 0;
+    cfg.sms_send_ms = 5;
+    cfg.sms_link_ms = 20;
+
+    for (run = 0; run < 3 && ret == EXIT_SUCCESS; run++) {
+        cfg.sms_fail_every = run == 2 ? 10 : 0;
+        if (!bench_modem_open(bm, &cfg))
+            return EXIT_FAILURE;
+        memset(&sr, 0, sizeof(sr));
+        sr.bm = bm;
+        sms_tx_init(&sr.tx, NULL, NULL);
+        for (i = 0; i < messages; i++) {
+            snprintf(number, sizeof(number), "+5511900%06u", i);
+            sms_tx_add(&sr.tx, number, "Community alert: the road to the river is closed");
+        }
+        sms_pdu_encode_submit("+5511900000000", "Community alert: the road to the river is closed",
+                              0, &sr.pdu, 1);
+        sr.left = messages;
+
+        start = modem_sim_now_ns();
+        give_up = start + 60 * 1000000000ull;
+        if (run > 0)
+            send_pump(&sr);
+        else
+            send_one(&sr);
+        while (!send_finished(&sr, run > 0) && modem_sim_now_ns() < give_up) {
+            pfd.fd = bm->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 100) < 0)
+                break;
+            rx_ptr = at_parser_write_ptr(&bm->parser, &rx_space);
+            cc = read(bm->fd, rx_ptr, rx_space);
+            if (cc > 0)
+                at_parser_commit(&bm->parser, cc);
+            at_queue_check_timeouts(&bm->queue);
+        }
+        elapsed = modem_sim_now_ns() - start;
+        sent = bm->sim.sms_sent;
+
+        if (sent != messages || !send_finished(&sr, run > 0) || sr.failed) {
+            fprintf(stderr, "sms send: %u of %u sent\n", sent, messages);
+            ret = EXIT_FAILURE;
+        } else {
+            printf("sms send: %u messages, %s, %.0f per minute%s\n", messages, how[run],
+                   messages / (elapsed / 60e9),
+                   run == 2 ? (sr.tx.retries ? ", all sent on retry" : ", no retries?") : "");
+        }
+        sms_tx_free(&sr.tx);
+        bench_modem_close(bm);
+    }
+    return ret;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the periods legacy_ring() "wrote", so the work isn't optimized away */
+static volatile unsigned int tone_sink;
+
+/* What ring() and ring_2tones() did for every RING before the cache: sin()
+ * per sample, packed byte by byte into a 4 frame period. The period goes
+ * to tone_sink instead of snd_pcm_writei(). */
+static void legacy_ring(double seconds, double freq1, double freq2)
+{
+    unsigned int sampling_rate = 48000, frames = 4;
+    char buffer[5 * 4];
+    int i, j = 0, sample, amp = 10000;
+    double x;
+
+    for (i = 0; i < seconds * sampling_rate; i++) {
+        x = (double) i / (double) sampling_rate;
+        sample = amp * sin(2.0 * 3.14159 * freq1 * x);
+        if (freq2 > 0)
+            sample = (sample + (int) (amp * sin(2.0 * 3.14159 * freq2 * x))) / 2;
+        buffer[0 + 4*j] = sample & 0xff;
+        buffer[1 + 4*j] = (sample & 0xff00) >> 8;
+        buffer[2 + 4*j] = sample & 0xff;
+        buffer[3 + 4*j] = (sample & 0xff00) >> 8;
+        if (j++ == frames) {
+            tone_sink += buffer[0] + buffer[4 * frames - 1];
+            j = 0;
+        }
+    }
+}
+
+/* Samples per second: sin() per sample and tone, packed byte by byte as
+ * ring() did, against the oscillators, for sums of 1 to TONE_MAX tones */
+static int bench_synth(unsigned int seconds)
+{
+    static const double freqs[TONE_MAX] = { 697.0, 1209.0, 350.0, 440.0 };
+    unsigned int rate = 48000, count, k;
+    size_t frames = (size_t) seconds * rate, i;
+    char *out = malloc(frames * 4);
+    struct tone_osc osc;
+    uint64_t start, legacy_ns, osc_ns;
+    double x, sum;
+    int sample;
+
+    if (!out) {
+        fprintf(stderr, "tone: no memory\n");
+        return EXIT_FAILURE;
+    }
+    for (count = 1; count <= TONE_MAX; count++) {
+        start = cpu_ns();
+        for (i = 0; i < frames; i++) {
+            x = (double) i / (double) rate;
+            sum = 0;
+            for (k = 0; k < count; k++)
+                sum += sin(2.0 * 3.14159 * freqs[k] * x);
+            sample = TONE_AMPLITUDE * sum / count;
+            out[4 * i + 0] = sample & 0xff;
+            out[4 * i + 1] = (sample & 0xff00) >> 8;
+            out[4 * i + 2] = sample & 0xff;
+            out[4 * i + 3] = (sample & 0xff00) >> 8;
+        }
+        legacy_ns = cpu_ns() - start;
+        tone_sink += out[frames * 2];
+
+        start = cpu_ns();
+        tone_osc_init(&osc, freqs, count, rate);
+        tone_osc_render(&osc, out, frames, 2, TONE_S16_LE);
+        osc_ns = cpu_ns() - start;
+        tone_sink += out[frames * 2];
+
+        printf("tone: sum of %u, %.1f M frames/s per-sample sin(), %.1f M frames/s "
+               "oscillators (%.0fx)\n", count, frames * 1e3 / legacy_ns,
+               frames * 1e3 / osc_ns, (double) legacy_ns / osc_ns);
+    }
+    free(out);
+    return EXIT_SUCCESS;
+}
+
+/* CPU time per ring: the old per-sample synthesis, the first ring of a
+ * tone (rendered into the cache) and every ring after that */
+static int bench_tone(unsigned int rings)
+{
+    static const struct { const char *name; double freq1, freq2; } tones[] = {
+        { "ring 1800 Hz", 1800.0, 0 },
+        { "ring 440+480 Hz", 440.0, 480.0 },
+    };
+    struct tone_key key;
+    const struct tone_pcm *pcm;
+    uint64_t start, legacy_ns, render_ns, cached_ns;
+    unsigned int i, t;
+    size_t frames, bad = 0;
+    double x;
+    int sample;
+
+    for (t = 0; t < sizeof(tones) / sizeof(tones[0]); t++) {
+        memset(&key, 0, sizeof(key));
+        key.freq1 = tones[t].freq1;
+        key.freq2 = tones[t].freq2;
+        key.duration_ms = 1000;
+        key.rate = 48000;
+        key.channels = 2;
+        key.period_frames = 1024;
+        key.format = TONE_S16_LE;
+
+        start = cpu_ns();
+        for (i = 0; i < rings; i++)
+            legacy_ring(1, tones[t].freq1, tones[t].freq2);
+        legacy_ns = (cpu_ns() - start) / rings;
+
+        start = cpu_ns();
+        pcm = tone_get(&key);
+        render_ns = cpu_ns() - start;
+        if (!pcm) {
+            fprintf(stderr, "tone: no memory\n");
+            return EXIT_FAILURE;
+        }
+
+        // the waveform as before (with all of pi) within 2 LSB, silence after it
+        frames = key.duration_ms * key.rate / 1000;
+        for (i = 0; i < pcm->frames; i++) {
+            x = (double) i / key.rate;
+            sample = 0;
+            if (i < frames) {
+                if (key.freq2 > 0)
+                    sample = lrint(5000 * sin(2.0 * M_PI * key.freq1 * x) +
+                                   5000 * sin(2.0 * M_PI * key.freq2 * x));
+                else
+                    sample = lrint(10000 * sin(2.0 * M_PI * key.freq1 * x));
+            }
+            bad += abs(((int16_t *) pcm->data)[2 * i] - sample) > 2 ||
+                ((int16_t *) pcm->data)[2 * i + 1] != ((int16_t *) pcm->data)[2 * i];
+        }
+        tone_put(pcm);
+        if (bad || pcm->frames % key.period_frames) {
+            fprintf(stderr, "tone: %s differs in %zu frames, or isn't whole periods\n",
+                    tones[t].name, bad);
+            return EXIT_FAILURE;
+        }
+
+        start = cpu_ns();
+        for (i = 0; i < rings; i++)
+            tone_put(tone_get(&key));
+        cached_ns = (cpu_ns() - start) / rings;
+
+        printf("tone: %s, CPU per ring %.0f us per-sample sin(), %.0f us the first time, "
+               "%.2f us from the cache\n", tones[t].name, legacy_ns / 1e3, render_ns / 1e3,
+               cached_ns / 1e3);
+    }
+    tone_dump_stats(stdout);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *trace = recorded_session;
+    size_t trace_len = sizeof(recorded_session) - 1;
+    unsigned int iterations = 20000;
+    unsigned int urcs = 1000, commands = 1000;
+    const char *replay = NULL, *capture = NULL;
+    bool realtime = false;
+    char *loaded = NULL;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "hf:n:u:c:t:Rw:")) != -1){
+        switch (opt){
+        case 'f':
+            loaded = load_file(optarg, &trace_len);
+            if (!loaded) {
+                fprintf(stderr, "Could not read %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            trace = loaded;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'u':
+            urcs = atoi(optarg);
+            break;
+        case 'c':
+            commands = atoi(optarg);
+            break;
+        case 't':
+            replay = optarg;
+            break;
+        case 'R':
+            realtime = true;
+            break;
+        case 'w':
+            capture = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-f raw_modem_capture] [-n iterations] [-u rings] [-c commands] [-w trace]\n"
+                    "       %s -t trace [-R]\n"
+                    "    -w    capture the command round trip run to a trace\n"
+                    "    -t    replay a trace from \"dialer -t\" or -w, -R keeps the recorded timing\n",
+                    argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (replay)
+        return bench_replay(replay, realtime);
+
+    ret = bench_parser(trace, trace_len, iterations);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_classify(trace, trace_len, iterations);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_text(trace, trace_len, iterations);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_probes(iterations * 50);
+    if (ret == EXIT_SUCCESS && (urcs || commands))
+        ret = bench_end_to_end(urcs, commands, capture);
+    if (ret == EXIT_SUCCESS && urcs)
+        ret = bench_ring_wakeup(urcs);
+    if (ret == EXIT_SUCCESS && commands)
+        ret = bench_status(commands);
+    if (ret == EXIT_SUCCESS && commands)
+        ret = bench_multi(commands / 4 ? commands / 4 : 1);
+    if (ret == EXIT_SUCCESS && commands)
+        ret = bench_sms(commands * 20);
+    if (ret == EXIT_SUCCESS && commands)
+        ret = bench_sms_send(commands / 10 ? commands / 10 : 1);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_tone(20);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_synth(10);
+
+    free(loaded);
+    return ret;
+}
@@ -21,21 +21,26 @@
  */
 
 #include <sys/types.h>
-#include <sys/file.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
-#include <strings.h>
-#include <asm/termbits.h>
 #include <errno.h>
-#include <threads.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
 #include "at.h"
-#include "ring-audio.h"
+#include "at_parser.h"
+#include "at_text.h"
+#include "at_trace.h"
+#include "status.h"
+#include "sms.h"
+#include "sms_tx.h"
+#include "sms_outbox.h"
 #include "daemonize.h"
+#include "probe.h"
 
 #include <hildon/hildon-banner.h>
 #include <hildon/hildon-program.h>
@@ -46,243 +51,1267 @@ extern GtkWidget *window;
 extern char dial_pad[MAX_BUF_SIZE];
 extern GtkWidget *display;
 
-struct baudrate {
-    char       *name;
-    int         termios_code;
-    int         nonstd_speed;
-    int         bootrom_code;
-    int         xram_records;
+void strip_cr(char *s)
+{
+    at_strip_cr(s);
+}
+
+/* RING is a URC, it never ends a command */
+bool is_final_result(const char * const response)
+{
+    enum at_token token = at_line_classify(response, strlen(response));
+
+    return (at_token_flags(token) & AT_FLAG_FINAL) != 0;
+}
+
+struct modem {
+    int index;
+    char name[64];
+    char path[MAX_MODEM_PATH];
+    const char *baud;
+    int fd;                   /* -1 while the device is gone */
+    const char *rate;         /* "auto": the rate negotiated, NULL until then */
+    int probe_rate;           /* "auto": index of the rate on trial */
+    unsigned int probe_ok;    /* AT/OK exchanges it passed so far */
+
+    struct at_parser parser;
+    struct at_queue queue;
+    struct call_table calls;
+    struct at_trace capture;
+    struct status_poller status;
+    struct sms_rx sms;
+    bool sms_listing;         /* AT+CMGL in flight */
+    bool sms_again;           /* +CMTI while it was */
+    struct sms_tx *sms_tx;    /* batch being sent, or NULL */
+    at_sms_done_cb sms_done;  /* and who hears when it is over */
+    void *sms_user;
+    char dtmf[DTMF_MAX + 1];  /* digits for the next AT+VTS */
+    bool dtmf_busy;           /* AT+VTS in flight */
+
+    GIOChannel *channel;
+    guint watch;
+    guint output_watch;
+    guint queue_timer;
+    guint status_timer;
+
+    // waiting for the device node to come back
+    int hotplug_fd;           /* inotify on its directory, -1 when not waiting */
+    GIOChannel *hotplug_channel;
+    guint hotplug_watch;
+    guint retry_timer;
+    gint64 lost_us;           /* when it went away, 0 once it answers again */
+    gint64 reopened_us;
+
+    /* DTMF statistics */
+    unsigned long long dtmf_digits;
+    unsigned long long dtmf_commands;
+
+    /* reconnect statistics */
+    unsigned int reconnects;
+    gint64 last_recovery_ms;
+    gint64 max_recovery_ms;
 };
 
-void strip_cr(char *s)
+// all modems are serviced by the one main loop, no thread per device
+static struct modem modems[MAX_MODEMS];
+static int modem_count;
+static unsigned int next_dial;
+
+static const char *capture_path;
+static unsigned int status_interval_ms = STATUS_INTERVAL_DEFAULT;
+
+// messages from every modem go to one store
+static const char *sms_path = SMS_STORE_FILE;
+static sms_event_cb sms_listener;
+static struct sms_store sms_store;
+static bool sms_store_ready;
+
+// batches other programs leave in the outbox, NULL dir: not looked at
+static const char *outbox_dir;
+static int outbox_fd = -1;
+static GIOChannel *outbox_channel;
+static guint outbox_timer;
+
+struct outbox_job {
+    struct sms_outbox_job job;
+    FILE *report;
+};
+
+/* when the bytes that are being parsed came out of read() */
+PROBE_VAR(static uint64_t rx_stamp;)
+
+static void on_clcc(const struct at_command *cmd, enum at_token result,
+                    const char *response, void *user)
 {
-    char *from, *to;
-    from = to = s;
-    while (*from != '\0') {
-        if (*from == '\r') {
-            from++;
-            continue;
-        }
-        *to++ = *from++;
+    struct modem *m = user;
+
+    if (result == AT_TOK_OK)
+        call_sync(&m->calls, response);
+    else
+        at_log_result(cmd, result, response, user);
+}
+
+static void sms_drain(struct modem *m);
+
+static void on_modem_line(const struct at_line *line, void *user)
+{
+    struct modem *m = user;
+    bool is_ring = line->token == AT_TOK_RING || line->token == AT_TOK_CRING;
+    PROBE_VAR(uint64_t window_stamp;)
+
+    // before the queue: the PDU after +CMT looks like a command's response
+    switch (sms_rx_urc(&m->sms, line))
+    {
+    case SMS_URC_NEW:
+        sms_drain(m);
+        return;
+    case SMS_URC_TAKEN:
+        return;
+    case SMS_URC_NONE:
+        break;
+    }
+
+    if (at_queue_line(&m->queue, line))
+        return;
+
+    if (is_ring)
+    {
+        char ring_str[512];
+
+        PROBE_END(PROBE_RING_DISPATCH, rx_stamp);
+        sprintf(ring_str, "%s: RINGING on %s\n", get_time(), m->name);
+        log_message(LOG_FILE,ring_str);
+        PROBE_START(window_stamp);
+    }
+
+    // the listener updates the UI and audio routing
+    if (call_line(&m->calls, line))
+        at_send(m, "AT+CLCC", AT_PRIO_URGENT, AT_TIMEOUT_DEFAULT, on_clcc, m);
+
+    // the ringtone starts with the call (the listener), not per RING
+    if (is_ring)
+    {
+        PROBE_END(PROBE_RING_WINDOW, window_stamp);
+        PROBE_END(PROBE_RING_TO_WINDOW, rx_stamp);
     }
-    *to = '\0';
 }
 
-bool is_final_result(const char * const response)
+static gboolean on_queue_timeout(gpointer data);
+
+/* (re)arm the timer for the command in flight */
+static void schedule_queue_timer(struct modem *m)
 {
-#define STARTS_WITH(a, b) ( strncmp((a), (b), strlen(b)) == 0)
-    switch (response[0]) {
-    case '+':
-        if (STARTS_WITH(&response[1], "CME ERROR:")) {
-            return true;
-        }
-        if (STARTS_WITH(&response[1], "CMS ERROR:")) {
-            return true;
+    int ms;
+
+    if (m->queue_timer)
+        g_source_remove(m->queue_timer);
+    m->queue_timer = 0;
+
+    ms = at_queue_next_timeout(&m->queue);
+    if (ms >= 0)
+        m->queue_timer = g_timeout_add(ms, on_queue_timeout, m);
+}
+
+static gboolean on_queue_timeout(gpointer data)
+{
+    struct modem *m = data;
+
+    m->queue_timer = 0;
+    at_queue_check_timeouts(&m->queue);
+    schedule_queue_timer(m);
+    return FALSE;
+}
+
+static void modem_lost(struct modem *m);
+
+static gboolean on_modem_io(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    struct modem *m = data;
+    char log_buf[AT_PARSER_BUF_SIZE + 1];
+    char *rx_ptr;
+    size_t rx_space;
+    int cc;
+    PROBE_VAR(uint64_t stamp;)
+
+    if (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+        m->watch = 0;
+        modem_lost(m);
+        return FALSE;
+    }
+
+    // the tty is O_NONBLOCK, drain it
+    for (;;) {
+        rx_ptr = at_parser_write_ptr(&m->parser, &rx_space);
+        PROBE_START(stamp);
+        cc = read(m->fd, rx_ptr, rx_space);
+        if (cc < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (cc <= 0) {
+            m->watch = 0;
+            modem_lost(m);
+            return FALSE;
         }
+        PROBE_START(rx_stamp);
+        PROBE_END(PROBE_RX_READ, stamp);
+
+        at_trace_record(&m->capture, AT_TRACE_RX, rx_ptr, cc);
+
+        // keep a copy for the log, the parser wants the raw bytes
+        memcpy(log_buf, rx_ptr, cc);
+        log_buf[cc] = 0;
+
+        PROBE_START(stamp);
+        at_parser_commit(&m->parser, cc);
+        PROBE_END(PROBE_RX_PARSE, stamp);
+
+        PROBE_START(stamp);
+        at_safe_output((unsigned char *) log_buf, cc);
+        log_message(LOG_FILE, log_buf);
+        PROBE_END(PROBE_RX_LOG, stamp);
+
+        if ((size_t) cc < rx_space)
+            break;
+    }
+
+    at_trace_flush(&m->capture);
+    schedule_queue_timer(m);
+    return TRUE;
+}
+
+static gboolean on_modem_writable(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    struct modem *m = data;
+
+    at_queue_output_ready(&m->queue);
+    schedule_queue_timer(m);
+
+    if (at_queue_output_pending(&m->queue))
+        return TRUE;
+    m->output_watch = 0;
+    return FALSE;
+}
+
+// the tty didn't take the whole command, finish it when it drains
+static void want_write(void *user)
+{
+    struct modem *m = user;
+
+    if (!m->output_watch)
+        m->output_watch = g_io_add_watch(m->channel, G_IO_OUT, on_modem_writable, m);
+}
+
+static void capture_tx(const char *data, size_t len, void *user)
+{
+    struct modem *m = user;
+
+    // a command is rare next to the RX chatter, and it may be the last
+    // thing written before the modem hangs: don't wait for a reply to flush
+    at_trace_record(&m->capture, AT_TRACE_TX, data, len);
+    at_trace_flush(&m->capture);
+}
+
+void at_capture(const char *path)
+{
+    capture_path = path;
+}
+
+void at_status_interval(unsigned int ms)
+{
+    status_interval_ms = ms;
+}
+
+const struct modem_status *at_modem_status(int index)
+{
+    if (index < 0 || index >= modem_count)
+        return NULL;
+    return status_get(&modems[index].status);
+}
+
+void at_sms(const char *path, sms_event_cb on_sms)
+{
+    sms_path = path;
+    sms_listener = on_sms;
+}
+
+void at_log_result(const struct at_command *cmd, enum at_token result,
+                   const char *response, void *user)
+{
+    char msg[AT_CMD_MAX + 64];
+
+    if (result == AT_RESULT_TIMEOUT)
+        snprintf(msg, sizeof(msg), "%.*s: timeout\n", (int) cmd->len - 1, cmd->text);
+    else if (at_token_flags(result) & AT_FLAG_ERROR)
+        snprintf(msg, sizeof(msg), "%.*s: %s\n", (int) cmd->len - 1, cmd->text,
+                 at_token_name(result));
+    else
+        return;
+    log_message(LOG_FILE, msg);
+}
+
+/* commands for a modem that is gone would only time out */
+static bool connected(struct modem *m)
+{
+    char msg[128];
+
+    if (m->fd >= 0)
+        return true;
+    snprintf(msg, sizeof(msg), "%s is not connected, command dropped\n", m->name);
+    log_message(LOG_FILE, msg);
+    return false;
+}
+
+bool at_send(struct modem *m, const char *cmd, enum at_priority priority,
+             unsigned int timeout_ms, at_done_cb done, void *user)
+{
+    bool res;
+
+    if (!connected(m))
         return false;
-    case 'B':
-        if (strcmp(&response[1], "USY\r\n") == 0) {
-            return true;
-        }
+    res = at_queue_submit(&m->queue, cmd, priority, timeout_ms, done, user);
+
+    if (!res)
+        log_message(LOG_FILE, "AT command queue full, command dropped\n");
+    schedule_queue_timer(m);
+    return res;
+}
+
+bool at_send_stream(struct modem *m, const char *cmd, enum at_priority priority,
+                    unsigned int timeout_ms, at_line_cb on_line, at_done_cb done, void *user)
+{
+    bool res;
+
+    if (!connected(m))
         return false;
-    case 'E':
-        if (strcmp(&response[1], "RROR\r\n") == 0) {
-            return true;
-        }
+    res = at_queue_submit_stream(&m->queue, cmd, priority, timeout_ms, on_line, done, user);
+
+    if (!res)
+        log_message(LOG_FILE, "AT command queue full, command dropped\n");
+    schedule_queue_timer(m);
+    return res;
+}
+
+bool at_send_prompt(struct modem *m, const char *cmd, const char *payload,
+                    enum at_priority priority, unsigned int timeout_ms, at_done_cb done,
+                    void *user)
+{
+    bool res;
+
+    if (!connected(m))
         return false;
-    case 'N':
-        if (strcmp(&response[1], "O ANSWER\r\n") == 0) {
-            return true;
-        }
-        if (strcmp(&response[1], "O CARRIER\r\n") == 0) {
-            return true;
+    res = at_queue_submit_prompt(&m->queue, cmd, payload, priority, timeout_ms, done, user);
+
+    if (!res)
+        log_message(LOG_FILE, "AT command queue full, command dropped\n");
+    schedule_queue_timer(m);
+    return res;
+}
+
+static void on_cmgl_line(const struct at_line *line, void *user)
+{
+    struct modem *m = user;
+
+    sms_rx_list_line(&m->sms, line);
+}
+
+static void on_cmgl(const struct at_command *cmd, enum at_token result,
+                    const char *response, void *user)
+{
+    struct modem *m = user;
+    char del[AT_CMD_MAX - 1];
+
+    m->sms_listing = false;
+    if (result != AT_TOK_OK)
+    {
+        at_log_result(cmd, result, response, user);
+    }
+    else if (!sms_rx_commit(&m->sms))
+    {
+        log_message(LOG_FILE, "Could not sync the SMS store, messages stay on the SIM\n");
+    }
+    else
+    {
+        // same priority as AT+CMGL, so they go out before the next listing
+        while (sms_rx_delete_command(&m->sms, del, sizeof(del)))
+            at_send(m, del, AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, at_log_result, m);
+    }
+
+    if (m->sms_again)
+    {
+        m->sms_again = false;
+        sms_drain(m);
+    }
+}
+
+/* everything on the SIM into the store, then off the SIM */
+static void sms_drain(struct modem *m)
+{
+    if (!sms_store_ready)
+        return;
+    if (m->sms_listing)
+    {
+        m->sms_again = true;
+        return;
+    }
+    sms_rx_begin(&m->sms);
+    m->sms_listing = at_send_stream(m, "AT+CMGL=4", AT_PRIO_NORMAL, AT_TIMEOUT_LIST,
+                                    on_cmgl_line, on_cmgl, m);
+}
+
+static void sms_tx_pump(struct modem *m);
+
+static void sms_tx_end(struct modem *m)
+{
+    struct sms_tx *tx = m->sms_tx;
+    at_sms_done_cb done = m->sms_done;
+    char msg[256];
+    double minutes = ((tx->finished_ns ? tx->finished_ns : tx->last_done_ns) -
+                      tx->started_ns) / 60e9;
+
+    snprintf(msg, sizeof(msg), "%s: %u of %u SMS parts sent, %u failed, %u retries, "
+             "%.0f per minute\n", m->name, tx->sent, tx->count, tx->failed, tx->retries,
+             minutes > 0 ? tx->sent / minutes : 0);
+    log_message(LOG_FILE, msg);
+    // the modem is free again by the time done hears about it
+    m->sms_tx = NULL;
+    m->sms_done = NULL;
+    if (done)
+        done(tx, m->sms_user);
+    sms_tx_free(tx);
+    free(tx);
+}
+
+static void on_sms_tx(const struct at_command *cmd, enum at_token result,
+                      const char *response, void *user)
+{
+    struct modem *m = user;
+
+    sms_tx_done(m->sms_tx, result, response, cmd->payload_sent);
+    sms_tx_pump(m);
+    if (sms_tx_finished(m->sms_tx))
+    {
+        sms_tx_end(m);
+    }
+    else if (m->sms_tx->window_len == 0)
+    {
+        // nothing queued means nothing left to pump again
+        if (m->fd < 0)
+            log_message(LOG_FILE, "Modem lost, SMS batch abandoned\n");
+        else
+            log_message(LOG_FILE, "AT command queue full, SMS batch abandoned\n");
+        sms_tx_abort(m->sms_tx);
+        sms_tx_end(m);
+    }
+}
+
+// keep SMS_TX_WINDOW commands queued, the queue writes each on the heels of the last
+static void sms_tx_pump(struct modem *m)
+{
+    struct sms_tx_cmd cmd;
+
+    while (m->sms_tx && sms_tx_next(m->sms_tx, &cmd)) {
+        if (!at_send_prompt(m, cmd.text, cmd.payload[0] ? cmd.payload : NULL,
+                            AT_PRIO_NORMAL, cmd.payload[0] ? AT_TIMEOUT_SMS : 0,
+                            on_sms_tx, m))
+        {
+            // the answers to what is queued pump again
+            sms_tx_unsubmit(m->sms_tx);
+            break;
         }
-        if (strcmp(&response[1], "O DIALTONE\r\n") == 0) {
-            return true;
+    }
+}
+
+static void on_dial(const struct at_command *cmd, enum at_token result,
+                    const char *response, void *user)
+{
+    struct modem *m = user;
+
+    at_log_result(cmd, result, response, user);
+    if (result != AT_TOK_OK && result != AT_TOK_CONNECT)
+        call_dial_failed(&m->calls);
+}
+
+static void on_answer(const struct at_command *cmd, enum at_token result,
+                      const char *response, void *user)
+{
+    struct modem *m = user;
+
+    at_log_result(cmd, result, response, user);
+    if (result == AT_TOK_OK || result == AT_TOK_CONNECT)
+        call_answered(&m->calls);
+}
+
+static void on_hangup(const struct at_command *cmd, enum at_token result,
+                      const char *response, void *user)
+{
+    struct modem *m = user;
+
+    at_log_result(cmd, result, response, user);
+    if (result == AT_TOK_OK)
+        call_hungup(&m->calls);
+}
+
+static void status_refresh(struct modem *m);
+
+static gboolean on_status_timer(gpointer data)
+{
+    struct modem *m = data;
+
+    m->status_timer = 0;
+    status_refresh(m);
+    return FALSE;
+}
+
+static void status_done(struct modem *m, const char *cmd, enum at_token result,
+                        const char *response)
+{
+    switch (status_response(&m->status, cmd, result, response))
+    {
+    case STATUS_RESEND:
+        log_message(LOG_FILE, "Modem refused the batched status query, splitting it\n");
+        status_refresh(m);
+        break;
+    case STATUS_PUBLISHED:
+        m->status_timer = g_timeout_add(m->status.interval_ms, on_status_timer, m);
+        break;
+    case STATUS_PENDING:
+        break;
+    }
+}
+
+static void on_status(const struct at_command *cmd, enum at_token result,
+                      const char *response, void *user)
+{
+    status_done(user, cmd->text, result, response);
+}
+
+static void status_refresh(struct modem *m)
+{
+    const char *cmds[STATUS_MAX_COMMANDS];
+    unsigned int n, i;
+
+    // started again once the modem is back
+    if (m->fd < 0)
+        return;
+    n = status_begin(&m->status, cmds);
+    for (i = 0; i < n; i++)
+        if (!at_send(m, cmds[i], AT_PRIO_BACKGROUND, AT_TIMEOUT_DEFAULT, on_status, m))
+            status_done(m, cmds[i], AT_RESULT_TIMEOUT, "");
+}
+
+/* Round robin over the modems without a call, so the load spreads and a
+ * modem that just failed isn't picked again right away */
+static struct modem *pick_idle_modem()
+{
+    struct modem *m;
+    int i;
+
+    for (i = 0; i < modem_count; i++) {
+        m = &modems[(next_dial + i) % modem_count];
+        if (m->fd >= 0 && call_count(&m->calls) == 0) {
+            next_dial = m->index + 1;
+            return m;
         }
+    }
+    return NULL;
+}
+
+bool at_dial(const char *number)
+{
+    char cmd[AT_CMD_MAX];
+    struct modem *m = pick_idle_modem();
+
+    if (!m)
+    {
+        log_message(LOG_FILE, "All modems are busy\n");
         return false;
-    case 'O':
-        if (strcmp(&response[1], "K\r\n") == 0) {
-            return true;
-        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "ATD%s;", number);
+    call_dialing(&m->calls, number);
+    if (!at_send(m, cmd, AT_PRIO_URGENT, AT_TIMEOUT_CALL, on_dial, m))
+    {
+        call_dial_failed(&m->calls);
         return false;
-    case 'R':
-        if (strcmp(&response[1], "ING\r\n") == 0) {
-            return true;
-        }
-        /* no break */
-    default:
+    }
+    return true;
+}
+
+// answer the modem that is ringing
+bool at_answer()
+{
+    int i;
+
+    for (i = 0; i < modem_count; i++)
+        if (call_find(&modems[i].calls, CALL_INCOMING))
+            return at_send(&modems[i], "ATA", AT_PRIO_URGENT, AT_TIMEOUT_CALL, on_answer, &modems[i]);
+    return false;
+}
+
+bool at_hangup()
+{
+    bool res = true;
+    int i;
+
+    for (i = 0; i < modem_count; i++)
+        if (call_count(&modems[i].calls) > 0)
+            res = at_send(&modems[i], "ATH", AT_PRIO_URGENT, AT_TIMEOUT_DEFAULT,
+                          on_hangup, &modems[i]) && res;
+    return res;
+}
+
+static void dtmf_flush(struct modem *m);
+
+static void on_vts(const struct at_command *cmd, enum at_token result,
+                   const char *response, void *user)
+{
+    struct modem *m = user;
+
+    at_log_result(cmd, result, response, user);
+    m->dtmf_busy = false;
+    dtmf_flush(m);
+}
+
+// everything pressed so far in one line, AT+VTS=1;+VTS=2;...
+static void dtmf_flush(struct modem *m)
+{
+    char cmd[AT_CMD_MAX];
+    size_t len, i;
+
+    if (!m->dtmf[0])
+        return;
+    len = snprintf(cmd, sizeof(cmd), "AT+VTS=%c", m->dtmf[0]);
+    for (i = 1; m->dtmf[i]; i++)
+        len += snprintf(cmd + len, sizeof(cmd) - len, ";+VTS=%c", m->dtmf[i]);
+
+    // the modem answers once it has played them all
+    m->dtmf_busy = at_send(m, cmd, AT_PRIO_URGENT, AT_TIMEOUT_DEFAULT + i * 1000, on_vts, m);
+    if (m->dtmf_busy)
+    {
+        m->dtmf_digits += i;
+        m->dtmf_commands++;
+    }
+    else
+        log_message(LOG_FILE, "DTMF digits dropped, queue full\n");
+    m->dtmf[0] = 0;
+}
+
+bool at_dtmf(const char *digits)
+{
+    struct modem *m = NULL;
+    size_t len;
+    int i;
+
+    if (digits[strspn(digits, DTMF_DIGITS)] != 0)
+        return false;
+    for (i = 0; i < modem_count && !m; i++)
+        if (modems[i].fd >= 0 && call_find(&modems[i].calls, CALL_ACTIVE))
+            m = &modems[i];
+    if (!m)
         return false;
+
+    len = strlen(m->dtmf);
+    if (len + strlen(digits) > DTMF_MAX)
+    {
+        log_message(LOG_FILE, "DTMF digits dropped, too many waiting\n");
+        return true;
     }
+    strcpy(m->dtmf + len, digits);
+    if (!m->dtmf_busy)
+        dtmf_flush(m);
+    return true;
 }
 
+// calls have the radio, a modem without one gets the batch
+static struct modem *sms_modem(void)
+{
+    int i;
+
+    for (i = 0; i < modem_count; i++)
+        if (modems[i].fd >= 0 && !modems[i].lost_us && !modems[i].sms_tx &&
+            call_count(&modems[i].calls) == 0)
+            return &modems[i];
+    return NULL;
+}
 
-int open_serial_port(char *ttyport)
+bool at_sms_send(const char * const *to, unsigned int count, const char *text,
+                 sms_tx_report_cb report, at_sms_done_cb done, void *user)
 {
-    int target_fd = open(ttyport, O_RDWR|O_NONBLOCK);
-    if (target_fd < 0)
+    struct modem *m = sms_modem();
+    struct sms_tx *tx;
+    unsigned int i;
+    char msg[128];
+
+    if (!m)
+    {
+        log_message(LOG_FILE, "No modem free to send SMS\n");
+        return false;
+    }
+
+    tx = malloc(sizeof(*tx));
+    if (!tx)
+        return false;
+    sms_tx_init(tx, report, user);
+    for (i = 0; i < count; i++)
+    {
+        if (!sms_tx_add(tx, to[i], text))
+        {
+            snprintf(msg, sizeof(msg), "SMS to %s not sent, text too long\n", to[i]);
+            log_message(LOG_FILE, msg);
+        }
+    }
+    if (tx->count == 0)
     {
-        log_message(LOG_FILE, "open() serial port error\n");
-        // perror(ttyport);
-        exit(EXIT_FAILURE);
+        sms_tx_free(tx);
+        free(tx);
+        return false;
     }
 
-    ioctl(target_fd, TIOCEXCL);
-    return target_fd;
+    m->sms_tx = tx;
+    sms_tx_pump(m);
+    if (tx->window_len == 0)
+    {
+        sms_tx_end(m);
+        return false;
+    }
+    m->sms_done = done;
+    m->sms_user = user;
+    return true;
 }
 
+static void outbox_pump(void);
+static gboolean on_outbox_timer(gpointer data);
 
-struct baudrate baud_rate_table[] = {
-    /* the first listed rate will be our default */
-    {"115200",	B115200,	0,	0,	100},
-    {"57600",	B57600,		0,	1,	100},
-    {"38400",	B38400,		0,	2,	100},
-    {"19200",	B19200,		0,	4,	50},
-    /* Non-standard high baud rates */
-    {"812500",	BOTHER,		812500,	-1,	1000},
-    {"406250",	BOTHER,		406250,	-1,	500},
-    {"203125",	BOTHER,		203125,	-1,	250},
-    /* table search terminator */
-    {NULL,		B0,		0,	-1,	0},
-};
+static void outbox_end(struct outbox_job *j, const struct sms_tx *tx)
+{
+    if (j->report)
+    {
+        sms_outbox_report_done(j->report, tx);
+        fclose(j->report);
+    }
+    sms_outbox_finish(outbox_dir, j->job.name);
+    sms_outbox_job_free(&j->job);
+    free(j);
+}
+
+static void on_outbox_part(const struct sms_tx_part *part, void *user)
+{
+    struct outbox_job *j = user;
 
-struct baudrate *find_baudrate_by_name(char *srch_name)
+    if (j->report)
+        sms_outbox_report_part(j->report, part);
+}
+
+static void on_outbox_done(const struct sms_tx *tx, void *user)
+{
+    outbox_end(user, tx);
+    outbox_pump();
+}
+
+// as many jobs as there are modems free, oldest first
+static void outbox_pump(void)
 {
-    struct baudrate *br;
+    char name[SMS_OUTBOX_NAME_MAX], path[PATH_MAX];
+    char msg[128];
+    struct outbox_job *j;
+    bool sent;
 
-    for (br = baud_rate_table; br->name; br++)
-        if (!strcmp(br->name, srch_name))
+    while (sms_modem() && sms_outbox_next(outbox_dir, name))
+    {
+        j = calloc(1, sizeof(*j));
+        if (!j)
             break;
-    if (br->name)
-        return(br);
+        sms_outbox_path(path, outbox_dir, name, ".report");
+        j->report = fopen(path, "a");
+        sent = sms_outbox_take(outbox_dir, name, &j->job) && j->report &&
+            at_sms_send((const char * const *) j->job.to, j->job.count, j->job.text,
+                        on_outbox_part, on_outbox_done, j);
+        snprintf(msg, sizeof(msg), "SMS batch %s from the outbox, %u numbers%s\n", name,
+                 j->job.count, sent ? "" : ", not sent");
+        log_message(LOG_FILE, msg);
+        if (!sent)
+            outbox_end(j, NULL);
+    }
+
+    // jobs waiting for a modem (or no inotify) are looked at again later
+    if (!outbox_timer && (outbox_fd < 0 || sms_outbox_next(outbox_dir, name)))
+        outbox_timer = g_timeout_add(SMS_OUTBOX_RETRY_MS, on_outbox_timer, NULL);
+}
+
+static gboolean on_outbox_timer(gpointer data)
+{
+    outbox_timer = 0;
+    outbox_pump();
+    return FALSE;
+}
+
+// a job renamed into place
+static gboolean on_outbox_event(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (read(outbox_fd, buf, sizeof(buf)) > 0)
+        ;
+    outbox_pump();
+    return TRUE;
+}
+
+void at_sms_outbox(const char *dir)
+{
+    char msg[PATH_MAX + 64];
+    char name[SMS_OUTBOX_NAME_MAX];
+
+    if (mkdir(dir, 0775) < 0 && errno != EEXIST)
+    {
+        snprintf(msg, sizeof(msg), "No SMS outbox, %s: %s\n", dir, strerror(errno));
+        log_message(LOG_FILE, msg);
+        return;
+    }
+    outbox_dir = dir;
+    outbox_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (outbox_fd >= 0 && inotify_add_watch(outbox_fd, dir, IN_MOVED_TO | IN_CREATE) >= 0)
+    {
+        outbox_channel = g_io_channel_unix_new(outbox_fd);
+        g_io_add_watch(outbox_channel, G_IO_IN, on_outbox_event, NULL);
+    }
     else
     {
-        log_message(LOG_FILE, "error: baud rate not known\n");
-//        fprintf(stderr, "error: baud rate \"%s\" not known\n", srch_name);
-        return(NULL);
+        log_message(LOG_FILE, "inotify not available, polling the SMS outbox\n");
+        if (outbox_fd >= 0)
+            close(outbox_fd);
+        outbox_fd = -1;
     }
+
+    // the modems aren't up yet, the timer takes what is already there
+    if (sms_outbox_next(dir, name))
+        outbox_timer = g_timeout_add(SMS_OUTBOX_RETRY_MS, on_outbox_timer, NULL);
+    else if (outbox_fd < 0)
+        outbox_pump();
 }
 
-struct baudrate *set_serial_baudrate(struct baudrate *br, int target_fd)
+const char *at_modem_name(const struct modem *m)
 {
-    struct termios2 target_termios;
+    return m->name;
+}
+
+void at_dump_stats(FILE *out)
+{
+    struct modem *m;
+    int i;
 
-    target_termios.c_iflag = IGNBRK;
-    target_termios.c_oflag = 0;
-    target_termios.c_cflag = br->termios_code | CLOCAL|HUPCL|CREAD|CS8;
-    target_termios.c_lflag = 0;
-    target_termios.c_cc[VMIN] = 1;
-    target_termios.c_cc[VTIME] = 0;
-    target_termios.c_ispeed = br->nonstd_speed;
-    target_termios.c_ospeed = br->nonstd_speed;
-    if (ioctl(target_fd, TCSETSF2, &target_termios) < 0) {
-        log_message(LOG_FILE, "ioctl() TCSETSF2 error\n");
-        // perror("TCSETSF2");
-        exit(1);
+    for (i = 0; i < modem_count; i++) {
+        m = &modems[i];
+        fprintf(out, "%s: %llu bytes, %llu lines in; %llu commands sent, %llu failed, "
+                "%llu timed out, %llu refused; %u calls; %llu SMS in, %llu undecodable, "
+                "%llu duplicates, %llu not stored\n", m->name,
+                (unsigned long long) m->parser.bytes, (unsigned long long) m->parser.lines,
+                (unsigned long long) m->queue.sent, (unsigned long long) m->queue.failed,
+                (unsigned long long) m->queue.timeouts, (unsigned long long) m->queue.rejected,
+                call_count(&m->calls), (unsigned long long) m->sms.received,
+                (unsigned long long) m->sms.undecodable, (unsigned long long) m->sms.duplicates,
+                (unsigned long long) m->sms.store_errors);
+        fprintf(out, "%s: %llu DTMF digits in %llu AT+VTS\n", m->name, m->dtmf_digits,
+                m->dtmf_commands);
+        fprintf(out, "%s: %u reconnects, last ready %lld ms after the loss, worst %lld ms%s\n",
+                m->name, m->reconnects, (long long) m->last_recovery_ms,
+                (long long) m->max_recovery_ms,
+                m->fd < 0 ? "; waiting for the device" : m->lost_us ? "; initializing" : "");
     }
+}
+
+void at_close()
+{
+    int i;
 
-    return br;
+    for (i = 0; i < modem_count; i++)
+    {
+        if (modems[i].fd >= 0)
+            close(modems[i].fd);
+        at_trace_close(&modems[i].capture);
+    }
 }
 
-void set_fixed_baudrate(char *baudname, int target_fd)
+static const char *modem_name(const void *user)
 {
-    struct baudrate *br;
+    return at_modem_name(user);
+}
+
+const struct backend_ops at_backend = {
+    .name = "at",
+    .dial = at_dial,
+    .answer = at_answer,
+    .hangup = at_hangup,
+    .dtmf = at_dtmf,
+    .modem_name = modem_name,
+    .dump_stats = at_dump_stats,
+};
+
+/* the last init command: the modem is ready again, or not quite yet */
+static void on_init_done(const struct at_command *cmd, enum at_token result,
+                         const char *response, void *user);
+static void baud_probe(struct modem *m, int i);
 
-    br = find_baudrate_by_name(baudname);
-    if (!br)
-        exit(1); /* error msg already printed */
-    set_serial_baudrate(br, target_fd);
+// caller id and call status URCs, then whatever calls are already up,
+// then SMS in PDU mode announced with +CMTI
+static bool send_init(struct modem *m)
+{
+    return at_send(m, "ATZ", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, at_log_result, m) &&
+        at_send(m, "AT+CLIP=1", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, at_log_result, m) &&
+        at_send(m, "AT^DSCI=1", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, at_log_result, m) &&
+        at_send(m, "AT+CLCC", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, on_clcc, m) &&
+        at_send(m, "AT+CMGF=0", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, at_log_result, m) &&
+        at_send(m, "AT+CNMI=2,1,0,0,0", AT_PRIO_NORMAL, AT_TIMEOUT_DEFAULT, on_init_done, m);
 }
 
-void safe_output(unsigned char *buf, int cc)
+static void on_init_done(const struct at_command *cmd, enum at_token result,
+                         const char *response, void *user)
 {
-    int i, c;
+    struct modem *m = user;
+    char msg[256];
+    gint64 now, ms;
 
-    for (i = 0; i < cc; i++) {
-        c = buf[i];
-        if (c == '\r' || c == '\n' || c == '\t' || c == '\b') {
-            continue;
-        }
-        if (c & 0x80) {
-            c &= 0x7F;
-        }
-        if (c < 0x20) {
-            buf[i] = '^';
-        } else if (c == 0x7F) {
-            buf[i] = '?';
+    at_log_result(cmd, result, response, user);
+    if (!m->lost_us || m->fd < 0)
+        return;
+
+    // a modem that just reset may still be booting, go again; with "auto"
+    // it may also have come back at another rate, so that is asked first
+    if (result == AT_RESULT_TIMEOUT)
+    {
+        if (m->rate)
+        {
+            snprintf(msg, sizeof(msg), "%s not answering at %s, probing again\n", m->name,
+                     m->rate);
+            log_message(LOG_FILE, msg);
+            m->rate = NULL;
+            baud_probe(m, 0);
+            return;
         }
+        if (!send_init(m))
+            log_message(LOG_FILE, "Error writing to the modem\n");
+        return;
     }
+
+    now = g_get_monotonic_time();
+    ms = (now - m->lost_us) / 1000;
+    m->reconnects++;
+    m->last_recovery_ms = ms;
+    if (ms > m->max_recovery_ms)
+        m->max_recovery_ms = ms;
+    snprintf(msg, sizeof(msg), "%s ready again %lld ms after it was lost "
+             "(%lld ms to reopen, %lld ms to initialize)\n", m->name, (long long) ms,
+             (long long) (m->reopened_us - m->lost_us) / 1000,
+             (long long) (now - m->reopened_us) / 1000);
+    log_message(LOG_FILE, msg);
+    m->lost_us = 0;
 }
 
-int loop(void *arg)
+/* open the port at the configured rate and hand it to the main loop;
+ * "auto" opens at the rate negotiated before, or at the fastest one and
+ * modem_start() probes from there */
+static bool modem_open(struct modem *m)
 {
-    int *target_fd_ptr = (int *)arg;
-    int target_fd = *target_fd_ptr;
-    char buf[MAX_BUF_SIZE];
-    fd_set fds, fds1;
-    int i, cc, max;
+    int fd = open_serial_port(m->path);
+    const char *rate = m->baud;
 
-    if (thrd_detach(thrd_current()) != thrd_success) {
-        /* Handle error */
+    if (fd < 0)
+        return false;
+    if (!strcmp(rate, "auto"))
+        rate = m->rate ? m->rate : baudrate_probe_order(0);
+    if (!set_fixed_baudrate(rate, fd))
+    {
+        close(fd);
+        return false;
     }
 
-    FD_ZERO(&fds);
-    FD_SET(target_fd, &fds);
-    max = target_fd + 1;
-    for (;;) {
-        bcopy(&fds, &fds1, sizeof(fd_set));
-        i = select(max, &fds1, NULL, NULL, NULL);
-        if (i < 0) {
-            if (errno == EINTR)
-                continue;
-            log_message(LOG_FILE, "select() error\n");
-            // perror("select");
-            exit(1);
-        }
+    m->fd = fd;
+    at_queue_set_fd(&m->queue, fd);
+    at_parser_reset(&m->parser);
+
+    // modem I/O is serviced by the same main loop that runs gtk_main()
+    m->channel = g_io_channel_unix_new(fd);
+    m->watch = g_io_add_watch(m->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                              on_modem_io, m);
+    return true;
+}
+
+static void modem_init(struct modem *m)
+{
+    if (!send_init(m))
+        log_message(LOG_FILE, "Error writing to the modem\n");
+    // whatever arrived while we were not running
+    sms_drain(m);
+    status_refresh(m);
+}
+
+static void on_baud_probe(const struct at_command *cmd, enum at_token result,
+                          const char *response, void *user);
+
+/* "auto": put the port on the i-th rate, fastest first, and ask for OK.
+ * The AT goes through the queue with a short timeout, so the main loop
+ * (UI, other modems) keeps running while a silent rate times out. */
+static void baud_probe(struct modem *m, int i)
+{
+    const char *rate = baudrate_probe_order(i);
+    char msg[128];
+
+    m->probe_rate = i;
+    m->probe_ok = 0;
+    if (!rate)
+    {
+        // maybe still booting: the rate that worked last time is the best guess
+        rate = read_saved_baudrate();
+        if (!rate)
+            rate = BAUD_DEFAULT;
+        snprintf(msg, sizeof(msg), "Baud rate autonegotiation failed, using %s\n", rate);
+        log_message(LOG_FILE, msg);
+        set_fixed_baudrate(rate, m->fd);
+        at_queue_set_fd(&m->queue, m->fd);
+        modem_init(m);
+        return;
+    }
+
+    if (!set_fixed_baudrate(rate, m->fd))
+    {
+        baud_probe(m, i + 1);
+        return;
+    }
+    at_queue_set_fd(&m->queue, m->fd);
+    if (!at_send(m, "AT", AT_PRIO_URGENT, BAUD_PROBE_TIMEOUT_MS, on_baud_probe, m))
+        log_message(LOG_FILE, "Error writing to the modem\n");
+}
+
+static void on_baud_probe(const struct at_command *cmd, enum at_token result,
+                          const char *response, void *user)
+{
+    struct modem *m = user;
+    const char *rate;
+    char msg[128];
+
+    // lost while probing: the reopen starts over
+    if (m->fd < 0)
+        return;
+    if (result != AT_TOK_OK)
+    {
+        baud_probe(m, m->probe_rate + 1);
+        return;
+    }
+    if (++m->probe_ok < BAUD_PROBE_TRIES)
+    {
+        if (!at_send(m, "AT", AT_PRIO_URGENT, BAUD_PROBE_TIMEOUT_MS, on_baud_probe, m))
+            log_message(LOG_FILE, "Error writing to the modem\n");
+        return;
+    }
+
+    rate = baudrate_probe_order(m->probe_rate);
+    snprintf(msg, sizeof(msg), "Baud rate autonegotiation: %s\n", rate);
+    log_message(LOG_FILE, msg);
+    save_baudrate(rate);
+    m->rate = rate;
+    modem_init(m);
+}
+
+// a reconnect keeps the rate it had, on_init_done() probes if that fails
+static void modem_start(struct modem *m)
+{
+    if (!strcmp(m->baud, "auto") && !m->rate)
+        baud_probe(m, 0);
+    else
+        modem_init(m);
+}
 
-        if (FD_ISSET(target_fd, &fds1)) {
-            cc = read(target_fd, buf, sizeof buf);
-            if (cc <= 0) {
-                fprintf(stderr, "EOF/error on target tty\n");
-                exit(1);
-            }
-            buf[cc] = 0;
-            if (strstr(buf,"ING") != NULL)
-            {
-                char ring_str[512];
-                sprintf(ring_str, "%s: RINGING\n", get_time());
-                log_message(LOG_FILE,ring_str);
-                if (!gtk_widget_get_visible (GTK_WIDGET(window)))
-                {
-                    gtk_widget_show(GTK_WIDGET(window));
-                    // sprintf(dial_pad, "!! RINGING !!");
-                }
-                hildon_entry_set_text((HildonEntry *)display, "!! RINGING !!");
-                ring(1, 1800.0);
-            }
-            safe_output(buf, cc);
-            log_message(LOG_FILE, buf);
+static void hotplug_stop(struct modem *m)
+{
+    if (m->hotplug_watch)
+        g_source_remove(m->hotplug_watch);
+    if (m->hotplug_channel)
+        g_io_channel_unref(m->hotplug_channel);
+    if (m->hotplug_fd >= 0)
+        close(m->hotplug_fd);
+    if (m->retry_timer)
+        g_source_remove(m->retry_timer);
+    m->hotplug_watch = m->retry_timer = 0;
+    m->hotplug_channel = NULL;
+    m->hotplug_fd = -1;
+}
+
+static bool try_reopen(struct modem *m)
+{
+    char msg[128];
+
+    if (!modem_open(m))
+        return false;
+
+    m->reopened_us = g_get_monotonic_time();
+    snprintf(msg, sizeof(msg), "%s is back after %lld ms, initializing\n", m->name,
+             (long long) (m->reopened_us - m->lost_us) / 1000);
+    log_message(LOG_FILE, msg);
+    modem_start(m);
+    return true;
+}
+
+// the node shows up (IN_CREATE) and udev fixes its permissions (IN_ATTRIB)
+static gboolean on_hotplug(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    struct modem *m = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    const char *base = strrchr(m->path, '/') ? strrchr(m->path, '/') + 1 : m->path;
+    bool ours = false;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(m->hotplug_fd, buf, sizeof(buf))) > 0)
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *) p;
+            if (ev->len && strcmp(ev->name, base) == 0)
+                ours = true;
         }
+
+    if (ours && try_reopen(m))
+    {
+        m->hotplug_watch = 0;
+        hotplug_stop(m);
+        return FALSE;
     }
+    return TRUE;
 }
 
-bool run_at_backend(int modem_fd)
+// for nodes that never went away, or no inotify
+static gboolean on_retry_timer(gpointer data)
 {
-    thrd_t rx_thread;
-    int result;
+    struct modem *m = data;
+
+    if (!try_reopen(m))
+        return TRUE;
+    m->retry_timer = 0;
+    hotplug_stop(m);
+    return FALSE;
+}
 
-    char cmd[MAX_BUF_SIZE];
+static void hotplug_wait(struct modem *m)
+{
+    char dir[MAX_MODEM_PATH];
+    char *slash;
 
-    sprintf(cmd, "ATZ\r");
-    int res = write(modem_fd, cmd, strlen(cmd));
+    snprintf(dir, sizeof(dir), "%s", m->path);
+    slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = 0;
+    else if (slash)
+        *slash = 0;
+    else
+        snprintf(dir, sizeof(dir), ".");
 
-    if (res < 0)
+    m->hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m->hotplug_fd >= 0 &&
+        inotify_add_watch(m->hotplug_fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) >= 0)
     {
-        log_message(LOG_FILE, "Error writing to the modem\n");
+        m->hotplug_channel = g_io_channel_unix_new(m->hotplug_fd);
+        m->hotplug_watch = g_io_add_watch(m->hotplug_channel, G_IO_IN, on_hotplug, m);
+    }
+    else
+    {
+        log_message(LOG_FILE, "inotify not available, polling for the modem\n");
+    }
+    m->retry_timer = g_timeout_add(RECONNECT_RETRY_MS, on_retry_timer, m);
+}
+
+/* EOF or an error on the port: the modem reset or left the USB bus. Fail
+ * what was queued, end its calls and wait for the node to come back. */
+static void modem_lost(struct modem *m)
+{
+    char msg[128];
+
+    snprintf(msg, sizeof(msg), "EOF/error on %s, waiting for it to come back\n", m->name);
+    log_message(LOG_FILE, msg);
+    m->lost_us = g_get_monotonic_time();
+    at_trace_flush(&m->capture);
+
+    if (m->output_watch)
+        g_source_remove(m->output_watch);
+    if (m->queue_timer)
+        g_source_remove(m->queue_timer);
+    m->output_watch = m->queue_timer = 0;
+    g_io_channel_unref(m->channel);
+    m->channel = NULL;
+    close(m->fd);
+    m->fd = -1;
+
+    // nothing can be sent from here on, the callbacks see timeouts
+    m->dtmf[0] = 0;
+    at_queue_set_fd(&m->queue, -1);
+    at_queue_flush(&m->queue);
+    if (m->status_timer)
+        g_source_remove(m->status_timer);
+    m->status_timer = 0;
+    call_hungup(&m->calls);
+
+    hotplug_wait(m);
+}
+
+bool run_at_backend(const char *path, const char *baud, call_event_cb on_call)
+{
+    struct modem *m;
+    char file[MAX_MODEM_PATH + 16];
+
+    if (modem_count == MAX_MODEMS)
+    {
+        log_message(LOG_FILE, "Too many modems\n");
+        return false;
+    }
+    m = &modems[modem_count];
+
+    if (!at_queue_init(&m->queue, -1))
+    {
+        log_message(LOG_FILE, "Error creating the AT command queue\n");
         return false;
     }
+    m->index = modem_count++;
+    m->fd = m->hotplug_fd = -1;
+    snprintf(m->name, sizeof(m->name), "%s", path);
+    snprintf(m->path, sizeof(m->path), "%s", path);
+    m->baud = baud;
+    if (m->index == 0)
+        snprintf(file, sizeof(file), "%s", STATUS_FILE);
+    else
+        snprintf(file, sizeof(file), "%s.%d", STATUS_FILE, m->index);
+    status_init(&m->status, status_interval_ms, file);
+    at_parser_init(&m->parser, on_modem_line, m);
+    if (!sms_store_ready)
+    {
+        sms_store_ready = sms_store_open(&sms_store, sms_path);
+        if (!sms_store_ready)
+            log_message(LOG_FILE, "Could not open the SMS store, messages stay on the SIM\n");
+    }
+    sms_rx_init(&m->sms, &sms_store, sms_listener, m);
+    call_table_init(&m->calls, on_call, m);
 
-    thrd_create(&rx_thread, loop, &modem_fd );
+    // one trace per modem: path, path.1, path.2...
+    if (capture_path)
+    {
+        if (m->index == 0)
+            snprintf(file, sizeof(file), "%s", capture_path);
+        else
+            snprintf(file, sizeof(file), "%s.%d", capture_path, m->index);
+        if (!at_trace_open(&m->capture, file))
+        {
+            log_message(LOG_FILE, "Could not open the capture file\n");
+            return false;
+        }
+        at_queue_set_tx_tap(&m->queue, capture_tx, m);
+    }
+    at_queue_set_write_hook(&m->queue, want_write, m);
+
+    // not plugged in yet counts as lost: it is picked up when it appears
+    if (!modem_open(m))
+    {
+        m->lost_us = g_get_monotonic_time();
+        log_message(LOG_FILE, "Could not open modem, waiting for it\n");
+        hotplug_wait(m);
+        return true;
+    }
+    modem_start(m);
 
     return true;
 }
@@ -24,18 +24,94 @@
 #define HAVE_AT_H__
 
 #include <stdbool.h>
+#include <stdio.h>
+
+#include "at_queue.h"
+#include "backend.h"
+#include "call.h"
+#include "serial.h"
+#include "status.h"
+#include "sms.h"
+#include "sms_tx.h"
 
 #define MAX_MODEM_PATH 4096
+#define MAX_MODEMS 8
 #define MAX_BUF_SIZE 4096
+/* reopen attempts while a lost modem is away, on top of inotify */
+#define RECONNECT_RETRY_MS 1000
+/* outbox jobs waiting for a modem without a call are looked at again */
+#define SMS_OUTBOX_RETRY_MS 5000
+
+struct modem;
+
+/* Add a modem to the main loop, once per -m. on_call hears about every
+ * call state change, with the modem as user. The port is opened at baud
+ * (see set_baudrate()); when it goes away (modem reset, USB
+ * re-enumeration) or isn't there yet, the modem is picked up again as
+ * soon as the device node reappears, calls on it ended. */
+bool run_at_backend(const char *path, const char *baud, call_event_cb on_call);
+
+/* record all modem traffic to binary traces (see at_trace.h): path for the
+ * first modem, path.1, path.2... for the others. Call before
+ * run_at_backend(). */
+void at_capture(const char *path);
+
+/* how often the status poller refreshes when things change, before
+ * run_at_backend() */
+void at_status_interval(unsigned int ms);
+/* latest status of modem index (in -m order), NULL before the first
+ * refresh. Written to STATUS_FILE(.index) as well. */
+const struct modem_status *at_modem_status(int index);
+
+/* Where received SMS are stored (SMS_STORE_FILE by default) and who
+ * hears about each new one, with the modem as user. Before
+ * run_at_backend(). */
+void at_sms(const char *path, sms_event_cb on_sms);
+
+/* queue a command for the modem, see at_queue_submit() */
+bool at_send(struct modem *m, const char *cmd, enum at_priority priority,
+             unsigned int timeout_ms, at_done_cb done, void *user);
+/* same, response lines streamed to on_line, see at_queue_submit_stream() */
+bool at_send_stream(struct modem *m, const char *cmd, enum at_priority priority,
+                    unsigned int timeout_ms, at_line_cb on_line, at_done_cb done, void *user);
+/* same, payload written when the modem prompts, see at_queue_submit_prompt() */
+bool at_send_prompt(struct modem *m, const char *cmd, const char *payload,
+                    enum at_priority priority, unsigned int timeout_ms, at_done_cb done,
+                    void *user);
+/* at_done_cb that only logs failures */
+void at_log_result(const struct at_command *cmd, enum at_token result,
+                   const char *response, void *user);
+
+/* call control, the outcome arrives through the call listener. Dials go
+ * to a modem without a call, answer to the one that rings, hangup ends
+ * every call. */
+bool at_dial(const char *number);
+bool at_answer();
+bool at_hangup();
+/* AT+VTS on the modem with the active call. Digits that come while one
+ * is in flight are sent together, as one command line, when it is done. */
+bool at_dtmf(const char *digits);
+
+/* a batch is over, every part sent or failed; tx goes when this returns */
+typedef void (*at_sms_done_cb)(const struct sms_tx *tx, void *user);
 
-#define BACKEND_NONE 0
-#define BACKEND_AT 1
-#define BACKEND_OFONO 2
+/* Send text to count numbers as one batch (see sms_tx.h) from a modem
+ * without a call or a batch. report hears about every part that is sent or
+ * failed for good, done about the end, both with user; the totals go to
+ * the log. False if no modem is free or nothing could be queued, and
+ * then neither is called. */
+bool at_sms_send(const char * const *to, unsigned int count, const char *text,
+                 sms_tx_report_cb report, at_sms_done_cb done, void *user);
 
-bool run_at_backend(int modem_fd);
+/* Send the batches other programs (sms-send) leave in dir, see
+ * sms_outbox.h, one per modem without a call at a time */
+void at_sms_outbox(const char *dir);
 
-int open_serial_port(char *ttyport);
-void set_fixed_baudrate(char *baudname, int target_fd);
+const char *at_modem_name(const struct modem *m);
+/* per modem traffic, command and call counters */
+void at_dump_stats(FILE *out);
+/* close every modem port, on exit */
+void at_close();
 
 void strip_cr(char *s);
 bool is_final_result(const char * const response);
@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_parser.c
+ * @brief Streaming AT response parser
+ *
+ * The receive buffer is used as a ring: data is appended at tail, lines
+ * are consumed from head. When tail hits the end of the buffer the only
+ * thing left is (at most) one partial line, which is moved back to the
+ * start. When everything is consumed the buffer simply restarts at 0, so
+ * in practice the move almost never happens.
+ *
+ */
+
+#include <string.h>
+
+#include "at_parser.h"
+#include "at_text.h"
+
+#define TOKEN_PREFIX(a, b, c, d) \
+    ((uint32_t) (unsigned char) (a) | (uint32_t) (unsigned char) (b) << 8 | \
+     (uint32_t) (unsigned char) (c) << 16 | (uint32_t) (unsigned char) (d) << 24)
+
+#define TOKEN(k, f) { k, sizeof(k) - 1, f }
+
+const struct at_token_info at_token_table[AT_TOK_COUNT] = {
+    [AT_TOK_UNKNOWN]     = { "", 0, 0 },
+    [AT_TOK_ECHO]        = { "AT", 2, 0 },
+    [AT_TOK_PROMPT]      = { ">", 1, 0 },
+
+    [AT_TOK_OK]          = TOKEN("OK", AT_FLAG_FINAL),
+    [AT_TOK_CONNECT]     = TOKEN("CONNECT", AT_FLAG_FINAL),
+    [AT_TOK_ERROR]       = TOKEN("ERROR", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_BUSY]        = TOKEN("BUSY", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_NO_CARRIER]  = TOKEN("NO CARRIER", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_NO_ANSWER]   = TOKEN("NO ANSWER", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_NO_DIALTONE] = TOKEN("NO DIALTONE", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_CME_ERROR]   = TOKEN("+CME ERROR", AT_FLAG_FINAL | AT_FLAG_ERROR),
+    [AT_TOK_CMS_ERROR]   = TOKEN("+CMS ERROR", AT_FLAG_FINAL | AT_FLAG_ERROR),
+
+    [AT_TOK_RING]        = TOKEN("RING", AT_FLAG_URC),
+    [AT_TOK_CRING]       = TOKEN("+CRING", AT_FLAG_URC),
+    [AT_TOK_CLIP]        = TOKEN("+CLIP", AT_FLAG_URC),
+    [AT_TOK_CCWA]        = TOKEN("+CCWA", AT_FLAG_URC),
+    [AT_TOK_DSCI]        = TOKEN("^DSCI", AT_FLAG_URC),
+    [AT_TOK_CMTI]        = TOKEN("+CMTI", AT_FLAG_URC),
+    [AT_TOK_CMT]         = TOKEN("+CMT", AT_FLAG_URC),
+    [AT_TOK_CDSI]        = TOKEN("+CDSI", AT_FLAG_URC),
+    [AT_TOK_CDS]         = TOKEN("+CDS", AT_FLAG_URC),
+    [AT_TOK_CUSD]        = TOKEN("+CUSD", AT_FLAG_URC),
+    [AT_TOK_QIND]        = TOKEN("+QIND", AT_FLAG_URC),
+    [AT_TOK_RDY]         = TOKEN("RDY", AT_FLAG_URC),
+    [AT_TOK_CPIN]        = TOKEN("+CPIN", AT_FLAG_URC),
+    [AT_TOK_CFUN]        = TOKEN("+CFUN", AT_FLAG_URC),
+    [AT_TOK_QUSIM]       = TOKEN("+QUSIM", AT_FLAG_URC),
+
+    [AT_TOK_CREG]        = TOKEN("+CREG", AT_FLAG_URC),
+    [AT_TOK_CGREG]       = TOKEN("+CGREG", AT_FLAG_URC),
+    [AT_TOK_CEREG]       = TOKEN("+CEREG", AT_FLAG_URC),
+
+    [AT_TOK_CLCC]        = TOKEN("+CLCC", 0),
+    [AT_TOK_CSQ]         = TOKEN("+CSQ", 0),
+    [AT_TOK_COPS]        = TOKEN("+COPS", 0),
+    [AT_TOK_CPAS]        = TOKEN("+CPAS", 0),
+    [AT_TOK_CMGL]        = TOKEN("+CMGL", 0),
+    [AT_TOK_CMGR]        = TOKEN("+CMGR", 0),
+    [AT_TOK_CMGS]        = TOKEN("+CMGS", 0),
+    [AT_TOK_CMSS]        = TOKEN("+CMSS", 0),
+    [AT_TOK_CMMS]        = TOKEN("+CMMS", 0),
+    [AT_TOK_CSCA]        = TOKEN("+CSCA", 0),
+    [AT_TOK_QCFG]        = TOKEN("+QCFG", 0),
+};
+
+/* Perfect hash of the keys above, worked out ahead of time: the first
+ * four bytes of the line (zero padded) plus the fifth unless it is the
+ * ':', times a multiplier for which no two keys share one of the 128
+ * slots. A lookup is one multiply, one load and one compare, and nothing
+ * is set up at run time. Adding a key means finding a new multiplier and
+ * recomputing the slots with TOKEN_SLOT(); at-bench fails when a key no
+ * longer comes back as its own token. Free slots are all zero and match
+ * no line. */
+#define TOKEN_INDEX_BITS 7
+#define TOKEN_INDEX_MUL 0x1c25c84bu
+#define TOKEN_SLOT(prefix, fifth) \
+    ((uint32_t) (((prefix) + (unsigned char) (fifth)) * TOKEN_INDEX_MUL) >> \
+     (32 - TOKEN_INDEX_BITS))
+
+/* everything the lookup compares is in the slot, so a hit costs one load */
+struct token_slot {
+    uint32_t prefix;      /* key[0..3], zero padded */
+    unsigned char fifth;  /* key[4], 0 when shorter */
+    unsigned char len;
+    unsigned char token;
+};
+
+#define KEY_BYTE(k, i) ((k "\0\0\0\0")[i])
+#define SLOT(tok, k) { TOKEN_PREFIX(KEY_BYTE(k, 0), KEY_BYTE(k, 1), KEY_BYTE(k, 2), \
+                                    KEY_BYTE(k, 3)), KEY_BYTE(k, 4), sizeof(k) - 1, tok }
+
+static const struct token_slot token_index[1 << TOKEN_INDEX_BITS] = {
+    [ 96] = SLOT(AT_TOK_OK, "OK"),
+    [ 62] = SLOT(AT_TOK_CONNECT, "CONNECT"),
+    [  0] = SLOT(AT_TOK_ERROR, "ERROR"),
+    [104] = SLOT(AT_TOK_BUSY, "BUSY"),
+    [  6] = SLOT(AT_TOK_NO_CARRIER, "NO CARRIER"),
+    [114] = SLOT(AT_TOK_NO_ANSWER, "NO ANSWER"),
+    [ 28] = SLOT(AT_TOK_NO_DIALTONE, "NO DIALTONE"),
+    [ 76] = SLOT(AT_TOK_CME_ERROR, "+CME ERROR"),
+    [ 89] = SLOT(AT_TOK_CMS_ERROR, "+CMS ERROR"),
+
+    [ 79] = SLOT(AT_TOK_RING, "RING"),
+    [ 94] = SLOT(AT_TOK_CRING, "+CRING"),
+    [ 33] = SLOT(AT_TOK_CLIP, "+CLIP"),
+    [ 85] = SLOT(AT_TOK_CCWA, "+CCWA"),
+    [123] = SLOT(AT_TOK_DSCI, "^DSCI"),
+    [ 63] = SLOT(AT_TOK_CMTI, "+CMTI"),
+    [ 60] = SLOT(AT_TOK_CMT, "+CMT"),
+    [ 20] = SLOT(AT_TOK_CDSI, "+CDSI"),
+    [ 17] = SLOT(AT_TOK_CDS, "+CDS"),
+    [116] = SLOT(AT_TOK_CUSD, "+CUSD"),
+    [ 16] = SLOT(AT_TOK_QIND, "+QIND"),
+    [ 87] = SLOT(AT_TOK_RDY, "RDY"),
+    [ 21] = SLOT(AT_TOK_CPIN, "+CPIN"),
+    [110] = SLOT(AT_TOK_CFUN, "+CFUN"),
+    [ 67] = SLOT(AT_TOK_QUSIM, "+QUSIM"),
+
+    [101] = SLOT(AT_TOK_CREG, "+CREG"),
+    [ 99] = SLOT(AT_TOK_CGREG, "+CGREG"),
+    [ 27] = SLOT(AT_TOK_CEREG, "+CEREG"),
+
+    [  9] = SLOT(AT_TOK_CLCC, "+CLCC"),
+    [ 36] = SLOT(AT_TOK_CSQ, "+CSQ"),
+    [126] = SLOT(AT_TOK_COPS, "+COPS"),
+    [ 48] = SLOT(AT_TOK_CPAS, "+CPAS"),
+    [  2] = SLOT(AT_TOK_CMGL, "+CMGL"),
+    [ 86] = SLOT(AT_TOK_CMGR, "+CMGR"),
+    [100] = SLOT(AT_TOK_CMGS, "+CMGS"),
+    [ 38] = SLOT(AT_TOK_CMSS, "+CMSS"),
+    [ 69] = SLOT(AT_TOK_CMMS, "+CMMS"),
+    [ 42] = SLOT(AT_TOK_CSCA, "+CSCA"),
+    [ 53] = SLOT(AT_TOK_QCFG, "+QCFG"),
+};
+
+/* keys are a few bytes long, this beats a call to memcmp() */
+static inline bool key_equal(const char *a, const char *b, size_t n)
+{
+    while (n--)
+        if (*a++ != *b++)
+            return false;
+    return true;
+}
+
+enum at_token at_line_classify(const char *s, size_t len)
+{
+    const struct token_slot *slot;
+    uint32_t prefix;
+    unsigned char fifth;
+
+    while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == '\n'))
+        len--;
+    if (len == 0)
+        return AT_TOK_UNKNOWN;
+
+    if (len >= 5) {
+        prefix = TOKEN_PREFIX(s[0], s[1], s[2], s[3]);
+        fifth = s[4] == ':' ? 0 : s[4];
+    } else {
+        prefix = TOKEN_PREFIX(s[0], len > 1 ? s[1] : 0, len > 2 ? s[2] : 0,
+                              len > 3 ? s[3] : 0);
+        fifth = 0;
+    }
+
+    /* The five bytes hashed settle keys of up to four: the fifth is 0 only
+     * at the end of the line or at the ':'. Longer keys need the byte after
+     * them checked, and the tail of keys over five compared. */
+    slot = &token_index[TOKEN_SLOT(prefix, fifth)];
+    if (slot->prefix == prefix && slot->fifth == fifth) {
+        if (slot->len <= 4)
+            return slot->token;
+        if ((len == slot->len || (len > slot->len && s[slot->len] == ':')) &&
+            key_equal(s + 5, at_token_table[slot->token].key + 5, slot->len - 5))
+            return slot->token;
+    }
+
+    /* the few results that carry text without a ':' */
+    if (len > 8 && memcmp(s, "CONNECT ", 8) == 0)
+        return AT_TOK_CONNECT;
+    if (len >= 2 && (s[0] == 'A' || s[0] == 'a') && (s[1] == 'T' || s[1] == 't'))
+        return AT_TOK_ECHO;
+
+    return AT_TOK_UNKNOWN;
+}
+
+const char *at_token_name(enum at_token token)
+{
+    if (token == AT_TOK_UNKNOWN || token >= AT_TOK_COUNT)
+        return "?";
+    return at_token_table[token].key;
+}
+
+int at_split_fields(const char *data, size_t len, struct at_field *f, int max)
+{
+    const char *end = data + len, *s, *start;
+    int n = 0;
+
+    while (end > data && (end[-1] == '\r' || end[-1] == '\n'))
+        end--;
+    s = memchr(data, ':', end - data);
+    if (!s)
+        return 0;
+    s++;
+
+    while (n < max) {
+        while (s < end && *s == ' ')
+            s++;
+        if (s < end && *s == '"') {
+            start = ++s;
+            while (s < end && *s != '"')
+                s++;
+            f[n].p = start;
+            f[n].len = s - start;
+            while (s < end && *s != ',')
+                s++;
+        } else {
+            start = s;
+            while (s < end && *s != ',')
+                s++;
+            f[n].p = start;
+            f[n].len = s - start;
+        }
+        n++;
+        if (s >= end)
+            break;
+        s++;
+    }
+    return n;
+}
+
+int at_field_int(const struct at_field *f)
+{
+    int v = 0;
+    size_t i;
+
+    if (f->len == 0)
+        return -1;
+    for (i = 0; i < f->len; i++) {
+        if (f->p[i] < '0' || f->p[i] > '9')
+            return -1;
+        v = v * 10 + f->p[i] - '0';
+    }
+    return v;
+}
+
+void at_parser_init(struct at_parser *p, at_line_cb on_line, void *user)
+{
+    memset(p, 0, sizeof(*p));
+    p->on_line = on_line;
+    p->user = user;
+}
+
+void at_parser_reset(struct at_parser *p)
+{
+    p->head = p->scan = p->tail = 0;
+    p->discard = false;
+}
+
+char *at_parser_write_ptr(struct at_parser *p, size_t *space)
+{
+    if (p->tail == AT_PARSER_BUF_SIZE) {
+        if (p->head == 0) {
+            /* one line filled the whole buffer, drop it */
+            p->overflows++;
+            p->discard = true;
+            p->head = p->scan = p->tail = 0;
+        } else {
+            size_t partial = p->tail - p->head;
+
+            memmove(p->buf, p->buf + p->head, partial);
+            p->scan -= p->head;
+            p->tail = partial;
+            p->head = 0;
+        }
+    }
+
+    *space = AT_PARSER_BUF_SIZE - p->tail;
+    return p->buf + p->tail;
+}
+
+void at_parser_commit(struct at_parser *p, size_t n)
+{
+    struct at_line line;
+
+    p->tail += n;
+    p->bytes += n;
+
+    while (p->scan < p->tail) {
+        p->scan += at_find_eol(p->buf + p->scan, p->tail - p->scan);
+        if (p->scan == p->tail)
+            break;
+
+        line.data = p->buf + p->head;
+        line.len = p->scan - p->head;
+        p->scan++;
+        p->head = p->scan;
+
+        if (p->discard) {
+            p->discard = false;
+            continue;
+        }
+        /* CR LF pairs and the blank line before every response */
+        if (line.len == 0)
+            continue;
+
+        line.token = at_line_classify(line.data, line.len);
+        p->lines++;
+        if (p->on_line)
+            p->on_line(&line, p->user);
+    }
+
+    if (p->tail - p->head == 2 && p->buf[p->head] == '>' && p->buf[p->head + 1] == ' ' &&
+        !p->discard) {
+        line.data = p->buf + p->head;
+        line.len = 2;
+        line.token = AT_TOK_PROMPT;
+        p->head = p->scan = p->tail;
+        p->lines++;
+        if (p->on_line)
+            p->on_line(&line, p->user);
+    }
+
+    if (p->head == p->tail)
+        p->head = p->scan = p->tail = 0;
+}
+
+void at_parser_feed(struct at_parser *p, const char *data, size_t n)
+{
+    size_t space, chunk;
+    char *dst;
+
+    while (n > 0) {
+        dst = at_parser_write_ptr(p, &space);
+        chunk = n < space ? n : space;
+        memcpy(dst, data, chunk);
+        at_parser_commit(p, chunk);
+        data += chunk;
+        n -= chunk;
+    }
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_parser.h
+ * @brief Streaming AT response parser
+ *
+ * Incremental, line framed parser for the modem byte stream. Bytes are
+ * read() straight into the parser receive buffer and every complete line
+ * is handed to a callback as a view into that buffer (no copy, no NUL).
+ *
+ */
+
+#ifndef HAVE_AT_PARSER_H__
+#define HAVE_AT_PARSER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* longer lines are dropped and counted as overflows */
+#define AT_PARSER_BUF_SIZE 8192
+
+/* Everything the classifier knows about. Information text that is not
+ * listed here (e.g. the IMEI from AT+CGSN) is AT_TOK_UNKNOWN. */
+enum at_token {
+    AT_TOK_UNKNOWN = 0,
+    AT_TOK_ECHO,          /* our own command echoed back */
+    AT_TOK_PROMPT,        /* "> " without line end: AT+CMGS wants its PDU */
+
+    /* final result codes */
+    AT_TOK_OK,
+    AT_TOK_CONNECT,
+    AT_TOK_ERROR,
+    AT_TOK_BUSY,
+    AT_TOK_NO_CARRIER,
+    AT_TOK_NO_ANSWER,
+    AT_TOK_NO_DIALTONE,
+    AT_TOK_CME_ERROR,
+    AT_TOK_CMS_ERROR,
+
+    /* unsolicited result codes */
+    AT_TOK_RING,
+    AT_TOK_CRING,
+    AT_TOK_CLIP,
+    AT_TOK_CCWA,
+    AT_TOK_DSCI,
+    AT_TOK_CMTI,
+    AT_TOK_CMT,
+    AT_TOK_CDSI,
+    AT_TOK_CDS,
+    AT_TOK_CUSD,
+    AT_TOK_QIND,
+    AT_TOK_RDY,
+    AT_TOK_CPIN,
+    AT_TOK_CFUN,
+    AT_TOK_QUSIM,
+
+    /* URCs that are also query responses */
+    AT_TOK_CREG,
+    AT_TOK_CGREG,
+    AT_TOK_CEREG,
+
+    /* intermediate responses */
+    AT_TOK_CLCC,
+    AT_TOK_CSQ,
+    AT_TOK_COPS,
+    AT_TOK_CPAS,
+    AT_TOK_CMGL,
+    AT_TOK_CMGR,
+    AT_TOK_CMGS,
+    AT_TOK_CMSS,
+    AT_TOK_CMMS,
+    AT_TOK_CSCA,
+    AT_TOK_QCFG,
+
+    AT_TOK_COUNT
+};
+
+#define AT_FLAG_FINAL  0x01   /* ends the command in flight */
+#define AT_FLAG_ERROR  0x02   /* ... and it failed */
+#define AT_FLAG_URC    0x04   /* may arrive at any time */
+
+struct at_line {
+    const char *data;     /* points into the parser buffer, not NUL terminated */
+    size_t len;           /* without the line terminator */
+    enum at_token token;
+};
+
+typedef void (*at_line_cb)(const struct at_line *line, void *user);
+
+struct at_parser {
+    char buf[AT_PARSER_BUF_SIZE];
+    size_t head;          /* start of the line being assembled */
+    size_t scan;          /* first byte not looked at yet */
+    size_t tail;          /* end of valid data */
+    bool discard;         /* skipping the rest of an overlong line */
+
+    at_line_cb on_line;
+    void *user;
+
+    /* statistics */
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t overflows;
+};
+
+void at_parser_init(struct at_parser *p, at_line_cb on_line, void *user);
+/* drop a partial line (the port was reopened), the counters stay */
+void at_parser_reset(struct at_parser *p);
+
+/* Contiguous free space to read() into. Never returns 0 bytes of space. */
+char *at_parser_write_ptr(struct at_parser *p, size_t *space);
+
+/* Account for n bytes written at at_parser_write_ptr() and emit the lines
+ * they complete. Only the new bytes are scanned. A "> " prompt left at the
+ * end is emitted as AT_TOK_PROMPT, the modem sends nothing after it. */
+void at_parser_commit(struct at_parser *p, size_t n);
+
+/* Copying variant of write_ptr/commit, for data that is not read() from a fd */
+void at_parser_feed(struct at_parser *p, const char *data, size_t n);
+
+/* Perfect hash of the first five bytes, one table probe and one compare,
+ * no scan for the ':'. Trailing CR/LF is ignored. */
+enum at_token at_line_classify(const char *s, size_t len);
+const char *at_token_name(enum at_token token);
+
+/* one field of a "+XXX: a,b,\"c\"" response */
+struct at_field {
+    const char *p;        /* into the line, quotes removed */
+    size_t len;
+};
+
+/* Split what follows the ':' into up to max fields. Returns how many
+ * there are, 0 without a ':'. */
+int at_split_fields(const char *data, size_t len, struct at_field *f, int max);
+/* the field as a decimal number, -1 when it is empty or not one */
+int at_field_int(const struct at_field *f);
+
+struct at_token_info {
+    const char *key;      /* text up to the ':' (or the whole line) */
+    unsigned char len;
+    unsigned char flags;
+};
+
+extern const struct at_token_info at_token_table[AT_TOK_COUNT];
+
+/* asked for every line, so inline */
+static inline unsigned int at_token_flags(enum at_token token)
+{
+    if (token >= AT_TOK_COUNT)
+        return 0;
+    return at_token_table[token].flags;
+}
+
+#endif /* HAVE_AT_PARSER_H__ */
@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_queue.c
+ * @brief AT command scheduler
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "at_queue.h"
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool at_queue_init(struct at_queue *q, int fd)
+{
+    int i;
+
+    memset(q, 0, sizeof(*q));
+    if (mtx_init(&q->lock, mtx_plain) != thrd_success)
+        return false;
+
+    q->fd = fd;
+    q->inflight = -1;
+    for (i = 0; i < AT_PRIO_COUNT; i++)
+        q->fifo_head[i] = q->fifo_tail[i] = -1;
+    for (i = 0; i < AT_QUEUE_DEPTH; i++)
+        q->pool[i].next = i + 1;
+    q->pool[AT_QUEUE_DEPTH - 1].next = -1;
+    q->free_list = 0;
+    q->free_count = AT_QUEUE_DEPTH;
+
+    return true;
+}
+
+void at_queue_destroy(struct at_queue *q)
+{
+    at_queue_flush(q);
+    mtx_destroy(&q->lock);
+}
+
+/* all the static helpers below are called with the lock held */
+
+static void release_slot(struct at_queue *q, int idx)
+{
+    q->pool[idx].next = q->free_list;
+    q->free_list = idx;
+    q->free_count++;
+}
+
+static int fifo_peek(struct at_queue *q)
+{
+    int prio;
+
+    for (prio = 0; prio < AT_PRIO_COUNT; prio++)
+        if (q->fifo_head[prio] >= 0)
+            return q->fifo_head[prio];
+    return -1;
+}
+
+static int fifo_pop(struct at_queue *q)
+{
+    int prio, idx;
+
+    for (prio = 0; prio < AT_PRIO_COUNT; prio++) {
+        idx = q->fifo_head[prio];
+        if (idx < 0)
+            continue;
+        q->fifo_head[prio] = q->pool[idx].next;
+        if (q->fifo_head[prio] < 0)
+            q->fifo_tail[prio] = -1;
+        return idx;
+    }
+    return -1;
+}
+
+/* Write as much of the pending output as the tty takes. False on a real
+ * write error. */
+static bool flush_output(struct at_queue *q)
+{
+    ssize_t res;
+
+    while (q->out_len > 0) {
+        res = write(q->fd, q->out + q->out_head, q->out_len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            q->out_len = 0;
+            return false;
+        }
+        q->write_calls++;
+        q->bytes_written += res;
+        if (q->tx_tap)
+            q->tx_tap(q->out + q->out_head, res, q->tx_tap_user);
+        q->out_head += res;
+        q->out_len -= res;
+    }
+
+    if (q->out_len == 0)
+        q->out_head = 0;
+    else if (q->want_write)
+        q->want_write(q->want_write_user);
+    return true;
+}
+
+/* the caller checked there is room */
+static void append_output(struct at_queue *q, const char *data, size_t len)
+{
+    if (q->out_head + q->out_len + len > AT_OUTBUF_SIZE) {
+        memmove(q->out, q->out + q->out_head, q->out_len);
+        q->out_head = 0;
+    }
+    memcpy(q->out + q->out_head + q->out_len, data, len);
+    q->out_len += len;
+}
+
+/* false when the write failed and the new in flight command must be
+ * completed with an error */
+static bool start_next(struct at_queue *q)
+{
+    struct at_command *cmd;
+    int idx;
+
+    if (q->inflight >= 0)
+        return true;
+    if (q->resync_until_ms) {
+        if (now_ms() < q->resync_until_ms)
+            return true;
+        q->resync_until_ms = 0;
+    }
+    idx = fifo_peek(q);
+    if (idx < 0)
+        return true;
+    /* no room: the next at_queue_output_ready() tries again. Nothing else
+     * is written while this one is in flight, so the payload fits later. */
+    if (AT_OUTBUF_SIZE - q->out_len < q->pool[idx].len + q->pool[idx].payload_len)
+        return true;
+    fifo_pop(q);
+
+    cmd = &q->pool[idx];
+    q->inflight = idx;
+    q->response_len = 0;
+    q->response[0] = 0;
+    cmd->deadline_ms = now_ms() + cmd->timeout_ms;
+
+    append_output(q, cmd->text, cmd->len);
+    q->sent++;
+    return flush_output(q);
+}
+
+/* The command in flight expired and its unwritten bytes were dropped
+ * (partial says whether there were any). The modem may be halfway through
+ * its line, at "> ", or about to answer late: end the line, leave the
+ * prompt, and hold the next command back until late replies are in. */
+static void resync(struct at_queue *q, const struct at_command *cmd, bool partial)
+{
+    // "\r" first: a cut off AT+CMGS line may only now bring up the prompt
+    if (cmd->payload_len && (!cmd->payload_sent || partial))
+        append_output(q, "\r\x1b", 2);
+    else
+        append_output(q, "\r", 1);
+    q->resync_until_ms = now_ms() + AT_RESYNC_MS;
+    flush_output(q);
+}
+
+/* Complete the command in flight and start the next one. Called without
+ * the lock, so the callback can submit follow up commands. */
+static void finish(struct at_queue *q, enum at_token result, bool expired)
+{
+    struct at_command cmd;
+    char response[AT_RESPONSE_MAX];
+    bool started, partial;
+
+    for (;;) {
+        mtx_lock(&q->lock);
+        if (q->inflight < 0) {
+            mtx_unlock(&q->lock);
+            return;
+        }
+        cmd = q->pool[q->inflight];
+        memcpy(response, q->response, q->response_len + 1);
+        release_slot(q, q->inflight);
+        q->inflight = -1;
+        q->completed++;
+        if (at_token_flags(result) & AT_FLAG_ERROR)
+            q->failed++;
+        /* only the command in flight is ever in the output buffer: what
+         * the tty hasn't taken yet must not run into the next command */
+        partial = q->out_len > 0;
+        q->out_head = q->out_len = 0;
+        if (expired && q->fd >= 0)
+            resync(q, &cmd, partial);
+        expired = false;
+        mtx_unlock(&q->lock);
+
+        if (cmd.done)
+            cmd.done(&cmd, result, response, cmd.user);
+
+        mtx_lock(&q->lock);
+        started = start_next(q);
+        mtx_unlock(&q->lock);
+        if (started)
+            return;
+        result = AT_TOK_ERROR;
+    }
+}
+
+static bool submit(struct at_queue *q, const char *text, const char *payload,
+                   enum at_priority priority, unsigned int timeout_ms, at_line_cb on_line,
+                   at_done_cb done, void *user)
+{
+    struct at_command *cmd;
+    int idx, len, payload_len = 0;
+    bool started;
+
+    if (priority >= AT_PRIO_COUNT)
+        priority = AT_PRIO_NORMAL;
+
+    mtx_lock(&q->lock);
+    idx = q->free_list;
+    if (idx < 0 ||
+        (priority != AT_PRIO_URGENT && q->free_count <= AT_QUEUE_URGENT_RESERVE)) {
+        q->rejected++;
+        mtx_unlock(&q->lock);
+        return false;
+    }
+    cmd = &q->pool[idx];
+    len = snprintf(cmd->text, AT_CMD_MAX, "%s\r", text);
+    if (len >= 0 && len < AT_CMD_MAX && payload)
+        payload_len = snprintf(cmd->text + len, AT_CMD_MAX - len, "%s", payload);
+    if (len < 0 || len >= AT_CMD_MAX || payload_len < 0 || payload_len >= AT_CMD_MAX - len) {
+        mtx_unlock(&q->lock);
+        return false;
+    }
+    q->free_list = cmd->next;
+    q->free_count--;
+
+    cmd->len = len;
+    cmd->payload_len = payload_len;
+    cmd->payload_sent = false;
+    cmd->priority = priority;
+    cmd->timeout_ms = timeout_ms ? timeout_ms : AT_TIMEOUT_DEFAULT;
+    cmd->done = done;
+    cmd->on_line = on_line;
+    cmd->user = user;
+    cmd->next = -1;
+    if (q->fifo_tail[priority] < 0)
+        q->fifo_head[priority] = idx;
+    else
+        q->pool[q->fifo_tail[priority]].next = idx;
+    q->fifo_tail[priority] = idx;
+
+    started = start_next(q);
+    mtx_unlock(&q->lock);
+
+    if (!started)
+        finish(q, AT_TOK_ERROR, false);
+    return true;
+}
+
+bool at_queue_submit(struct at_queue *q, const char *text, enum at_priority priority,
+                     unsigned int timeout_ms, at_done_cb done, void *user)
+{
+    return submit(q, text, NULL, priority, timeout_ms, NULL, done, user);
+}
+
+bool at_queue_submit_stream(struct at_queue *q, const char *text, enum at_priority priority,
+                            unsigned int timeout_ms, at_line_cb on_line, at_done_cb done,
+                            void *user)
+{
+    return submit(q, text, NULL, priority, timeout_ms, on_line, done, user);
+}
+
+bool at_queue_submit_prompt(struct at_queue *q, const char *text, const char *payload,
+                            enum at_priority priority, unsigned int timeout_ms,
+                            at_done_cb done, void *user)
+{
+    return submit(q, text, payload, priority, timeout_ms, NULL, done, user);
+}
+
+/* BUSY, NO CARRIER etc. only end ATD and ATA. Any other time they tell us
+ * a voice call is over and are handled like URCs. */
+static bool is_call_command(const struct at_command *cmd)
+{
+    return cmd->len >= 3 && (cmd->text[0] == 'A' || cmd->text[0] == 'a') &&
+        (cmd->text[1] == 'T' || cmd->text[1] == 't') &&
+        (cmd->text[2] == 'D' || cmd->text[2] == 'd' ||
+         cmd->text[2] == 'A' || cmd->text[2] == 'a');
+}
+
+bool at_queue_line(struct at_queue *q, const struct at_line *line)
+{
+    struct at_command *cmd;
+    unsigned int flags = at_token_flags(line->token);
+    at_line_cb on_line;
+    void *user;
+    size_t room;
+    bool ok;
+
+    mtx_lock(&q->lock);
+    if (q->inflight < 0) {
+        /* late replies to the command that timed out. Call progress still
+         * goes to the URC handlers, a hung up call must not be missed. */
+        ok = q->resync_until_ms && now_ms() < q->resync_until_ms &&
+            ((flags & AT_FLAG_FINAL) || line->token == AT_TOK_PROMPT) &&
+            line->token != AT_TOK_BUSY && line->token != AT_TOK_NO_CARRIER &&
+            line->token != AT_TOK_NO_ANSWER && line->token != AT_TOK_NO_DIALTONE;
+        mtx_unlock(&q->lock);
+        return ok;
+    }
+    cmd = &q->pool[q->inflight];
+
+    if (line->token == AT_TOK_ECHO) {
+        mtx_unlock(&q->lock);
+        return true;
+    }
+
+    if (line->token == AT_TOK_PROMPT) {
+        ok = true;
+        if (cmd->payload_len && !cmd->payload_sent) {
+            append_output(q, cmd->text + cmd->len, cmd->payload_len);
+            cmd->payload_sent = true;
+            ok = flush_output(q);
+        }
+        mtx_unlock(&q->lock);
+        if (!ok)
+            finish(q, AT_TOK_ERROR, false);
+        return true;
+    }
+
+    switch (line->token) {
+    case AT_TOK_BUSY:
+    case AT_TOK_NO_CARRIER:
+    case AT_TOK_NO_ANSWER:
+    case AT_TOK_NO_DIALTONE:
+        if (!is_call_command(cmd)) {
+            mtx_unlock(&q->lock);
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+
+    /* +CREG: is a URC, unless we just asked for it */
+    if ((flags & AT_FLAG_URC) && !strstr(cmd->text, at_token_name(line->token))) {
+        mtx_unlock(&q->lock);
+        return false;
+    }
+
+    /* streamed: the handler sees the line while it is still in the parser
+     * buffer, nothing is copied */
+    if (!(flags & AT_FLAG_FINAL) && cmd->on_line) {
+        on_line = cmd->on_line;
+        user = cmd->user;
+        mtx_unlock(&q->lock);
+        on_line(line, user);
+        return true;
+    }
+
+    /* keep the error text of +CME/+CMS ERROR: <n> for the callback */
+    if (!(flags & AT_FLAG_FINAL) || line->token == AT_TOK_CME_ERROR ||
+        line->token == AT_TOK_CMS_ERROR) {
+        room = AT_RESPONSE_MAX - 1 - q->response_len;
+        if (line->len + 1 <= room) {
+            memcpy(q->response + q->response_len, line->data, line->len);
+            q->response_len += line->len;
+            q->response[q->response_len++] = '\n';
+            q->response[q->response_len] = 0;
+        }
+    }
+    mtx_unlock(&q->lock);
+
+    if (flags & AT_FLAG_FINAL)
+        finish(q, line->token, false);
+    return true;
+}
+
+int at_queue_next_timeout(struct at_queue *q)
+{
+    uint64_t now;
+    int ms = -1;
+
+    mtx_lock(&q->lock);
+    if (q->inflight >= 0) {
+        now = now_ms();
+        if (q->pool[q->inflight].deadline_ms > now)
+            ms = q->pool[q->inflight].deadline_ms - now;
+        else
+            ms = 0;
+    } else if (q->resync_until_ms) {
+        now = now_ms();
+        ms = q->resync_until_ms > now ? (int) (q->resync_until_ms - now) : 0;
+    }
+    mtx_unlock(&q->lock);
+
+    return ms;
+}
+
+void at_queue_check_timeouts(struct at_queue *q)
+{
+    bool expired = false, ok = true;
+
+    mtx_lock(&q->lock);
+    if (q->inflight >= 0 && now_ms() >= q->pool[q->inflight].deadline_ms) {
+        q->timeouts++;
+        expired = true;
+    } else if (q->inflight < 0 && q->resync_until_ms) {
+        ok = start_next(q);
+    }
+    mtx_unlock(&q->lock);
+
+    if (expired)
+        finish(q, AT_RESULT_TIMEOUT, true);
+    else if (!ok)
+        finish(q, AT_TOK_ERROR, false);
+}
+
+void at_queue_flush(struct at_queue *q)
+{
+    struct at_command cmd;
+    int idx;
+
+    for (;;) {
+        mtx_lock(&q->lock);
+        idx = fifo_pop(q);
+        if (idx < 0) {
+            mtx_unlock(&q->lock);
+            break;
+        }
+        cmd = q->pool[idx];
+        release_slot(q, idx);
+        mtx_unlock(&q->lock);
+
+        if (cmd.done)
+            cmd.done(&cmd, AT_RESULT_TIMEOUT, "", cmd.user);
+    }
+
+    // half written commands are of no use to whoever gets the fd next
+    mtx_lock(&q->lock);
+    q->out_head = q->out_len = 0;
+    q->resync_until_ms = 0;
+    mtx_unlock(&q->lock);
+
+    finish(q, AT_RESULT_TIMEOUT, false);
+}
+
+bool at_queue_idle(struct at_queue *q)
+{
+    bool idle;
+
+    mtx_lock(&q->lock);
+    idle = q->inflight < 0;
+    mtx_unlock(&q->lock);
+
+    return idle;
+}
+
+void at_queue_set_fd(struct at_queue *q, int fd)
+{
+    mtx_lock(&q->lock);
+    q->fd = fd;
+    // late replies at the old line settings are lost with the tty input
+    q->resync_until_ms = 0;
+    mtx_unlock(&q->lock);
+}
+
+void at_queue_set_write_hook(struct at_queue *q, at_write_hook hook, void *user)
+{
+    mtx_lock(&q->lock);
+    q->want_write = hook;
+    q->want_write_user = user;
+    mtx_unlock(&q->lock);
+}
+
+void at_queue_output_ready(struct at_queue *q)
+{
+    bool ok;
+
+    mtx_lock(&q->lock);
+    ok = flush_output(q) && start_next(q);
+    mtx_unlock(&q->lock);
+
+    if (!ok)
+        finish(q, AT_TOK_ERROR, false);
+}
+
+bool at_queue_output_pending(struct at_queue *q)
+{
+    bool pending;
+
+    mtx_lock(&q->lock);
+    pending = q->out_len > 0;
+    mtx_unlock(&q->lock);
+
+    return pending;
+}
+
+void at_queue_set_tx_tap(struct at_queue *q, at_tx_tap tap, void *user)
+{
+    mtx_lock(&q->lock);
+    q->tx_tap = tap;
+    q->tx_tap_user = user;
+    mtx_unlock(&q->lock);
+}
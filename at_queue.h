@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_queue.h
+ * @brief AT command scheduler
+ *
+ * Owns the modem fd for writing. Commands are queued by priority, exactly
+ * one is in flight, and it completes when the parser sees its final
+ * result (or when its timeout expires). The next command is written from
+ * the same place the final result is handled, so back to back commands
+ * don't wait for anything but the modem.
+ *
+ * AT+CMGS and friends take a payload: it is kept with the command and
+ * written as soon as the modem prompts for it ("> "), again without a
+ * round trip through the caller.
+ *
+ * Writes never block: with one command in flight there is only ever that
+ * command (or its payload) to send, so it is written straight from a flat
+ * buffer, in one write() when the tty takes it all. The rest waits for
+ * at_queue_output_ready().
+ *
+ */
+
+#ifndef HAVE_AT_QUEUE_H__
+#define HAVE_AT_QUEUE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+
+#include "at_parser.h"
+
+#define AT_CMD_MAX 512
+#define AT_RESPONSE_MAX 4096
+#define AT_QUEUE_DEPTH 32
+/* the command in flight and its payload, plus the resync after a timeout */
+#define AT_OUTBUF_SIZE (AT_CMD_MAX + 8)
+/* slots only urgent commands may take, so call control is never refused */
+#define AT_QUEUE_URGENT_RESERVE 4
+
+#define AT_TIMEOUT_DEFAULT 5000 /* ms */
+#define AT_TIMEOUT_CALL 30000
+#define AT_TIMEOUT_LIST 30000   /* AT+CMGL of a full SIM */
+#define AT_TIMEOUT_SMS 120000   /* AT+CMGS, the network may take its time */
+/* after a timeout: how long late replies to the dead command are dropped */
+#define AT_RESYNC_MS 300
+
+/* final result handed to the callback when the modem never answered */
+#define AT_RESULT_TIMEOUT AT_TOK_UNKNOWN
+
+enum at_priority {
+    AT_PRIO_URGENT = 0,   /* call control: ATA, ATH, ATD */
+    AT_PRIO_NORMAL,
+    AT_PRIO_BACKGROUND,   /* status polling */
+    AT_PRIO_COUNT
+};
+
+struct at_command;
+
+/* output is pending: call at_queue_output_ready() once the fd is writable */
+typedef void (*at_write_hook)(void *user);
+
+/* sees every byte the tty accepted, in order (capture) */
+typedef void (*at_tx_tap)(const char *data, size_t len, void *user);
+
+/* response holds the intermediate lines, '\n' separated and NUL terminated */
+typedef void (*at_done_cb)(const struct at_command *cmd, enum at_token result,
+                           const char *response, void *user);
+
+struct at_command {
+    char text[AT_CMD_MAX];    /* with the trailing '\r', then the payload */
+    size_t len;               /* of the command */
+    size_t payload_len;       /* written after "> ", 0 when none */
+    bool payload_sent;
+    enum at_priority priority;
+    unsigned int timeout_ms;
+    uint64_t deadline_ms;
+    at_done_cb done;
+    at_line_cb on_line;       /* streamed intermediate lines, or NULL */
+    void *user;
+    int next;                 /* free list / FIFO link, -1 terminates */
+};
+
+struct at_queue {
+    int fd;
+    mtx_t lock;
+
+    struct at_command pool[AT_QUEUE_DEPTH];
+    int free_list;
+    int free_count;
+    int fifo_head[AT_PRIO_COUNT];
+    int fifo_tail[AT_PRIO_COUNT];
+    int inflight;             /* -1 when idle */
+    uint64_t resync_until_ms; /* nothing is started before, 0 when not resyncing */
+
+    char response[AT_RESPONSE_MAX];
+    size_t response_len;
+
+    char out[AT_OUTBUF_SIZE];
+    size_t out_head;
+    size_t out_len;
+    at_write_hook want_write;
+    void *want_write_user;
+    at_tx_tap tx_tap;
+    void *tx_tap_user;
+
+    /* statistics */
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t timeouts;
+    uint64_t rejected;        /* submits refused for lack of room */
+    uint64_t write_calls;
+    uint64_t bytes_written;
+};
+
+bool at_queue_init(struct at_queue *q, int fd);
+void at_queue_destroy(struct at_queue *q);
+
+/* Fails when the queue is full; only urgent commands get the last
+ * AT_QUEUE_URGENT_RESERVE slots. cmd is given without the trailing '\r'. */
+bool at_queue_submit(struct at_queue *q, const char *cmd, enum at_priority priority,
+                     unsigned int timeout_ms, at_done_cb done, void *user);
+
+/* Like at_queue_submit(), but the intermediate lines are handed to
+ * on_line as they arrive instead of being collected, so the response may
+ * be longer than AT_RESPONSE_MAX. done still gets the final result. */
+bool at_queue_submit_stream(struct at_queue *q, const char *cmd, enum at_priority priority,
+                            unsigned int timeout_ms, at_line_cb on_line, at_done_cb done,
+                            void *user);
+
+/* Like at_queue_submit(), for commands that prompt for more ("> "):
+ * payload (e.g. the PDU hex and Ctrl-Z) is written when the prompt
+ * arrives. If the command times out before that, ESC is written instead
+ * so the modem leaves the prompt. */
+bool at_queue_submit_prompt(struct at_queue *q, const char *cmd, const char *payload,
+                            enum at_priority priority, unsigned int timeout_ms,
+                            at_done_cb done, void *user);
+
+/* Feed every parsed line here. Returns true when the line belonged to the
+ * command in flight (or to one that just timed out), false for URCs and
+ * unsolicited text. */
+bool at_queue_line(struct at_queue *q, const struct at_line *line);
+
+/* When a command times out, the modem is put back on an empty line ("\r",
+ * ESC if it may be at a prompt) and the next command waits AT_RESYNC_MS,
+ * so a late final result isn't taken for its own. */
+
+/* Milliseconds until the command in flight times out or the resync wait
+ * ends, -1 when idle */
+int at_queue_next_timeout(struct at_queue *q);
+void at_queue_check_timeouts(struct at_queue *q);
+
+/* Complete everything, in flight and queued, with AT_RESULT_TIMEOUT */
+void at_queue_flush(struct at_queue *q);
+
+bool at_queue_idle(struct at_queue *q);
+
+/* the port was reopened (-1 while it is gone) or its rate changed; flush
+ * first when there is anything to drop, counters stay */
+void at_queue_set_fd(struct at_queue *q, int fd);
+
+void at_queue_set_write_hook(struct at_queue *q, at_write_hook hook, void *user);
+/* the fd is writable: write what is pending, start waiting commands */
+void at_queue_output_ready(struct at_queue *q);
+bool at_queue_output_pending(struct at_queue *q);
+
+void at_queue_set_tx_tap(struct at_queue *q, at_tx_tap tap, void *user);
+
+#endif /* HAVE_AT_QUEUE_H__ */
@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_text.c
+ * @brief Vectorized scanning and sanitizing of modem text
+ *
+ * Every kernel set has three entries: find2() looks for the first of two
+ * byte values, sanitize() is at_safe_output() and strip() at_strip_cr().
+ * Blocks with nothing to replace (nearly all of them) are not written
+ * back, blocks without a CR are moved down whole.
+ *
+ */
+
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define TEXT_X86
+#include <immintrin.h>
+#endif
+
+/* 64 bit ARM always has NEON. 32 bit ARM builds for CPUs that may lack
+ * it: only the NEON functions below are compiled for it, the rest of the
+ * program doesn't get NEON instructions behind the HWCAP check's back. */
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TEXT_NEON
+#define NEON_TARGET
+#elif defined(__arm__) && defined(__ARM_FP) && __GNUC__ >= 8
+#define TEXT_NEON
+#define NEON_TARGET __attribute__((target("fpu=neon")))
+#endif
+
+#ifdef TEXT_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "at_text.h"
+
+struct text_ops {
+    const char *name;
+    bool (*supported)(void);
+    size_t (*find2)(const char *s, size_t len, char a, char b);
+    void (*sanitize)(unsigned char *buf, size_t len);
+    size_t (*strip)(char *s, size_t len);
+};
+
+/* ---- scalar, also the tail of every vector kernel ---- */
+
+static bool scalar_supported(void)
+{
+    return true;
+}
+
+static size_t find2_scalar(const char *s, size_t len, char a, char b)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (s[i] == a || s[i] == b)
+            break;
+    }
+    return i;
+}
+
+static void sanitize_scalar(unsigned char *buf, size_t len)
+{
+    size_t i;
+    int c;
+
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+        if (c == '\r' || c == '\n' || c == '\t' || c == '\b')
+            continue;
+        c &= 0x7F;
+        if (c < 0x20)
+            buf[i] = '^';
+        else if (c == 0x7F)
+            buf[i] = '?';
+    }
+}
+
+/* move s[from..end) down to s[to], without the CRs; returns the new to */
+static size_t strip_run(char *s, size_t from, size_t end, size_t to)
+{
+    for (; from < end; from++) {
+        if (s[from] != '\r')
+            s[to++] = s[from];
+    }
+    return to;
+}
+
+static size_t strip_scalar(char *s, size_t len)
+{
+    return strip_run(s, 0, len, 0);
+}
+
+/* ---- x86 ---- */
+
+#ifdef TEXT_X86
+
+static bool sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static size_t find2_sse2(const char *s, size_t len, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i v;
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (s + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find2_scalar(s + i, len - i, a, b);
+}
+
+__attribute__((target("sse2")))
+static void sanitize_sse2(unsigned char *buf, size_t len)
+{
+    const __m128i low7 = _mm_set1_epi8(0x7F), space = _mm_set1_epi8(0x20);
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t'), bs = _mm_set1_epi8('\b');
+    const __m128i caret = _mm_set1_epi8('^'), question = _mm_set1_epi8('?');
+    __m128i v, c, ctrl, keep, del;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        c = _mm_and_si128(v, low7);
+        // c is 0..127, so the signed compare is fine
+        ctrl = _mm_cmplt_epi8(c, space);
+        keep = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, bs)));
+        ctrl = _mm_andnot_si128(keep, ctrl);
+        del = _mm_cmpeq_epi8(c, low7);
+        if (!_mm_movemask_epi8(_mm_or_si128(ctrl, del)))
+            continue;
+        v = _mm_or_si128(_mm_andnot_si128(ctrl, v), _mm_and_si128(ctrl, caret));
+        v = _mm_or_si128(_mm_andnot_si128(del, v), _mm_and_si128(del, question));
+        _mm_storeu_si128((__m128i *) (buf + i), v);
+    }
+    sanitize_scalar(buf + i, len - i);
+}
+
+/* the store at to never reaches bytes not loaded yet, to <= from */
+__attribute__((target("sse2")))
+static size_t strip_sse2(char *s, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    __m128i v;
+    size_t from, to = 0;
+
+    for (from = 0; from + 16 <= len; from += 16) {
+        v = _mm_loadu_si128((const __m128i *) (s + from));
+        if (!_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr))) {
+            _mm_storeu_si128((__m128i *) (s + to), v);
+            to += 16;
+        } else {
+            to = strip_run(s, from, from + 16, to);
+        }
+    }
+    return strip_run(s, from, len, to);
+}
+
+static bool avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static size_t find2_avx2(const char *s, size_t len, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    __m256i v;
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (s + i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                    _mm256_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find2_sse2(s + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static void sanitize_avx2(unsigned char *buf, size_t len)
+{
+    const __m256i low7 = _mm256_set1_epi8(0x7F), space = _mm256_set1_epi8(0x20);
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    const __m256i tab = _mm256_set1_epi8('\t'), bs = _mm256_set1_epi8('\b');
+    const __m256i caret = _mm256_set1_epi8('^'), question = _mm256_set1_epi8('?');
+    __m256i v, c, ctrl, keep, del;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        c = _mm256_and_si256(v, low7);
+        ctrl = _mm256_cmpgt_epi8(space, c);
+        keep = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+                               _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, bs)));
+        ctrl = _mm256_andnot_si256(keep, ctrl);
+        del = _mm256_cmpeq_epi8(c, low7);
+        if (!_mm256_movemask_epi8(_mm256_or_si256(ctrl, del)))
+            continue;
+        v = _mm256_blendv_epi8(v, caret, ctrl);
+        v = _mm256_blendv_epi8(v, question, del);
+        _mm256_storeu_si256((__m256i *) (buf + i), v);
+    }
+    sanitize_sse2(buf + i, len - i);
+}
+
+#endif /* TEXT_X86 */
+
+/* ---- ARM ---- */
+
+#ifdef TEXT_NEON
+
+static bool neon_supported(void)
+{
+#if defined(__aarch64__)
+    return true;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+/* NEON has no movemask: narrowing shift leaves 4 bits per byte */
+NEON_TARGET static inline uint64_t neon_mask(uint8x16_t m)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+NEON_TARGET static size_t find2_neon(const char *s, size_t len, char a, char b)
+{
+    const uint8x16_t va = vdupq_n_u8(a), vb = vdupq_n_u8(b);
+    uint8x16_t v;
+    uint64_t mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8((const uint8_t *) (s + i));
+        mask = neon_mask(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)));
+        if (mask)
+            return i + (__builtin_ctzll(mask) >> 2);
+    }
+    return i + find2_scalar(s + i, len - i, a, b);
+}
+
+NEON_TARGET static void sanitize_neon(unsigned char *buf, size_t len)
+{
+    const uint8x16_t low7 = vdupq_n_u8(0x7F), space = vdupq_n_u8(0x20);
+    const uint8x16_t cr = vdupq_n_u8('\r'), lf = vdupq_n_u8('\n');
+    const uint8x16_t tab = vdupq_n_u8('\t'), bs = vdupq_n_u8('\b');
+    const uint8x16_t caret = vdupq_n_u8('^'), question = vdupq_n_u8('?');
+    uint8x16_t v, c, ctrl, keep, del;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8(buf + i);
+        c = vandq_u8(v, low7);
+        ctrl = vcltq_u8(c, space);
+        keep = vorrq_u8(vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf)),
+                        vorrq_u8(vceqq_u8(v, tab), vceqq_u8(v, bs)));
+        ctrl = vbicq_u8(ctrl, keep);
+        del = vceqq_u8(c, low7);
+        if (!neon_mask(vorrq_u8(ctrl, del)))
+            continue;
+        v = vbslq_u8(ctrl, caret, v);
+        v = vbslq_u8(del, question, v);
+        vst1q_u8(buf + i, v);
+    }
+    sanitize_scalar(buf + i, len - i);
+}
+
+NEON_TARGET static size_t strip_neon(char *s, size_t len)
+{
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    uint8x16_t v;
+    size_t from, to = 0;
+
+    for (from = 0; from + 16 <= len; from += 16) {
+        v = vld1q_u8((const uint8_t *) (s + from));
+        if (!neon_mask(vceqq_u8(v, cr))) {
+            vst1q_u8((uint8_t *) (s + to), v);
+            to += 16;
+        } else {
+            to = strip_run(s, from, from + 16, to);
+        }
+    }
+    return strip_run(s, from, len, to);
+}
+
+#endif /* TEXT_NEON */
+
+/* best first; AVX2 strips 16 at a time, 32 byte runs without a CR are rare */
+static const struct text_ops text_ops[] = {
+#ifdef TEXT_X86
+    { "avx2", avx2_supported, find2_avx2, sanitize_avx2, strip_sse2 },
+    { "sse2", sse2_supported, find2_sse2, sanitize_sse2, strip_sse2 },
+#endif
+#ifdef TEXT_NEON
+    { "neon", neon_supported, find2_neon, sanitize_neon, strip_neon },
+#endif
+    { "scalar", scalar_supported, find2_scalar, sanitize_scalar, strip_scalar },
+};
+
+#define TEXT_OPS_COUNT (sizeof(text_ops) / sizeof(text_ops[0]))
+
+static _Atomic(const struct text_ops *) current_ops;
+static once_flag ops_once = ONCE_FLAG_INIT;
+
+static void select_best(void)
+{
+    size_t i;
+
+#ifdef TEXT_X86
+    __builtin_cpu_init();
+#endif
+    for (i = 0; i < TEXT_OPS_COUNT; i++) {
+        if (text_ops[i].supported()) {
+            atomic_store(&current_ops, &text_ops[i]);
+            return;
+        }
+    }
+}
+
+static inline const struct text_ops *ops(void)
+{
+    const struct text_ops *o = atomic_load_explicit(&current_ops, memory_order_acquire);
+
+    if (!o) {
+        call_once(&ops_once, select_best);
+        o = atomic_load(&current_ops);
+    }
+    return o;
+}
+
+size_t at_find_eol_long(const char *s, size_t len)
+{
+    return ops()->find2(s, len, '\r', '\n');
+}
+
+void at_strip_cr(char *s)
+{
+    s[ops()->strip(s, strlen(s))] = '\0';
+}
+
+void at_safe_output(unsigned char *buf, size_t len)
+{
+    ops()->sanitize(buf, len);
+}
+
+const char *at_text_impl(void)
+{
+    return ops()->name;
+}
+
+bool at_text_select(const char *impl)
+{
+    size_t i;
+
+    for (i = 0; i < TEXT_OPS_COUNT; i++) {
+        if (strcmp(text_ops[i].name, impl) == 0) {
+            if (!text_ops[i].supported())
+                return false;
+            ops();
+            atomic_store(&current_ops, &text_ops[i]);
+            return true;
+        }
+    }
+    return false;
+}
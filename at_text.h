@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_text.h
+ * @brief Vectorized scanning and sanitizing of modem text
+ *
+ * Everything the modem sends is searched for line ends and, before it is
+ * logged, has its control bytes replaced. These kernels do both 16 (SSE2,
+ * NEON) or 32 (AVX2) bytes at a time. The best one the CPU has is picked
+ * on first use; the scalar versions handle the tails and any other CPU.
+ *
+ * On 32 bit ARM the NEON kernels alone are compiled for NEON (a function
+ * target attribute, GCC 8 and later), and only used when the kernel
+ * reports HWCAP_NEON.
+ *
+ * Lines are mostly shorter than AT_TEXT_SHORT (RING, OK, the blank half
+ * of CR LF), those never leave the inline loop below.
+ *
+ */
+
+#ifndef HAVE_AT_TEXT_H__
+#define HAVE_AT_TEXT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AT_TEXT_SHORT 16
+
+size_t at_find_eol_long(const char *s, size_t len);
+
+/* Index of the first CR or LF, len if there is none. Half the calls
+ * start on the LF of a CR LF pair and most lines are short, so the first
+ * bytes are looked at here before paying for a call. */
+static inline size_t at_find_eol(const char *s, size_t len)
+{
+    size_t n = len < AT_TEXT_SHORT ? len : AT_TEXT_SHORT;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if (s[i] == '\r' || s[i] == '\n')
+            return i;
+    return n == len ? len : n + at_find_eol_long(s + n, len - n);
+}
+
+/* remove every CR from a NUL terminated string */
+void at_strip_cr(char *s);
+
+/* Make modem output safe for the log: control bytes other than CR, LF,
+ * TAB and BS become '^', DEL becomes '?'. The high bit is ignored when
+ * looking for those. */
+void at_safe_output(unsigned char *buf, size_t len);
+
+/* kernel set in use: "scalar", "sse2", "avx2" or "neon" */
+const char *at_text_impl(void);
+
+/* Switch to another kernel set, for benchmarks and equivalence checks.
+ * False when it isn't built in or the CPU lacks it. */
+bool at_text_select(const char *impl);
+
+#endif /* HAVE_AT_TEXT_H__ */
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_trace.c
+ * @brief Binary capture and replay of modem traffic
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "at_trace.h"
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t put_varint(unsigned char *out, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+static bool get_varint(FILE *fp, uint64_t *v)
+{
+    unsigned int shift;
+    int c;
+
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        c = getc(fp);
+        if (c == EOF)
+            return false;
+        *v |= (uint64_t) (c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool at_trace_open(struct at_trace *t, const char *path)
+{
+    unsigned char stamp[8];
+    uint64_t now;
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    t->fp = fopen(path, "ab");
+    if (!t->fp)
+        return false;
+
+    fseek(t->fp, 0, SEEK_END);
+    if (ftell(t->fp) == 0)
+        fwrite(AT_TRACE_MAGIC, 1, AT_TRACE_MAGIC_LEN, t->fp);
+
+    now = clock_ns(CLOCK_REALTIME);
+    for (i = 0; i < 8; i++)
+        stamp[i] = now >> (8 * i);
+    t->last_ns = clock_ns(CLOCK_MONOTONIC);
+    at_trace_record(t, AT_TRACE_SESSION, stamp, sizeof(stamp));
+    at_trace_flush(t);
+
+    return true;
+}
+
+void at_trace_record(struct at_trace *t, enum at_trace_dir dir, const void *data, size_t len)
+{
+    unsigned char head[1 + 10 + 10];
+    uint64_t now;
+    size_t n;
+
+    if (!t->fp)
+        return;
+
+    // larger writes are split, the reader only has so much room
+    while (len > AT_TRACE_RECORD_MAX) {
+        at_trace_record(t, dir, data, AT_TRACE_RECORD_MAX);
+        data = (const char *) data + AT_TRACE_RECORD_MAX;
+        len -= AT_TRACE_RECORD_MAX;
+    }
+
+    now = clock_ns(CLOCK_MONOTONIC);
+    head[0] = dir;
+    n = 1 + put_varint(head + 1, now - t->last_ns);
+    n += put_varint(head + n, len);
+    t->last_ns = now;
+
+    fwrite(head, 1, n, t->fp);
+    fwrite(data, 1, len, t->fp);
+    t->records++;
+    t->bytes += len;
+}
+
+void at_trace_flush(struct at_trace *t)
+{
+    if (t->fp)
+        fflush(t->fp);
+}
+
+void at_trace_close(struct at_trace *t)
+{
+    if (t->fp)
+        fclose(t->fp);
+    t->fp = NULL;
+}
+
+bool at_trace_reader_open(struct at_trace_reader *r, const char *path)
+{
+    char magic[AT_TRACE_MAGIC_LEN];
+
+    r->ns = 0;
+    r->fp = fopen(path, "rb");
+    if (!r->fp)
+        return false;
+    if (fread(magic, 1, sizeof(magic), r->fp) != sizeof(magic) ||
+        memcmp(magic, AT_TRACE_MAGIC, sizeof(magic)) != 0) {
+        fclose(r->fp);
+        r->fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+int at_trace_read(struct at_trace_reader *r, struct at_trace_event *ev)
+{
+    uint64_t delta, len;
+    int dir;
+
+    dir = getc(r->fp);
+    if (dir == EOF)
+        return 0;
+    if (dir > AT_TRACE_SESSION || !get_varint(r->fp, &delta) ||
+        !get_varint(r->fp, &len) || len > AT_TRACE_RECORD_MAX ||
+        fread(r->buf, 1, len, r->fp) != len)
+        return -1;
+
+    if (dir == AT_TRACE_SESSION)
+        r->ns = 0;
+    else
+        r->ns += delta;
+
+    ev->dir = dir;
+    ev->ns = r->ns;
+    ev->len = len;
+    ev->data = r->buf;
+    return 1;
+}
+
+void at_trace_reader_close(struct at_trace_reader *r)
+{
+    if (r->fp)
+        fclose(r->fp);
+    r->fp = NULL;
+}
+
+bool at_trace_replay(const char *path, struct at_parser *p, bool realtime,
+                     struct at_replay_stats *stats)
+{
+    struct at_trace_reader *reader;
+    struct at_trace_event ev;
+    struct timespec ts;
+    uint64_t start, due, base = 0, last = 0, now;
+    int res;
+
+    memset(stats, 0, sizeof(*stats));
+    // 64 KB of record buffer, too much for the stack of a caller's thread
+    reader = malloc(sizeof(*reader));
+    if (!reader)
+        return false;
+    if (!at_trace_reader_open(reader, path)) {
+        free(reader);
+        return false;
+    }
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    while ((res = at_trace_read(reader, &ev)) > 0) {
+        stats->records++;
+        if (ev.dir == AT_TRACE_SESSION) {
+            // sessions are played back to back, the gap between them is unknown
+            stats->sessions++;
+            base += last;
+            last = 0;
+            continue;
+        }
+        last = ev.ns;
+
+        if (ev.dir == AT_TRACE_TX) {
+            stats->tx_bytes += ev.len;
+            continue;
+        }
+
+        if (realtime) {
+            due = start + base + ev.ns;
+            ts.tv_sec = due / 1000000000ull;
+            ts.tv_nsec = due % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+
+        at_parser_feed(p, ev.data, ev.len);
+        stats->rx_bytes += ev.len;
+
+        if (realtime) {
+            now = clock_ns(CLOCK_MONOTONIC);
+            if (now - due > stats->max_late_ns)
+                stats->max_late_ns = now - due;
+        }
+    }
+    stats->elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    at_trace_reader_close(reader);
+    free(reader);
+
+    return res == 0;
+}
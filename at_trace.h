@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file at_trace.h
+ * @brief Binary capture and replay of modem traffic
+ *
+ * A trace file is an 8 byte magic followed by records, appended as the
+ * bytes cross the tty:
+ *
+ *   direction (1 byte) | ns since previous record (varint) |
+ *   length (varint) | raw bytes
+ *
+ * Varints are LEB128. Every capture starts with an AT_TRACE_SESSION record
+ * holding the CLOCK_REALTIME ns of the start (8 bytes, little endian), so
+ * several runs can be appended to the same file.
+ *
+ */
+
+#ifndef HAVE_AT_TRACE_H__
+#define HAVE_AT_TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "at_parser.h"
+
+#define AT_TRACE_MAGIC "RHZTRC1\n"
+#define AT_TRACE_MAGIC_LEN 8
+#define AT_TRACE_RECORD_MAX 65536
+
+enum at_trace_dir {
+    AT_TRACE_RX = 0,      /* modem to us */
+    AT_TRACE_TX,          /* us to modem */
+    AT_TRACE_SESSION,
+};
+
+struct at_trace {
+    FILE *fp;
+    uint64_t last_ns;     /* CLOCK_MONOTONIC of the previous record */
+    uint64_t records;
+    uint64_t bytes;
+};
+
+struct at_trace_event {
+    enum at_trace_dir dir;
+    uint64_t ns;          /* since the start of its session */
+    size_t len;
+    const char *data;     /* valid until the next at_trace_read() */
+};
+
+struct at_trace_reader {
+    FILE *fp;
+    uint64_t ns;
+    char buf[AT_TRACE_RECORD_MAX];
+};
+
+struct at_replay_stats {
+    uint64_t records;
+    uint64_t sessions;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t elapsed_ns;
+    uint64_t max_late_ns; /* worst lag behind the recording, realtime only */
+};
+
+/* Appends to path, writing the magic when the file is new */
+bool at_trace_open(struct at_trace *t, const char *path);
+void at_trace_record(struct at_trace *t, enum at_trace_dir dir, const void *data, size_t len);
+void at_trace_flush(struct at_trace *t);
+void at_trace_close(struct at_trace *t);
+
+bool at_trace_reader_open(struct at_trace_reader *r, const char *path);
+/* 1: got a record, 0: end of file, -1: truncated or not a trace */
+int at_trace_read(struct at_trace_reader *r, struct at_trace_event *ev);
+void at_trace_reader_close(struct at_trace_reader *r);
+
+/* Feed the RX side of a trace to the parser, with the recorded gaps
+ * (realtime) or as fast as it goes */
+bool at_trace_replay(const char *path, struct at_parser *p, bool realtime,
+                     struct at_replay_stats *stats);
+
+#endif /* HAVE_AT_TRACE_H__ */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file backend.h
+ * @brief Call control, whoever talks to the modem
+ *
+ * The UI only sees these operations and the call listener (call.h); the
+ * AT backend (at.c) drives the serial port itself, the oFono backend
+ * (ofono.c) asks ofonod over D-Bus.
+ *
+ */
+
+#ifndef HAVE_BACKEND_H__
+#define HAVE_BACKEND_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define BACKEND_NONE 0
+#define BACKEND_AT 1
+#define BACKEND_OFONO 2
+
+#define DTMF_DIGITS "0123456789*#ABCD"
+#define DTMF_MAX 32             /* digits waiting to go out, per modem */
+
+struct backend_ops {
+    const char *name;
+
+    /* the outcome arrives through the call listener */
+    bool (*dial)(const char *number);
+    bool (*answer)(void);
+    bool (*hangup)(void);
+    /* tones in the active call; false when there is none, or for
+     * anything not in DTMF_DIGITS */
+    bool (*dtmf)(const char *digits);
+
+    /* user is what the call listener got */
+    const char *(*modem_name)(const void *user);
+    void (*dump_stats)(FILE *out);
+};
+
+extern const struct backend_ops at_backend;
+extern const struct backend_ops ofono_backend;
+
+#endif /* HAVE_BACKEND_H__ */
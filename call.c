@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file call.c
+ * @brief Voice call state machine
+ *
+ */
+
+#include <string.h>
+
+#include "call.h"
+
+#define SLOT_BIT(i) (1u << (i))
+#define MAX_FIELDS 8
+
+void call_table_init(struct call_table *t, call_event_cb listener, void *user)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < CALL_MAX; i++)
+        t->calls[i].state = CALL_IDLE;
+    t->listener = listener;
+    t->user = user;
+}
+
+static void notify(struct call_table *t, struct call *c, enum call_state old)
+{
+    if (t->listener)
+        t->listener(c, old, t->user);
+}
+
+static void set_state(struct call_table *t, struct call *c, enum call_state state)
+{
+    enum call_state old = c->state;
+
+    if (state == old)
+        return;
+    c->state = state;
+    notify(t, c, old);
+
+    if (state == CALL_DISCONNECTED) {
+        t->used &= ~SLOT_BIT(c - t->calls);
+        c->state = CALL_IDLE;
+    }
+}
+
+/* true when the number is new, so the listener has something to show */
+static bool set_number(struct call *c, const struct at_field *f)
+{
+    size_t len = f->len < CALL_NUMBER_MAX - 1 ? f->len : CALL_NUMBER_MAX - 1;
+
+    if (len == 0 || (strncmp(c->number, f->p, len) == 0 && c->number[len] == 0))
+        return false;
+    memcpy(c->number, f->p, len);
+    c->number[len] = 0;
+    return true;
+}
+
+static struct call *new_call(struct call_table *t, int slot, bool outgoing)
+{
+    struct call *c = &t->calls[slot];
+
+    memset(c, 0, sizeof(*c));
+    c->id = slot;
+    c->outgoing = outgoing;
+    c->state = CALL_IDLE;
+    t->used |= SLOT_BIT(slot);
+    return c;
+}
+
+/* The call the modem calls id. A pending call in slot 0 going the same
+ * way is the one it now has an id for. */
+static struct call *adopt(struct call_table *t, int id, bool outgoing)
+{
+    if (t->used & SLOT_BIT(id))
+        return &t->calls[id];
+
+    if ((t->used & SLOT_BIT(0)) && t->calls[0].outgoing == outgoing) {
+        t->calls[id] = t->calls[0];
+        t->calls[id].id = id;
+        t->calls[0].state = CALL_IDLE;
+        t->used = (t->used & ~SLOT_BIT(0)) | SLOT_BIT(id);
+        return &t->calls[id];
+    }
+
+    return new_call(t, id, outgoing);
+}
+
+/* id as the modem numbers it, number NULL when not given */
+static void update_call(struct call_table *t, int id, bool outgoing, enum call_state state,
+                        const struct at_field *number)
+{
+    struct call *c;
+    bool renamed = false;
+
+    // a disconnect for a call we never knew about
+    if (state == CALL_DISCONNECTED && !(t->used & SLOT_BIT(id)))
+        return;
+
+    c = adopt(t, id, outgoing);
+    if (number)
+        renamed = set_number(c, number);
+    if (c->state == state) {
+        if (renamed)
+            notify(t, c, c->state);
+    } else {
+        set_state(t, c, state);
+    }
+}
+
+/* ^DSCI: <id>,<dir>,<stat>,<type>,<number>,<num_type>
+ * +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>,<number>,<type> */
+static int update(struct call_table *t, const struct at_field *f, int n, int number_field)
+{
+    int id, dir, stat;
+
+    if (n < 3)
+        return -1;
+    id = at_field_int(&f[0]);
+    dir = at_field_int(&f[1]);
+    stat = at_field_int(&f[2]);
+    if (id < 1 || id >= CALL_MAX || dir < 0 || stat < 0 || stat > CALL_DISCONNECTED)
+        return -1;
+
+    update_call(t, id, dir == 0, stat, n > number_field ? &f[number_field] : NULL);
+    return id;
+}
+
+static struct call *find_incoming(struct call_table *t)
+{
+    int i;
+
+    for (i = 0; i < CALL_MAX; i++)
+        if ((t->used & SLOT_BIT(i)) &&
+            (t->calls[i].state == CALL_INCOMING || t->calls[i].state == CALL_WAITING))
+            return &t->calls[i];
+    return NULL;
+}
+
+/* RING or +CLIP without a call to go with it yet */
+static struct call *incoming(struct call_table *t)
+{
+    struct call *c = find_incoming(t);
+
+    if (c || (t->used & SLOT_BIT(0)))
+        return c;
+    c = new_call(t, 0, false);
+    set_state(t, c, t->used & ~SLOT_BIT(0) ? CALL_WAITING : CALL_INCOMING);
+    return c;
+}
+
+bool call_line(struct call_table *t, const struct at_line *line)
+{
+    struct at_field f[MAX_FIELDS];
+    struct call *c;
+    int n, i, live = -1;
+
+    switch (line->token) {
+    case AT_TOK_DSCI:
+        t->dsci = true;
+        n = at_split_fields(line->data, line->len, f, MAX_FIELDS);
+        return update(t, f, n, 4) < 0;
+
+    case AT_TOK_CLCC:
+        n = at_split_fields(line->data, line->len, f, MAX_FIELDS);
+        return update(t, f, n, 5) < 0;
+
+    case AT_TOK_RING:
+    case AT_TOK_CRING:
+        incoming(t);
+        return false;
+
+    case AT_TOK_CLIP:
+        n = at_split_fields(line->data, line->len, f, MAX_FIELDS);
+        c = incoming(t);
+        if (c && n > 0 && set_number(c, &f[0]))
+            notify(t, c, c->state);
+        return false;
+
+    case AT_TOK_NO_CARRIER:
+    case AT_TOK_BUSY:
+    case AT_TOK_NO_ANSWER:
+        // ^DSCI will say which call it was
+        if (t->dsci || !t->used)
+            return false;
+        for (i = 0; i < CALL_MAX; i++) {
+            if (!(t->used & SLOT_BIT(i)))
+                continue;
+            if (live >= 0)
+                return true;
+            live = i;
+        }
+        set_state(t, &t->calls[live], CALL_DISCONNECTED);
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+void call_sync(struct call_table *t, const char *clcc_response)
+{
+    struct at_field f[MAX_FIELDS];
+    const char *line = clcc_response, *eol;
+    unsigned int listed = 0;
+    int n, id, i;
+
+    while (*line) {
+        eol = strchr(line, '\n');
+        if (!eol)
+            eol = line + strlen(line);
+        if (strncmp(line, "+CLCC:", 6) == 0) {
+            n = at_split_fields(line, eol - line, f, MAX_FIELDS);
+            id = update(t, f, n, 5);
+            if (id > 0)
+                listed |= SLOT_BIT(id);
+        }
+        line = *eol ? eol + 1 : eol;
+    }
+
+    // slot 0 is waiting for an id, the modem may not have listed it yet
+    for (i = 1; i < CALL_MAX; i++)
+        if ((t->used & SLOT_BIT(i)) && !(listed & SLOT_BIT(i)))
+            set_state(t, &t->calls[i], CALL_DISCONNECTED);
+}
+
+void call_update(struct call_table *t, int id, bool outgoing, enum call_state state,
+                 const char *number)
+{
+    struct at_field f;
+
+    if (id < 1 || id >= CALL_MAX || state > CALL_DISCONNECTED)
+        return;
+    if (number) {
+        f.p = number;
+        f.len = strlen(number);
+    }
+    update_call(t, id, outgoing, state, number ? &f : NULL);
+}
+
+void call_dialing(struct call_table *t, const char *number)
+{
+    struct call *c;
+
+    if (t->used & SLOT_BIT(0))
+        return;
+    c = new_call(t, 0, true);
+    strncpy(c->number, number, CALL_NUMBER_MAX - 1);
+    set_state(t, c, CALL_DIALING);
+}
+
+void call_dial_failed(struct call_table *t)
+{
+    int i;
+
+    for (i = 0; i < CALL_MAX; i++)
+        if ((t->used & SLOT_BIT(i)) && t->calls[i].outgoing &&
+            (t->calls[i].state == CALL_DIALING || t->calls[i].state == CALL_ALERTING))
+            set_state(t, &t->calls[i], CALL_DISCONNECTED);
+}
+
+void call_answered(struct call_table *t)
+{
+    struct call *c = find_incoming(t);
+
+    if (c)
+        set_state(t, c, CALL_ACTIVE);
+}
+
+void call_hungup(struct call_table *t)
+{
+    int i;
+
+    for (i = 0; i < CALL_MAX; i++)
+        if (t->used & SLOT_BIT(i))
+            set_state(t, &t->calls[i], CALL_DISCONNECTED);
+}
+
+const struct call *call_find(const struct call_table *t, enum call_state state)
+{
+    int i;
+
+    for (i = 0; i < CALL_MAX; i++)
+        if ((t->used & SLOT_BIT(i)) && t->calls[i].state == state)
+            return &t->calls[i];
+    return NULL;
+}
+
+unsigned int call_count(const struct call_table *t)
+{
+    return __builtin_popcount(t->used);
+}
+
+const char *call_state_name(enum call_state state)
+{
+    static const char *names[] = {
+        "active", "held", "dialing", "alerting", "incoming", "waiting",
+        "disconnected", "idle",
+    };
+
+    return state <= CALL_IDLE ? names[state] : "?";
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file call.h
+ * @brief Voice call state machine
+ *
+ * One entry per call id (1..7 as in +CLCC), kept current from ^DSCI,
+ * +CLIP, RING and NO CARRIER as they arrive. +CLCC is only needed at
+ * startup and when a URC is ambiguous. Every state change is handed to a
+ * single listener (UI, audio routing).
+ *
+ * Slot 0 holds a call whose id the modem hasn't told us yet: an incoming
+ * RING before its ^DSCI, or an ATD before the modem answered.
+ *
+ */
+
+#ifndef HAVE_CALL_H__
+#define HAVE_CALL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "at_parser.h"
+
+#define CALL_MAX 8              /* slot 0 + ids 1..7 */
+#define CALL_NUMBER_MAX 32
+
+/* 27.007 +CLCC <stat>, then ours */
+enum call_state {
+    CALL_ACTIVE = 0,
+    CALL_HELD,
+    CALL_DIALING,               /* outgoing */
+    CALL_ALERTING,              /* outgoing, remote is ringing */
+    CALL_INCOMING,
+    CALL_WAITING,               /* incoming while in another call */
+    CALL_DISCONNECTED,          /* reported once, then the slot is free */
+    CALL_IDLE,                  /* free slot */
+};
+
+struct call {
+    uint8_t id;                 /* 0: not known yet */
+    bool outgoing;
+    enum call_state state;
+    char number[CALL_NUMBER_MAX];
+};
+
+/* old is CALL_IDLE for a new call, and equal to call->state when only the
+ * number changed (+CLIP after RING) */
+typedef void (*call_event_cb)(const struct call *call, enum call_state old, void *user);
+
+struct call_table {
+    struct call calls[CALL_MAX];
+    uint8_t used;               /* bit per slot */
+    bool dsci;                  /* ^DSCI seen, it is the authority on hangups */
+    call_event_cb listener;
+    void *user;
+};
+
+void call_table_init(struct call_table *t, call_event_cb listener, void *user);
+
+/* Feed URCs (^DSCI, +CLIP, RING, NO CARRIER, BUSY, NO ANSWER) and
+ * unsolicited +CLCC lines. Returns true when the line couldn't be pinned
+ * to a call and the table should be refreshed with AT+CLCC. */
+bool call_line(struct call_table *t, const struct at_line *line);
+
+/* Replace the table with a complete AT+CLCC response */
+void call_sync(struct call_table *t, const char *clcc_response);
+
+/* A call as a backend without URCs reports it (oFono): id 1..7, number
+ * NULL when not known. Same rules as for ^DSCI. */
+void call_update(struct call_table *t, int id, bool outgoing, enum call_state state,
+                 const char *number);
+
+/* our own call control: call_dialing() when ATD is sent, the others when
+ * the command returned its final result */
+void call_dialing(struct call_table *t, const char *number);
+void call_dial_failed(struct call_table *t);
+void call_answered(struct call_table *t);
+void call_hungup(struct call_table *t);
+
+/* first call in state, NULL when there is none */
+const struct call *call_find(const struct call_table *t, enum call_state state);
+unsigned int call_count(const struct call_table *t);
+
+const char *call_state_name(enum call_state state);
+
+#endif /* HAVE_CALL_H__ */
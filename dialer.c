@@ -30,32 +30,154 @@
 #include <signal.h>
 #include <threads.h>
 
+#include <glib-unix.h>
+
 #include "ui.h"
 #include "at.h"
+#include "sms_outbox.h"
+#include "backend.h"
+#include "ofono.h"
+#include "tp.h"
 #include "audio_setup.h"
 #include "ring-audio.h"
+#include "tone.h"
 #include "daemonize.h"
+#include "probe.h"
 
 #define MODE_NONE 0
 #define MODE_DIAL_PAD 1
 
-int modem_fd;
+int modem_path_count;
 
 bool set_alsa;
 
-void sig_handler(int sig_num)
+// played from the first RING until the call is answered or gone
+static const struct ring_cadence *cadence = &ring_cadences[0];
+
+// calls incoming or waiting; keypad tones would cut the cadence short
+static unsigned int ringing;
+
+// call control, AT unless -b ofono
+static const struct backend_ops *backend = &at_backend;
+
+// signals are taken in the main loop, where gtk and the backends can be
+// touched: SIGINT leaves gtk_main() and main() closes everything
+gboolean on_sigint(gpointer data)
+{
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
+
+gboolean on_sigusr1(gpointer data)
+{
+    gtk_widget_show(GTK_WIDGET(window));
+    return G_SOURCE_CONTINUE;
+}
+
+// SIGUSR2 appends the per modem counters and latency histograms to the log
+gboolean dump_stats(gpointer data)
 {
+    FILE *out = fopen(LOG_FILE, "a");
 
-    if(sig_num == SIGINT)
+    if (out)
     {
-        close(modem_fd);
-        exit(EXIT_SUCCESS);
+        backend->dump_stats(out);
+        tp_registry_dump_stats(out);
+        tone_dump_stats(out);
+        ring_audio_dump_stats(out);
+#ifdef ENABLE_PROBES
+        probe_dump(out);
+#endif
+        fclose(out);
     }
-    else if (sig_num == SIGUSR1)
+    return TRUE;
+}
+
+static bool is_ringing(enum call_state state)
+{
+    return state == CALL_INCOMING || state == CALL_WAITING;
+}
+
+// every call state change from the modem backend lands here
+void on_call_event(const struct call *call, enum call_state old, void *user)
+{
+    char text[MAX_BUF_SIZE];
+    char msg[128];
+
+    snprintf(msg, sizeof(msg), "%s call %d %s: %s -> %s\n", backend->modem_name(user),
+             call->id, call->number, call_state_name(old), call_state_name(call->state));
+    log_message(LOG_FILE, msg);
+
+    // the ringtone plays while any call rings: the first one starts it,
+    // the last one answered, rejected or missed stops it
+    if (is_ringing(call->state) && !is_ringing(old))
+    {
+        if (ringing++ == 0)
+            ring_cadence(cadence);
+    }
+    else if (is_ringing(old) && !is_ringing(call->state) && ringing > 0)
     {
-        gtk_widget_show(GTK_WIDGET(window));
+        if (--ringing == 0)
+            ring_stop();
+    }
+
+    switch (call->state)
+    {
+    case CALL_INCOMING:
+    case CALL_WAITING:
+        if (!gtk_widget_get_visible (GTK_WIDGET(window)))
+            gtk_widget_show(GTK_WIDGET(window));
+        snprintf(text, sizeof(text), "!! RINGING !! %s", call->number);
+        break;
+    case CALL_DIALING:
+    case CALL_ALERTING:
+        if (set_alsa && old == CALL_IDLE)
+            call_audio_setup();
+        snprintf(text, sizeof(text), "Calling %s", call->number);
+        break;
+    case CALL_ACTIVE:
+        if (set_alsa && !call->outgoing && old != CALL_ACTIVE)
+            call_audio_setup();
+        snprintf(text, sizeof(text), "In call %s", call->number);
+        break;
+    case CALL_HELD:
+        snprintf(text, sizeof(text), "On hold %s", call->number);
+        break;
+    case CALL_DISCONNECTED:
+    default:
+        memset (dial_pad, 0, MAX_BUF_SIZE);
+        text[0] = 0;
+        break;
     }
 
+    hildon_entry_set_text((HildonEntry *)display, text);
+}
+
+// a new SMS, already in the store
+void on_sms_event(const struct sms *sms, void *user)
+{
+    char msg[SMS_TEXT_MAX + 128];
+
+    snprintf(msg, sizeof(msg), "%s SMS from %s: %s\n", backend->modem_name(user), sms->sender,
+             sms->text);
+    log_message(LOG_FILE, msg);
+
+    snprintf(msg, sizeof(msg), "SMS from %s", sms->sender);
+    hildon_banner_show_information(GTK_WIDGET(window), NULL, msg);
+}
+
+// Telepathy connections coming and going, from the registry's cache
+void on_tp_change(const char *cm, const struct tp_connection_info *conn, bool added, void *user)
+{
+    char msg[256];
+
+    if (conn)
+        snprintf(msg, sizeof(msg), "Telepathy connection %s (%s, %s) %s\n", conn->bus_name,
+                 cm, conn->protocol, added ? "up" : "gone");
+    else
+        snprintf(msg, sizeof(msg), "Telepathy connection manager %s %s\n", cm,
+                 added ? "up" : "gone");
+    log_message(LOG_FILE, msg);
 }
 
 gboolean hide_instead(GtkWidget * widget, char key_pressed)
@@ -66,49 +188,32 @@ gboolean hide_instead(GtkWidget * widget, char key_pressed)
 
 void callback_button_pressed(GtkWidget * widget, char key_pressed)
 {
-    char cmd[MAX_BUF_SIZE];
-    int res;
+    char digit[2] = { key_pressed, 0 };
 
     if (key_pressed == 'D')
     {
-      snprintf(cmd, MAX_BUF_SIZE, "ATD%s;\r", dial_pad);
-      res = write(modem_fd, cmd, strlen(cmd));
-      if (res < 0)
-      {
-          log_message(LOG_FILE,"Error writing to the modem\n");
-          return;
-      }
-
-      if (set_alsa)
-      {
-          // save status first ?
-          call_audio_setup();
-      }
+        if (!backend->dial(dial_pad))
+            log_message(LOG_FILE,"Error writing to the modem\n");
+        return;
     }
 
-    if (key_pressed == 'H'){
-        sprintf(cmd, "ATH\r");
-        res = write(modem_fd, cmd, strlen(cmd));
-        if (res < 0)
-        {
+    // silent right away, unless another call is ringing too
+    if (key_pressed == 'H')
+    {
+        if (ringing <= 1)
+            ring_stop();
+        if (!backend->hangup())
             log_message(LOG_FILE,"Error writing to the modem\n");
-            return;
-        }
-        memset (dial_pad, 0, MAX_BUF_SIZE);
+        return;
     }
 
     if (key_pressed == 'A')
     {
-        sprintf(cmd, "ATA\r");
-        res = write(modem_fd, cmd, strlen(cmd));
-        if (res < 0)
-        {
+        if (ringing <= 1)
+            ring_stop();
+        if (!backend->answer())
             log_message(LOG_FILE,"Error writing to the modem\n");
-            return;
-        }
-
-        if (set_alsa) // save status first?
-            call_audio_setup();
+        return;
     }
 
     if ((key_pressed >= '0' && key_pressed <= '9') ||
@@ -116,6 +221,14 @@ void callback_button_pressed(GtkWidget * widget, char key_pressed)
         key_pressed == '#' ||
         key_pressed == '+')
     {
+        // heard right away, dialing or in a call, but not over a ring;
+        // '+' is no DTMF key
+        if (!ringing && key_pressed != '+')
+            ring_dtmf(key_pressed);
+
+        // in a call the digit goes to the network, otherwise to the number
+        if (backend->dtmf(digit))
+            return;
         dial_pad[strlen(dial_pad)] = key_pressed;
         dial_pad[strlen(dial_pad)] = 0;
     }
@@ -126,17 +239,6 @@ void callback_button_pressed(GtkWidget * widget, char key_pressed)
     }
 
     hildon_entry_set_text((HildonEntry *)display, dial_pad);
-
-#if 0
-// play correct DTMF event
-    switch(key_pressed)
-    {
-    case '1':
-        // play DTMF...
-        break;
-        ...
-#endif
-
 }
 
 
@@ -170,27 +272,37 @@ void callback_button_pressed(GtkWidget * widget, char key_pressed)
 
 int main(int argc, char *argv[])
 {
-    char modem_path[MAX_MODEM_PATH];
+    char *modem_paths[MAX_MODEMS];
     int mode = MODE_NONE;
     bool daemonize_flag = false;
     set_alsa = false;
-    int backend = BACKEND_AT;
+    int backend_type = BACKEND_AT;
+    char *baud_rate = "115200";
+    char *capture_path = NULL;
 
     if (argc < 2){
     usage_info:
-        fprintf(stderr, "Usage: %s [-h] [-p] [-s] [-d] -m modem_dev\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-h] [-p] [-s] [-d] [-r auto|rate] [-t trace_file] [-i seconds] [-b at|ofono] [-c cadence] -m modem_dev [-m modem_dev...]\n", argv[0]);
         fprintf(stderr, "Usage example: %s -m /dev/EG25.AT -s -d\n\n", argv[0]);
         fprintf(stderr, "OPTIONS:\n");
         fprintf(stderr, "    -h                      Show this help\n");
         fprintf(stderr, "    -p                      Open Dial Pad\n");
         fprintf(stderr, "    -s                      Set alsa routing option (right now - no option yet!)\n");
         fprintf(stderr, "    -d                      Daemonize\n");
-        fprintf(stderr, "    -m <modem AT device>    Modem AT device\n");
-        fprintf(stderr, "    -b <at, ofono>          Choose between AT and ofono backends (ofono not implemented yet!)\n");
+        fprintf(stderr, "    -m <modem AT device>    Modem AT device, repeat for up to %d modems\n", MAX_MODEMS);
+        fprintf(stderr, "    -r <auto, rate>         Serial baud rate, \"auto\" probes the fastest working one (default 115200)\n");
+        fprintf(stderr, "    -t <trace file>         Append all modem traffic to a binary trace, see at-bench -t\n");
+        fprintf(stderr, "    -i <seconds>            Modem status refresh interval, backs off up to %dx while nothing changes (default %d)\n",
+                STATUS_BACKOFF_MAX, STATUS_INTERVAL_DEFAULT / 1000);
+        fprintf(stderr, "    -b <at, ofono>          Choose between AT and ofono backends (default at), ofono needs no -m\n");
+        fprintf(stderr, "    -c <cadence>            Ring cadence:");
+        for (const struct ring_cadence *c = ring_cadences; c->name; c++)
+            fprintf(stderr, " %s", c->name);
+        fprintf(stderr, " (default %s)\n", ring_cadences[0].name);
         return EXIT_SUCCESS;
     }
     int opt;
-    while ((opt = getopt(argc, argv, "hpm:sdb:")) != -1){
+    while ((opt = getopt(argc, argv, "hpm:sdb:r:t:i:c:")) != -1){
         switch (opt){
         case 'h':
             goto usage_info;
@@ -199,10 +311,45 @@ int main(int argc, char *argv[])
             mode = MODE_DIAL_PAD;
             break;
         case 'm':
-            strncpy (modem_path, optarg, MAX_MODEM_PATH);
+            if (modem_path_count == MAX_MODEMS)
+            {
+                fprintf(stderr, "At most %d modems.\n", MAX_MODEMS);
+                goto usage_info;
+            }
+            modem_paths[modem_path_count++] = optarg;
             break;
         case 'b':
-            // TODO: set backend
+            if (strcmp(optarg, "at") == 0)
+                backend_type = BACKEND_AT;
+            else if (strcmp(optarg, "ofono") == 0)
+                backend_type = BACKEND_OFONO;
+            else
+            {
+                fprintf(stderr, "Unknown backend %s.\n", optarg);
+                goto usage_info;
+            }
+            break;
+        case 'r':
+            baud_rate = optarg;
+            if (!baudrate_known(baud_rate))
+            {
+                fprintf(stderr, "Unknown baud rate %s.\n", baud_rate);
+                goto usage_info;
+            }
+            break;
+        case 't':
+            capture_path = optarg;
+            break;
+        case 'c':
+            cadence = ring_cadence_find(optarg);
+            if (!cadence)
+            {
+                fprintf(stderr, "Unknown cadence %s.\n", optarg);
+                goto usage_info;
+            }
+            break;
+        case 'i':
+            at_status_interval(atoi(optarg) * 1000);
             break;
         case 's':
             set_alsa = true;
@@ -216,6 +363,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (backend_type == BACKEND_AT && modem_path_count == 0)
+    {
+        fprintf(stderr, "No modem given.\n");
+        goto usage_info;
+    }
+
     if (daemonize_flag == true)
         daemonize();
 
@@ -225,8 +378,9 @@ int main(int argc, char *argv[])
         exit (EXIT_FAILURE);
     }
 
-    signal(SIGINT, sig_handler);
-    signal(SIGUSR1, sig_handler);
+    g_unix_signal_add(SIGINT, on_sigint, NULL);
+    g_unix_signal_add(SIGUSR1, on_sigusr1, NULL);
+    g_unix_signal_add(SIGUSR2, dump_stats, NULL);
 
     /* Create the hildon program and setup the title */
     program = HILDON_PROGRAM(hildon_program_get_instance());
@@ -331,28 +485,37 @@ int main(int argc, char *argv[])
     //    g_signal_connect(G_OBJECT(window), "delete_event", G_CALLBACK(gtk_main_quit), NULL);
     g_signal_connect(G_OBJECT(window), "delete-event", G_CALLBACK(hide_instead), NULL);
 
-    if (backend == BACKEND_AT)
+    if (backend_type == BACKEND_AT)
     {
         log_message(LOG_FILE,"Starting AT backend\n");
-        // Modem initialization
-        modem_fd = open_serial_port(modem_path);
-
-        if (modem_fd == -1)
+        if (capture_path)
+            at_capture(capture_path);
+        at_sms(SMS_STORE_FILE, on_sms_event);
+        // bulk SMS from sms-send, while calls go on
+        at_sms_outbox(SMS_OUTBOX_DIR);
+
+        // Modem initialization, every modem joins the same main loop
+        for (int i = 0; i < modem_path_count; i++)
         {
-            log_message(LOG_FILE, "Could not open modem\n");
-            return EXIT_FAILURE;
-        }
-
-        // make this a parameter?
-        set_fixed_baudrate("115200", modem_fd);
-
-        bool at_res = run_at_backend(modem_fd);
-        if (at_res == false)
-        {
-            log_message(LOG_FILE, "AT Error\n");
-            return EXIT_FAILURE;
+            // a modem that isn't there yet is waited for, like one that resets
+            bool at_res = run_at_backend(modem_paths[i], baud_rate, on_call_event);
+            if (at_res == false)
+            {
+                log_message(LOG_FILE, "AT Error\n");
+                return EXIT_FAILURE;
+            }
         }
     }
+    else if (backend_type == BACKEND_OFONO)
+    {
+        // ofonod owns the modems, they come and go over D-Bus
+        backend = &ofono_backend;
+        run_ofono_backend(on_call_event);
+    }
+
+    // not needed for calls, failing here only costs the log lines
+    if (!tp_registry_start(on_tp_change, NULL))
+        log_message(LOG_FILE, "No session bus, Telepathy connections not followed\n");
 
     log_message(LOG_FILE,"aqui 4444\n");
 
@@ -364,6 +527,7 @@ int main(int argc, char *argv[])
 
     gtk_main();
 
-    close (modem_fd);
+    at_close();
+    ring_audio_close();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file eg25-sim.c
+ * @brief Stand alone EG25 simulator
+ *
+ * Run "eg25-sim -l /tmp/EG25.AT" and then "dialer -m /tmp/EG25.AT -p".
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "modem_sim.h"
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t reset;
+
+static void sig_handler(int sig_num)
+{
+    if (sig_num == SIGUSR1)
+        reset = 1;
+    else
+        running = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct modem_sim_config cfg;
+    struct modem_sim sim;
+    const char *link = "/tmp/EG25.AT";
+    int boot_ms = 0;
+    int opt;
+
+    modem_sim_default_config(&cfg);
+
+    while ((opt = getopt(argc, argv, "hl:r:n:c:t:d:x:es:S:g:L:f:B:")) != -1){
+        switch (opt){
+        case 'l':
+            link = optarg;
+            break;
+        case 'r':
+            cfg.ring_interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            cfg.rings_per_call = atoi(optarg);
+            break;
+        case 'c':
+            cfg.call_interval_ms = atoi(optarg);
+            break;
+        case 't':
+            cfg.talk_ms = atoi(optarg);
+            break;
+        case 'd':
+            cfg.reply_delay_ms = atoi(optarg);
+            break;
+        case 'x':
+            cfg.caller = optarg;
+            break;
+        case 'e':
+            cfg.echo = false;
+            break;
+        case 's':
+            cfg.sms_stored = atoi(optarg);
+            break;
+        case 'S':
+            cfg.sms_interval_ms = atoi(optarg);
+            break;
+        case 'g':
+            cfg.sms_send_ms = atoi(optarg);
+            break;
+        case 'L':
+            cfg.sms_link_ms = atoi(optarg);
+            break;
+        case 'f':
+            cfg.sms_fail_every = atoi(optarg);
+            break;
+        case 'B':
+            boot_ms = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-l link] [-r ring_ms] [-n rings] [-c call_interval_ms] [-t talk_ms] [-d reply_delay_ms] [-x caller] [-e] [-s sms] [-S sms_ms] [-g send_ms] [-L link_ms] [-f n] [-B boot_ms]\n", argv[0]);
+            fprintf(stderr, "OPTIONS:\n");
+            fprintf(stderr, "    -l <path>    Symlink to the pty slave (default /tmp/EG25.AT)\n");
+            fprintf(stderr, "    -r <ms>      RING interval, 0 disables incoming calls (default 3000)\n");
+            fprintf(stderr, "    -n <rings>   RINGs before the caller gives up, 0 never (default 5)\n");
+            fprintf(stderr, "    -c <ms>      Pause between incoming calls (default 10000)\n");
+            fprintf(stderr, "    -t <ms>      Remote hangs up after this, 0 never (default 20000)\n");
+            fprintf(stderr, "    -d <ms>      Delay before answering a command (default 0)\n");
+            fprintf(stderr, "    -x <number>  Caller id sent in +CLIP\n");
+            fprintf(stderr, "    -e           Start with echo off (ATE0)\n");
+            fprintf(stderr, "    -s <count>   SMS waiting in storage at start (default 0)\n");
+            fprintf(stderr, "    -S <ms>      A new SMS (+CMTI) every ms, 0 never (default 0)\n");
+            fprintf(stderr, "    -g <ms>      Time to send an SMS (AT+CMGS) (default 0)\n");
+            fprintf(stderr, "    -L <ms>      Radio link setup before it, AT+CMMS saves it (default 0)\n");
+            fprintf(stderr, "    -f <n>       Every n-th AT+CMGS fails with +CMS ERROR: 500 (default never)\n");
+            fprintf(stderr, "    -B <ms>      SIGUSR1 resets the modem: the port goes away for ms (default 0)\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!modem_sim_open(&sim, &cfg, link)) {
+        perror("modem_sim_open");
+        return EXIT_FAILURE;
+    }
+    printf("EG25 simulator on %s -> %s\n", link, sim.slave_path);
+    fflush(stdout);
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, sig_handler);
+
+    while (running && modem_sim_step(&sim, 1000)) {
+        if (!reset)
+            continue;
+        // like a firmware reset: the port vanishes and a new one shows up
+        reset = 0;
+        modem_sim_close(&sim);
+        usleep(boot_ms * 1000);
+        if (!modem_sim_open(&sim, &cfg, link)) {
+            perror("modem_sim_open");
+            return EXIT_FAILURE;
+        }
+        printf("Reset, now on %s -> %s\n", link, sim.slave_path);
+        fflush(stdout);
+    }
+
+    modem_sim_close(&sim);
+    return EXIT_SUCCESS;
+}
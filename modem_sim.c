@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file modem_sim.c
+ * @brief Fake Quectel EG25 on a pseudo-terminal
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "modem_sim.h"
+#include "sms_pdu.h"
+
+uint64_t modem_sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+    return modem_sim_now_ns() / 1000000;
+}
+
+void modem_sim_default_config(struct modem_sim_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->ring_interval_ms = 3000;
+    cfg->rings_per_call = 5;
+    cfg->call_interval_ms = 10000;
+    cfg->talk_ms = 20000;
+    cfg->caller = "+5511999990000";
+    cfg->echo = true;
+}
+
+/* a new message into the first free slot, its index or -1 when full */
+static int sim_store_sms(struct modem_sim *sim)
+{
+    struct sms msg;
+    unsigned int tpdu_len;
+    int i;
+
+    for (i = 0; i < SIM_SMS_SLOTS && sim->sms[i][0]; i++)
+        ;
+    if (i == SIM_SMS_SLOTS)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.sender, sizeof(msg.sender), "%s", sim->cfg.caller);
+    msg.time = time(NULL);
+    snprintf(msg.text, sizeof(msg.text), "Message %u from the EG25 simulator", ++sim->sms_seq);
+    if (!sms_pdu_encode_deliver(&msg, sim->sms[i], SIM_PDU_MAX, &tpdu_len))
+        return -1;
+    sim->sms_stat[i] = 0;           /* REC UNREAD */
+    sim->sms_count++;
+    return i;
+}
+
+bool modem_sim_open(struct modem_sim *sim, const struct modem_sim_config *cfg,
+                    const char *link)
+{
+    struct termios tio;
+
+    memset(sim, 0, sizeof(*sim));
+    sim->cmgs_len = -1;
+    sim->cfg = *cfg;
+    sim->slave = -1;
+
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master < 0)
+        return false;
+    if (grantpt(sim->master) < 0 || unlockpt(sim->master) < 0 ||
+        ptsname_r(sim->master, sim->slave_path, sizeof(sim->slave_path)) != 0)
+        goto fail;
+
+    sim->slave = open(sim->slave_path, O_RDWR | O_NOCTTY);
+    if (sim->slave < 0)
+        goto fail;
+    tcgetattr(sim->slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(sim->slave, TCSANOW, &tio);
+
+    fcntl(sim->master, F_SETFL, fcntl(sim->master, F_GETFL) | O_NONBLOCK);
+
+    if (link) {
+        unlink(link);
+        if (symlink(sim->slave_path, link) < 0)
+            goto fail;
+        snprintf(sim->link_path, sizeof(sim->link_path), "%s", link);
+    }
+
+    if (sim->cfg.ring_interval_ms)
+        sim->next_event_ms = now_ms() + sim->cfg.ring_interval_ms;
+    while (sim->sms_count < sim->cfg.sms_stored && sim_store_sms(sim) >= 0)
+        ;
+    if (sim->cfg.sms_interval_ms)
+        sim->next_sms_ms = now_ms() + sim->cfg.sms_interval_ms;
+    return true;
+
+fail:
+    modem_sim_close(sim);
+    return false;
+}
+
+void modem_sim_close(struct modem_sim *sim)
+{
+    if (sim->link_path[0])
+        unlink(sim->link_path);
+    if (sim->slave >= 0)
+        close(sim->slave);
+    if (sim->master >= 0)
+        close(sim->master);
+    sim->slave = sim->master = -1;
+}
+
+static void sim_write(struct modem_sim *sim, const char *data, size_t len)
+{
+    ssize_t res;
+
+    while (len > 0) {
+        res = write(sim->master, data, len);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                poll(&(struct pollfd){ .fd = sim->master, .events = POLLOUT }, 1, 100);
+                continue;
+            }
+            return;
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+/* "\r\n<text>\r\n", like the real thing */
+static void sim_reply(struct modem_sim *sim, const char *fmt, ...)
+{
+    char buf[SIM_LINE_MAX + 4];
+    va_list ap;
+    int len;
+
+    buf[0] = '\r';
+    buf[1] = '\n';
+    va_start(ap, fmt);
+    len = vsnprintf(buf + 2, SIM_LINE_MAX, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (len > SIM_LINE_MAX - 1)
+        len = SIM_LINE_MAX - 1;
+    buf[2 + len] = '\r';
+    buf[3 + len] = '\n';
+    sim_write(sim, buf, len + 4);
+}
+
+/* Quectel call status indication, <stat> as in +CLCC, 6 for released */
+static void sim_dsci(struct modem_sim *sim, int stat)
+{
+    if (sim->dsci)
+        sim_reply(sim, "^DSCI: 1,%d,%d,0,\"%s\",145", sim->outgoing ? 0 : 1, stat,
+                  sim->cfg.caller);
+}
+
+static void sim_ring(struct modem_sim *sim)
+{
+    unsigned int n = atomic_load(&sim->ring_count);
+
+    sim->ring_stamp[n & (SIM_STAMPS - 1)] = modem_sim_now_ns();
+    sim_reply(sim, "RING");
+    atomic_store(&sim->ring_count, n + 1);
+    if (sim->clip)
+        sim_reply(sim, "+CLIP: \"%s\",145,,,,0", sim->cfg.caller);
+}
+
+static void sim_hangup(struct modem_sim *sim, uint64_t now)
+{
+    if (sim->state != SIM_IDLE)
+        sim_dsci(sim, 6);
+    sim->state = SIM_IDLE;
+    sim->rings = 0;
+    sim->next_event_ms = sim->cfg.ring_interval_ms ? now + sim->cfg.call_interval_ms : 0;
+}
+
+static void sim_call_active(struct modem_sim *sim, uint64_t now)
+{
+    sim->state = SIM_ACTIVE;
+    sim_dsci(sim, 0);
+    sim->next_event_ms = sim->cfg.talk_ms ? now + sim->cfg.talk_ms : 0;
+}
+
+/* scripted incoming calls and remote hangups, and incoming SMS */
+static void sim_events(struct modem_sim *sim)
+{
+    uint64_t now = now_ms();
+    int index;
+
+    if (sim->next_sms_ms && now >= sim->next_sms_ms) {
+        index = sim_store_sms(sim);
+        if (index >= 0)
+            sim_reply(sim, "+CMTI: \"ME\",%d", index);
+        sim->next_sms_ms = now + sim->cfg.sms_interval_ms;
+    }
+
+    if (!sim->next_event_ms || now < sim->next_event_ms)
+        return;
+
+    switch (sim->state) {
+    case SIM_IDLE:
+        sim->state = SIM_RINGING;
+        sim->outgoing = false;
+        sim->rings = 0;
+        sim_dsci(sim, 4);
+        /* fall through */
+    case SIM_RINGING:
+        if (sim->cfg.rings_per_call && sim->rings >= sim->cfg.rings_per_call) {
+            sim_reply(sim, "NO CARRIER");
+            sim_hangup(sim, now);
+            break;
+        }
+        sim_ring(sim);
+        sim->rings++;
+        sim->next_event_ms = now + sim->cfg.ring_interval_ms;
+        break;
+    case SIM_DIALING:
+        sim_call_active(sim, now);
+        break;
+    case SIM_ACTIVE:
+        sim_reply(sim, "NO CARRIER");
+        sim_hangup(sim, now);
+        break;
+    }
+}
+
+#define CMD_IS(c, lit) (strcasecmp((c), (lit)) == 0)
+#define CMD_STARTS_WITH(c, lit) (strncasecmp((c), (lit), sizeof(lit) - 1) == 0)
+
+static void sim_list_sms(struct modem_sim *sim, int stat)
+{
+    int i;
+
+    for (i = 0; i < SIM_SMS_SLOTS; i++) {
+        if (!sim->sms[i][0] || (stat != 4 && sim->sms_stat[i] != stat))
+            continue;
+        sim_reply(sim, "+CMGL: %d,%d,,%zu", i, sim->sms_stat[i], strlen(sim->sms[i]) / 2 - 1);
+        sim_reply(sim, "%s", sim->sms[i]);
+        if (sim->sms_stat[i] == 0)
+            sim->sms_stat[i] = 1;   /* listing marks them read */
+    }
+}
+
+/* AT+CMGD=<index>[,<delflag>] */
+static void sim_delete_sms(struct modem_sim *sim, const char *args)
+{
+    int index = -1, flag = 0, i;
+
+    sscanf(args, "%d,%d", &index, &flag);
+    for (i = 0; i < SIM_SMS_SLOTS; i++) {
+        if (!sim->sms[i][0])
+            continue;
+        if (flag == 0 ? i == index :
+            flag == 4 || sim->sms_stat[i] == 1 || (flag >= 2 && sim->sms_stat[i] == 3) ||
+            (flag >= 3 && sim->sms_stat[i] == 2)) {
+            sim->sms[i][0] = 0;
+            sim->sms_count--;
+        }
+    }
+}
+
+/* the PDU after "> ", up to Ctrl-Z */
+static void sim_submit(struct modem_sim *sim, const char *hex)
+{
+    size_t len = strlen(hex);
+    uint64_t now = now_ms();
+
+    if (sim->cfg.echo)
+        sim_write(sim, hex, len);
+
+    // AT+CMMS=1 lets the link go after a few idle seconds
+    if (sim->cmms == 1 && now - sim->link_used_ms > 3000)
+        sim->link_up = false;
+    if (!sim->link_up && sim->cfg.sms_link_ms)
+        usleep(sim->cfg.sms_link_ms * 1000);
+    sim->link_up = sim->cmms != 0;
+    if (sim->cfg.sms_send_ms)
+        usleep(sim->cfg.sms_send_ms * 1000);
+    sim->link_used_ms = now_ms();
+
+    sim->sms_submitted++;
+    if (len != (size_t) (sim->cmgs_len + 1) * 2 || strspn(hex, "0123456789ABCDEFabcdef") != len)
+        sim_reply(sim, "+CMS ERROR: 304");
+    else if (sim->cfg.sms_fail_every && sim->sms_submitted % sim->cfg.sms_fail_every == 0)
+        sim_reply(sim, "+CMS ERROR: 500");
+    else {
+        sim_reply(sim, "+CMGS: %u", ++sim->sms_sent & 0xFF);
+        sim_reply(sim, "OK");
+    }
+}
+
+/* Commands that may share a command line. False when cmd is not one of
+ * them. */
+static bool sim_query(struct modem_sim *sim, const char *cmd)
+{
+    int index;
+
+    if (CMD_IS(cmd, "AT+CLCC")) {
+        if (sim->state == SIM_RINGING)
+            sim_reply(sim, "+CLCC: 1,1,4,0,0,\"%s\",145", sim->cfg.caller);
+        else if (sim->state == SIM_DIALING)
+            sim_reply(sim, "+CLCC: 1,0,2,0,0,\"%s\",145", sim->cfg.caller);
+        else if (sim->state == SIM_ACTIVE)
+            sim_reply(sim, "+CLCC: 1,%d,0,0,0,\"%s\",145", sim->outgoing ? 0 : 1,
+                      sim->cfg.caller);
+    } else if (CMD_IS(cmd, "AT+CPAS")) {
+        sim_reply(sim, "+CPAS: %d", sim->state == SIM_IDLE ? 0 :
+                  sim->state == SIM_RINGING ? 3 : 4);
+    } else if (CMD_IS(cmd, "AT+CSQ")) {
+        sim_reply(sim, "+CSQ: 22,99");
+    } else if (CMD_IS(cmd, "AT+CREG?")) {
+        sim_reply(sim, "+CREG: 0,1");
+    } else if (CMD_IS(cmd, "AT+COPS?")) {
+        sim_reply(sim, "+COPS: 0,0,\"Rhizomatica\",7");
+    } else if (CMD_IS(cmd, "AT+CGSN")) {
+        sim_reply(sim, "867698040000001");
+    } else if (CMD_IS(cmd, "AT+CIMI")) {
+        sim_reply(sim, "724990000000001");
+    } else if (CMD_STARTS_WITH(cmd, "AT+CMGL=")) {
+        sim_list_sms(sim, atoi(cmd + 8));
+    } else if (CMD_STARTS_WITH(cmd, "AT+CMGR=")) {
+        index = atoi(cmd + 8);
+        if (index >= 0 && index < SIM_SMS_SLOTS && sim->sms[index][0]) {
+            sim_reply(sim, "+CMGR: %d,,%zu", sim->sms_stat[index],
+                      strlen(sim->sms[index]) / 2 - 1);
+            sim_reply(sim, "%s", sim->sms[index]);
+            if (sim->sms_stat[index] == 0)
+                sim->sms_stat[index] = 1;
+        }
+    } else if (CMD_STARTS_WITH(cmd, "AT+CMGD=")) {
+        sim_delete_sms(sim, cmd + 8);
+    } else if (CMD_IS(cmd, "AT+CMMS?")) {
+        sim_reply(sim, "+CMMS: %d", sim->cmms);
+    } else if (CMD_STARTS_WITH(cmd, "AT+CMMS=")) {
+        sim->cmms = atoi(cmd + 8);
+        if (sim->cmms == 0)
+            sim->link_up = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* AT+CSQ;+CREG?;+COPS? answers each part, then one OK */
+static void sim_concatenated(struct modem_sim *sim, const char *cmd)
+{
+    char part[SIM_LINE_MAX + 2];
+    const char *s = cmd + 2, *semi;
+    size_t len;
+
+    for (;;) {
+        semi = strchr(s, ';');
+        len = semi ? (size_t) (semi - s) : strlen(s);
+        snprintf(part, sizeof(part), "AT%.*s", (int) len, s);
+        if (len > 0 && !sim_query(sim, part)) {
+            sim_reply(sim, "ERROR");
+            return;
+        }
+        if (!semi)
+            break;
+        s = semi + 1;
+    }
+    sim_reply(sim, "OK");
+}
+
+static void sim_command(struct modem_sim *sim, const char *cmd)
+{
+    uint64_t now = now_ms();
+
+    atomic_fetch_add(&sim->commands, 1);
+    if (sim->cfg.echo) {
+        sim_write(sim, cmd, strlen(cmd));
+        sim_write(sim, "\r", 1);
+    }
+    if (sim->cfg.reply_delay_ms)
+        usleep(sim->cfg.reply_delay_ms * 1000);
+
+    if (!CMD_STARTS_WITH(cmd, "AT")) {
+        sim_reply(sim, "ERROR");
+        return;
+    }
+
+    if (CMD_IS(cmd, "ATE0") || CMD_IS(cmd, "ATE1")) {
+        sim->cfg.echo = cmd[3] == '1';
+    } else if (CMD_STARTS_WITH(cmd, "ATD")) {
+        if (sim->state != SIM_IDLE) {
+            sim_reply(sim, "+CME ERROR: 3");
+            return;
+        }
+        sim->state = SIM_DIALING;
+        sim->outgoing = true;
+        sim->next_event_ms = now + 500;
+        sim_reply(sim, "OK");
+        sim_dsci(sim, 2);
+        return;
+    } else if (CMD_IS(cmd, "ATA")) {
+        if (sim->state != SIM_RINGING) {
+            sim_reply(sim, "NO CARRIER");
+            return;
+        }
+        sim_call_active(sim, now);
+    } else if (CMD_IS(cmd, "ATH") || CMD_IS(cmd, "AT+CHUP")) {
+        if (sim->state != SIM_IDLE)
+            sim_hangup(sim, now);
+    } else if (CMD_STARTS_WITH(cmd, "AT+CMGS=")) {
+        sim->cmgs_len = atoi(cmd + 8);
+        sim_write(sim, "\r\n> ", 4);
+        return;
+    } else if (CMD_IS(cmd, "AT+CLIP=0") || CMD_IS(cmd, "AT+CLIP=1")) {
+        sim->clip = cmd[8] == '1';
+    } else if (CMD_IS(cmd, "AT^DSCI=0") || CMD_IS(cmd, "AT^DSCI=1")) {
+        sim->dsci = cmd[8] == '1';
+    } else if (strchr(cmd, ';')) {
+        sim_concatenated(sim, cmd);
+        return;
+    } else {
+        sim_query(sim, cmd);
+    }
+    /* ATZ, AT and everything else we don't model just succeed */
+
+    sim_reply(sim, "OK");
+}
+
+static void sim_input(struct modem_sim *sim, const char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (sim->cmgs_len >= 0 && (data[i] == 0x1A || data[i] == 0x1B)) {
+            sim->line[sim->line_len] = 0;
+            if (data[i] == 0x1A)
+                sim_submit(sim, sim->line);
+            else
+                sim_reply(sim, "OK");      /* ESC: not sent */
+            sim->cmgs_len = -1;
+            sim->line_len = 0;
+        } else if (sim->cmgs_len < 0 && (data[i] == '\r' || data[i] == '\n')) {
+            if (sim->line_len == 0)
+                continue;
+            sim->line[sim->line_len] = 0;
+            sim_command(sim, sim->line);
+            sim->line_len = 0;
+        } else if (sim->line_len < SIM_LINE_MAX - 1) {
+            sim->line[sim->line_len++] = data[i];
+        }
+    }
+}
+
+bool modem_sim_step(struct modem_sim *sim, int max_wait_ms)
+{
+    struct pollfd pfd = { .fd = sim->master, .events = POLLIN };
+    char buf[4096];
+    uint64_t now = now_ms();
+    ssize_t cc;
+    int wait = max_wait_ms;
+
+    if (sim->next_event_ms) {
+        if (sim->next_event_ms <= now)
+            wait = 0;
+        else if (wait < 0 || sim->next_event_ms - now < (uint64_t) wait)
+            wait = sim->next_event_ms - now;
+    }
+    if (sim->next_sms_ms) {
+        if (sim->next_sms_ms <= now)
+            wait = 0;
+        else if (wait < 0 || sim->next_sms_ms - now < (uint64_t) wait)
+            wait = sim->next_sms_ms - now;
+    }
+
+    if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+        return false;
+
+    if (pfd.revents & POLLIN) {
+        cc = read(sim->master, buf, sizeof(buf));
+        if (cc > 0)
+            sim_input(sim, buf, cc);
+    }
+
+    sim_events(sim);
+    return true;
+}
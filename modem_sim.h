@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file modem_sim.h
+ * @brief Fake Quectel EG25 on a pseudo-terminal
+ *
+ * The slave side of the pty behaves like /dev/EG25.AT: it answers the
+ * commands the dialer sends and plays incoming calls (RING, +CLIP, ^DSCI,
+ * NO CARRIER) and incoming SMS (+CMTI, then AT+CMGL/+CMGR/+CMGD on its
+ * message storage) at a configurable rate. Outgoing SMS (AT+CMGS) take
+ * the time a network would, less when AT+CMMS keeps the link up.
+ *
+ */
+
+#ifndef HAVE_MODEM_SIM_H__
+#define HAVE_MODEM_SIM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SIM_LINE_MAX 1024
+#define SIM_STAMPS 4096 /* power of two */
+#define SIM_SMS_SLOTS 255
+#define SIM_PDU_MAX 400 /* hex digits */
+
+struct modem_sim_config {
+    unsigned int ring_interval_ms;  /* 0: no incoming calls */
+    unsigned int rings_per_call;    /* 0: ring until answered */
+    unsigned int call_interval_ms;  /* pause between incoming calls */
+    unsigned int talk_ms;           /* remote hangs up after this, 0: never */
+    unsigned int reply_delay_ms;    /* how long the "modem" thinks */
+    const char *caller;             /* +CLIP number, SMS sender */
+    bool echo;                      /* ATE1, the EG25 default */
+    unsigned int sms_stored;        /* messages waiting in storage at start */
+    unsigned int sms_interval_ms;   /* a new one every so often, 0: never */
+    unsigned int sms_send_ms;       /* AT+CMGS on an established link */
+    unsigned int sms_link_ms;       /* link setup, AT+CMMS saves it */
+    unsigned int sms_fail_every;    /* +CMS ERROR for every n-th AT+CMGS, 0: never */
+};
+
+enum sim_call_state {
+    SIM_IDLE = 0,
+    SIM_RINGING,       /* incoming */
+    SIM_DIALING,       /* outgoing */
+    SIM_ACTIVE,
+};
+
+struct modem_sim {
+    int master;
+    int slave;                      /* kept open so the master never sees HUP */
+    char slave_path[64];
+    char link_path[256];
+    struct modem_sim_config cfg;
+
+    char line[SIM_LINE_MAX];
+    size_t line_len;
+
+    enum sim_call_state state;
+    bool outgoing;
+    bool clip;                      /* AT+CLIP=1 */
+    bool dsci;                      /* AT^DSCI=1 */
+    unsigned int rings;
+    uint64_t next_event_ms;
+
+    /* message storage, "" for a free slot; stat as in +CMGL */
+    char sms[SIM_SMS_SLOTS][SIM_PDU_MAX];
+    uint8_t sms_stat[SIM_SMS_SLOTS];
+    unsigned int sms_count;
+    unsigned int sms_seq;
+    uint64_t next_sms_ms;
+    int cmgs_len;                   /* after "> ": TPDU length, else -1 */
+    int cmms;                       /* AT+CMMS */
+    bool link_up;
+    uint64_t link_used_ms;
+    unsigned int sms_submitted;
+    unsigned int sms_sent;
+
+    /* CLOCK_MONOTONIC ns at which each RING was written, for benchmarks */
+    uint64_t ring_stamp[SIM_STAMPS];
+    atomic_uint ring_count;
+    atomic_uint commands;
+};
+
+void modem_sim_default_config(struct modem_sim_config *cfg);
+
+/* link, when not NULL, is made a symlink to the slave (e.g. /tmp/EG25.AT) */
+bool modem_sim_open(struct modem_sim *sim, const struct modem_sim_config *cfg,
+                    const char *link);
+void modem_sim_close(struct modem_sim *sim);
+
+/* Serve commands and scripted events for at most max_wait_ms */
+bool modem_sim_step(struct modem_sim *sim, int max_wait_ms);
+
+uint64_t modem_sim_now_ns(void);
+
+#endif /* HAVE_MODEM_SIM_H__ */
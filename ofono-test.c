@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file ofono-test.c
+ * @brief ofono.c against a mock ofonod
+ *
+ * Starts a dbus-daemon of its own (GTestDBus), points
+ * DBUS_SYSTEM_BUS_ADDRESS at it and owns org.ofono there with just
+ * enough Manager, VoiceCallManager and VoiceCall to be ofonod. The
+ * backend is driven through its public calls while the mock writes down
+ * what it was asked and emits what ofonod would:
+ *
+ *  - GetModems at start up, ModemAdded and ModemRemoved later
+ *  - CallAdded and State changes, as seen by the call listener
+ *  - Dial, Answer and HangupAll, on the right objects
+ *  - digits pressed while SendTones plays, in one more SendTones
+ *
+ * One line per check; the exit status is the number that failed.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "ofono.h"
+#include "daemonize.h"
+
+#define MOCK_MODEMS 2
+#define MOCK_CALLS 4              /* voicecall01..03 */
+#define MOCK_TONE_MS 200          /* how long SendTones takes to play */
+#define STEP_TIMEOUT_MS 5000
+#define LOG_SIZE 4096
+
+static const char mock_xml[] =
+    "<node>"
+    " <interface name='org.ofono.Manager'>"
+    "  <method name='GetModems'><arg type='a(oa{sv})' direction='out'/></method>"
+    " </interface>"
+    " <interface name='org.ofono.VoiceCallManager'>"
+    "  <method name='GetCalls'><arg type='a(oa{sv})' direction='out'/></method>"
+    "  <method name='Dial'>"
+    "   <arg type='s' direction='in'/><arg type='s' direction='in'/>"
+    "   <arg type='o' direction='out'/>"
+    "  </method>"
+    "  <method name='HangupAll'/>"
+    "  <method name='SendTones'><arg type='s' direction='in'/></method>"
+    " </interface>"
+    " <interface name='org.ofono.VoiceCall'>"
+    "  <method name='Answer'/>"
+    " </interface>"
+    "</node>";
+
+struct mock_call {
+    bool used;
+    char state[16];
+    char number[32];
+    guint object;
+};
+
+struct mock_modem {
+    const char *path;
+    const char *name;
+    bool listed;                  /* in GetModems */
+    guint object;
+    struct mock_call calls[MOCK_CALLS];
+};
+
+static struct mock_modem mock_modems[MOCK_MODEMS] = {
+    { .path = "/mock0", .name = "Mock modem 0" },
+    { .path = "/mock1", .name = "Mock modem 1" },
+};
+
+static GDBusConnection *mock_bus;
+static GDBusNodeInfo *mock_info;
+static bool mock_named;
+
+/* "Method path argument" per request the mock got, and
+ * "modem: id state number" per call listener event */
+static char requests[LOG_SIZE];
+static char events[LOG_SIZE];
+
+static unsigned int checks, failures;
+
+static void log_append(char *log, const char *fmt, ...)
+{
+    size_t len = strlen(log);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(log + len, LOG_SIZE - len, fmt, ap);
+    va_end(ap);
+}
+
+static unsigned int count(const char *log, const char *text)
+{
+    unsigned int n = 0;
+
+    for (log = strstr(log, text); log; log = strstr(log + 1, text))
+        n++;
+    return n;
+}
+
+static void check(const char *what, bool ok)
+{
+    checks++;
+    if (!ok)
+        failures++;
+    printf("ofono: %-48s %s\n", what, ok ? "ok" : "FAILED");
+}
+
+static gboolean wake_up(gpointer data)
+{
+    return TRUE;
+}
+
+/* run the main loop until text shows up in log */
+static bool wait_for(const char *log, const char *text)
+{
+    gint64 deadline = g_get_monotonic_time() + STEP_TIMEOUT_MS * 1000;
+
+    while (!strstr(log, text) && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    return strstr(log, text) != NULL;
+}
+
+/* ---- the mock ofonod ---- */
+
+static void mock_emit(const char *path, const char *interface, const char *member,
+                      GVariant *params)
+{
+    g_dbus_connection_emit_signal(mock_bus, NULL, path, interface, member, params, NULL);
+}
+
+static GVariant *modem_props(const struct mock_modem *mm)
+{
+    const char *interfaces[] = { OFONO_SERVICE ".VoiceCallManager", NULL };
+    GVariantBuilder b;
+
+    g_variant_builder_init(&b, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&b, "{sv}", "Name", g_variant_new_string(mm->name));
+    g_variant_builder_add(&b, "{sv}", "Interfaces", g_variant_new_strv(interfaces, -1));
+    return g_variant_builder_end(&b);
+}
+
+static GVariant *call_props(const struct mock_call *c)
+{
+    GVariantBuilder b;
+
+    g_variant_builder_init(&b, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&b, "{sv}", "State", g_variant_new_string(c->state));
+    g_variant_builder_add(&b, "{sv}", "LineIdentification", g_variant_new_string(c->number));
+    return g_variant_builder_end(&b);
+}
+
+static void call_path(char *path, size_t size, const struct mock_modem *mm, int id)
+{
+    snprintf(path, size, "%s/voicecall%02d", mm->path, id);
+}
+
+static struct mock_modem *mock_modem_at(const char *path)
+{
+    int i;
+
+    for (i = 0; i < MOCK_MODEMS; i++)
+        if (strcmp(mock_modems[i].path, path) == 0)
+            return &mock_modems[i];
+    return NULL;
+}
+
+static void mock_method(GDBusConnection *connection, const char *sender, const char *path,
+                        const char *interface, const char *method, GVariant *params,
+                        GDBusMethodInvocation *invocation, gpointer data);
+
+static const GDBusInterfaceVTable mock_vtable = { mock_method, NULL, NULL, { 0 } };
+
+static guint mock_export(const char *path, const char *interface)
+{
+    return g_dbus_connection_register_object(mock_bus, path,
+                                             g_dbus_node_info_lookup_interface(mock_info,
+                                                                               interface),
+                                             &mock_vtable, NULL, NULL, NULL);
+}
+
+static void mock_call_state(struct mock_modem *mm, int id, const char *state)
+{
+    struct mock_call *c = &mm->calls[id];
+    char path[96];
+
+    call_path(path, sizeof(path), mm, id);
+    snprintf(c->state, sizeof(c->state), "%s", state);
+    mock_emit(path, OFONO_SERVICE ".VoiceCall", "PropertyChanged",
+              g_variant_new("(sv)", "State", g_variant_new_string(state)));
+    if (strcmp(state, "disconnected") == 0) {
+        mock_emit(mm->path, OFONO_SERVICE ".VoiceCallManager", "CallRemoved",
+                  g_variant_new("(o)", path));
+        g_dbus_connection_unregister_object(mock_bus, c->object);
+        c->used = false;
+    }
+}
+
+static int mock_call_add(struct mock_modem *mm, const char *state, const char *number)
+{
+    struct mock_call *c;
+    char path[96];
+    int id;
+
+    for (id = 1; id < MOCK_CALLS && mm->calls[id].used; id++)
+        ;
+    if (id == MOCK_CALLS)
+        return -1;
+    c = &mm->calls[id];
+    c->used = true;
+    snprintf(c->state, sizeof(c->state), "%s", state);
+    snprintf(c->number, sizeof(c->number), "%s", number);
+
+    call_path(path, sizeof(path), mm, id);
+    c->object = mock_export(path, OFONO_SERVICE ".VoiceCall");
+    mock_emit(mm->path, OFONO_SERVICE ".VoiceCallManager", "CallAdded",
+              g_variant_new("(o@a{sv})", path, call_props(c)));
+    return id;
+}
+
+static void mock_modem_add(struct mock_modem *mm)
+{
+    mm->listed = true;
+    mm->object = mock_export(mm->path, OFONO_SERVICE ".VoiceCallManager");
+    mock_emit("/", OFONO_SERVICE ".Manager", "ModemAdded",
+              g_variant_new("(o@a{sv})", mm->path, modem_props(mm)));
+}
+
+static void mock_modem_remove(struct mock_modem *mm)
+{
+    mm->listed = false;
+    g_dbus_connection_unregister_object(mock_bus, mm->object);
+    mock_emit("/", OFONO_SERVICE ".Manager", "ModemRemoved", g_variant_new("(o)", mm->path));
+}
+
+static gboolean tones_played(gpointer data)
+{
+    g_dbus_method_invocation_return_value(data, NULL);
+    return FALSE;
+}
+
+static void mock_method(GDBusConnection *connection, const char *sender, const char *path,
+                        const char *interface, const char *method, GVariant *params,
+                        GDBusMethodInvocation *invocation, gpointer data)
+{
+    struct mock_modem *mm = mock_modem_at(path);
+    const char *number, *digits;
+    GVariantBuilder b;
+    char object[96];
+    int i;
+
+    log_append(requests, "%s %s", method, path);
+
+    if (strcmp(method, "GetModems") == 0) {
+        log_append(requests, "\n");
+        g_variant_builder_init(&b, G_VARIANT_TYPE("a(oa{sv})"));
+        for (i = 0; i < MOCK_MODEMS; i++)
+            if (mock_modems[i].listed)
+                g_variant_builder_add(&b, "(o@a{sv})", mock_modems[i].path,
+                                      modem_props(&mock_modems[i]));
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(oa{sv}))", &b));
+    } else if (strcmp(method, "GetCalls") == 0) {
+        log_append(requests, "\n");
+        g_variant_builder_init(&b, G_VARIANT_TYPE("a(oa{sv})"));
+        for (i = 1; i < MOCK_CALLS; i++) {
+            if (!mm->calls[i].used)
+                continue;
+            call_path(object, sizeof(object), mm, i);
+            g_variant_builder_add(&b, "(o@a{sv})", object, call_props(&mm->calls[i]));
+        }
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(oa{sv}))", &b));
+    } else if (strcmp(method, "Dial") == 0) {
+        g_variant_get(params, "(&s&s)", &number, NULL);
+        log_append(requests, " %s\n", number);
+        i = mock_call_add(mm, "dialing", number);
+        call_path(object, sizeof(object), mm, i);
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", object));
+    } else if (strcmp(method, "HangupAll") == 0) {
+        log_append(requests, "\n");
+        for (i = 1; i < MOCK_CALLS; i++)
+            if (mm->calls[i].used)
+                mock_call_state(mm, i, "disconnected");
+        g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (strcmp(method, "SendTones") == 0) {
+        g_variant_get(params, "(&s)", &digits);
+        log_append(requests, " %s\n", digits);
+        // answered once the tones are played, like ofonod
+        g_timeout_add(MOCK_TONE_MS, tones_played, invocation);
+    } else if (strcmp(method, "Answer") == 0) {
+        log_append(requests, "\n");
+        for (i = 0; i < MOCK_MODEMS; i++)
+            if (strncmp(path, mock_modems[i].path, strlen(mock_modems[i].path)) == 0)
+                mm = &mock_modems[i];
+        g_dbus_method_invocation_return_value(invocation, NULL);
+        mock_call_state(mm, atoi(strrchr(path, '/') + 10), "active");
+    }
+}
+
+static void on_name(GDBusConnection *connection, const char *name, gpointer data)
+{
+    mock_named = true;
+}
+
+static bool mock_start(const char *address)
+{
+    GError *error = NULL;
+
+    mock_info = g_dbus_node_info_new_for_xml(mock_xml, &error);
+    if (mock_info)
+        mock_bus = g_dbus_connection_new_for_address_sync(address,
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error);
+    if (!mock_bus) {
+        fprintf(stderr, "mock ofonod: %s\n", error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    // the first modem is there from the start, for GetModems
+    mock_modems[0].listed = true;
+    mock_modems[0].object = mock_export(mock_modems[0].path, OFONO_SERVICE ".VoiceCallManager");
+    mock_export("/", OFONO_SERVICE ".Manager");
+    g_bus_own_name_on_connection(mock_bus, OFONO_SERVICE, G_BUS_NAME_OWNER_FLAGS_NONE,
+                                 on_name, NULL, NULL, NULL);
+    return true;
+}
+
+/* ---- the dialer side ---- */
+
+static void on_call(const struct call *call, enum call_state old, void *user)
+{
+    log_append(events, "%s: %d %s %s\n", ofono_modem_name(user), call->id,
+               call_state_name(call->state), call->number);
+}
+
+static bool modem_listed(const char *path)
+{
+    char *text = NULL;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    bool listed;
+
+    ofono_dump_stats(out);
+    fclose(out);
+    listed = strstr(text, path) != NULL;
+    free(text);
+    return listed;
+}
+
+int main(int argc, char *argv[])
+{
+    GTestDBus *dbus;
+    int id;
+
+    dbus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(dbus);
+    // ofono.c talks to the system bus
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address(dbus), 1);
+    g_timeout_add(20, wake_up, NULL);
+
+    if (!mock_start(g_test_dbus_get_bus_address(dbus)))
+        return EXIT_FAILURE;
+    while (!mock_named)
+        g_main_context_iteration(NULL, TRUE);
+
+    run_ofono_backend(on_call);
+    check("GetModems, then GetCalls on the voice modem",
+          wait_for(requests, "GetModems /\n") && wait_for(requests, "GetCalls /mock0\n"));
+
+    mock_modem_add(&mock_modems[1]);
+    check("ModemAdded, then GetCalls on it", wait_for(requests, "GetCalls /mock1\n"));
+
+    // an incoming call, answered
+    id = mock_call_add(&mock_modems[0], "incoming", "+5511987654321");
+    check("CallAdded incoming",
+          id == 1 && wait_for(events, "Mock modem 0: 1 incoming +5511987654321\n"));
+    check("Answer goes to the incoming call", ofono_answer() &&
+          wait_for(requests, "Answer /mock0/voicecall01\n"));
+    check("State active", wait_for(events, "Mock modem 0: 1 active +5511987654321\n"));
+
+    // three digits while the first one plays: two SendTones
+    check("DTMF accepted in the active call",
+          ofono_dtmf("1") && ofono_dtmf("2") && ofono_dtmf("3"));
+    check("SendTones 1, then 23 when it is done",
+          wait_for(requests, "SendTones /mock0 1\n") &&
+          wait_for(requests, "SendTones /mock0 23\n") &&
+          count(requests, "SendTones") == 2);
+
+    check("HangupAll", ofono_hangup() && wait_for(requests, "HangupAll /mock0\n"));
+    check("State disconnected", wait_for(events, "Mock modem 0: 1 disconnected"));
+
+    // outgoing ones, each on an idle modem
+    check("Dial", ofono_dial("5551234") && wait_for(requests, "Dial /mock0 5551234\n"));
+    // id 0 until CallAdded names the call
+    check("Dialing right away", strstr(events, "Mock modem 0: 0 dialing 5551234\n") != NULL);
+    mock_call_state(&mock_modems[0], 1, "alerting");
+    mock_call_state(&mock_modems[0], 1, "active");
+    check("CallAdded, then State alerting and active on it",
+          wait_for(events, "Mock modem 0: 1 alerting 5551234\n") &&
+          wait_for(events, "Mock modem 0: 1 active 5551234\n"));
+    check("Dial with the first modem busy goes to the other",
+          ofono_dial("5550000") && wait_for(requests, "Dial /mock1 5550000\n") &&
+          strstr(events, "Mock modem 1: 0 dialing 5550000\n"));
+
+    // the modem goes away with its call
+    mock_modem_remove(&mock_modems[1]);
+    check("ModemRemoved ends its call", wait_for(events, "Mock modem 1: 1 disconnected"));
+    check("ModemRemoved forgets the modem", !modem_listed("/mock1"));
+
+    if (failures)
+        printf("requests:\n%sevents:\n%s", requests, events);
+    printf("ofono: %u of %u checks passed\n", checks - failures, checks);
+    g_test_dbus_down(dbus);
+    return failures;
+}
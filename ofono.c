@@ -0,0 +1,627 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file ofono.c
+ * @brief oFono backend
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "ofono.h"
+#include "daemonize.h"
+
+#define MANAGER_INTERFACE OFONO_SERVICE ".Manager"
+#define MODEM_INTERFACE OFONO_SERVICE ".Modem"
+#define VCM_INTERFACE OFONO_SERVICE ".VoiceCallManager"
+#define CALL_INTERFACE OFONO_SERVICE ".VoiceCall"
+
+#define PATH_MAX_LEN 96
+
+struct ofono_modem {
+    bool present;
+    bool voice;                 /* has a VoiceCallManager */
+    char path[PATH_MAX_LEN];
+    char name[64];
+    struct call_table calls;
+    char dtmf[DTMF_MAX + 1];    /* digits for the next SendTones */
+    bool dtmf_busy;             /* SendTones in flight */
+
+    /* statistics */
+    unsigned long long dials;
+    unsigned long long tones;   /* SendTones calls */
+    unsigned long long failed;  /* method calls that returned an error */
+    unsigned long long signals;
+};
+
+static GDBusConnection *bus;
+static struct ofono_modem modems[OFONO_MODEMS_MAX];
+static call_event_cb call_listener;
+static unsigned int next_dial;
+
+static struct ofono_modem *find_modem(const char *path)
+{
+    int i;
+
+    for (i = 0; i < OFONO_MODEMS_MAX; i++)
+        if (modems[i].present && strcmp(modems[i].path, path) == 0)
+            return &modems[i];
+    return NULL;
+}
+
+/* the modem a call object belongs to, /phonesim/voicecall01 -> /phonesim */
+static struct ofono_modem *find_call_modem(const char *call_path, int *id)
+{
+    const char *slash = strrchr(call_path, '/');
+    char path[PATH_MAX_LEN];
+    size_t len;
+
+    if (!slash || strncmp(slash, "/voicecall", 10) != 0)
+        return NULL;
+    len = slash - call_path;
+    if (len == 0 || len >= sizeof(path))
+        return NULL;
+    memcpy(path, call_path, len);
+    path[len] = 0;
+
+    *id = atoi(slash + 10);
+    if (*id < 1 || *id >= CALL_MAX) {
+        log_message(LOG_FILE, "oFono call id out of range, ignored\n");
+        return NULL;
+    }
+    return find_modem(path);
+}
+
+static enum call_state parse_state(const char *state)
+{
+    static const char *names[] = {
+        "active", "held", "dialing", "alerting", "incoming", "waiting", "disconnected",
+    };
+    int i;
+
+    for (i = 0; i <= CALL_DISCONNECTED; i++)
+        if (strcmp(state, names[i]) == 0)
+            return i;
+    return CALL_IDLE;
+}
+
+static void log_error(const char *what, const struct ofono_modem *m, GError *error)
+{
+    char msg[256];
+
+    snprintf(msg, sizeof(msg), "%s: %s failed: %s\n", m ? m->name : "oFono", what,
+             error->message);
+    log_message(LOG_FILE, msg);
+}
+
+/* State and LineIdentification of one call, from CallAdded, GetCalls or
+ * PropertyChanged */
+static void update_call(struct ofono_modem *m, int id, GVariant *props)
+{
+    const struct call *c = &m->calls.calls[id];
+    const char *state_name = NULL, *number = NULL;
+    enum call_state state;
+    bool outgoing;
+
+    g_variant_lookup(props, "State", "&s", &state_name);
+    g_variant_lookup(props, "LineIdentification", "&s", &number);
+
+    if (state_name)
+        state = parse_state(state_name);
+    else if (m->calls.used & (1u << id))
+        state = c->state;
+    else
+        return;
+    if (state == CALL_IDLE)
+        return;
+
+    // a call keeps its direction, a new one is ours while it is being set up
+    if (m->calls.used & (1u << id))
+        outgoing = c->outgoing;
+    else
+        outgoing = state == CALL_DIALING || state == CALL_ALERTING;
+    call_update(&m->calls, id, outgoing, state, number && number[0] ? number : NULL);
+}
+
+static void drop_calls(struct ofono_modem *m)
+{
+    call_hungup(&m->calls);
+}
+
+static void on_get_calls(GObject *source, GAsyncResult *res, gpointer data)
+{
+    char *path = data;
+    struct ofono_modem *m = find_modem(path);
+    GError *error = NULL;
+    GVariant *reply, *props;
+    GVariantIter *iter;
+    const char *call_path;
+    int id;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (!reply) {
+        if (m)
+            m->failed++;
+        log_error("GetCalls", m, error);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+
+    g_variant_get(reply, "(a(oa{sv}))", &iter);
+    while (g_variant_iter_loop(iter, "(&o@a{sv})", &call_path, &props))
+        if (m && find_call_modem(call_path, &id) == m)
+            update_call(m, id, props);
+    g_variant_iter_free(iter);
+    g_variant_unref(reply);
+    g_free(path);
+}
+
+static void set_voice(struct ofono_modem *m, bool voice)
+{
+    char msg[128];
+
+    if (voice == m->voice)
+        return;
+    m->voice = voice;
+    snprintf(msg, sizeof(msg), "%s: voice calls %s\n", m->name, voice ? "available" : "gone");
+    log_message(LOG_FILE, msg);
+
+    if (!voice) {
+        drop_calls(m);
+        return;
+    }
+    // calls that were there before we looked
+    g_dbus_connection_call(bus, OFONO_SERVICE, m->path, VCM_INTERFACE, "GetCalls", NULL,
+                           G_VARIANT_TYPE("(a(oa{sv}))"), G_DBUS_CALL_FLAGS_NONE,
+                           OFONO_TIMEOUT_MS, NULL, on_get_calls, g_strdup(m->path));
+}
+
+static bool has_voice(GVariant *interfaces)
+{
+    GVariantIter iter;
+    const char *name;
+
+    g_variant_iter_init(&iter, interfaces);
+    while (g_variant_iter_next(&iter, "&s", &name))
+        if (strcmp(name, VCM_INTERFACE) == 0)
+            return true;
+    return false;
+}
+
+static void modem_property(struct ofono_modem *m, const char *name, GVariant *value)
+{
+    if (strcmp(name, "Name") == 0 && g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+        snprintf(m->name, sizeof(m->name), "%s", g_variant_get_string(value, NULL));
+    else if (strcmp(name, "Interfaces") == 0 && g_variant_is_of_type(value, G_VARIANT_TYPE("as")))
+        set_voice(m, has_voice(value));
+}
+
+static void modem_added(const char *path, GVariant *props)
+{
+    struct ofono_modem *m = find_modem(path);
+    GVariantIter iter;
+    const char *name;
+    GVariant *value;
+    char msg[160];
+    int i;
+
+    if (!m) {
+        for (i = 0; i < OFONO_MODEMS_MAX && modems[i].present; i++)
+            ;
+        if (i == OFONO_MODEMS_MAX) {
+            log_message(LOG_FILE, "Too many oFono modems, ignoring one\n");
+            return;
+        }
+        m = &modems[i];
+        memset(m, 0, sizeof(*m));
+        m->present = true;
+        snprintf(m->path, sizeof(m->path), "%s", path);
+        snprintf(m->name, sizeof(m->name), "%s", path);
+        call_table_init(&m->calls, call_listener, m);
+
+        snprintf(msg, sizeof(msg), "oFono modem %s\n", path);
+        log_message(LOG_FILE, msg);
+    }
+
+    g_variant_iter_init(&iter, props);
+    while (g_variant_iter_loop(&iter, "{&sv}", &name, &value))
+        modem_property(m, name, value);
+}
+
+static void modem_removed(struct ofono_modem *m)
+{
+    char msg[160];
+
+    snprintf(msg, sizeof(msg), "oFono modem %s gone\n", m->path);
+    log_message(LOG_FILE, msg);
+    drop_calls(m);
+    m->present = false;
+}
+
+static void on_get_modems(GObject *source, GAsyncResult *res, gpointer data)
+{
+    GError *error = NULL;
+    GVariant *reply, *props;
+    GVariantIter *iter;
+    const char *path;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (!reply) {
+        log_error("GetModems", NULL, error);
+        g_error_free(error);
+        return;
+    }
+
+    g_variant_get(reply, "(a(oa{sv}))", &iter);
+    while (g_variant_iter_loop(iter, "(&o@a{sv})", &path, &props))
+        modem_added(path, props);
+    g_variant_iter_free(iter);
+    g_variant_unref(reply);
+}
+
+// one handler for everything ofonod broadcasts
+static void on_signal(GDBusConnection *connection, const char *sender, const char *path,
+                      const char *interface, const char *member, GVariant *params,
+                      gpointer data)
+{
+    struct ofono_modem *m;
+    const char *object, *name;
+    GVariant *props, *value;
+    int id;
+
+    if (strcmp(interface, MANAGER_INTERFACE) == 0) {
+        if (strcmp(member, "ModemAdded") == 0 &&
+            g_variant_is_of_type(params, G_VARIANT_TYPE("(oa{sv})"))) {
+            g_variant_get(params, "(&o@a{sv})", &object, &props);
+            modem_added(object, props);
+            g_variant_unref(props);
+        } else if (strcmp(member, "ModemRemoved") == 0 &&
+                   g_variant_is_of_type(params, G_VARIANT_TYPE("(o)"))) {
+            g_variant_get(params, "(&o)", &object);
+            if ((m = find_modem(object)))
+                modem_removed(m);
+        }
+        return;
+    }
+
+    if (strcmp(interface, CALL_INTERFACE) == 0) {
+        if (strcmp(member, "PropertyChanged") != 0 ||
+            !g_variant_is_of_type(params, G_VARIANT_TYPE("(sv)")) ||
+            !(m = find_call_modem(path, &id)))
+            return;
+        m->signals++;
+        g_variant_get(params, "(&sv)", &name, &value);
+        // the same lookup as for a whole property dictionary
+        props = g_variant_new_parsed("{%s: %v}", name, value);
+        g_variant_ref_sink(props);
+        update_call(m, id, props);
+        g_variant_unref(props);
+        g_variant_unref(value);
+        return;
+    }
+
+    if (!(m = find_modem(path)))
+        return;
+    m->signals++;
+
+    if (strcmp(interface, MODEM_INTERFACE) == 0) {
+        if (strcmp(member, "PropertyChanged") == 0 &&
+            g_variant_is_of_type(params, G_VARIANT_TYPE("(sv)"))) {
+            g_variant_get(params, "(&sv)", &name, &value);
+            modem_property(m, name, value);
+            g_variant_unref(value);
+        }
+    } else if (strcmp(interface, VCM_INTERFACE) == 0) {
+        if (strcmp(member, "CallAdded") == 0 &&
+            g_variant_is_of_type(params, G_VARIANT_TYPE("(oa{sv})"))) {
+            g_variant_get(params, "(&o@a{sv})", &object, &props);
+            if (find_call_modem(object, &id) == m)
+                update_call(m, id, props);
+            g_variant_unref(props);
+        } else if (strcmp(member, "CallRemoved") == 0 &&
+                   g_variant_is_of_type(params, G_VARIANT_TYPE("(o)"))) {
+            g_variant_get(params, "(&o)", &object);
+            // normally already reported by State "disconnected"
+            if (find_call_modem(object, &id) == m)
+                call_update(&m->calls, id, m->calls.calls[id].outgoing, CALL_DISCONNECTED, NULL);
+        }
+    }
+}
+
+static void ofono_appeared(GDBusConnection *connection, const char *name, const char *owner,
+                           gpointer data)
+{
+    log_message(LOG_FILE, "oFono is running\n");
+    g_dbus_connection_call(bus, OFONO_SERVICE, "/", MANAGER_INTERFACE, "GetModems", NULL,
+                           G_VARIANT_TYPE("(a(oa{sv}))"), G_DBUS_CALL_FLAGS_NONE,
+                           OFONO_TIMEOUT_MS, NULL, on_get_modems, NULL);
+}
+
+// ofonod restarted or stopped: its modems and calls went with it
+static void ofono_vanished(GDBusConnection *connection, const char *name, gpointer data)
+{
+    int i;
+
+    for (i = 0; i < OFONO_MODEMS_MAX; i++)
+        if (modems[i].present)
+            modem_removed(&modems[i]);
+    if (connection)
+        log_message(LOG_FILE, "oFono is not running\n");
+}
+
+static void on_bus(GObject *source, GAsyncResult *res, gpointer data)
+{
+    GError *error = NULL;
+
+    bus = g_bus_get_finish(res, &error);
+    if (!bus) {
+        log_error("Connecting to the system bus", NULL, error);
+        g_error_free(error);
+        return;
+    }
+
+    // subscribe before asking, so no change falls in between
+    g_dbus_connection_signal_subscribe(bus, OFONO_SERVICE, NULL, NULL, NULL, NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE, on_signal, NULL, NULL);
+    g_bus_watch_name_on_connection(bus, OFONO_SERVICE, G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                   ofono_appeared, ofono_vanished, NULL, NULL);
+}
+
+bool run_ofono_backend(call_event_cb on_call)
+{
+    log_message(LOG_FILE, "Starting oFono backend\n");
+    call_listener = on_call;
+    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, on_bus, NULL);
+    return true;
+}
+
+static void on_dial(GObject *source, GAsyncResult *res, gpointer data)
+{
+    char *path = data;
+    struct ofono_modem *m = find_modem(path);
+    GError *error = NULL;
+    GVariant *reply;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply) {
+        // the call itself shows up with CallAdded
+        g_variant_unref(reply);
+    } else {
+        log_error("Dial", m, error);
+        g_error_free(error);
+        if (m) {
+            m->failed++;
+            call_dial_failed(&m->calls);
+        }
+    }
+    g_free(path);
+}
+
+static void on_call_control(GObject *source, GAsyncResult *res, gpointer data)
+{
+    char *path = data;
+    struct ofono_modem *m = find_modem(path);
+    const char *what = path + strlen(path) + 1;
+    GError *error = NULL;
+    GVariant *reply;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply) {
+        if (m && strcmp(what, "HangupAll") == 0)
+            call_hungup(&m->calls);
+        g_variant_unref(reply);
+    } else {
+        log_error(what, m, error);
+        g_error_free(error);
+        if (m)
+            m->failed++;
+    }
+    g_free(path);
+}
+
+/* modem path and method name in one allocation, for on_call_control() */
+static char *control_data(const struct ofono_modem *m, const char *method)
+{
+    size_t len = strlen(m->path) + 1;
+    char *data = g_malloc(len + strlen(method) + 1);
+
+    memcpy(data, m->path, len);
+    strcpy(data + len, method);
+    return data;
+}
+
+static struct ofono_modem *pick_idle_modem(void)
+{
+    struct ofono_modem *m;
+    int i;
+
+    for (i = 0; i < OFONO_MODEMS_MAX; i++) {
+        m = &modems[(next_dial + i) % OFONO_MODEMS_MAX];
+        if (m->present && m->voice && call_count(&m->calls) == 0) {
+            next_dial = (m - modems) + 1;
+            return m;
+        }
+    }
+    return NULL;
+}
+
+bool ofono_dial(const char *number)
+{
+    struct ofono_modem *m;
+
+    if (!bus)
+        return false;
+    m = pick_idle_modem();
+    if (!m) {
+        log_message(LOG_FILE, "No idle oFono modem with voice calls\n");
+        return false;
+    }
+
+    m->dials++;
+    call_dialing(&m->calls, number);
+    // "" leaves caller id to the network default
+    g_dbus_connection_call(bus, OFONO_SERVICE, m->path, VCM_INTERFACE, "Dial",
+                           g_variant_new("(ss)", number, ""), G_VARIANT_TYPE("(o)"),
+                           G_DBUS_CALL_FLAGS_NONE, OFONO_TIMEOUT_MS, NULL, on_dial,
+                           g_strdup(m->path));
+    return true;
+}
+
+bool ofono_answer(void)
+{
+    char call_path[PATH_MAX_LEN + 16];
+    const struct call *c;
+    int i;
+
+    if (!bus)
+        return false;
+    for (i = 0; i < OFONO_MODEMS_MAX; i++) {
+        if (!modems[i].present || !(c = call_find(&modems[i].calls, CALL_INCOMING)) || c->id == 0)
+            continue;
+        snprintf(call_path, sizeof(call_path), "%s/voicecall%02d", modems[i].path, c->id);
+        g_dbus_connection_call(bus, OFONO_SERVICE, call_path, CALL_INTERFACE, "Answer", NULL,
+                               NULL, G_DBUS_CALL_FLAGS_NONE, OFONO_TIMEOUT_MS, NULL,
+                               on_call_control, control_data(&modems[i], "Answer"));
+        return true;
+    }
+    return false;
+}
+
+bool ofono_hangup(void)
+{
+    bool res = false;
+    int i;
+
+    if (!bus)
+        return false;
+    for (i = 0; i < OFONO_MODEMS_MAX; i++) {
+        if (!modems[i].present || call_count(&modems[i].calls) == 0)
+            continue;
+        g_dbus_connection_call(bus, OFONO_SERVICE, modems[i].path, VCM_INTERFACE, "HangupAll",
+                               NULL, NULL, G_DBUS_CALL_FLAGS_NONE, OFONO_TIMEOUT_MS, NULL,
+                               on_call_control, control_data(&modems[i], "HangupAll"));
+        res = true;
+    }
+    return res;
+}
+
+static void dtmf_flush(struct ofono_modem *m);
+
+static void on_send_tones(GObject *source, GAsyncResult *res, gpointer data)
+{
+    char *path = data;
+    struct ofono_modem *m = find_modem(path);
+    GError *error = NULL;
+    GVariant *reply;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply) {
+        g_variant_unref(reply);
+    } else {
+        log_error("SendTones", m, error);
+        g_error_free(error);
+        if (m)
+            m->failed++;
+    }
+    if (m) {
+        m->dtmf_busy = false;
+        dtmf_flush(m);
+    }
+    g_free(path);
+}
+
+// what was pressed while the last SendTones was played, in one call
+static void dtmf_flush(struct ofono_modem *m)
+{
+    if (!m->dtmf[0])
+        return;
+    m->tones++;
+    m->dtmf_busy = true;
+    g_dbus_connection_call(bus, OFONO_SERVICE, m->path, VCM_INTERFACE, "SendTones",
+                           g_variant_new("(s)", m->dtmf), NULL, G_DBUS_CALL_FLAGS_NONE,
+                           OFONO_TIMEOUT_MS, NULL, on_send_tones, g_strdup(m->path));
+    m->dtmf[0] = 0;
+}
+
+bool ofono_dtmf(const char *digits)
+{
+    struct ofono_modem *m = NULL;
+    size_t len;
+    int i;
+
+    if (!bus || digits[strspn(digits, DTMF_DIGITS)] != 0)
+        return false;
+    for (i = 0; i < OFONO_MODEMS_MAX && !m; i++)
+        if (modems[i].present && call_find(&modems[i].calls, CALL_ACTIVE))
+            m = &modems[i];
+    if (!m)
+        return false;
+
+    len = strlen(m->dtmf);
+    if (len + strlen(digits) > DTMF_MAX) {
+        log_message(LOG_FILE, "DTMF digits dropped, too many waiting\n");
+        return true;
+    }
+    strcpy(m->dtmf + len, digits);
+    if (!m->dtmf_busy)
+        dtmf_flush(m);
+    return true;
+}
+
+const char *ofono_modem_name(const struct ofono_modem *m)
+{
+    return m ? m->name : "?";
+}
+
+void ofono_dump_stats(FILE *out)
+{
+    int i;
+
+    for (i = 0; i < OFONO_MODEMS_MAX; i++)
+        if (modems[i].present)
+            fprintf(out, "%s (oFono %s): %s; %llu signals; %llu dials, %llu SendTones, "
+                    "%llu requests failed; %u calls\n", modems[i].name, modems[i].path,
+                    modems[i].voice ? "voice" : "no voice", modems[i].signals,
+                    modems[i].dials, modems[i].tones, modems[i].failed,
+                    call_count(&modems[i].calls));
+}
+
+static const char *modem_name(const void *user)
+{
+    return ofono_modem_name(user);
+}
+
+const struct backend_ops ofono_backend = {
+    .name = "ofono",
+    .dial = ofono_dial,
+    .answer = ofono_answer,
+    .hangup = ofono_hangup,
+    .dtmf = ofono_dtmf,
+    .modem_name = modem_name,
+    .dump_stats = ofono_dump_stats,
+};
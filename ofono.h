@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file ofono.h
+ * @brief oFono backend
+ *
+ * Call control through ofonod instead of the AT port, so the port
+ * doesn't have to be shared with it. Every D-Bus call is asynchronous and
+ * call state comes from the VoiceCallManager and VoiceCall signals, fed
+ * to the same call table the AT backend keeps (voicecallNN in the object
+ * path is the call id), so the UI can't tell the backends apart.
+ *
+ * The system bus is used; DBUS_SYSTEM_BUS_ADDRESS points it elsewhere,
+ * e.g. at a private bus with ofonod and phonesim on it.
+ *
+ */
+
+#ifndef HAVE_OFONO_H__
+#define HAVE_OFONO_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "backend.h"
+#include "call.h"
+
+#define OFONO_SERVICE "org.ofono"
+#define OFONO_TIMEOUT_MS 30000
+#define OFONO_MODEMS_MAX 8
+
+struct ofono_modem;
+
+/* Connect to the bus and follow every modem with voice calls. Returns
+ * right away, modems show up as ofonod reports them. on_call gets the
+ * ofono_modem as user. */
+bool run_ofono_backend(call_event_cb on_call);
+
+bool ofono_dial(const char *number);
+bool ofono_answer(void);
+bool ofono_hangup(void);
+/* SendTones, digits pressed while one is played go in the next */
+bool ofono_dtmf(const char *digits);
+
+const char *ofono_modem_name(const struct ofono_modem *m);
+void ofono_dump_stats(FILE *out);
+
+#endif /* HAVE_OFONO_H__ */
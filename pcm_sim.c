@@ -0,0 +1,583 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file pcm_sim.c
+ * @brief Fake ALSA playback PCM
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <alsa/asoundlib.h>
+
+#include "pcm_sim.h"
+
+// hw and sw params are only handed back to us, their contents don't matter
+#define PARAMS_SIZE 64
+
+static struct pcm_sim_config cfg = { true, true, true, 48000, 2, 0 };
+
+// the one device; the playback thread runs it while the test reads the
+// statistics and pulls the plug, so the calls take the lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    bool open;
+    snd_pcm_state_t state;
+    bool mmap;
+    bool s32;
+    unsigned int channels;
+    snd_pcm_uframes_t period;
+    snd_pcm_uframes_t buffer;
+    snd_pcm_uframes_t start_threshold;
+    snd_pcm_uframes_t avail_min;
+    char *ring;
+    snd_pcm_channel_area_t area;
+
+    uint64_t hw;                    /* frames played */
+    uint64_t appl;                  /* frames committed */
+    uint64_t clock_ns;              /* hw is as of then */
+    bool xrun_next;
+    bool negative;                  /* last left sample, for crossings */
+    bool zero;                      /* and for silence */
+    uint64_t drop_ns;
+    struct pcm_sim_stats stats;
+} pcm;
+
+uint64_t pcm_sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t frame_bytes(void)
+{
+    return pcm.channels * (pcm.s32 ? 4 : 2);
+}
+
+// the hardware pointer, moved on to now; caller holds the lock
+static void tick(void)
+{
+    uint64_t now = pcm_sim_now_ns();
+    uint64_t played;
+
+    if (pcm.state != SND_PCM_STATE_RUNNING) {
+        pcm.clock_ns = now;
+        return;
+    }
+    played = (now - pcm.clock_ns) * cfg.rate / 1000000000ull;
+    if (!played)
+        return;
+    pcm.clock_ns += played * 1000000000ull / cfg.rate;
+    pcm.hw += played;
+    if (pcm.hw >= pcm.appl || pcm.xrun_next) {
+        pcm.hw = pcm.appl;
+        pcm.xrun_next = false;
+        pcm.state = SND_PCM_STATE_XRUN;
+        pcm.stats.xruns++;
+    }
+}
+
+static snd_pcm_uframes_t room(void)
+{
+    return pcm.buffer - (pcm.appl - pcm.hw);
+}
+
+// frames as they go into the buffer: is it sound, and the left channel's
+// zero crossings
+static void look_at(const char *data, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+    int32_t left;
+    bool negative;
+
+    for (i = 0; i < frames; i++, data += frame_bytes()) {
+        if (pcm.s32)
+            memcpy(&left, data, 4);
+        else
+            left = (int16_t) ((data[0] & 0xff) | (data[1] << 8));
+        // a tone passes through 0 now and then, silence stays there
+        if (left || !pcm.zero)
+            pcm.stats.sound++;
+        pcm.zero = !left;
+        negative = left < 0;
+        if (pcm.negative && !negative)
+            pcm.stats.crossings++;
+        pcm.negative = negative;
+    }
+    pcm.stats.frames += frames;
+}
+
+static void commit(snd_pcm_uframes_t frames)
+{
+    pcm.appl += frames;
+    if (pcm.state == SND_PCM_STATE_PREPARED && pcm.appl - pcm.hw >= pcm.start_threshold) {
+        pcm.state = SND_PCM_STATE_RUNNING;
+        pcm.clock_ns = pcm_sim_now_ns();
+    }
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+
+    nanosleep(&ts, NULL);
+}
+
+// how long until the card has played out enough for frames of room
+static uint64_t wait_ns(snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t have = room();
+
+    if (have >= frames)
+        return 0;
+    return (uint64_t) (frames - have) * 1000000000ull / cfg.rate + 1000;
+}
+
+void pcm_sim_default_config(struct pcm_sim_config *c)
+{
+    c->mmap = true;
+    c->s16 = true;
+    c->s32 = true;
+    c->rate = 48000;
+    c->channels = 2;
+    c->max_period = 0;
+}
+
+void pcm_sim_setup(const struct pcm_sim_config *c)
+{
+    pthread_mutex_lock(&lock);
+    cfg = *c;
+    pthread_mutex_unlock(&lock);
+}
+
+void pcm_sim_stats(struct pcm_sim_stats *s)
+{
+    pthread_mutex_lock(&lock);
+    *s = pcm.stats;
+    s->period = pcm.period;
+    s->buffer = pcm.buffer;
+    s->s32 = pcm.s32;
+    s->mmap = pcm.mmap;
+    pthread_mutex_unlock(&lock);
+}
+
+void pcm_sim_xrun(void)
+{
+    pthread_mutex_lock(&lock);
+    pcm.xrun_next = true;
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t pcm_sim_last_drop_ns(void)
+{
+    uint64_t ns;
+
+    pthread_mutex_lock(&lock);
+    ns = pcm.drop_ns;
+    pthread_mutex_unlock(&lock);
+    return ns;
+}
+
+/* ---- the ALSA calls ---- */
+
+int snd_pcm_open(snd_pcm_t **handle, const char *name, snd_pcm_stream_t stream, int mode)
+{
+    pthread_mutex_lock(&lock);
+    if (pcm.open || stream != SND_PCM_STREAM_PLAYBACK) {
+        pthread_mutex_unlock(&lock);
+        return -EBUSY;
+    }
+    memset(&pcm, 0, sizeof(pcm));
+    pcm.open = true;
+    pcm.state = SND_PCM_STATE_OPEN;
+    pcm.mmap = cfg.mmap;
+    pcm.s32 = !cfg.s16;
+    pcm.channels = cfg.channels;
+    pcm.stats.opens = 1;
+    pthread_mutex_unlock(&lock);
+    *handle = (snd_pcm_t *) &pcm;
+    return 0;
+}
+
+int snd_pcm_close(snd_pcm_t *handle)
+{
+    pthread_mutex_lock(&lock);
+    free(pcm.ring);
+    pcm.ring = NULL;
+    pcm.open = false;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+size_t snd_pcm_hw_params_sizeof(void)
+{
+    return PARAMS_SIZE;
+}
+
+size_t snd_pcm_sw_params_sizeof(void)
+{
+    return PARAMS_SIZE;
+}
+
+int snd_pcm_hw_params_any(snd_pcm_t *handle, snd_pcm_hw_params_t *params)
+{
+    return 0;
+}
+
+int snd_pcm_hw_params_set_rate_resample(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                        unsigned int val)
+{
+    return 0;
+}
+
+int snd_pcm_hw_params_set_access(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                 snd_pcm_access_t access)
+{
+    if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        return cfg.mmap ? 0 : -EINVAL;
+    if (access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+        pcm.mmap = false;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int snd_pcm_hw_params_test_format(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                  snd_pcm_format_t format)
+{
+    if ((format == SND_PCM_FORMAT_S16_LE && cfg.s16) ||
+        (format == SND_PCM_FORMAT_S32_LE && cfg.s32))
+        return 0;
+    return -EINVAL;
+}
+
+int snd_pcm_hw_params_set_format(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                 snd_pcm_format_t format)
+{
+    if (snd_pcm_hw_params_test_format(handle, params, format) < 0)
+        return -EINVAL;
+    pcm.s32 = format == SND_PCM_FORMAT_S32_LE;
+    return 0;
+}
+
+int snd_pcm_hw_params_set_channels(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                   unsigned int val)
+{
+    return val == cfg.channels ? 0 : -EINVAL;
+}
+
+int snd_pcm_hw_params_set_channels_near(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                        unsigned int *val)
+{
+    *val = cfg.channels;
+    return 0;
+}
+
+int snd_pcm_hw_params_set_rate_near(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                    unsigned int *val, int *dir)
+{
+    *val = cfg.rate;
+    return 0;
+}
+
+int snd_pcm_hw_params_set_period_size_near(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                           snd_pcm_uframes_t *val, int *dir)
+{
+    if (cfg.max_period && *val > cfg.max_period)
+        *val = cfg.max_period;
+    pcm.period = *val;
+    return 0;
+}
+
+int snd_pcm_hw_params_set_buffer_size_near(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+                                           snd_pcm_uframes_t *val)
+{
+    // whole periods, at least two
+    if (*val < 2 * pcm.period)
+        *val = 2 * pcm.period;
+    *val -= *val % pcm.period;
+    pcm.buffer = *val;
+    return 0;
+}
+
+int snd_pcm_hw_params(snd_pcm_t *handle, snd_pcm_hw_params_t *params)
+{
+    pthread_mutex_lock(&lock);
+    if (!pcm.period)
+        pcm.period = cfg.rate / 100;
+    if (!pcm.buffer)
+        pcm.buffer = 4 * pcm.period;
+    pcm.ring = calloc(pcm.buffer, frame_bytes());
+    pcm.area.addr = pcm.ring;
+    pcm.area.first = 0;
+    pcm.area.step = frame_bytes() * 8;
+    pcm.start_threshold = pcm.avail_min = pcm.period;
+    pcm.state = SND_PCM_STATE_PREPARED;
+    pthread_mutex_unlock(&lock);
+    return pcm.ring ? 0 : -ENOMEM;
+}
+
+int snd_pcm_hw_params_get_period_size(const snd_pcm_hw_params_t *params,
+                                      snd_pcm_uframes_t *val, int *dir)
+{
+    *val = pcm.period;
+    return 0;
+}
+
+int snd_pcm_hw_params_get_buffer_size(const snd_pcm_hw_params_t *params,
+                                      snd_pcm_uframes_t *val)
+{
+    *val = pcm.buffer;
+    return 0;
+}
+
+int snd_pcm_sw_params_current(snd_pcm_t *handle, snd_pcm_sw_params_t *params)
+{
+    return 0;
+}
+
+int snd_pcm_sw_params_set_start_threshold(snd_pcm_t *handle, snd_pcm_sw_params_t *params,
+                                          snd_pcm_uframes_t val)
+{
+    pcm.start_threshold = val;
+    return 0;
+}
+
+int snd_pcm_sw_params_set_avail_min(snd_pcm_t *handle, snd_pcm_sw_params_t *params,
+                                    snd_pcm_uframes_t val)
+{
+    pcm.avail_min = val;
+    return 0;
+}
+
+int snd_pcm_sw_params(snd_pcm_t *handle, snd_pcm_sw_params_t *params)
+{
+    return 0;
+}
+
+snd_pcm_state_t snd_pcm_state(snd_pcm_t *handle)
+{
+    snd_pcm_state_t state;
+
+    pthread_mutex_lock(&lock);
+    tick();
+    state = pcm.state;
+    pthread_mutex_unlock(&lock);
+    return state;
+}
+
+int snd_pcm_prepare(snd_pcm_t *handle)
+{
+    pthread_mutex_lock(&lock);
+    pcm.hw = pcm.appl;
+    pcm.state = SND_PCM_STATE_PREPARED;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int snd_pcm_start(snd_pcm_t *handle)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&lock);
+    if (pcm.state != SND_PCM_STATE_PREPARED || pcm.appl == pcm.hw) {
+        rc = -EBADFD;
+    } else {
+        pcm.state = SND_PCM_STATE_RUNNING;
+        pcm.clock_ns = pcm_sim_now_ns();
+    }
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int snd_pcm_drop(snd_pcm_t *handle)
+{
+    pthread_mutex_lock(&lock);
+    pcm.hw = pcm.appl;
+    pcm.state = SND_PCM_STATE_SETUP;
+    pcm.stats.drops++;
+    pcm.drop_ns = pcm_sim_now_ns();
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int snd_pcm_drain(snd_pcm_t *handle)
+{
+    uint64_t ns;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        tick();
+        if (pcm.state != SND_PCM_STATE_RUNNING)
+            break;
+        ns = (pcm.appl - pcm.hw) * 1000000000ull / cfg.rate + 1000;
+        pthread_mutex_unlock(&lock);
+        sleep_ns(ns);
+        pthread_mutex_lock(&lock);
+    }
+    pcm.state = SND_PCM_STATE_SETUP;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int snd_pcm_resume(snd_pcm_t *handle)
+{
+    return -ENOSYS;
+}
+
+int snd_pcm_recover(snd_pcm_t *handle, int err, int silent)
+{
+    if (err != -EPIPE && err != -ESTRPIPE)
+        return err;
+    return snd_pcm_prepare(handle);
+}
+
+int snd_pcm_delay(snd_pcm_t *handle, snd_pcm_sframes_t *delay)
+{
+    pthread_mutex_lock(&lock);
+    tick();
+    *delay = pcm.appl - pcm.hw;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *handle)
+{
+    snd_pcm_sframes_t avail;
+
+    pthread_mutex_lock(&lock);
+    tick();
+    avail = pcm.state == SND_PCM_STATE_XRUN ? -EPIPE : (snd_pcm_sframes_t) room();
+    pthread_mutex_unlock(&lock);
+    return avail;
+}
+
+// sleeps until avail_min frames are free, like poll() on the card
+int snd_pcm_wait(snd_pcm_t *handle, int timeout)
+{
+    uint64_t ns;
+
+    pthread_mutex_lock(&lock);
+    pcm.stats.waits++;
+    for (;;) {
+        tick();
+        if (pcm.state == SND_PCM_STATE_XRUN) {
+            pthread_mutex_unlock(&lock);
+            return -EPIPE;
+        }
+        ns = wait_ns(pcm.avail_min);
+        if (!ns || pcm.state != SND_PCM_STATE_RUNNING)
+            break;
+        pthread_mutex_unlock(&lock);
+        sleep_ns(ns);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+int snd_pcm_mmap_begin(snd_pcm_t *handle, const snd_pcm_channel_area_t **areas,
+                       snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames)
+{
+    snd_pcm_uframes_t n;
+
+    pthread_mutex_lock(&lock);
+    if (!pcm.mmap) {
+        pthread_mutex_unlock(&lock);
+        return -ENXIO;
+    }
+    *areas = &pcm.area;
+    *offset = pcm.appl % pcm.buffer;
+    // up to the end of the buffer, then the caller comes back for the rest
+    n = pcm.buffer - *offset;
+    if (n > room())
+        n = room();
+    if (*frames > n)
+        *frames = n;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *handle, snd_pcm_uframes_t offset,
+                                      snd_pcm_uframes_t frames)
+{
+    pthread_mutex_lock(&lock);
+    tick();
+    if (pcm.state == SND_PCM_STATE_XRUN) {
+        pthread_mutex_unlock(&lock);
+        return -EPIPE;
+    }
+    pcm.stats.commits++;
+    look_at(pcm.ring + offset * frame_bytes(), frames);
+    commit(frames);
+    pthread_mutex_unlock(&lock);
+    return frames;
+}
+
+// blocks until all of it is in, like a write() to the card
+snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *handle, const void *buffer,
+                                 snd_pcm_uframes_t size)
+{
+    const char *data = buffer;
+    snd_pcm_uframes_t left = size, n, offset;
+    uint64_t ns;
+
+    pthread_mutex_lock(&lock);
+    pcm.stats.writes++;
+    while (left) {
+        tick();
+        if (pcm.state == SND_PCM_STATE_XRUN) {
+            pthread_mutex_unlock(&lock);
+            return -EPIPE;
+        }
+        n = room() < left ? room() : left;
+        if (!n) {
+            // full and not started: start it, as the start threshold would
+            if (pcm.state == SND_PCM_STATE_PREPARED) {
+                pcm.state = SND_PCM_STATE_RUNNING;
+                pcm.clock_ns = pcm_sim_now_ns();
+            }
+            ns = wait_ns(left < pcm.avail_min ? left : pcm.avail_min);
+            pthread_mutex_unlock(&lock);
+            sleep_ns(ns);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+        offset = pcm.appl % pcm.buffer;
+        if (n > pcm.buffer - offset)
+            n = pcm.buffer - offset;
+        memcpy(pcm.ring + offset * frame_bytes(), data, n * frame_bytes());
+        look_at(data, n);
+        commit(n);
+        data += n * frame_bytes();
+        left -= n;
+    }
+    pthread_mutex_unlock(&lock);
+    return size;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file pcm_sim.h
+ * @brief Fake ALSA playback PCM
+ *
+ * The snd_pcm_* calls ring-audio.c makes, linked instead of libasound.
+ * There is one device: a ring buffer the hardware pointer moves through
+ * at the configured rate by CLOCK_MONOTONIC, starting at the start
+ * threshold (or snd_pcm_start()) and going to XRUN when it catches up
+ * with the application, like a card. It can offer mmap or only write(),
+ * S16_LE, S32_LE or both, and be made to under run on purpose.
+ *
+ * What was played is looked at as it is committed: transfers, waits,
+ * frames that weren't silence, the frequency of the left channel (zero
+ * crossings) and when the last drop came.
+ *
+ */
+
+#ifndef HAVE_PCM_SIM_H__
+#define HAVE_PCM_SIM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct pcm_sim_config {
+    bool mmap;                      /* MMAP_INTERLEAVED, else RW only */
+    bool s16;                       /* formats offered */
+    bool s32;
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int max_period;        /* frames, 0: whatever is asked */
+};
+
+struct pcm_sim_stats {
+    unsigned long opens;
+    unsigned long commits;          /* snd_pcm_mmap_commit() */
+    unsigned long writes;           /* snd_pcm_writei() */
+    unsigned long waits;            /* snd_pcm_wait() */
+    unsigned long xruns;
+    unsigned long drops;
+    unsigned long frames;           /* committed or written */
+    unsigned long sound;            /* of them, not silence */
+    unsigned long crossings;        /* left channel, - to + */
+    unsigned int period;            /* as configured */
+    unsigned int buffer;
+    bool s32;
+    bool mmap;
+};
+
+void pcm_sim_default_config(struct pcm_sim_config *cfg);
+
+/* for the next snd_pcm_open(), which also clears the statistics */
+void pcm_sim_setup(const struct pcm_sim_config *cfg);
+
+void pcm_sim_stats(struct pcm_sim_stats *s);
+
+/* the running device under runs at its next look at the clock */
+void pcm_sim_xrun(void);
+
+/* CLOCK_MONOTONIC ns of the last snd_pcm_drop(), 0: none yet */
+uint64_t pcm_sim_last_drop_ns(void);
+
+uint64_t pcm_sim_now_ns(void);
+
+#endif /* HAVE_PCM_SIM_H__ */
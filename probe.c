@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file probe.c
+ * @brief Hot path latency probes
+ *
+ */
+
+#include <stdatomic.h>
+
+#include "probe.h"
+
+#ifdef ENABLE_PROBES
+
+struct probe_hist {
+    atomic_uint_fast64_t bucket[PROBE_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+static struct probe_hist hists[PROBE_COUNT];
+
+static const char *stage_names[PROBE_COUNT] = {
+    [PROBE_RX_READ]        = "rx read()",
+    [PROBE_RX_PARSE]       = "rx parse",
+    [PROBE_RX_LOG]         = "rx log",
+    [PROBE_RING_DISPATCH]  = "ring dispatch",
+    [PROBE_RING_WINDOW]    = "ring window",
+    [PROBE_RING_TO_WINDOW] = "ring to window",
+    [PROBE_AUDIO_OPEN]     = "audio open",
+    [PROBE_AUDIO_FIRST]    = "audio first",
+    [PROBE_AUDIO_PLAY]     = "audio play",
+    [PROBE_AUDIO_STOP]     = "audio stop",
+};
+
+static unsigned int bucket_of(uint64_t ns)
+{
+    unsigned int msb;
+
+    if (ns < 4)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/* smallest value that lands in bucket b */
+static uint64_t bucket_floor(unsigned int b)
+{
+    if (b < 4)
+        return b;
+    return (uint64_t) (4 + b % 4) << (b / 4 - 1);
+}
+
+void probe_record(enum probe_stage stage, uint64_t ns)
+{
+    struct probe_hist *h = &hists[stage];
+    uint_fast64_t max;
+
+    atomic_fetch_add_explicit(&h->bucket[bucket_of(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+static uint64_t percentile(struct probe_hist *h, uint64_t count, unsigned int pct)
+{
+    uint64_t rank = (count * pct + 99) / 100, seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < PROBE_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+        if (seen >= rank)
+            return bucket_floor(b);
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void probe_dump(FILE *out)
+{
+    struct probe_hist *h;
+    uint64_t count;
+    int i;
+
+    fprintf(out, "%-16s %10s %10s %10s %10s %10s %10s\n", "stage (us)",
+            "count", "mean", "p50", "p90", "p99", "max");
+    for (i = 0; i < PROBE_COUNT; i++) {
+        h = &hists[i];
+        count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        if (count == 0)
+            continue;
+        fprintf(out, "%-16s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage_names[i],
+                (unsigned long long) count,
+                atomic_load_explicit(&h->sum, memory_order_relaxed) / 1000.0 / count,
+                percentile(h, count, 50) / 1000.0, percentile(h, count, 90) / 1000.0,
+                percentile(h, count, 99) / 1000.0,
+                atomic_load_explicit(&h->max, memory_order_relaxed) / 1000.0);
+    }
+    fflush(out);
+}
+
+void probe_reset(void)
+{
+    int i, b;
+
+    for (i = 0; i < PROBE_COUNT; i++) {
+        for (b = 0; b < PROBE_BUCKETS; b++)
+            atomic_store_explicit(&hists[i].bucket[b], 0, memory_order_relaxed);
+        atomic_store_explicit(&hists[i].count, 0, memory_order_relaxed);
+        atomic_store_explicit(&hists[i].sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&hists[i].max, 0, memory_order_relaxed);
+    }
+}
+
+#endif /* ENABLE_PROBES */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file probe.h
+ * @brief Hot path latency probes
+ *
+ * Monotonic clock probes feeding fixed bucket, lock-free histograms, one
+ * per stage. Built with -DENABLE_PROBES (the default, see the Makefile);
+ * without it every macro below expands to nothing.
+ *
+ */
+
+#ifndef HAVE_PROBE_H__
+#define HAVE_PROBE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum probe_stage {
+    PROBE_RX_READ = 0,      /* read() of the modem tty */
+    PROBE_RX_PARSE,         /* framing, classifying and line handlers */
+    PROBE_RX_LOG,           /* at_safe_output() + log_message() of a chunk */
+    PROBE_RING_DISPATCH,    /* read() returned -> RING handler runs */
+    PROBE_RING_WINDOW,      /* gtk_widget_show() + entry text */
+    PROBE_RING_TO_WINDOW,   /* read() returned -> window shown */
+    PROBE_AUDIO_OPEN,       /* snd_pcm_open() up to snd_pcm_hw_params() */
+    PROBE_AUDIO_FIRST,      /* ring_start() -> first period written */
+    PROBE_AUDIO_PLAY,       /* ring_start() -> pattern played out */
+    PROBE_AUDIO_STOP,       /* ring_stop() -> card silenced */
+    PROBE_COUNT
+};
+
+#ifdef ENABLE_PROBES
+
+/* 4 buckets per power of two, from 1 ns up */
+#define PROBE_BUCKETS 256
+
+static inline uint64_t probe_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void probe_record(enum probe_stage stage, uint64_t ns);
+void probe_dump(FILE *out);
+void probe_reset(void);
+
+#define PROBE_VAR(decl) decl
+#define PROBE_START(var) ((var) = probe_now())
+#define PROBE_END(stage, var) probe_record((stage), probe_now() - (var))
+
+#else
+
+#define PROBE_VAR(decl)
+#define PROBE_START(var) ((void) 0)
+#define PROBE_END(stage, var) ((void) 0)
+
+#endif /* ENABLE_PROBES */
+
+#endif /* HAVE_PROBE_H__ */
@@ -20,33 +20,221 @@
  *
  */
 
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <alsa/asoundlib.h>
 
 #include "daemonize.h"
 #include "ring-audio.h"
+#include "probe.h"
+#include "tone.h"
+
+// The playback handle, opened and configured on the first ring and kept
+// prepared between rings, so a ring starts with the first period written.
+// Only the playback thread touches it.
+static struct {
+    snd_pcm_t *handle; // A reference to the sound card
+    bool mmap; // tones go straight into the card's buffer
+    enum tone_format format;
+    unsigned int channels;
+    unsigned int rate;
+    snd_pcm_uframes_t frames; // The size of the period
+    snd_pcm_uframes_t buffer;
+    size_t frame_bytes;
+    char *scratch; // One period, for volume and silence without mmap
+    char *dtmf; // The keypad tones, rendered when the card is opened
+    size_t dtmf_frames; // each
+} out;
+
+static const char *device = "default";
+
+// Keypad layout: the row gives the low tone, the column the high one
+static const char dtmf_keys[] = "123A456B789C*0#D";
+static const double dtmf_low[] = { 697.0, 770.0, 852.0, 941.0 };
+static const double dtmf_high[] = { 1209.0, 1336.0, 1477.0, 1633.0 };
+
+// Sample formats we render, the card's own one is picked from these
+static const struct {
+    snd_pcm_format_t alsa;
+    enum tone_format tone;
+} formats[] = {
+    { SND_PCM_FORMAT_S16_LE, TONE_S16_LE },
+    { SND_PCM_FORMAT_S32_LE, TONE_S32_LE },
+};
+
+// A tone with RING_EDGE_MS ramps at both ends, so it starts and stops
+// without a click
+#define TONE(f1, f2, ms) \
+    { f1, f2, RING_EDGE_MS, 0, 100 }, \
+    { f1, f2, (ms) - 2 * RING_EDGE_MS, 100, 100 }, \
+    { f1, f2, RING_EDGE_MS, 100, 0 }
+#define SILENCE(ms) { 0, 0, ms, 0, 0 }
+#define CADENCE(name, segments) { name, segments, sizeof(segments) / sizeof(segments[0]), 0 }
+
+// What the dialer played on each RING, 1 s of 1800 Hz about every 3 s
+static const struct ring_segment cadence_default[] = {
+    TONE(1800, 0, 1000), SILENCE(2000),
+};
+// North America: 440+480 Hz, 2 s on, 4 s off
+static const struct ring_segment cadence_us[] = {
+    TONE(440, 480, 2000), SILENCE(4000),
+};
+// UK: 400+450 Hz, 0.4 s on, 0.2 s off, 0.4 s on, 2 s off
+static const struct ring_segment cadence_uk[] = {
+    TONE(400, 450, 400), SILENCE(200), TONE(400, 450, 400), SILENCE(2000),
+};
+// Most of Europe and Latin America (ETSI): 425 Hz, 1 s on, 4 s off
+static const struct ring_segment cadence_eu[] = {
+    TONE(425, 0, 1000), SILENCE(4000),
+};
+// France: 440 Hz, 1.5 s on, 3.5 s off
+static const struct ring_segment cadence_fr[] = {
+    TONE(440, 0, 1500), SILENCE(3500),
+};
+// The default ring, growing from quiet to full over its first second
+static const struct ring_segment cadence_crescendo[] = {
+    { 1800, 0, 1000, 20, 100 }, { 1800, 0, RING_EDGE_MS, 100, 0 }, SILENCE(2000),
+};
+
+const struct ring_cadence ring_cadences[] = {
+    CADENCE("default", cadence_default),
+    CADENCE("us", cadence_us),
+    CADENCE("uk", cadence_uk),
+    CADENCE("eu", cadence_eu),
+    CADENCE("fr", cadence_fr),
+    CADENCE("crescendo", cadence_crescendo),
+    { NULL, NULL, 0, 0 },
+};
+
+// What the main loop asks the playback thread to do
+enum ring_op {
+    RING_START,
+    RING_STOP,
+    RING_VOLUME,
+    RING_DTMF,
+    RING_CADENCE,
+};
+
+struct ring_cmd {
+    enum ring_op op;
+    struct ring_pattern pattern;
+    unsigned int volume;
+    unsigned int key; // in dtmf_keys
+    const struct ring_cadence *cadence;
+    PROBE_VAR(uint64_t stamp;)
+};
+
+// Single producer, single consumer: head is only written by the main
+// loop, tail by the playback thread. wake counts the commands (and the
+// quit) so an idle thread can sleep.
+static struct {
+    struct ring_cmd slot[RING_QUEUE_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+} queue;
+static sem_t wake;
+static atomic_bool quit;
+static bool started;
+static thrd_t worker;
+
+// The pattern being played, playback thread only
+static struct {
+    bool playing;
+    bool draining; // all written, waiting for the card to play it out
+    struct ring_pattern pattern;
+    const struct tone_pcm *pcm; // NULL for a keypad tone
+    const char *data; // the tone
+    size_t frames;
+    size_t offset; // frames of the tone written
+    size_t gap; // frames of silence still to write
+    unsigned int played;
+    bool done; // all of it made, the rest is silence
+    // or a cadence, synthesized segment by segment
+    const struct ring_cadence *cadence;
+    unsigned int segment;
+    unsigned int cycles;
+    size_t seg_pos, seg_frames;
+    struct tone_osc osc;
+    double osc_freq[2];
+    int gain; // Q15
+    bool first;
+    PROBE_VAR(uint64_t stamp;)
+} player = { .gain = 32767 };
+
+// statistics, read by dump_stats from the main loop
+static atomic_ulong opens, recoveries, rings, stops, dropped, transfers, waits;
+static atomic_uint period_frames, buffer_frames, sampling_rate;
+static atomic_bool mmapped;
+
+static void output_close(void)
+{
+    if (out.handle){
+        snd_pcm_close(out.handle);
+        out.handle = NULL;
+    }
+    free(out.scratch);
+    out.scratch = NULL;
+    free(out.dtmf);
+    out.dtmf = NULL;
+}
 
-bool ring_2tones (double seconds, double freq1, double freq2)
+// All keypad tones for this card, so a key is heard a period later
+static bool dtmf_render(void)
 {
-    unsigned int sampling_rate = 48000;
-    int dir = 0, rc, i, j = 0;
-    char * buffer;
-    double x, y1, y2;
-    int sample, sample1, sample2, amp = 10000;
+    struct tone_key key;
+    size_t bytes;
+    int i;
+
+    memset(&key, 0, sizeof(key));
+    key.duration_ms = RING_DTMF_MS;
+    key.rate = out.rate;
+    key.channels = out.channels;
+    key.period_frames = out.frames;
+    key.format = out.format;
+    out.dtmf_frames = tone_frames(&key);
+    bytes = out.dtmf_frames * tone_frame_bytes(&key);
+
+    out.dtmf = malloc(bytes * (sizeof(dtmf_keys) - 1));
+    if (!out.dtmf)
+        return false;
+    for (i = 0; dtmf_keys[i]; i++){
+        key.freq1 = dtmf_low[i / 4];
+        key.freq2 = dtmf_high[i % 4];
+        tone_render(&key, out.dtmf + i * bytes);
+    }
+    return true;
+}
 
-    // Here are some alsa specific structures
-    snd_pcm_t * handle; // A reference to the sound card
+static bool output_open(void)
+{
+    unsigned int sampling_rate_near = 48000, channels = 2;
+    int dir = 0, rc;
+    size_t i;
     snd_pcm_hw_params_t * params; // Information about hardware params
-    snd_pcm_uframes_t frames = 4; // The size of the period
+    snd_pcm_sw_params_t * swparams;
+    snd_pcm_uframes_t frames, buffer;
+    PROBE_VAR(uint64_t stamp;)
+
+    PROBE_START(stamp);
 
     // Here we open a reference to the sound card
-    rc = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
+    rc = snd_pcm_open(&out.handle, device, SND_PCM_STREAM_PLAYBACK, 0);
     if(rc < 0){
-        log_message(LOG_FILE, "unable to open default device\n");
+        char msg[128];
+
+        snprintf(msg, sizeof(msg), "unable to open audio device %s\n", device);
+        log_message(LOG_FILE, msg);
         // fprintf(stderr, "unable to open default device: %s\n", snd_strerror(rc));
+        out.handle = NULL;
         return false;
     }
 
@@ -57,164 +245,696 @@ bool ring_2tones (double seconds, double freq1, double freq2)
 
     // This sets up the soundcard with some default parameters and we'll 
     // customize it a bit afterwards
-    snd_pcm_hw_params_any(handle, params);
-
-    // Set the samples for each channel to be interleaved
-    snd_pcm_hw_params_set_access(handle, params,
-                                 SND_PCM_ACCESS_RW_INTERLEAVED);
-
-    // This says our samples represented as signed, 16 bit integers in
-    // little endian format
-    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_any(out.handle, params);
+
+    // Only what the card does itself, no resampling on the way
+    snd_pcm_hw_params_set_rate_resample(out.handle, params, 0);
+
+    // Interleaved samples written straight into the card's buffer, or
+    // through write() where it can't be mapped
+    out.mmap = snd_pcm_hw_params_set_access(out.handle, params,
+                                            SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+    if (!out.mmap)
+        snd_pcm_hw_params_set_access(out.handle, params,
+                                     SND_PCM_ACCESS_RW_INTERLEAVED);
+
+    // Signed little endian, 16 bits or 32, whichever the card takes
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+        if (snd_pcm_hw_params_test_format(out.handle, params, formats[i].alsa) == 0)
+            break;
+    if (i == sizeof(formats) / sizeof(formats[0])){
+        log_message(LOG_FILE, "no sample format the card and the tones share\n");
+        output_close();
+        return false;
+    }
+    snd_pcm_hw_params_set_format(out.handle, params, formats[i].alsa);
+    out.format = formats[i].tone;
 
-    // We use 2 channels (left audio and right audio)
-    snd_pcm_hw_params_set_channels(handle, params, 2);
+    // Stereo, or what the card has; the same sample goes to each channel
+    snd_pcm_hw_params_set_channels_near(out.handle, params, &channels);
 
-    // Here we set our sampling rate.
-    snd_pcm_hw_params_set_rate_near(handle, params, &sampling_rate, &dir);
+    // Here we set our sampling rate, the nearest the card has
+    snd_pcm_hw_params_set_rate_near(out.handle, params, &sampling_rate_near, &dir);
 
-    // This sets the period size
-    snd_pcm_hw_params_set_period_size_near(handle, params, &frames, &dir);
+    // A few periods of RING_PERIOD_MS each: one wake up per period, and
+    // a stop is heard at most a period later
+    frames = sampling_rate_near * RING_PERIOD_MS / 1000;
+    snd_pcm_hw_params_set_period_size_near(out.handle, params, &frames, &dir);
+    buffer = frames * RING_PERIODS;
+    snd_pcm_hw_params_set_buffer_size_near(out.handle, params, &buffer);
 
-    // Finally, the parameters get written to the sound card
-    rc = snd_pcm_hw_params(handle, params);
+    // Finally, the parameters get written to the sound card, which also
+    // leaves it prepared
+    rc = snd_pcm_hw_params(out.handle, params);
     if(rc < 0){
         log_message(LOG_FILE, "unable to set the hw params\n");
-        exit(1);
-    }
-
-    // This allocates memory to hold our samples
-    buffer = (char *) malloc(frames * 4);
-    j = 0;
-    for (i=0;i< seconds * sampling_rate; i++){
-        // Create a sample and convert it back to an integer
-        x = (double) i / (double) sampling_rate;
-        y1 = sin(2.0 * 3.14159 * freq1 * x);
-        y2 = sin(2.0 * 3.14159 * freq2 * x);
-        sample1 = amp * y1;
-        sample2 = amp * y2;
-        sample = (sample1 + sample2) / 2;
-
-        // Store the sample in our buffer using Little Endian format
-        buffer[0 + 4*j] = sample & 0xff;
-        buffer[1 + 4*j] = (sample & 0xff00) >> 8;
-        buffer[2 + 4*j] = sample & 0xff;
-        buffer[3 + 4*j] = (sample & 0xff00) >> 8;
-
-        // If we have a buffer full of samples, write 1 period of 
-        //samples to the sound card
-        if(j++ == frames){
-            j = snd_pcm_writei(handle, buffer, frames);
-
-            // Check for under runs
-            if (j < 0){
-                snd_pcm_prepare(handle);
+        // fprintf(stderr, "unable to set the hw params: %s\n",snd_strerror(rc));
+        output_close();
+        return false;
+    }
+    snd_pcm_hw_params_get_period_size(params, &frames, &dir);
+    snd_pcm_hw_params_get_buffer_size(params, &buffer);
+
+    // Start as soon as the first period is in, wake up for each one
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_sw_params_current(out.handle, swparams);
+    snd_pcm_sw_params_set_start_threshold(out.handle, swparams, frames);
+    snd_pcm_sw_params_set_avail_min(out.handle, swparams, frames);
+    if (snd_pcm_sw_params(out.handle, swparams) < 0){
+        log_message(LOG_FILE, "unable to set the sw params\n");
+        output_close();
+        return false;
+    }
+
+    out.channels = channels;
+    out.rate = sampling_rate_near;
+    out.frames = frames;
+    out.buffer = buffer;
+    out.frame_bytes = channels * (out.format == TONE_S32_LE ? 4 : 2);
+    if (!out.mmap){
+        out.scratch = malloc(frames * out.frame_bytes);
+        if (!out.scratch){
+            log_message(LOG_FILE, "no memory for the audio period\n");
+            output_close();
+            return false;
+        }
+    }
+    if (!dtmf_render()){
+        log_message(LOG_FILE, "no memory for the keypad tones\n");
+        output_close();
+        return false;
+    }
+    atomic_store(&sampling_rate, out.rate);
+    atomic_store(&period_frames, out.frames);
+    atomic_store(&buffer_frames, out.buffer);
+    atomic_store(&mmapped, out.mmap);
+    atomic_fetch_add(&opens, 1);
+    PROBE_END(PROBE_AUDIO_OPEN, stamp);
+    return true;
+}
+
+// Open the card the first time, and bring it back to PREPARED from
+// wherever the last ring or the device left it
+static bool output_ready(void)
+{
+    int rc = 0;
+
+    if (!out.handle)
+        return output_open();
+
+    switch (snd_pcm_state(out.handle)){
+    case SND_PCM_STATE_PREPARED:
+        return true;
+    case SND_PCM_STATE_SUSPENDED:
+        // Wait for the resume, or start over if the driver can't
+        while ((rc = snd_pcm_resume(out.handle)) == -EAGAIN)
+            usleep(10000);
+        if (rc == 0)
+            break;
+        /* fall through */
+    case SND_PCM_STATE_SETUP:
+    case SND_PCM_STATE_XRUN:
+    case SND_PCM_STATE_DRAINING:
+    case SND_PCM_STATE_RUNNING:
+        rc = snd_pcm_prepare(out.handle);
+        break;
+    default:
+        // Unplugged, or something prepare can't fix: reopen
+        rc = -ENODEV;
+        break;
+    }
+    if (rc == 0)
+        return true;
+
+    atomic_fetch_add(&recoveries, 1);
+    log_message(LOG_FILE, "audio device lost, reopening\n");
+    output_close();
+    return output_open();
+}
+
+// frames from src to dst (which may be the same) scaled by gain, Q15
+static void output_scale(char *dst, const char *src, size_t frames, int32_t gain)
+{
+    size_t i, samples = frames * out.channels;
+    int32_t sample;
+
+    if (out.format == TONE_S32_LE){
+        for (i = 0; i < samples; i++, src += 4, dst += 4){
+            sample = (int32_t) ((src[0] & 0xff) | (src[1] & 0xff) << 8 |
+                                (src[2] & 0xff) << 16 | (uint32_t) (src[3] & 0xff) << 24);
+            sample = (int64_t) sample * gain >> 15;
+            dst[0] = sample & 0xff;
+            dst[1] = (sample >> 8) & 0xff;
+            dst[2] = (sample >> 16) & 0xff;
+            dst[3] = (sample >> 24) & 0xff;
+        }
+        return;
+    }
+    for (i = 0; i < samples; i++, src += 2, dst += 2){
+        sample = (int16_t) ((src[0] & 0xff) | (src[1] << 8));
+        sample = sample * gain >> 15;
+        dst[0] = sample & 0xff;
+        dst[1] = (sample & 0xff00) >> 8;
+    }
+}
+
+// frames from src to dst scaled to the volume
+static void output_copy(char *dst, const char *src, size_t frames)
+{
+    if (player.gain >= 32767)
+        memcpy(dst, src, frames * out.frame_bytes);
+    else
+        output_scale(dst, src, frames, player.gain);
+}
+
+// The next frames of a pattern: its tone, then silence, then the tone again
+static size_t pattern_fill(char *dst, size_t frames)
+{
+    size_t n;
+
+    if (player.offset < player.frames){
+        n = player.frames - player.offset < frames ? player.frames - player.offset : frames;
+        output_copy(dst, player.data + player.offset * out.frame_bytes, n);
+        player.offset += n;
+        if (player.offset < player.frames)
+            return n;
+
+        player.played++;
+        if (player.pattern.count && player.played >= player.pattern.count){
+            player.done = true;
+            return n;
+        }
+        player.gap = (size_t) player.pattern.off_ms * out.rate / 1000;
+        if (player.gap == 0)
+            player.offset = 0;
+        return n;
+    }
+
+    n = player.gap < frames ? player.gap : frames;
+    memset(dst, 0, n * out.frame_bytes);
+    player.gap -= n;
+    if (player.gap == 0)
+        player.offset = 0;
+    return n;
+}
+
+static void cadence_enter(void)
+{
+    const struct ring_segment *seg = &player.cadence->segments[player.segment];
+    double freqs[2] = { seg->freq1, seg->freq2 };
+
+    player.seg_pos = 0;
+    player.seg_frames = (size_t) seg->ms * out.rate / 1000;
+
+    // the same tone carries on with its phase, so a ramp into a steady
+    // segment has no seam
+    if (seg->freq1 > 0 && (player.osc.count == 0 || seg->freq1 != player.osc_freq[0] ||
+                           seg->freq2 != player.osc_freq[1])){
+        tone_osc_init(&player.osc, freqs, seg->freq2 > 0 ? 2 : 1, out.rate);
+        player.osc_freq[0] = seg->freq1;
+        player.osc_freq[1] = seg->freq2;
+    }
+}
+
+// The next frames of a cadence, up to the end of the segment. Tones are
+// synthesized as they go out, silence costs a memset.
+static size_t cadence_fill(char *dst, size_t frames)
+{
+    const struct ring_segment *seg;
+    size_t n, i;
+    int32_t level;
+
+    while (player.seg_pos == player.seg_frames){
+        if (++player.segment == player.cadence->count){
+            player.segment = 0;
+            player.cycles++;
+            if (player.cadence->repeat && player.cycles >= player.cadence->repeat){
+                player.done = true;
+                return 0;
+            }
+        }
+        cadence_enter();
+    }
+
+    seg = &player.cadence->segments[player.segment];
+    n = player.seg_frames - player.seg_pos < frames ? player.seg_frames - player.seg_pos : frames;
+    if (seg->freq1 <= 0){
+        memset(dst, 0, n * out.frame_bytes);
+    } else {
+        tone_osc_render(&player.osc, dst, n, out.channels, out.format);
+        // the ramp from gain_from to gain_to, frame by frame
+        if (seg->gain_from != 100 || seg->gain_to != 100 || player.gain < 32767){
+            for (i = 0; i < n; i++){
+                level = seg->gain_from + ((int32_t) seg->gain_to - seg->gain_from) *
+                    (int64_t) (player.seg_pos + i) / (int64_t) player.seg_frames;
+                output_scale(dst + i * out.frame_bytes, dst + i * out.frame_bytes, 1,
+                             level * player.gain / 100);
             }
-            j = 0;
         }
     }
+    player.seg_pos += n;
+
+    // the end of the last one: nothing after it, not even a period
+    if (player.seg_pos == player.seg_frames && player.cadence->repeat &&
+        player.segment + 1 == player.cadence->count &&
+        player.cycles + 1 >= player.cadence->repeat)
+        player.done = true;
+    return n;
+}
 
-    // Play all remaining samples before exitting
-    snd_pcm_drain(handle);
+// The next frames of whatever is playing, silence after the end of it
+static void player_fill(char *dst, size_t frames)
+{
+    size_t n;
 
-    // Close the sound card handle
-    snd_pcm_close(handle);
+    while (frames && !player.done){
+        n = player.cadence ? cadence_fill(dst, frames) : pattern_fill(dst, frames);
+        dst += n * out.frame_bytes;
+        frames -= n;
+    }
+    if (frames)
+        memset(dst, 0, frames * out.frame_bytes);
+}
 
-    free(buffer);
+// Under runs and suspends are recovered and the transfer tried again;
+// anything else drops the handle, the next ring reopens it
+static bool output_recover(int err)
+{
+    atomic_fetch_add(&recoveries, 1);
+    if (snd_pcm_recover(out.handle, err, 1) == 0)
+        return true;
+    log_message(LOG_FILE, "audio write failed, closing the device\n");
+    output_close();
+    return false;
+}
 
+// One period through write(), for cards that can't be mapped
+static bool output_write(void)
+{
+    snd_pcm_sframes_t written;
+
+    player_fill(out.scratch, out.frames);
+    for (;;){
+        atomic_fetch_add(&transfers, 1);
+        written = snd_pcm_writei(out.handle, out.scratch, out.frames);
+        if (written >= 0)
+            return true;
+        if (!output_recover(written))
+            return false;
+    }
+}
+
+// The player's next period, made straight in the card's buffer
+static bool output_period(void)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, n, left = out.frames;
+    snd_pcm_sframes_t avail, committed;
+    char *dst;
+    int rc;
+
+    if (!out.mmap)
+        return output_write();
+
+    while (left){
+        avail = snd_pcm_avail_update(out.handle);
+        if (avail < 0){
+            if (!output_recover(avail))
+                return false;
+            continue;
+        }
+
+        // The buffer is full: wait for the card to play a period out
+        if ((snd_pcm_uframes_t) avail < left){
+            if (snd_pcm_state(out.handle) == SND_PCM_STATE_PREPARED)
+                snd_pcm_start(out.handle);
+            atomic_fetch_add(&waits, 1);
+            rc = snd_pcm_wait(out.handle, RING_PERIOD_MS * RING_PERIODS * 10);
+            if (rc < 0 && !output_recover(rc))
+                return false;
+            continue;
+        }
+
+        n = left;
+        rc = snd_pcm_mmap_begin(out.handle, &areas, &offset, &n);
+        if (rc < 0){
+            if (!output_recover(rc))
+                return false;
+            continue;
+        }
+        dst = (char *) areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8;
+        player_fill(dst, n);
+
+        atomic_fetch_add(&transfers, 1);
+        committed = snd_pcm_mmap_commit(out.handle, offset, n);
+        if (committed < 0 || (snd_pcm_uframes_t) committed != n){
+            if (!output_recover(committed < 0 ? committed : -EPIPE))
+                return false;
+            continue;
+        }
+        left -= n;
+    }
     return true;
 }
 
-bool ring (double seconds, double freq)
+static void player_release(void)
 {
-    unsigned int sampling_rate = 48000;
-    int dir = 0, rc, i, j = 0;
-    char * buffer;
-    double x, y;
-    int sample, amp = 10000;
+    if (player.pcm)
+        tone_put(player.pcm);
+    player.pcm = NULL;
+    player.data = NULL;
+    player.cadence = NULL;
+    player.playing = false;
+    player.draining = false;
+}
 
-    // Here are some alsa specific structures
-    snd_pcm_t * handle; // A reference to the sound card
-    snd_pcm_hw_params_t * params; // Information about hardware params
-    snd_pcm_uframes_t frames = 4; // The size of the period
+// Silence right away: whatever the card still has queued is dropped
+static void player_stop(void)
+{
+    if (!player.playing)
+        return;
+    if (out.handle){
+        snd_pcm_drop(out.handle);
+        snd_pcm_prepare(out.handle);
+    }
+    player_release();
+    atomic_fetch_add(&stops, 1);
+}
 
-    // Here we open a reference to the sound card
-    rc = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
-    if(rc < 0){
-        log_message(LOG_FILE, "unable to open default device\n");
-        // fprintf(stderr, "unable to open default device: %s\n", snd_strerror(rc));
-        return false;
+static void player_begin(const struct ring_cmd *cmd)
+{
+    player.pattern = cmd->pattern;
+    player.offset = 0;
+    player.gap = 0;
+    player.played = 0;
+    player.done = false;
+    player.first = true;
+    player.playing = true;
+    PROBE_VAR(player.stamp = cmd->stamp;)
+}
+
+static void player_start(const struct ring_cmd *cmd)
+{
+    struct tone_key key;
+
+    player_stop();
+    if (!output_ready())
+        return;
+
+    // The samples, rendered the first time this tone is played in this
+    // format, from memory after that
+    memset(&key, 0, sizeof(key));
+    key.freq1 = cmd->pattern.freq1;
+    key.freq2 = cmd->pattern.freq2;
+    key.duration_ms = cmd->pattern.on_ms;
+    key.rate = out.rate;
+    key.channels = out.channels;
+    key.period_frames = out.frames;
+    key.format = out.format;
+    player.pcm = tone_get(&key);
+    if (!player.pcm){
+        log_message(LOG_FILE, "no memory for the tone\n");
+        return;
+    }
+    if (!player.pcm->frames){
+        player_release();
+        return;
     }
+    player.data = player.pcm->data;
+    player.frames = player.pcm->frames;
+    player_begin(cmd);
+}
 
-    // Now we allocate memory for the parameters structure on the stack
-    snd_pcm_hw_params_alloca(&params);
+// A keypad tone, once, straight from the table
+static void player_key(const struct ring_cmd *cmd)
+{
+    player_stop();
+    if (!output_ready())
+        return;
 
-    // Next, we're going to set all the parameters for the sound card
+    player.data = out.dtmf + cmd->key * out.dtmf_frames * out.frame_bytes;
+    player.frames = out.dtmf_frames;
+    player_begin(cmd);
+}
 
-    // This sets up the soundcard with some default parameters and we'll 
-    // customize it a bit afterwards
-    snd_pcm_hw_params_any(handle, params);
+static void player_cadence(const struct ring_cmd *cmd)
+{
+    player_stop();
+    if (!output_ready())
+        return;
+
+    player.cadence = cmd->cadence;
+    player.segment = 0;
+    player.cycles = 0;
+    player.osc.count = 0;
+    cadence_enter();
+    player_begin(cmd);
+}
 
-    // Set the samples for each channel to be interleaved
-    snd_pcm_hw_params_set_access(handle, params,
-                                 SND_PCM_ACCESS_RW_INTERLEAVED);
+// Played out, or the wait for it interrupted by a command
+static void player_drain(void)
+{
+    snd_pcm_sframes_t delay = 0;
+    long ms;
+    struct timespec until;
+
+    if (out.handle && snd_pcm_delay(out.handle, &delay) == 0 && delay > 0){
+        // Never longer than a period, so a stop still gets through
+        if (delay > (snd_pcm_sframes_t) out.frames)
+            delay = out.frames;
+        ms = (long) delay * 1000 / out.rate + 1;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += ms * 1000000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        // a command that wakes us is in the queue, looked at next
+        sem_timedwait(&wake, &until);
+        return;
+    }
 
-    // This says our samples represented as signed, 16 bit integers in
-    // little endian format
-    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    if (out.handle){
+        snd_pcm_drop(out.handle);
+        snd_pcm_prepare(out.handle);
+    }
+    player_release();
+    atomic_fetch_add(&rings, 1);
+    PROBE_END(PROBE_AUDIO_PLAY, player.stamp);
+}
 
-    // We use 2 channels (left audio and right audio)
-    snd_pcm_hw_params_set_channels(handle, params, 2);
+// One period of whatever is playing, then the wait for the card to
+// play it all out
+static void player_step(void)
+{
+    if (player.draining){
+        player_drain();
+        return;
+    }
+
+    if (!output_period()){
+        player_release();
+        return;
+    }
+    if (player.first){
+        PROBE_END(PROBE_AUDIO_FIRST, player.stamp);
+        player.first = false;
+    }
+    if (player.done)
+        player.draining = true;
+}
 
-    // Here we set our sampling rate.
-    snd_pcm_hw_params_set_rate_near(handle, params, &sampling_rate, &dir);
+static bool queue_pop(struct ring_cmd *cmd)
+{
+    unsigned int tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
 
-    // This sets the period size
-    snd_pcm_hw_params_set_period_size_near(handle, params, &frames, &dir);
+    if (tail == atomic_load_explicit(&queue.head, memory_order_acquire))
+        return false;
+    *cmd = queue.slot[tail % RING_QUEUE_SIZE];
+    atomic_store_explicit(&queue.tail, tail + 1, memory_order_release);
+    return true;
+}
 
-    // Finally, the parameters get written to the sound card
-    rc = snd_pcm_hw_params(handle, params);
-    if(rc < 0){
-        log_message(LOG_FILE, "unable to set the hw params\n");
-        // fprintf(stderr, "unable to set the hw params: %s\n",snd_strerror(rc));
-        exit(1);
-    }
-
-    // This allocates memory to hold our samples
-    buffer = (char *) malloc(frames * 4);
-    j = 0;
-    for (i=0;i< seconds * sampling_rate; i++){
-        // Create a sample and convert it back to an integer
-        x = (double) i / (double) sampling_rate;
-        y = sin(2.0 * 3.14159 * freq * x);
-        sample = amp * y;
-
-        // Store the sample in our buffer using Little Endian format
-        buffer[0 + 4*j] = sample & 0xff;
-        buffer[1 + 4*j] = (sample & 0xff00) >> 8;
-        buffer[2 + 4*j] = sample & 0xff;
-        buffer[3 + 4*j] = (sample & 0xff00) >> 8;
-
-        // If we have a buffer full of samples, write 1 period of 
-        //samples to the sound card
-        if(j++ == frames){
-            j = snd_pcm_writei(handle, buffer, frames);
-
-            // Check for under runs
-            if (j < 0){
-                snd_pcm_prepare(handle);
+static int ring_worker(void *arg)
+{
+    struct ring_cmd cmd;
+
+    (void) arg;
+    while (!atomic_load(&quit)){
+        // Idle, or draining (which waits itself): sleep until a command.
+        // Playing: only look, a period goes out between two looks
+        if (!player.playing)
+            sem_wait(&wake);
+        else if (!player.draining)
+            while (sem_trywait(&wake) == 0)
+                ;
+
+        while (queue_pop(&cmd)){
+            switch (cmd.op){
+            case RING_START:
+                player_start(&cmd);
+                break;
+            case RING_STOP:
+                player_stop();
+                PROBE_END(PROBE_AUDIO_STOP, cmd.stamp);
+                break;
+            case RING_VOLUME:
+                player.gain = cmd.volume * 32767 / RING_VOLUME_MAX;
+                break;
+            case RING_DTMF:
+                player_key(&cmd);
+                break;
+            case RING_CADENCE:
+                player_cadence(&cmd);
+                break;
             }
-            j = 0;
         }
-    }
 
-    // Play all remaining samples before exitting
-    snd_pcm_drain(handle);
+        if (player.playing)
+            player_step();
+    }
 
-    // Close the sound card handle
-    snd_pcm_close(handle);
+    player_stop();
+    output_close();
+    return 0;
+}
 
-    free(buffer);
+static bool queue_push(struct ring_cmd *cmd)
+{
+    unsigned int head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+
+    if (!started){
+        // a thread closed before left quit set
+        atomic_store(&quit, false);
+        if (sem_init(&wake, 0, 0) < 0 ||
+            thrd_create(&worker, ring_worker, NULL) != thrd_success){
+            log_message(LOG_FILE, "unable to start the ring thread\n");
+            return false;
+        }
+        started = true;
+    }
 
+    if (head - atomic_load_explicit(&queue.tail, memory_order_acquire) == RING_QUEUE_SIZE){
+        atomic_fetch_add(&dropped, 1);
+        return false;
+    }
+    PROBE_START(cmd->stamp);
+    queue.slot[head % RING_QUEUE_SIZE] = *cmd;
+    atomic_store_explicit(&queue.head, head + 1, memory_order_release);
+    sem_post(&wake);
     return true;
 }
+
+bool ring_start(const struct ring_pattern *pattern)
+{
+    struct ring_cmd cmd = { .op = RING_START, .pattern = *pattern };
+
+    return queue_push(&cmd);
+}
+
+bool ring_stop(void)
+{
+    struct ring_cmd cmd = { .op = RING_STOP };
+
+    // nothing was ever played
+    if (!started)
+        return true;
+    return queue_push(&cmd);
+}
+
+bool ring_volume(unsigned int percent)
+{
+    struct ring_cmd cmd = { .op = RING_VOLUME };
+
+    cmd.volume = percent > RING_VOLUME_MAX ? RING_VOLUME_MAX : percent;
+    return queue_push(&cmd);
+}
+
+bool ring_cadence(const struct ring_cadence *cadence)
+{
+    struct ring_cmd cmd = { .op = RING_CADENCE, .cadence = cadence };
+    unsigned int i, ms = 0;
+
+    for (i = 0; i < cadence->count; i++)
+        ms += cadence->segments[i].ms;
+    if (ms == 0)
+        return false;
+    cmd.pattern.count = cadence->repeat;
+    return queue_push(&cmd);
+}
+
+const struct ring_cadence *ring_cadence_find(const char *name)
+{
+    const struct ring_cadence *c;
+
+    for (c = ring_cadences; c->name; c++)
+        if (strcmp(c->name, name) == 0)
+            return c;
+    return NULL;
+}
+
+bool ring_dtmf(char key)
+{
+    struct ring_cmd cmd = { .op = RING_DTMF };
+    const char *k = key ? strchr(dtmf_keys, key) : NULL;
+
+    if (!k)
+        return false;
+    cmd.key = k - dtmf_keys;
+    cmd.pattern.count = 1;
+    return queue_push(&cmd);
+}
+
+bool ring_2tones (double seconds, double freq1, double freq2)
+{
+    struct ring_pattern pattern = { freq1, freq2, seconds * 1000, 0, 1 };
+
+    return ring_start(&pattern);
+}
+
+bool ring (double seconds, double freq)
+{
+    return ring_2tones(seconds, freq, 0);
+}
+
+void ring_audio_close(void)
+{
+    if (!started)
+        return;
+    atomic_store(&quit, true);
+    sem_post(&wake);
+    thrd_join(worker, NULL);
+    sem_destroy(&wake);
+    // what it didn't get to is not played by the next one
+    atomic_store(&queue.tail, atomic_load(&queue.head));
+    started = false;
+}
+
+void ring_audio_device(const char *name)
+{
+    device = name;
+}
+
+void ring_audio_stats(struct ring_audio_stats *s)
+{
+    s->rings = atomic_load(&rings);
+    s->stops = atomic_load(&stops);
+    s->opens = atomic_load(&opens);
+    s->recoveries = atomic_load(&recoveries);
+    s->dropped = atomic_load(&dropped);
+    s->transfers = atomic_load(&transfers);
+    s->waits = atomic_load(&waits);
+    s->rate = atomic_load(&sampling_rate);
+    s->period = atomic_load(&period_frames);
+    s->buffer = atomic_load(&buffer_frames);
+    s->mmap = atomic_load(&mmapped);
+}
+
+void ring_audio_dump_stats(FILE *f)
+{
+    struct ring_audio_stats s;
+
+    ring_audio_stats(&s);
+    fprintf(f, "audio: %lu rings, %lu stopped, %lu opens, %lu recoveries, %lu commands dropped\n",
+            s.rings, s.stops, s.opens, s.recoveries, s.dropped);
+    fprintf(f, "audio: %s, %u Hz, %u frame periods, %u frame buffer, %lu transfers, %lu waits\n",
+            s.mmap ? "mmap" : "write", s.rate, s.period, s.buffer, s.transfers, s.waits);
+}
@@ -24,8 +24,88 @@
 #define HAVE_RA_H__
 
 #include <stdbool.h>
+#include <stdio.h>
 
+#define RING_QUEUE_SIZE 16
+#define RING_VOLUME_MAX 100
+#define RING_PERIOD_MS 10       /* also how soon a stop is heard */
+#define RING_PERIODS 4          /* in the card's buffer */
+#define RING_DTMF_MS 100        /* keypad tone */
+#define RING_EDGE_MS 10         /* ramp at each end of a cadence tone */
+
+/* A tone on for on_ms then silent for off_ms, count times (0: until
+ * ring_stop()). freq2 is 0 for a single tone. */
+struct ring_pattern {
+    double freq1;
+    double freq2;
+    unsigned int on_ms;
+    unsigned int off_ms;
+    unsigned int count;
+};
+
+/* One step of a cadence: a tone (or two), or silence with freq1 0, for
+ * ms, its level going from gain_from to gain_to percent of the volume */
+struct ring_segment {
+    double freq1;
+    double freq2;
+    unsigned int ms;
+    unsigned char gain_from;
+    unsigned char gain_to;
+};
+
+/* A ring pattern: the segments back to back, repeat times (0: until
+ * ring_stop()). Timed in frames of the card's clock, each tone made as
+ * it goes out. */
+struct ring_cadence {
+    const char *name;
+    const struct ring_segment *segments;
+    unsigned int count;
+    unsigned int repeat;
+};
+
+/* Playback runs in its own thread, started on the first command. These
+ * queue a command for it and return right away, false when the queue is
+ * full; they are meant for a single thread (the main loop). A start
+ * replaces whatever is playing, a stop is heard within one period. */
+bool ring_start(const struct ring_pattern *pattern);
+bool ring_stop(void);
+bool ring_volume(unsigned int percent);
+
+/* Play cadence, which has to stay around while it plays (a static
+ * table); false for one with nothing in it */
+bool ring_cadence(const struct ring_cadence *cadence);
+/* The built in cadence called name (see ring_cadences), or NULL */
+const struct ring_cadence *ring_cadence_find(const char *name);
+extern const struct ring_cadence ring_cadences[];
+
+/* The keypad tone of key (0-9, *, #, A-D) once, false for other keys */
+bool ring_dtmf(char key);
+
+/* The tone played once */
 bool ring_2tones (double seconds, double freq1, double freq2);
 bool ring (double seconds, double freq);
 
+struct ring_audio_stats {
+    unsigned long rings;        /* patterns played out */
+    unsigned long stops;
+    unsigned long opens;
+    unsigned long recoveries;
+    unsigned long dropped;      /* commands, queue full */
+    unsigned long transfers;    /* mmap commits or writes */
+    unsigned long waits;        /* for room in the card's buffer */
+    unsigned int rate;
+    unsigned int period;        /* frames */
+    unsigned int buffer;        /* frames */
+    bool mmap;
+};
+
+/* The PCM to open, "default" unless set before the first ring */
+void ring_audio_device(const char *name);
+
+/* Stops the thread, the card is opened on the first ring and kept until
+ * this */
+void ring_audio_close(void);
+void ring_audio_stats(struct ring_audio_stats *s);
+void ring_audio_dump_stats(FILE *f);
+
 #endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file ring-bench.c
+ * @brief Cost of a second of ringtone on an ALSA device
+ *
+ * Plays the same tone through the old output (write() of a 4 frame period
+ * at a time) and through the ring thread (mmap, RING_PERIOD_MS periods),
+ * and reports ALSA transfers, waits, context switches and CPU time per
+ * second of tone. The null device by default, so no sound card is
+ * needed; run it under "strace -f -c" for the syscalls a real card costs.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <alsa/asoundlib.h>
+
+#include "ring-audio.h"
+#include "tone.h"
+
+struct usage {
+    double cpu_ms;
+    double wall_s;
+    long switches;
+};
+
+static void usage_now(struct usage *u)
+{
+    struct rusage ru;
+    struct timespec ts;
+
+    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    u->cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+        ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+    u->wall_s = ts.tv_sec + ts.tv_nsec / 1e9;
+    u->switches = ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void print_row(const char *path, unsigned long period, double transfers,
+                      double waits, const struct usage *a, const struct usage *b,
+                      unsigned int seconds)
+{
+    printf("%-16s %8lu %12.1f %10.1f %10.2f %10.1f %8.2f\n", path, period,
+           transfers / seconds, waits / seconds, (b->cpu_ms - a->cpu_ms) / seconds,
+           (double) (b->switches - a->switches) / seconds, b->wall_s - a->wall_s);
+}
+
+/* What ring() did before the ring thread: 4 frame periods of S16 stereo
+ * at 48 kHz, one snd_pcm_writei() each */
+static bool legacy_play(const char *device, unsigned int seconds, double freq)
+{
+    unsigned int rate = 48000, s;
+    int dir = 0;
+    unsigned long writes = 0;
+    snd_pcm_t *handle;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_uframes_t frames = 4;
+    snd_pcm_sframes_t written;
+    struct tone_key key;
+    const struct tone_pcm *pcm;
+    struct usage a, b;
+    size_t offset;
+
+    if (snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        fprintf(stderr, "Could not open %s\n", device);
+        return false;
+    }
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(handle, params);
+    snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(handle, params, 2);
+    snd_pcm_hw_params_set_rate_near(handle, params, &rate, &dir);
+    snd_pcm_hw_params_set_period_size_near(handle, params, &frames, &dir);
+    if (snd_pcm_hw_params(handle, params) < 0) {
+        fprintf(stderr, "Could not set up %s\n", device);
+        snd_pcm_close(handle);
+        return false;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.freq1 = freq;
+    key.duration_ms = 1000;
+    key.rate = rate;
+    key.channels = 2;
+    key.period_frames = frames;
+    key.format = TONE_S16_LE;
+    pcm = tone_get(&key);
+    if (!pcm) {
+        snd_pcm_close(handle);
+        return false;
+    }
+
+    usage_now(&a);
+    for (s = 0; s < seconds; s++) {
+        for (offset = 0; offset < pcm->frames; ) {
+            writes++;
+            written = snd_pcm_writei(handle, pcm->data + offset * pcm->frame_bytes, frames);
+            if (written < 0) {
+                if (snd_pcm_prepare(handle) < 0)
+                    break;
+                continue;
+            }
+            offset += written;
+        }
+    }
+    snd_pcm_drain(handle);
+    usage_now(&b);
+
+    print_row("write, 4 frames", frames, writes, 0, &a, &b, seconds);
+    tone_put(pcm);
+    snd_pcm_close(handle);
+    return true;
+}
+
+/* until the ring thread has played more than rings patterns */
+static bool wait_ring(struct ring_audio_stats *st, unsigned long rings, unsigned int timeout_s)
+{
+    unsigned int i;
+
+    for (i = 0; i < timeout_s * 100; i++) {
+        usleep(10000);
+        ring_audio_stats(st);
+        if (st->rings > rings)
+            return true;
+    }
+    return false;
+}
+
+static bool thread_play(const char *device, unsigned int seconds, double freq)
+{
+    struct ring_pattern pattern = { freq, 0, 1000, 0, seconds };
+    struct ring_audio_stats before, after;
+    struct usage a, b;
+
+    ring_audio_device(device);
+
+    // a short ring first, so the open isn't counted
+    ring(0.1, freq);
+    if (!wait_ring(&before, 0, 2)) {
+        fprintf(stderr, "Could not play to %s\n", device);
+        return false;
+    }
+
+    usage_now(&a);
+    ring_start(&pattern);
+    if (!wait_ring(&after, before.rings, seconds * 2 + 2)) {
+        fprintf(stderr, "%s stopped playing\n", device);
+        return false;
+    }
+    usage_now(&b);
+
+    print_row(after.mmap ? "thread, mmap" : "thread, write", after.period,
+              after.transfers - before.transfers, after.waits - before.waits,
+              &a, &b, seconds);
+    printf("(%u Hz, %u frame buffer)\n", after.rate, after.buffer);
+    ring_audio_close();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "null";
+    unsigned int seconds = 10;
+    double freq = 1800.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hD:s:f:")) != -1){
+        switch (opt){
+        case 'D':
+            device = optarg;
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'f':
+            freq = atof(optarg);
+            break;
+        case 'h':
+        default:
+            goto usage;
+        }
+    }
+    if (seconds == 0)
+        goto usage;
+
+    printf("%u s of %.0f Hz on %s, per second of tone:\n", seconds, freq, device);
+    printf("%-16s %8s %12s %10s %10s %10s %8s\n", "output", "period", "transfers",
+           "waits", "cpu ms", "switches", "wall s");
+    if (!legacy_play(device, seconds, freq) || !thread_play(device, seconds, freq))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "Usage: %s [-D device] [-s seconds] [-f frequency]\n", argv[0]);
+    fprintf(stderr, "  -D  ALSA PCM to play to (default: null)\n");
+    fprintf(stderr, "  -s  seconds of tone for each output (default: 10)\n");
+    fprintf(stderr, "  -f  tone frequency in Hz (default: 1800)\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file ring-test.c
+ * @brief The ring thread against a fake sound card
+ *
+ * ring-audio.c linked with pcm_sim.c instead of libasound, so it runs
+ * without a card or ALSA installed. It checks that:
+ *
+ *  - a mappable card gets RING_PERIOD_MS periods, RING_PERIODS of them
+ *    in the buffer, one commit per period and no write()
+ *  - the tone is the right one (zero crossings) and as long as asked
+ *  - ring_stop() drops the card within a period
+ *  - an under run is recovered and the ring carries on
+ *  - a card with only write() and S32_LE gets both, after the thread was
+ *    closed and started again
+ *
+ * and prints transfers, waits and CPU time per second of tone. One line
+ * per check; the exit status is the number that failed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "ring-audio.h"
+#include "pcm_sim.h"
+
+static unsigned int checks, failures;
+
+static void check(const char *what, bool ok)
+{
+    checks++;
+    if (!ok)
+        failures++;
+    printf("ring: %-52s %s\n", what, ok ? "ok" : "FAILED");
+}
+
+static double cpu_ms(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+        ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+}
+
+/* until more than rings patterns were played out */
+static bool wait_ring(unsigned long rings, unsigned int timeout_ms)
+{
+    struct ring_audio_stats st;
+    unsigned int i;
+
+    for (i = 0; i < timeout_ms / 5; i++) {
+        ring_audio_stats(&st);
+        if (st.rings > rings)
+            return true;
+        usleep(5000);
+    }
+    return false;
+}
+
+static bool near(double value, double expected, double tolerance)
+{
+    return value > expected * (1 - tolerance) && value < expected * (1 + tolerance);
+}
+
+/* the left channel's frequency over what wasn't silence */
+static double frequency(const struct pcm_sim_stats *s, unsigned int rate)
+{
+    return s->sound ? (double) s->crossings * rate / s->sound : 0;
+}
+
+static void card(bool mmap, bool s16, bool s32)
+{
+    struct pcm_sim_config cfg;
+
+    pcm_sim_default_config(&cfg);
+    cfg.mmap = mmap;
+    cfg.s16 = s16;
+    cfg.s32 = s32;
+    pcm_sim_setup(&cfg);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ring_audio_stats before, after;
+    struct pcm_sim_stats s;
+    uint64_t asked, dropped;
+    unsigned long sound;
+    double cpu;
+    int i;
+
+    ring_audio_device("sim");
+
+    // a second of 1800 Hz on a card that maps its buffer
+    card(true, true, true);
+    ring_audio_stats(&before);
+    cpu = cpu_ms();
+    ring(1.0, 1800.0);
+    check("played on the mappable card", wait_ring(before.rings, 3000));
+    cpu = cpu_ms() - cpu;
+    pcm_sim_stats(&s);
+    check("mmap, S16_LE", s.mmap && !s.s32);
+    check("10 ms periods, 4 of them in the buffer", s.period == 480 && s.buffer == 4 * 480);
+    check("one commit per period, no write()",
+          s.commits >= 100 && s.commits <= 101 && s.writes == 0);
+    check("1800 Hz", near(frequency(&s, 48000), 1800.0, 0.02));
+    check("a second of it", near(s.sound, 48000, 0.02));
+    printf("ring: mmap, %u frame periods: %lu commits, %lu waits, %.2f ms CPU "
+           "per second of tone\n", s.period, s.commits, s.waits, cpu);
+
+    // a cadence that goes on until stopped
+    ring_audio_stats(&before);
+    ring_cadence(ring_cadence_find("default"));
+    usleep(300000);
+    asked = pcm_sim_now_ns();
+    ring_stop();
+    for (i = 0; i < 200 && pcm_sim_last_drop_ns() < asked; i++)
+        usleep(5000);
+    dropped = pcm_sim_last_drop_ns();
+    check("ring_stop() heard within a period",
+          dropped > asked && dropped - asked < 2 * RING_PERIOD_MS * 1000000ull);
+    ring_audio_stats(&after);
+    check("stop counted", after.stops == before.stops + 1);
+
+    // an under run half way through
+    ring_audio_stats(&before);
+    ring(1.0, 1800.0);
+    usleep(300000);
+    pcm_sim_xrun();
+    check("played through an under run", wait_ring(before.rings, 3000));
+    ring_audio_stats(&after);
+    check("under run recovered", after.recoveries > before.recoveries);
+
+    // a keypad tone
+    ring_audio_stats(&before);
+    pcm_sim_stats(&s);
+    sound = s.sound;
+    ring_dtmf('5');
+    check("keypad tone played", wait_ring(before.rings, 2000));
+    pcm_sim_stats(&s);
+    check("keypad tone lasts RING_DTMF_MS",
+          near(s.sound - sound, 48000 * RING_DTMF_MS / 1000, 0.1));
+
+    // the thread closed and started again, on a card with only write()
+    // and 32 bit samples
+    ring_audio_close();
+    card(false, false, true);
+    ring_audio_stats(&before);
+    cpu = cpu_ms();
+    ring(0.5, 1000.0);
+    check("played after a restart", wait_ring(before.rings, 3000));
+    cpu = cpu_ms() - cpu;
+    pcm_sim_stats(&s);
+    check("write(), S32_LE", !s.mmap && s.s32 && s.commits == 0);
+    check("one write() per period", s.writes >= 50 && s.writes <= 51);
+    check("1000 Hz", near(frequency(&s, 48000), 1000.0, 0.02));
+    printf("ring: write, %u frame periods: %lu writes, %.2f ms CPU per second of tone\n",
+           s.period, s.writes, cpu * 2);
+
+    printf("ring: %u of %u checks passed\n", checks - failures, checks);
+    ring_audio_close();
+    return failures;
+}
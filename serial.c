@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file serial.c
+ * @brief Serial port setup for the modem AT port
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <asm/termbits.h>
+
+#include "serial.h"
+#include "daemonize.h"
+
+struct baudrate {
+    char       *name;
+    int         termios_code;
+    int         nonstd_speed;
+    int         bootrom_code;
+    int         xram_records;
+};
+
+int open_serial_port(const char *ttyport)
+{
+    char msg[256];
+    int target_fd = open(ttyport, O_RDWR|O_NONBLOCK);
+    if (target_fd < 0)
+    {
+        snprintf(msg, sizeof(msg), "open() serial port error: %s: %s\n", ttyport,
+                 strerror(errno));
+        log_message(LOG_FILE, msg);
+        return -1;
+    }
+
+    ioctl(target_fd, TIOCEXCL);
+    return target_fd;
+}
+
+
+struct baudrate baud_rate_table[] = {
+    /* the first listed rate will be our default */
+    {"115200",	B115200,	0,	0,	100},
+    {"57600",	B57600,		0,	1,	100},
+    {"38400",	B38400,		0,	2,	100},
+    {"19200",	B19200,		0,	4,	50},
+    /* Non-standard high baud rates */
+    {"812500",	BOTHER,		812500,	-1,	1000},
+    {"406250",	BOTHER,		406250,	-1,	500},
+    {"203125",	BOTHER,		203125,	-1,	250},
+    /* table search terminator */
+    {NULL,		B0,		0,	-1,	0},
+};
+
+struct baudrate *find_baudrate_by_name(const char *srch_name)
+{
+    struct baudrate *br;
+
+    for (br = baud_rate_table; br->name; br++)
+        if (!strcmp(br->name, srch_name))
+            break;
+    if (br->name)
+        return(br);
+    else
+    {
+        log_message(LOG_FILE, "error: baud rate not known\n");
+//        fprintf(stderr, "error: baud rate \"%s\" not known\n", srch_name);
+        return(NULL);
+    }
+}
+
+bool baudrate_known(const char *baudname)
+{
+    struct baudrate *br;
+
+    for (br = baud_rate_table; br->name; br++)
+        if (!strcmp(br->name, baudname))
+            return true;
+    return !strcmp(baudname, "auto");
+}
+
+struct baudrate *set_serial_baudrate(struct baudrate *br, int target_fd)
+{
+    struct termios2 target_termios;
+
+    target_termios.c_iflag = IGNBRK;
+    target_termios.c_oflag = 0;
+    target_termios.c_cflag = br->termios_code | CLOCAL|HUPCL|CREAD|CS8;
+    target_termios.c_lflag = 0;
+    target_termios.c_cc[VMIN] = 1;
+    target_termios.c_cc[VTIME] = 0;
+    target_termios.c_ispeed = br->nonstd_speed;
+    target_termios.c_ospeed = br->nonstd_speed;
+    if (ioctl(target_fd, TCSETSF2, &target_termios) < 0) {
+        log_message(LOG_FILE, "ioctl() TCSETSF2 error\n");
+        // perror("TCSETSF2");
+        return NULL;
+    }
+
+    return br;
+}
+
+bool set_fixed_baudrate(const char *baudname, int target_fd)
+{
+    struct baudrate *br;
+
+    br = find_baudrate_by_name(baudname);
+    if (!br)
+        return false; /* error msg already printed */
+    return set_serial_baudrate(br, target_fd) != NULL;
+}
+
+static int baudrate_speed(const struct baudrate *br)
+{
+    return br->nonstd_speed ? br->nonstd_speed : atoi(br->name);
+}
+
+const char *baudrate_probe_order(int i)
+{
+    static struct baudrate *order[sizeof(baud_rate_table) / sizeof(baud_rate_table[0])];
+    static int n;
+    struct baudrate *br, *tmp;
+    int j, k;
+
+    // the table, fastest first (sorted once)
+    if (n == 0) {
+        for (br = baud_rate_table; br->name; br++)
+            order[n++] = br;
+        for (k = 1; k < n; k++) {
+            tmp = order[k];
+            for (j = k; j > 0 && baudrate_speed(order[j - 1]) < baudrate_speed(tmp); j--)
+                order[j] = order[j - 1];
+            order[j] = tmp;
+        }
+    }
+
+    return (i >= 0 && i < n) ? order[i]->name : NULL;
+}
+
+const char *read_saved_baudrate()
+{
+    char name[32];
+    FILE *f = fopen(BAUD_SAVE_FILE, "r");
+    struct baudrate *br = NULL;
+
+    if (!f)
+        return NULL;
+    if (fscanf(f, "%31s", name) == 1)
+        for (br = baud_rate_table; br->name && strcmp(br->name, name); br++)
+            ;
+    fclose(f);
+    return (br && br->name) ? br->name : NULL;
+}
+
+void save_baudrate(const char *baudname)
+{
+    FILE *f = fopen(BAUD_SAVE_FILE, "w");
+
+    if (!f)
+        return;
+    fprintf(f, "%s\n", baudname);
+    fclose(f);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file serial.h
+ * @brief Serial port setup for the modem AT port
+ *
+ */
+
+#ifndef HAVE_SERIAL_H__
+#define HAVE_SERIAL_H__
+
+#include <stdbool.h>
+
+// the first rate of the table, when nothing better is known
+#define BAUD_DEFAULT "115200"
+#define BAUD_PROBE_TRIES 3
+#define BAUD_PROBE_TIMEOUT_MS 300
+// last negotiated rate, relative to the working directory like LOG_FILE
+#define BAUD_SAVE_FILE "dialer.baud"
+
+// -1 when the port can't be opened (not there yet, busy), logged
+int open_serial_port(const char *ttyport);
+// false for an unknown rate or a port that went away
+bool set_fixed_baudrate(const char *baudname, int target_fd);
+
+// "auto" probing: the i-th rate of the table, fastest first, NULL past
+// the end. A rate is good when BAUD_PROBE_TRIES AT/OK exchanges in a row
+// work, each within BAUD_PROBE_TIMEOUT_MS; the modem's command queue runs
+// them (at.c), so the main loop never waits on the probe.
+const char *baudrate_probe_order(int i);
+// the last negotiated rate, only a fallback when none answers, or NULL
+const char *read_saved_baudrate();
+void save_baudrate(const char *baudname);
+// a rate from the table or "auto"
+bool baudrate_known(const char *baudname);
+
+#endif // HAVE_SERIAL_H__
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms-send.c
+ * @brief Bulk SMS from the command line
+ *
+ * Sends one text to a list of numbers and reports messages per minute
+ * and the modem's time per message. By default the batch is left in the
+ * running dialer's outbox (sms_outbox.h), which sends it with
+ * at_sms_send() between calls, and the report is followed until it ends.
+ *
+ * With -m it drives a modem itself the same way instead, for one the
+ * dialer is not using or the simulator (make bench-style measurements
+ * without a dialer).
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "at_parser.h"
+#include "at_queue.h"
+#include "sms_tx.h"
+#include "sms_outbox.h"
+#include "serial.h"
+
+/* how long the client waits before it wonders whether the dialer runs */
+#define CLIENT_PATIENCE_MS 10000
+#define CLIENT_POLL_MS 100
+
+struct sender {
+    const char **numbers;     /* as given, for the outbox */
+    unsigned int count;
+    const char *text;
+    int fd;
+    struct at_parser parser;
+    struct at_queue queue;
+    struct sms_tx tx;
+    bool ready;               /* AT+CMGF=0 answered */
+    bool failed;
+    bool lost;                /* EOF or error on the port */
+    bool verbose;
+};
+
+static void on_line(const struct at_line *line, void *user)
+{
+    struct sender *s = user;
+
+    at_queue_line(&s->queue, line);
+}
+
+static void on_report(const struct sms_tx_part *part, void *user)
+{
+    struct sender *s = user;
+
+    if (part->state == SMS_TX_FAILED && s->lost)
+        printf("%s: not sent, modem lost\n", part->to);
+    else if (part->state == SMS_TX_FAILED)
+        printf("%s: failed, %s %d after %u attempts\n", part->to,
+               part->error < 0 ? "timeout" : part->cme ? "+CME ERROR" : "+CMS ERROR",
+               part->error, part->attempts);
+    else if (s->verbose)
+        printf("%s: sent, reference %d, %.0f ms\n", part->to, part->mr,
+               part->latency_ns / 1e6);
+}
+
+static void on_cmgf(const struct at_command *cmd, enum at_token result,
+                    const char *response, void *user)
+{
+    struct sender *s = user;
+
+    s->ready = result == AT_TOK_OK;
+    s->failed = !s->ready;
+}
+
+static void pump(struct sender *s);
+
+static void on_sms(const struct at_command *cmd, enum at_token result,
+                   const char *response, void *user)
+{
+    struct sender *s = user;
+
+    sms_tx_done(&s->tx, result, response, cmd->payload_sent);
+    pump(s);
+}
+
+static void pump(struct sender *s)
+{
+    struct sms_tx_cmd cmd;
+
+    while (sms_tx_next(&s->tx, &cmd)) {
+        if (!at_queue_submit_prompt(&s->queue, cmd.text, cmd.payload[0] ? cmd.payload : NULL,
+                                    AT_PRIO_NORMAL, cmd.payload[0] ? AT_TIMEOUT_SMS : 0,
+                                    on_sms, s)) {
+            sms_tx_unsubmit(&s->tx);
+            break;
+        }
+    }
+}
+
+/* encoded here in any case, so a text too long is refused before it goes */
+static bool add_number(struct sender *s, const char *number, const char *text)
+{
+    const char **numbers;
+
+    if (!sms_tx_add(&s->tx, number, text)) {
+        fprintf(stderr, "Text too long, more than %d messages\n", SMS_PARTS_MAX);
+        return false;
+    }
+    numbers = realloc(s->numbers, (s->count + 1) * sizeof(*numbers));
+    if (!numbers || !(numbers[s->count] = strdup(number))) {
+        s->numbers = numbers ? numbers : s->numbers;
+        return false;
+    }
+    s->numbers = numbers;
+    s->count++;
+    return true;
+}
+
+/* one number per line, '#' starts a comment */
+static bool add_numbers(struct sender *s, const char *path, const char *text)
+{
+    FILE *f = fopen(path, "r");
+    char line[128], *number;
+
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n")] = 0;
+        number = strtok(line, " \t");
+        if (number && !add_number(s, number, text)) {
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static char *load_text(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char *text = calloc(1, SMS_PARTS_MAX * 160 * 4 + 1);
+    size_t len;
+
+    if (!f || !text) {
+        if (f)
+            fclose(f);
+        free(text);
+        return NULL;
+    }
+    len = fread(text, 1, SMS_PARTS_MAX * 160 * 4, f);
+    fclose(f);
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+        text[--len] = 0;
+    return text;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* ms: the modem's time per part sent, n of them */
+static void print_summary(unsigned int delivered, unsigned int messages, unsigned int sent,
+                          unsigned int failed, unsigned int retries, double seconds,
+                          uint64_t *ms, unsigned int n)
+{
+    double minutes = seconds / 60;
+
+    printf("%u of %u messages sent (%u parts, %u failed, %u retries) in %.1f s, "
+           "%.0f messages per minute\n", delivered, messages, sent, failed,
+           retries, seconds, minutes > 0 ? delivered / minutes : 0);
+    if (n > 0) {
+        qsort(ms, n, sizeof(*ms), cmp_u64);
+        printf("per part: p50 %.0f ms, p90 %.0f ms, p99 %.0f ms, max %.0f ms\n",
+               ms[n / 2] / 1e6, ms[n * 9 / 10] / 1e6, ms[n * 99 / 100] / 1e6,
+               ms[n - 1] / 1e6);
+    }
+}
+
+static void print_tx_summary(struct sender *s)
+{
+    struct sms_tx *tx = &s->tx;
+    uint64_t *ms = malloc((tx->count + 1) * sizeof(*ms));
+    uint64_t end = tx->finished_ns ? tx->finished_ns : tx->last_done_ns;
+    unsigned int i, n = 0;
+
+    for (i = 0; ms && i < tx->count; i++)
+        if (tx->parts[i].state == SMS_TX_SENT)
+            ms[n++] = tx->parts[i].latency_ns;
+    print_summary(sms_tx_delivered(tx), tx->messages, tx->sent, tx->failed, tx->retries,
+                  (end - tx->started_ns) / 1e9, ms, n);
+    free(ms);
+}
+
+/* -m: the modem to ourselves */
+static int run_modem(struct sender *s, const char *modem_path, const char *baud)
+{
+    struct pollfd pfd;
+    char *rx_ptr;
+    size_t rx_space;
+    ssize_t cc;
+    int ret;
+
+    s->fd = open_serial_port(modem_path);
+    if (s->fd < 0 || !set_fixed_baudrate(baud, s->fd)) {
+        fprintf(stderr, "Could not open %s at %s baud\n", modem_path, baud);
+        return EXIT_FAILURE;
+    }
+    at_parser_init(&s->parser, on_line, s);
+    at_queue_init(&s->queue, s->fd);
+    at_queue_submit(&s->queue, "AT+CMGF=0", AT_PRIO_NORMAL, 0, on_cmgf, s);
+
+    while (!s->failed && !(s->ready && sms_tx_finished(&s->tx))) {
+        pfd.fd = s->fd;
+        pfd.events = POLLIN | (at_queue_output_pending(&s->queue) ? POLLOUT : 0);
+        if (poll(&pfd, 1, at_queue_next_timeout(&s->queue)) < 0) {
+            if (errno == EINTR)
+                continue;
+            s->lost = true;
+            break;
+        }
+        if (pfd.revents & POLLOUT)
+            at_queue_output_ready(&s->queue);
+        // a hang up or an error reads as EOF or fails, and would be
+        // polled again at once; the modem was unplugged or reset
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            rx_ptr = at_parser_write_ptr(&s->parser, &rx_space);
+            cc = read(s->fd, rx_ptr, rx_space);
+            if (cc > 0) {
+                at_parser_commit(&s->parser, cc);
+            } else if (cc == 0 || (errno != EAGAIN && errno != EINTR) ||
+                       (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+                s->lost = true;
+                break;
+            }
+        }
+        at_queue_check_timeouts(&s->queue);
+        if (s->ready && s->tx.next == 0 && !s->tx.link_held)
+            pump(s);
+    }
+
+    if (s->lost) {
+        fprintf(stderr, "Lost the modem on %s\n", modem_path);
+        sms_tx_abort(&s->tx);
+    }
+    if (s->failed)
+        fprintf(stderr, "The modem refused PDU mode (AT+CMGF=0)\n");
+    else
+        print_tx_summary(s);
+    ret = s->failed || s->lost || s->tx.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    at_queue_destroy(&s->queue);
+    close(s->fd);
+    return ret;
+}
+
+/* A report line from the dialer, true once it was the last one */
+static bool client_line(struct sender *s, const struct sms_outbox_line *line,
+                        uint64_t *ms, unsigned int *n, int *ret)
+{
+    switch (line->event) {
+    case SMS_OUTBOX_SENT:
+        if (*n < s->tx.count)
+            ms[(*n)++] = line->latency_ms * 1000000ull;
+        if (s->verbose)
+            printf("%s: sent, reference %d, %u ms\n", line->to, line->mr, line->latency_ms);
+        return false;
+    case SMS_OUTBOX_FAILED:
+        printf("%s: failed, %s %d after %u attempts\n", line->to,
+               line->error < 0 ? "timeout" : line->cme ? "+CME ERROR" : "+CMS ERROR",
+               line->error, line->attempts);
+        return false;
+    case SMS_OUTBOX_DONE:
+    default:
+        if (line->messages == 0)
+            fprintf(stderr, "The dialer could not send the batch, see its log\n");
+        else
+            print_summary(line->delivered, line->messages, line->sent, line->failed,
+                          line->retries, line->elapsed_ms / 1e3, ms, *n);
+        *ret = line->messages && !line->failed ? EXIT_SUCCESS : EXIT_FAILURE;
+        return true;
+    }
+}
+
+/* Leave the batch in the dialer's outbox and follow its report */
+static int run_client(struct sender *s, const char *dir, bool wait)
+{
+    char name[SMS_OUTBOX_NAME_MAX], path[PATH_MAX], buf[256];
+    struct sms_outbox_line line;
+    uint64_t *ms;
+    unsigned int n = 0, waited = 0;
+    bool done = false;
+    FILE *report = NULL;
+    long at = 0;
+    int ret = EXIT_FAILURE;
+
+    if (!sms_outbox_submit(dir, s->numbers, s->count, s->text, name)) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    sms_outbox_path(path, dir, name, ".job");
+    if (!wait) {
+        printf("%s\n", path);
+        return EXIT_SUCCESS;
+    }
+
+    ms = malloc((s->tx.count + 1) * sizeof(*ms));
+    sms_outbox_path(path, dir, name, ".report");
+    while (!done && ms) {
+        if (!report)
+            report = fopen(path, "r");
+        // whole lines only, a line being written is read again next time
+        while (report && !done && fgets(buf, sizeof(buf), report)) {
+            if (!sms_outbox_parse(buf, &line)) {
+                fseek(report, at, SEEK_SET);
+                break;
+            }
+            at = ftell(report);
+            done = client_line(s, &line, ms, &n, &ret);
+        }
+        if (report && !done)
+            clearerr(report);
+        if (done)
+            break;
+        usleep(CLIENT_POLL_MS * 1000);
+        waited += CLIENT_POLL_MS;
+        if (!report && waited == CLIENT_PATIENCE_MS)
+            fprintf(stderr, "Queued in %s, waiting for the dialer to take it "
+                    "(is it running?)\n", dir);
+    }
+    if (report)
+        fclose(report);
+    if (done)
+        unlink(path);
+    free(ms);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct sender s;
+    char *modem_path = NULL, *baud = "115200";
+    const char *list = NULL, *dir = SMS_OUTBOX_DIR;
+    char *text = NULL, *text_file = NULL;
+    bool wait = true;
+    unsigned int u;
+    int opt, i, ret;
+
+    while ((opt = getopt(argc, argv, "hm:b:o:nt:T:l:v")) != -1){
+        switch (opt){
+        case 'm':
+            modem_path = optarg;
+            break;
+        case 'b':
+            baud = optarg;
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        case 'n':
+            wait = false;
+            break;
+        case 't':
+            text = optarg;
+            break;
+        case 'T':
+            text_file = optarg;
+            break;
+        case 'l':
+            list = optarg;
+            break;
+        case 'v':
+            s.verbose = true;
+            break;
+        case 'h':
+        default:
+            goto usage;
+        }
+    }
+
+    if (text_file) {
+        text = load_text(text_file);
+        if (!text) {
+            perror(text_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!text || (!list && optind == argc))
+        goto usage;
+    s.text = text;
+
+    sms_tx_init(&s.tx, on_report, &s);
+    if (list && !add_numbers(&s, list, text))
+        return EXIT_FAILURE;
+    for (i = optind; i < argc; i++)
+        if (!add_number(&s, argv[i], text))
+            return EXIT_FAILURE;
+    if (s.tx.count == 0) {
+        fprintf(stderr, "No numbers to send to\n");
+        return EXIT_FAILURE;
+    }
+
+    if (modem_path)
+        ret = run_modem(&s, modem_path, baud);
+    else
+        ret = run_client(&s, dir, wait);
+
+    sms_tx_free(&s.tx);
+    for (u = 0; u < s.count; u++)
+        free((char *) s.numbers[u]);
+    free(s.numbers);
+    if (text_file)
+        free(text);
+    return ret;
+
+usage:
+    fprintf(stderr, "Usage: %s [-o outbox | -m modem_path [-b baud]] [-n] (-t text | -T text_file) [-l number_list] [-v] [number...]\n", argv[0]);
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "    -o <dir>     The running dialer's outbox (default " SMS_OUTBOX_DIR ")\n");
+    fprintf(stderr, "    -n           Leave the batch there, don't wait for the report\n");
+    fprintf(stderr, "    -m <path>    Send from this modem port instead, not in use by the dialer\n");
+    fprintf(stderr, "    -b <baud>    Baud rate with -m (default 115200)\n");
+    fprintf(stderr, "    -t <text>    Message text, UTF-8; long ones go out in parts\n");
+    fprintf(stderr, "    -T <file>    Message text from a file\n");
+    fprintf(stderr, "    -l <file>    Numbers to send to, one per line\n");
+    fprintf(stderr, "    -v           Report every part sent, not just failures\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms.c
+ * @brief Incoming SMS
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sms.h"
+
+void sms_rx_init(struct sms_rx *rx, struct sms_store *store, sms_event_cb listener,
+                 void *user)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->store = store;
+    rx->listener = listener;
+    rx->user = user;
+    rx->index = -1;
+}
+
+/* decode and store one PDU line, false when the store failed */
+static bool take_pdu(struct sms_rx *rx, const struct at_line *line)
+{
+    struct sms msg;
+    size_t len = line->len;
+    int res;
+
+    if (!sms_pdu_decode(line->data, line->len, &msg)) {
+        // nothing is thrown away: keep the PDU for a better decoder
+        memset(&msg, 0, sizeof(msg));
+        if (len >= sizeof(msg.text))
+            len = sizeof(msg.text) - 1;
+        memcpy(msg.text, line->data, len);
+        msg.flags = SMS_FLAG_RAW;
+        msg.time = time(NULL);
+        rx->undecodable++;
+    }
+
+    res = sms_store_append(rx->store, &msg, time(NULL));
+    if (res < 0) {
+        rx->store_errors++;
+        return false;
+    }
+    if (res == 0) {
+        rx->duplicates++;
+        return true;
+    }
+    rx->received++;
+    if (rx->listener)
+        rx->listener(&msg, rx->user);
+    return true;
+}
+
+/* the n-th field after the ':' as a number, -1 when there is none */
+static int field_number(const struct at_line *line, int n)
+{
+    struct at_field f[2];
+
+    if (n >= 2 || at_split_fields(line->data, line->len, f, 2) <= n)
+        return -1;
+    return at_field_int(&f[n]);
+}
+
+enum sms_urc sms_rx_urc(struct sms_rx *rx, const struct at_line *line)
+{
+    if (rx->cmt) {
+        rx->cmt = false;
+        // never on the SIM, the store is the only copy
+        if (take_pdu(rx, line) && !sms_store_sync(rx->store))
+            rx->store_errors++;
+        return SMS_URC_TAKEN;
+    }
+
+    switch (line->token) {
+    case AT_TOK_CMT:
+        // +CMT: [<alpha>],<length>, the PDU follows on the next line
+        rx->cmt = true;
+        return SMS_URC_TAKEN;
+    case AT_TOK_CMTI:
+        return SMS_URC_NEW;
+    default:
+        return SMS_URC_NONE;
+    }
+}
+
+void sms_rx_begin(struct sms_rx *rx)
+{
+    rx->index = -1;
+    rx->nstored = 0;
+    rx->deleted = 0;
+}
+
+void sms_rx_list_line(struct sms_rx *rx, const struct at_line *line)
+{
+    int index = rx->index, stat;
+
+    if (line->token == AT_TOK_CMGL) {
+        // +CMGL: <index>,<stat>,[<alpha>],<length>; stored outgoing ones stay
+        stat = field_number(line, 1);
+        rx->index = stat == 0 || stat == 1 ? field_number(line, 0) : -1;
+        return;
+    }
+    if (index < 0)
+        return;
+    rx->index = -1;
+
+    if (take_pdu(rx, line) && rx->nstored < SMS_SIM_SLOTS)
+        rx->stored[rx->nstored++] = index;
+}
+
+bool sms_rx_commit(struct sms_rx *rx)
+{
+    if (!sms_store_sync(rx->store)) {
+        rx->store_errors++;
+        rx->nstored = 0;
+        return false;
+    }
+    return true;
+}
+
+bool sms_rx_delete_command(struct sms_rx *rx, char *cmd, size_t size)
+{
+    size_t len = 0;
+    int n;
+
+    while (rx->deleted < rx->nstored) {
+        n = snprintf(cmd + len, size - len, len ? ";+CMGD=%d" : "AT+CMGD=%d",
+                     rx->stored[rx->deleted]);
+        if (n < 0 || (size_t) n >= size - len) {
+            cmd[len] = 0;
+            break;
+        }
+        len += n;
+        rx->deleted++;
+    }
+    return len > 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms.h
+ * @brief Incoming SMS
+ *
+ * The modem is in PDU mode (AT+CMGF=0) and announces new messages with
+ * +CMTI. Each announcement, and startup, drains the SIM: one AT+CMGL=4
+ * lists every stored message, each PDU is decoded and appended to the
+ * store as its line arrives, the store is synced, and only then are the
+ * messages that made it deleted from the SIM, many per command line.
+ * Messages delivered straight away (+CMT) go to the store the same way.
+ *
+ * Nothing here talks to the modem; at.c sends what it is told to.
+ *
+ */
+
+#ifndef HAVE_SMS_H__
+#define HAVE_SMS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "at_parser.h"
+#include "sms_pdu.h"
+#include "sms_store.h"
+
+#define SMS_SIM_SLOTS 255         /* EG25 "ME" storage, SIMs hold fewer */
+
+/* a new message, after it was stored */
+typedef void (*sms_event_cb)(const struct sms *msg, void *user);
+
+enum sms_urc {
+    SMS_URC_NONE,                 /* not ours */
+    SMS_URC_TAKEN,                /* +CMT and its PDU */
+    SMS_URC_NEW,                  /* +CMTI: drain the SIM */
+};
+
+struct sms_rx {
+    struct sms_store *store;
+    sms_event_cb listener;
+    void *user;
+
+    int index;                    /* SIM index of the PDU line to come, -1 */
+    bool cmt;                     /* +CMT seen, its PDU is the next line */
+
+    int stored[SMS_SIM_SLOTS];    /* SIM indexes safe to delete */
+    unsigned int nstored;
+    unsigned int deleted;         /* of those, already in delete commands */
+
+    /* statistics */
+    uint64_t received;
+    uint64_t undecodable;         /* kept as raw PDU */
+    uint64_t duplicates;
+    uint64_t store_errors;
+};
+
+void sms_rx_init(struct sms_rx *rx, struct sms_store *store, sms_event_cb listener,
+                 void *user);
+
+/* Offer every line before the command queue sees it */
+enum sms_urc sms_rx_urc(struct sms_rx *rx, const struct at_line *line);
+
+/* AT+CMGL=4: sms_rx_begin() when it is sent, its intermediate lines as they
+ * arrive, sms_rx_commit() after OK. commit is false when the store could
+ * not be synced, then nothing may be deleted. */
+void sms_rx_begin(struct sms_rx *rx);
+void sms_rx_list_line(struct sms_rx *rx, const struct at_line *line);
+bool sms_rx_commit(struct sms_rx *rx);
+
+/* Next command line deleting stored messages from the SIM,
+ * "AT+CMGD=3;+CMGD=4;...", as long as fits size. False when none are left. */
+bool sms_rx_delete_command(struct sms_rx *rx, char *cmd, size_t size);
+
+#endif /* HAVE_SMS_H__ */
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_outbox.c
+ * @brief SMS batches handed to the running dialer
+ *
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sms_outbox.h"
+
+void sms_outbox_path(char *path, const char *dir, const char *name, const char *suffix)
+{
+    snprintf(path, PATH_MAX, "%s/%s%s", dir, name, suffix);
+}
+
+bool sms_outbox_submit(const char *dir, const char * const *to, unsigned int count,
+                       const char *text, char *name)
+{
+    char tmp[PATH_MAX], path[PATH_MAX];
+    unsigned int i, seq;
+    FILE *f;
+    bool ok;
+
+    snprintf(tmp, sizeof(tmp), "%s/.%d.tmp", dir, (int) getpid());
+    f = fopen(tmp, "w");
+    if (!f)
+        return false;
+    // numbers up to an empty line, the text after it as it is
+    for (i = 0; i < count; i++)
+        fprintf(f, "%s\n", to[i]);
+    fprintf(f, "\n%s", text);
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+
+    // link() fails rather than replace a job of the same name
+    for (seq = 0; ok && seq < 100; seq++) {
+        snprintf(name, SMS_OUTBOX_NAME_MAX, "%010lld-%d-%u", (long long) time(NULL),
+                 (int) getpid(), seq);
+        sms_outbox_path(path, dir, name, ".job");
+        if (link(tmp, path) == 0)
+            break;
+    }
+    unlink(tmp);
+    return ok && seq < 100;
+}
+
+bool sms_outbox_next(const char *dir, char *name)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    size_t len;
+    bool found = false;
+
+    if (!d)
+        return false;
+    // names start with the time, the smallest is the oldest
+    while ((e = readdir(d))) {
+        len = strlen(e->d_name);
+        if (e->d_name[0] == '.' || len <= 4 || len - 4 >= SMS_OUTBOX_NAME_MAX ||
+            strcmp(e->d_name + len - 4, ".job") != 0)
+            continue;
+        if (!found || strncmp(e->d_name, name, len - 4) < 0) {
+            memcpy(name, e->d_name, len - 4);
+            name[len - 4] = 0;
+            found = true;
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+static char *read_all(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char *buf = NULL;
+    ssize_t cc;
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1))) {
+        cc = read(fd, buf, st.st_size);
+        if (cc < 0) {
+            free(buf);
+            buf = NULL;
+        } else {
+            buf[cc] = 0;
+        }
+    }
+    close(fd);
+    return buf;
+}
+
+bool sms_outbox_take(const char *dir, const char *name, struct sms_outbox_job *job)
+{
+    char path[PATH_MAX], sending[PATH_MAX];
+    char *buf, *line, *end;
+    unsigned int n = 0;
+
+    memset(job, 0, sizeof(*job));
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    sms_outbox_path(path, dir, name, ".job");
+    sms_outbox_path(sending, dir, name, ".sending");
+    buf = read_all(path);
+    // taken even when it can't be read, it would only be tried again
+    if (rename(path, sending) != 0 || !buf) {
+        free(buf);
+        return false;
+    }
+
+    // every line before the empty one is a number, the text follows it
+    for (line = buf; (end = strchr(line, '\n')) && end != line; line = end + 1)
+        n++;
+    if (!end || n == 0 || !(job->to = calloc(n, sizeof(*job->to)))) {
+        free(buf);
+        return false;
+    }
+    job->text = strdup(end + 1);
+    for (line = buf; job->count < n; line = end + 1) {
+        end = strchr(line, '\n');
+        *end = 0;
+        job->to[job->count] = strdup(line);
+        if (!job->to[job->count++])
+            break;
+    }
+    free(buf);
+    if (!job->text || !job->to[n - 1]) {
+        sms_outbox_job_free(job);
+        return false;
+    }
+    return true;
+}
+
+void sms_outbox_job_free(struct sms_outbox_job *job)
+{
+    unsigned int i;
+
+    for (i = 0; i < job->count; i++)
+        free(job->to[i]);
+    free(job->to);
+    free(job->text);
+    job->to = NULL;
+    job->text = NULL;
+    job->count = 0;
+}
+
+void sms_outbox_finish(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    sms_outbox_path(path, dir, name, ".sending");
+    unlink(path);
+}
+
+void sms_outbox_report_part(FILE *report, const struct sms_tx_part *part)
+{
+    if (part->state == SMS_TX_SENT)
+        fprintf(report, "sent %s %d %u\n", part->to, part->mr,
+                (unsigned int) (part->latency_ns / 1000000));
+    else
+        fprintf(report, "failed %s %s %d %u\n", part->to,
+                part->error < 0 ? "timeout" : part->cme ? "cme" : "cms", part->error,
+                part->attempts);
+    fflush(report);
+}
+
+/* tx NULL: nothing was sent */
+void sms_outbox_report_done(FILE *report, const struct sms_tx *tx)
+{
+    uint64_t end;
+
+    if (!tx) {
+        fprintf(report, "done 0 0 0 0 0 0\n");
+    } else {
+        end = tx->finished_ns ? tx->finished_ns : tx->last_done_ns;
+        fprintf(report, "done %u %u %u %u %u %u\n", sms_tx_delivered(tx), tx->messages,
+                tx->sent, tx->failed, tx->retries,
+                (unsigned int) ((end - tx->started_ns) / 1000000));
+    }
+    fflush(report);
+}
+
+bool sms_outbox_parse(const char *text, struct sms_outbox_line *line)
+{
+    char kind[8];
+    int end = 0;
+
+    memset(line, 0, sizeof(*line));
+    if (sscanf(text, "sent %23s %d %u\n%n", line->to, &line->mr, &line->latency_ms,
+               &end) == 3 && end > 0) {
+        line->event = SMS_OUTBOX_SENT;
+    } else if (sscanf(text, "failed %23s %7s %d %u\n%n", line->to, kind, &line->error,
+                      &line->attempts, &end) == 4 && end > 0) {
+        line->event = SMS_OUTBOX_FAILED;
+        line->cme = strcmp(kind, "cme") == 0;
+    } else if (sscanf(text, "done %u %u %u %u %u %u\n%n", &line->delivered,
+                      &line->messages, &line->sent, &line->failed, &line->retries,
+                      &line->elapsed_ms, &end) == 6 && end > 0) {
+        line->event = SMS_OUTBOX_DONE;
+    } else {
+        return false;
+    }
+    // a line still being written has no newline yet
+    return text[end - 1] == '\n';
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_outbox.h
+ * @brief SMS batches handed to the running dialer
+ *
+ * A spool directory. A client writes a job (the numbers, then the text)
+ * under a dot name and renames it to NAME.job, so the dialer never sees
+ * half of one. The dialer renames the job it takes to NAME.sending and
+ * appends a line per part to NAME.report as it is sent or fails, then
+ * one "done" line with the totals, and removes NAME.sending. The client
+ * follows the report and removes it once it read the end.
+ *
+ * A job still NAME.sending when the dialer starts was cut short; it is
+ * left alone rather than sent twice.
+ *
+ */
+
+#ifndef HAVE_SMS_OUTBOX_H__
+#define HAVE_SMS_OUTBOX_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sms_pdu.h"
+#include "sms_tx.h"
+
+#define SMS_OUTBOX_DIR "dialer.outbox"
+#define SMS_OUTBOX_NAME_MAX 32
+
+struct sms_outbox_job {
+    char name[SMS_OUTBOX_NAME_MAX];
+    char **to;
+    unsigned int count;
+    char *text;
+};
+
+enum sms_outbox_event {
+    SMS_OUTBOX_SENT,
+    SMS_OUTBOX_FAILED,
+    SMS_OUTBOX_DONE,
+};
+
+/* one report line */
+struct sms_outbox_line {
+    enum sms_outbox_event event;
+    /* SENT and FAILED */
+    char to[SMS_ADDR_MAX];
+    int mr;
+    unsigned int latency_ms;
+    int error;                    /* -1 timeout or modem lost */
+    bool cme;
+    unsigned int attempts;
+    /* DONE */
+    unsigned int delivered;
+    unsigned int messages;
+    unsigned int sent;
+    unsigned int failed;
+    unsigned int retries;
+    unsigned int elapsed_ms;
+};
+
+/* Queue text for count numbers in dir; name gets the job's name */
+bool sms_outbox_submit(const char *dir, const char * const *to, unsigned int count,
+                       const char *text, char *name);
+
+/* The oldest job waiting in dir, false when there is none */
+bool sms_outbox_next(const char *dir, char *name);
+
+/* Take job name: read it and rename it to NAME.sending */
+bool sms_outbox_take(const char *dir, const char *name, struct sms_outbox_job *job);
+void sms_outbox_job_free(struct sms_outbox_job *job);
+/* the job is over, its report complete */
+void sms_outbox_finish(const char *dir, const char *name);
+
+/* "dir/name.suffix" into path, PATH_MAX long */
+void sms_outbox_path(char *path, const char *dir, const char *name, const char *suffix);
+
+/* report lines, flushed as they are written */
+void sms_outbox_report_part(FILE *report, const struct sms_tx_part *part);
+void sms_outbox_report_done(FILE *report, const struct sms_tx *tx);
+/* false for anything but a complete report line */
+bool sms_outbox_parse(const char *text, struct sms_outbox_line *line);
+
+#endif /* HAVE_SMS_OUTBOX_H__ */
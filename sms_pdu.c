@@ -0,0 +1,724 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_pdu.c
+ * @brief 3GPP 23.040 SMS PDU codec
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "sms_pdu.h"
+
+#define GSM7_ESCAPE 0x1B
+#define UD_MAX 140                /* user data octets */
+#define GSM7_MAX 160              /* septets */
+
+/* 23.038 default alphabet */
+static const uint16_t gsm7_default[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+/* after GSM7_ESCAPE */
+static const struct {
+    uint8_t septet;
+    uint16_t ucs;
+} gsm7_extension[] = {
+    { 0x0A, 0x000C }, { 0x14, '^' }, { 0x28, '{' }, { 0x29, '}' }, { 0x2F, '\\' },
+    { 0x3C, '[' }, { 0x3D, '~' }, { 0x3E, ']' }, { 0x40, '|' }, { 0x65, 0x20AC },
+};
+
+#define EXTENSIONS (sizeof(gsm7_extension) / sizeof(gsm7_extension[0]))
+
+/* ---- decoding ---- */
+
+struct pdu_in {
+    const char *hex;
+    size_t len;
+    size_t pos;                   /* in hex digits */
+    bool bad;                     /* ran out of digits or hit a non-hex one */
+};
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static unsigned int get_octet(struct pdu_in *in)
+{
+    int hi, lo;
+
+    if (in->pos + 2 > in->len) {
+        in->bad = true;
+        return 0;
+    }
+    hi = hex_value(in->hex[in->pos]);
+    lo = hex_value(in->hex[in->pos + 1]);
+    in->pos += 2;
+    if (hi < 0 || lo < 0) {
+        in->bad = true;
+        return 0;
+    }
+    return hi << 4 | lo;
+}
+
+static void skip_octets(struct pdu_in *in, size_t n)
+{
+    in->pos += 2 * n;
+    if (in->pos > in->len)
+        in->bad = true;
+}
+
+struct text_out {
+    char *p;
+    size_t size;
+    size_t len;
+};
+
+/* drops what doesn't fit, always NUL terminated */
+static void put_utf8(struct text_out *out, uint32_t c)
+{
+    char buf[4];
+    size_t n;
+
+    if (c < 0x80) {
+        buf[0] = c;
+        n = 1;
+    } else if (c < 0x800) {
+        buf[0] = 0xC0 | c >> 6;
+        buf[1] = 0x80 | (c & 0x3F);
+        n = 2;
+    } else if (c < 0x10000) {
+        buf[0] = 0xE0 | c >> 12;
+        buf[1] = 0x80 | ((c >> 6) & 0x3F);
+        buf[2] = 0x80 | (c & 0x3F);
+        n = 3;
+    } else {
+        buf[0] = 0xF0 | c >> 18;
+        buf[1] = 0x80 | ((c >> 12) & 0x3F);
+        buf[2] = 0x80 | ((c >> 6) & 0x3F);
+        buf[3] = 0x80 | (c & 0x3F);
+        n = 4;
+    }
+    if (out->len + n >= out->size)
+        return;
+    memcpy(out->p + out->len, buf, n);
+    out->len += n;
+    out->p[out->len] = 0;
+}
+
+/* septets come out of the octets LSB first */
+struct septets {
+    struct pdu_in *in;
+    uint32_t acc;
+    unsigned int bits;
+};
+
+static unsigned int get_septet(struct septets *s)
+{
+    unsigned int v;
+
+    if (s->bits < 7) {
+        s->acc |= get_octet(s->in) << s->bits;
+        s->bits += 8;
+    }
+    v = s->acc & 0x7F;
+    s->acc >>= 7;
+    s->bits -= 7;
+    return v;
+}
+
+static uint16_t gsm7_extended(unsigned int septet)
+{
+    size_t i;
+
+    for (i = 0; i < EXTENSIONS; i++)
+        if (gsm7_extension[i].septet == septet)
+            return gsm7_extension[i].ucs;
+    return gsm7_default[septet];
+}
+
+static void decode_gsm7(struct septets *s, unsigned int count, struct text_out *out)
+{
+    unsigned int i, c;
+    bool escape = false;
+
+    for (i = 0; i < count; i++) {
+        c = get_septet(s);
+        if (escape) {
+            put_utf8(out, gsm7_extended(c));
+            escape = false;
+        } else if (c == GSM7_ESCAPE) {
+            escape = true;
+        } else {
+            put_utf8(out, gsm7_default[c]);
+        }
+    }
+}
+
+static void decode_address(struct pdu_in *in, unsigned int digits, unsigned int toa,
+                           char *addr, size_t size)
+{
+    static const char bcd[] = "0123456789*#abc";
+    struct text_out out = { addr, size, 0 };
+    struct septets s = { in, 0, 0 };
+    size_t end = in->pos + 2 * ((digits + 1) / 2);
+    unsigned int i, o;
+
+    addr[0] = 0;
+    if (((toa >> 4) & 7) == 5) {
+        // alphanumeric, digits counts the semi-octets of packed GSM 7 bit
+        decode_gsm7(&s, digits * 4 / 7, &out);
+        in->pos = end;
+        return;
+    }
+
+    if (((toa >> 4) & 7) == 1)
+        put_utf8(&out, '+');
+    for (i = 0; i < digits; i += 2) {
+        o = get_octet(in);
+        if ((o & 0x0F) < 15)
+            put_utf8(&out, bcd[o & 0x0F]);
+        if (i + 1 < digits && (o >> 4) < 15)
+            put_utf8(&out, bcd[o >> 4]);
+    }
+}
+
+static int swapped_bcd(unsigned int o)
+{
+    return (o & 0x0F) * 10 + (o >> 4);
+}
+
+/* TP-SCTS: local time and its offset from UTC in quarters of an hour */
+static int64_t decode_scts(struct pdu_in *in)
+{
+    unsigned int o[7];
+    struct tm tm;
+    int i, quarters;
+
+    for (i = 0; i < 7; i++)
+        o[i] = get_octet(in);
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 100 + swapped_bcd(o[0]);
+    tm.tm_mon = swapped_bcd(o[1]) - 1;
+    tm.tm_mday = swapped_bcd(o[2]);
+    tm.tm_hour = swapped_bcd(o[3]);
+    tm.tm_min = swapped_bcd(o[4]);
+    tm.tm_sec = swapped_bcd(o[5]);
+    if (tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+        tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+        return 0;
+
+    quarters = (o[6] & 0x07) * 10 + (o[6] >> 4);
+    if (o[6] & 0x08)
+        quarters = -quarters;
+    return (int64_t) timegm(&tm) - quarters * 15 * 60;
+}
+
+/* 23.038 data coding scheme, -1 for compressed text */
+static int dcs_alphabet(unsigned int dcs)
+{
+    switch (dcs >> 4) {
+    case 0x0: case 0x1: case 0x2: case 0x3:
+    case 0x4: case 0x5: case 0x6: case 0x7:
+        if (dcs & 0x20)
+            return -1;
+        return ((dcs >> 2) & 3) == 3 ? SMS_GSM7 : (dcs >> 2) & 3;
+    case 0xE:
+        return SMS_UCS2;
+    case 0xF:
+        return dcs & 0x04 ? SMS_8BIT : SMS_GSM7;
+    default:
+        return SMS_GSM7;
+    }
+}
+
+/* Concatenation is the only element we care about. Returns the header
+ * octets, length octet included. */
+static unsigned int decode_udh(struct pdu_in *in, struct sms *msg)
+{
+    unsigned int udhl = get_octet(in), iei, iel;
+    size_t end = in->pos + 2 * udhl;
+
+    while (!in->bad && in->pos + 4 <= end) {
+        iei = get_octet(in);
+        iel = get_octet(in);
+        if (iei == 0x00 && iel == 3) {
+            msg->ref = get_octet(in);
+            msg->parts = get_octet(in);
+            msg->part = get_octet(in);
+        } else if (iei == 0x08 && iel == 4) {
+            msg->ref = get_octet(in) << 8;
+            msg->ref |= get_octet(in);
+            msg->parts = get_octet(in);
+            msg->part = get_octet(in);
+        } else {
+            skip_octets(in, iel);
+        }
+    }
+    in->pos = end;
+    if (in->pos > in->len)
+        in->bad = true;
+    return udhl + 1;
+}
+
+static void decode_ucs2(struct pdu_in *in, unsigned int octets, struct text_out *out)
+{
+    uint32_t c, low;
+    unsigned int i;
+
+    for (i = 0; i + 1 < octets; i += 2) {
+        c = get_octet(in) << 8;
+        c |= get_octet(in);
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < octets) {
+            low = get_octet(in) << 8;
+            low |= get_octet(in);
+            i += 2;
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        }
+        put_utf8(out, c);
+    }
+}
+
+bool sms_pdu_decode(const char *hex, size_t len, struct sms *msg)
+{
+    struct pdu_in in = { hex, len, 0, false };
+    struct text_out out = { msg->text, sizeof(msg->text), 0 };
+    struct septets s = { &in, 0, 0 };
+    unsigned int first, digits, toa, dcs, udl, header = 0, skip = 0, fill;
+    int alphabet;
+
+    memset(msg, 0, sizeof(*msg));
+
+    skip_octets(&in, get_octet(&in));       /* SMSC */
+    first = get_octet(&in);
+    if ((first & 0x03) != 0)                /* not an SMS-DELIVER */
+        return false;
+
+    digits = get_octet(&in);
+    toa = get_octet(&in);
+    if (digits > 2 * (SMS_ADDR_MAX - 2))
+        return false;
+    decode_address(&in, digits, toa, msg->sender, sizeof(msg->sender));
+
+    get_octet(&in);                         /* TP-PID */
+    dcs = get_octet(&in);
+    msg->time = decode_scts(&in);
+    udl = get_octet(&in);
+
+    alphabet = dcs_alphabet(dcs);
+    if (alphabet < 0 || in.bad)
+        return false;
+    msg->alphabet = alphabet;
+
+    if (first & 0x40)
+        header = decode_udh(&in, msg);
+
+    switch (alphabet) {
+    case SMS_GSM7:
+        // the header is padded to a septet boundary
+        if (header) {
+            skip = (header * 8 + 6) / 7;
+            fill = skip * 7 - header * 8;
+            if (fill) {
+                s.acc = get_octet(&in) >> fill;
+                s.bits = 8 - fill;
+            }
+        }
+        if (skip > udl)
+            return false;
+        decode_gsm7(&s, udl - skip, &out);
+        break;
+    case SMS_UCS2:
+        if (header > udl)
+            return false;
+        decode_ucs2(&in, udl - header, &out);
+        break;
+    case SMS_8BIT:
+        if (header > udl)
+            return false;
+        // kept as hex, there is no telling what it is
+        udl -= header;
+        if (in.pos + 2 * udl > len || 2 * udl >= sizeof(msg->text))
+            return false;
+        memcpy(msg->text, hex + in.pos, 2 * udl);
+        msg->text[2 * udl] = 0;
+        in.pos += 2 * udl;
+        break;
+    }
+
+    return !in.bad;
+}
+
+/* ---- encoding ---- */
+
+struct pdu_out {
+    char *hex;
+    size_t size;
+    size_t len;
+    bool full;
+};
+
+static void put_octet(struct pdu_out *out, unsigned int v)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    if (out->len + 3 > out->size) {
+        out->full = true;
+        return;
+    }
+    out->hex[out->len++] = digits[(v >> 4) & 0x0F];
+    out->hex[out->len++] = digits[v & 0x0F];
+    out->hex[out->len] = 0;
+}
+
+/* next code point, invalid sequences come out as U+FFFD */
+static uint32_t next_utf8(const unsigned char **s)
+{
+    const unsigned char *p = *s;
+    uint32_t c = *p++;
+    int extra, i;
+
+    if (c < 0x80)
+        extra = 0;
+    else if ((c & 0xE0) == 0xC0)
+        extra = 1, c &= 0x1F;
+    else if ((c & 0xF0) == 0xE0)
+        extra = 2, c &= 0x0F;
+    else if ((c & 0xF8) == 0xF0)
+        extra = 3, c &= 0x07;
+    else
+        extra = -1;
+
+    for (i = 0; i < extra; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            extra = -1;
+            break;
+        }
+        c = c << 6 | (p[i] & 0x3F);
+    }
+    if (extra < 0) {
+        *s = p;
+        return 0xFFFD;
+    }
+    *s = p + extra;
+    return c;
+}
+
+/* the default alphabet and its extension, -1 when c is in neither */
+static int gsm7_lookup(uint32_t c, bool *escaped)
+{
+    int i;
+
+    *escaped = false;
+    for (i = 0; i < 128; i++)
+        if (gsm7_default[i] == c && i != GSM7_ESCAPE)
+            return i;
+    for (i = 0; i < (int) EXTENSIONS; i++) {
+        if (gsm7_extension[i].ucs == c) {
+            *escaped = true;
+            return gsm7_extension[i].septet;
+        }
+    }
+    return -1;
+}
+
+/* text as septets, false when it needs UCS2 or is longer than max */
+static bool gsm7_septets(const char *text, uint8_t *septets, unsigned int max,
+                         unsigned int *count)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    unsigned int n = 0;
+    bool escaped;
+    int v;
+
+    while (*p) {
+        v = gsm7_lookup(next_utf8(&p), &escaped);
+        if (v < 0 || n + escaped + 1 > max)
+            return false;
+        if (escaped)
+            septets[n++] = GSM7_ESCAPE;
+        septets[n++] = v;
+    }
+    *count = n;
+    return true;
+}
+
+/* pack septets at septet offset first of data, LSB first */
+static void pack_septets(uint8_t *data, unsigned int first, const uint8_t *septets,
+                         unsigned int count)
+{
+    unsigned int i, bit;
+
+    for (i = 0; i < count; i++) {
+        bit = (first + i) * 7;
+        data[bit / 8] |= septets[i] << (bit % 8);
+        if (bit % 8 > 1)
+            data[bit / 8 + 1] |= septets[i] >> (8 - bit % 8);
+    }
+}
+
+struct user_data {
+    uint8_t data[UD_MAX + 1];
+    unsigned int udl;             /* septets or octets, as TP-UDL counts */
+    unsigned int octets;
+    int alphabet;
+};
+
+/* TP-UD of one PDU, with a concatenation header when parts > 1 */
+static bool build_user_data(const char *text, uint16_t ref, uint8_t part, uint8_t parts,
+                            struct user_data *ud)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    uint8_t septets[GSM7_MAX];
+    unsigned int header = 0, skip = 0, count;
+    uint32_t c;
+
+    memset(ud, 0, sizeof(*ud));
+    if (parts > 1) {
+        ud->data[0] = 5;
+        ud->data[1] = 0x00;
+        ud->data[2] = 3;
+        ud->data[3] = ref & 0xFF;
+        ud->data[4] = parts;
+        ud->data[5] = part;
+        header = 6;
+        skip = (header * 8 + 6) / 7;
+    }
+
+    if (gsm7_septets(text, septets, GSM7_MAX - skip, &count)) {
+        pack_septets(ud->data, skip, septets, count);
+        ud->alphabet = SMS_GSM7;
+        ud->udl = skip + count;
+        ud->octets = (ud->udl * 7 + 7) / 8;
+        return true;
+    }
+
+    ud->alphabet = SMS_UCS2;
+    ud->octets = header;
+    while (*p) {
+        c = next_utf8(&p);
+        if (c >= 0x10000) {
+            if (ud->octets + 4 > UD_MAX)
+                return false;
+            c -= 0x10000;
+            ud->data[ud->octets++] = (0xD800 + (c >> 10)) >> 8;
+            ud->data[ud->octets++] = (0xD800 + (c >> 10)) & 0xFF;
+            ud->data[ud->octets++] = (0xDC00 + (c & 0x3FF)) >> 8;
+            ud->data[ud->octets++] = (0xDC00 + (c & 0x3FF)) & 0xFF;
+        } else {
+            if (ud->octets + 2 > UD_MAX)
+                return false;
+            ud->data[ud->octets++] = c >> 8;
+            ud->data[ud->octets++] = c & 0xFF;
+        }
+    }
+    ud->udl = ud->octets;
+    return true;
+}
+
+/* "+5511..." as BCD, anything else as an alphanumeric address */
+static void encode_address(struct pdu_out *out, const char *addr)
+{
+    uint8_t septets[SMS_ADDR_MAX], packed[SMS_ADDR_MAX];
+    const char *digits = addr[0] == '+' ? addr + 1 : addr;
+    unsigned int n = strlen(digits), i, count;
+
+    if (n > 0 && strspn(digits, "0123456789") == n) {
+        put_octet(out, n);
+        put_octet(out, addr[0] == '+' ? 0x91 : 0x81);
+        for (i = 0; i < n; i += 2)
+            put_octet(out, (digits[i] - '0') | (i + 1 < n ? digits[i + 1] - '0' : 0xF) << 4);
+        return;
+    }
+
+    if (!gsm7_septets(addr, septets, 11, &count))
+        count = 0;
+    memset(packed, 0, sizeof(packed));
+    pack_septets(packed, 0, septets, count);
+    put_octet(out, (count * 7 + 3) / 4);
+    put_octet(out, 0xD0);
+    for (i = 0; i < (count * 7 + 7) / 8; i++)
+        put_octet(out, packed[i]);
+}
+
+static unsigned int to_swapped_bcd(int v)
+{
+    return (v % 10) << 4 | (v / 10) % 10;
+}
+
+size_t sms_pdu_encode_deliver(const struct sms *msg, char *hex, size_t size,
+                              unsigned int *tpdu_len)
+{
+    struct pdu_out out = { hex, size, 0, false };
+    struct user_data ud;
+    time_t t = msg->time;
+    struct tm tm;
+    unsigned int i;
+
+    if (!build_user_data(msg->text, msg->ref, msg->part, msg->parts, &ud))
+        return 0;
+    gmtime_r(&t, &tm);
+
+    put_octet(&out, 0);                     /* no SMSC */
+    // SMS-DELIVER, no more messages waiting
+    put_octet(&out, 0x04 | (msg->parts > 1 ? 0x40 : 0));
+    encode_address(&out, msg->sender);
+    put_octet(&out, 0);                     /* TP-PID */
+    put_octet(&out, ud.alphabet == SMS_UCS2 ? 0x08 : 0x00);
+    put_octet(&out, to_swapped_bcd(tm.tm_year % 100));
+    put_octet(&out, to_swapped_bcd(tm.tm_mon + 1));
+    put_octet(&out, to_swapped_bcd(tm.tm_mday));
+    put_octet(&out, to_swapped_bcd(tm.tm_hour));
+    put_octet(&out, to_swapped_bcd(tm.tm_min));
+    put_octet(&out, to_swapped_bcd(tm.tm_sec));
+    put_octet(&out, 0);                     /* UTC */
+    put_octet(&out, ud.udl);
+    for (i = 0; i < ud.octets; i++)
+        put_octet(&out, ud.data[i]);
+
+    if (out.full)
+        return 0;
+    if (tpdu_len)
+        *tpdu_len = out.len / 2 - 1;
+    return out.len;
+}
+
+/* septets (default alphabet) or octets (UCS2) c takes in user data */
+static unsigned int char_units(uint32_t c, bool gsm7)
+{
+    bool escaped;
+
+    if (gsm7)
+        return gsm7_lookup(c, &escaped) < 0 ? 0 : 1 + escaped;
+    return c >= 0x10000 ? 4 : 2;
+}
+
+/* where the part starting at text ends, the whole text when room is big
+ * enough. Characters are never split, escapes and surrogates included. */
+static const char *part_end(const char *text, bool gsm7, unsigned int room)
+{
+    const unsigned char *p = (const unsigned char *) text, *next;
+    unsigned int used = 0, units;
+
+    while (*p) {
+        next = p;
+        units = char_units(next_utf8(&next), gsm7);
+        if (used + units > room)
+            break;
+        used += units;
+        p = next;
+    }
+    return (const char *) p;
+}
+
+static bool is_gsm7(const char *text)
+{
+    const unsigned char *p = (const unsigned char *) text;
+
+    while (*p)
+        if (char_units(next_utf8(&p), true) == 0)
+            return false;
+    return true;
+}
+
+static size_t encode_submit(const char *addr, const struct user_data *ud, bool concatenated,
+                            struct sms_submit *pdu)
+{
+    struct pdu_out out = { pdu->hex, sizeof(pdu->hex), 0, false };
+    unsigned int i;
+
+    put_octet(&out, 0);                     /* SMSC from AT+CSCA */
+    // SMS-SUBMIT, relative validity period
+    put_octet(&out, 0x01 | 0x10 | (concatenated ? 0x40 : 0));
+    put_octet(&out, 0);                     /* TP-MR, the modem sets it */
+    encode_address(&out, addr);
+    put_octet(&out, 0);                     /* TP-PID */
+    put_octet(&out, ud->alphabet == SMS_UCS2 ? 0x08 : 0x00);
+    put_octet(&out, 0xA7);                  /* valid for a day */
+    put_octet(&out, ud->udl);
+    for (i = 0; i < ud->octets; i++)
+        put_octet(&out, ud->data[i]);
+
+    if (out.full)
+        return 0;
+    pdu->tpdu_len = out.len / 2 - 1;
+    return out.len;
+}
+
+unsigned int sms_pdu_encode_submit(const char *addr, const char *text, uint16_t ref,
+                                   struct sms_submit *pdus, unsigned int max)
+{
+    char part[UD_MAX * 4 + 1];
+    const char *start, *end;
+    struct user_data ud;
+    bool gsm7 = is_gsm7(text);
+    unsigned int parts = 0, room, i;
+
+    if (*part_end(text, gsm7, gsm7 ? GSM7_MAX : UD_MAX) == 0) {
+        if (max < 1 || !build_user_data(text, 0, 0, 1, &ud) ||
+            !encode_submit(addr, &ud, false, &pdus[0]))
+            return 0;
+        return 1;
+    }
+
+    // room left by the 6 octet concatenation header
+    room = gsm7 ? GSM7_MAX - 7 : UD_MAX - 6;
+    for (start = text; *start; start = end, parts++)
+        end = part_end(start, gsm7, room);
+    if (parts > max || parts > 255)
+        return 0;
+
+    for (start = text, i = 0; i < parts; i++, start = end) {
+        end = part_end(start, gsm7, room);
+        memcpy(part, start, end - start);
+        part[end - start] = 0;
+        if (!build_user_data(part, ref, i + 1, parts, &ud) ||
+            !encode_submit(addr, &ud, true, &pdus[i]))
+            return 0;
+    }
+    return parts;
+}
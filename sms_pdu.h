@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_pdu.h
+ * @brief 3GPP 23.040 SMS PDU codec
+ *
+ * PDUs are decoded straight from the hex text the modem sends (AT+CMGF=0),
+ * octet by octet, without converting the whole PDU first. GSM 7 bit
+ * (with the extension table), UCS2 and 8 bit data are understood; text
+ * comes out as UTF-8. Concatenation headers are decoded, parts are not
+ * joined.
+ *
+ * Outgoing text is encoded as SMS-SUBMIT, in the default alphabet when it
+ * can be and UCS2 otherwise, split into concatenated parts when it does
+ * not fit one message.
+ *
+ */
+
+#ifndef HAVE_SMS_PDU_H__
+#define HAVE_SMS_PDU_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SMS_ADDR_MAX 24
+#define SMS_TEXT_MAX 640          /* 160 septets, or hex of 8 bit data */
+#define SMS_PDU_MAX 180           /* octets, SMSC address included */
+#define SMS_PDU_HEX (SMS_PDU_MAX * 2 + 1)
+#define SMS_PARTS_MAX 10          /* longest text sent, in messages */
+
+enum sms_alphabet {
+    SMS_GSM7 = 0,
+    SMS_8BIT,
+    SMS_UCS2,
+};
+
+/* flags */
+#define SMS_FLAG_RAW 0x01         /* undecodable, text holds the PDU hex */
+
+struct sms {
+    char sender[SMS_ADDR_MAX];    /* "+5511...", or an alphanumeric name */
+    int64_t time;                 /* service centre time stamp, unix UTC */
+    uint8_t alphabet;
+    uint8_t flags;
+    uint16_t ref;                 /* concatenation reference, 0 when single */
+    uint8_t part;                 /* 1 based, 0 when single */
+    uint8_t parts;
+    char text[SMS_TEXT_MAX];      /* UTF-8 */
+};
+
+struct sms_submit {
+    char hex[SMS_PDU_HEX];        /* without SMSC: "00" then the TPDU */
+    unsigned int tpdu_len;        /* octets, as AT+CMGS wants it */
+};
+
+/* SMS-DELIVER as listed by +CMGL, +CMGR and +CMT, SMSC address first */
+bool sms_pdu_decode(const char *hex, size_t len, struct sms *msg);
+
+/* The other way, for the simulator and benchmarks. Returns the hex length
+ * (0 when the text doesn't fit one PDU); tpdu_len is the octet count
+ * without the SMSC, as +CMGL and AT+CMGS want it. */
+size_t sms_pdu_encode_deliver(const struct sms *msg, char *hex, size_t size,
+                              unsigned int *tpdu_len);
+
+/* SMS-SUBMIT of text to addr (the SMSC from AT+CSCA is used), one PDU per
+ * part. ref tells the parts of a long text apart from those of the last
+ * one. Returns the number of parts, 0 when text needs more than max. */
+unsigned int sms_pdu_encode_submit(const char *addr, const char *text, uint16_t ref,
+                                   struct sms_submit *pdus, unsigned int max);
+
+#endif /* HAVE_SMS_PDU_H__ */
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_store.c
+ * @brief Append-only message store
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "sms_store.h"
+
+#define SMS_RECORD_MAGIC 0x31534D53u   /* "SMS1" */
+#define SMS_READ_CHUNK 65536
+#define SMS_DUP_WINDOW 64              /* newest messages of a sender checked */
+
+/* on disk, host byte order, followed by sender and text (no NULs) */
+struct sms_record {
+    uint32_t magic;
+    uint16_t text_len;
+    uint8_t sender_len;
+    uint8_t flags;
+    int64_t time;
+    int64_t received;
+    uint16_t ref;
+    uint8_t part;
+    uint8_t parts;
+    uint8_t alphabet;
+    uint8_t pad[3];
+};
+
+#define RECORD_MAX (sizeof(struct sms_record) + SMS_ADDR_MAX + SMS_TEXT_MAX)
+
+static uint32_t fnv1a(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static bool grow(struct sms_store *s)
+{
+    uint32_t capacity = s->capacity ? s->capacity * 2 : 1024;
+    struct sms_entry *entries;
+    uint32_t *by_time;
+
+    entries = realloc(s->entries, capacity * sizeof(*entries));
+    if (!entries)
+        return false;
+    s->entries = entries;
+    by_time = realloc(s->by_time, capacity * sizeof(*by_time));
+    if (!by_time)
+        return false;
+    s->by_time = by_time;
+    s->capacity = capacity;
+    return true;
+}
+
+/* one bucket per message at most, chains stay short */
+static bool rehash(struct sms_store *s)
+{
+    uint32_t buckets = s->sender_buckets ? s->sender_buckets * 2 : 1024, i, slot;
+    int32_t *senders = malloc(buckets * sizeof(*senders));
+
+    if (!senders)
+        return false;
+    for (i = 0; i < buckets; i++)
+        senders[i] = -1;
+    // file order is oldest first, so every chain comes out newest first
+    for (i = 0; i < s->count; i++) {
+        slot = s->entries[i].sender_hash & (buckets - 1);
+        s->entries[i].older = senders[slot];
+        senders[slot] = i;
+    }
+    free(s->senders);
+    s->senders = senders;
+    s->sender_buckets = buckets;
+    return true;
+}
+
+/* first position in by_time whose message is newer than time */
+static uint32_t time_upper_bound(const struct sms_store *s, int64_t time)
+{
+    uint32_t lo = 0, hi = s->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->entries[s->by_time[mid]].time <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static uint32_t time_lower_bound(const struct sms_store *s, int64_t time)
+{
+    uint32_t lo = 0, hi = s->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->entries[s->by_time[mid]].time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool add_entry(struct sms_store *s, int64_t time, uint64_t offset,
+                      uint32_t sender_hash, uint32_t text_hash)
+{
+    struct sms_entry *e;
+    uint32_t n = s->count, pos, slot;
+
+    if (n == s->capacity && !grow(s))
+        return false;
+    if (n >= s->sender_buckets && !rehash(s))
+        return false;
+
+    e = &s->entries[n];
+    e->time = time;
+    e->offset = offset;
+    e->sender_hash = sender_hash;
+    e->text_hash = text_hash;
+    slot = sender_hash & (s->sender_buckets - 1);
+    e->older = s->senders[slot];
+    s->senders[slot] = n;
+
+    // messages mostly arrive in order, the move is short or nothing
+    pos = time_upper_bound(s, time);
+    memmove(s->by_time + pos + 1, s->by_time + pos, (n - pos) * sizeof(*s->by_time));
+    s->by_time[pos] = n;
+    s->count++;
+    return true;
+}
+
+/* a complete record at buf, or 0 */
+static size_t record_size(const char *buf, size_t len)
+{
+    struct sms_record r;
+    size_t size;
+
+    if (len < sizeof(r))
+        return 0;
+    memcpy(&r, buf, sizeof(r));
+    if (r.magic != SMS_RECORD_MAGIC || r.sender_len >= SMS_ADDR_MAX ||
+        r.text_len >= SMS_TEXT_MAX)
+        return 0;
+    size = sizeof(r) + r.sender_len + r.text_len;
+    return size <= len ? size : 0;
+}
+
+/* where the magic is next seen at or after from, len when it isn't */
+static size_t find_magic(const char *buf, size_t from, size_t len)
+{
+    const uint32_t magic = SMS_RECORD_MAGIC;
+
+    for (; from + sizeof(magic) <= len; from++)
+        if (memcmp(buf + from, &magic, sizeof(magic)) == 0)
+            return from;
+    return len;
+}
+
+/* Index every record. A bad one at the very end (less than RECORD_MAX
+ * left) is a torn write and cut off. A bad one further in is damage:
+ * the records after it are found by their magic, the bad bytes are left
+ * alone. Bad bytes too long to be a torn write at the end mean this is
+ * not a store we understand, and it isn't opened. */
+static bool load(struct sms_store *s)
+{
+    char *buf = malloc(SMS_READ_CHUNK);
+    struct sms_record r;
+    size_t have = 0, pos, size, next;
+    uint64_t bad = UINT64_MAX;    /* offset where bad bytes start */
+    ssize_t cc;
+    bool eof = false;
+    const char *sender, *text;
+
+    if (!buf)
+        return false;
+
+    while (!eof) {
+        cc = read(s->fd, buf + have, SMS_READ_CHUNK - have);
+        if (cc < 0 && errno == EINTR)
+            continue;
+        if (cc <= 0)
+            eof = true;
+        else
+            have += cc;
+
+        // s->size is the file offset of buf + pos
+        pos = 0;
+        while (pos < have) {
+            size = record_size(buf + pos, have - pos);
+            if (size == 0) {
+                // maybe only the rest of it isn't read yet
+                if (!eof && have - pos < RECORD_MAX)
+                    break;
+                if (bad == UINT64_MAX)
+                    bad = s->size;
+                next = find_magic(buf, pos + 1, have);
+                // the last bytes may be the start of a magic not read yet
+                if (next == have && !eof)
+                    next = have - (sizeof(r.magic) - 1);
+                s->size += next - pos;
+                pos = next;
+                continue;
+            }
+
+            if (bad != UINT64_MAX) {
+                s->skipped += s->size - bad;
+                bad = UINT64_MAX;
+            }
+            memcpy(&r, buf + pos, sizeof(r));
+            sender = buf + pos + sizeof(r);
+            text = sender + r.sender_len;
+            if (!add_entry(s, r.time, s->size, fnv1a(sender, r.sender_len),
+                           fnv1a(text, r.text_len))) {
+                free(buf);
+                return false;
+            }
+            s->size += size;
+            pos += size;
+        }
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+    }
+    free(buf);
+
+    if (bad == UINT64_MAX)
+        return true;
+    if (s->size - bad > RECORD_MAX)
+        return false;
+    // a record that was being appended when we died
+    s->truncated = s->size - bad;
+    s->size = bad;
+    return ftruncate(s->fd, s->size) == 0;
+}
+
+bool sms_store_open(struct sms_store *s, const char *path)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (s->fd < 0)
+        return false;
+    if (!rehash(s) || !load(s)) {
+        sms_store_close(s);
+        return false;
+    }
+    return true;
+}
+
+void sms_store_close(struct sms_store *s)
+{
+    if (s->fd >= 0) {
+        sms_store_sync(s);
+        close(s->fd);
+    }
+    free(s->entries);
+    free(s->by_time);
+    free(s->senders);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+static bool read_message(struct sms_store *s, const struct sms_entry *e, struct sms *msg,
+                         int64_t *received)
+{
+    char buf[RECORD_MAX];
+    struct sms_record r;
+    ssize_t cc = pread(s->fd, buf, sizeof(buf), e->offset);
+
+    if (cc < (ssize_t) sizeof(r) || record_size(buf, cc) == 0)
+        return false;
+    memcpy(&r, buf, sizeof(r));
+    memset(msg, 0, sizeof(*msg));
+    memcpy(msg->sender, buf + sizeof(r), r.sender_len);
+    memcpy(msg->text, buf + sizeof(r) + r.sender_len, r.text_len);
+    msg->time = r.time;
+    msg->flags = r.flags;
+    msg->ref = r.ref;
+    msg->part = r.part;
+    msg->parts = r.parts;
+    msg->alphabet = r.alphabet;
+    *received = r.received;
+    return true;
+}
+
+static bool is_duplicate(struct sms_store *s, const struct sms *msg, uint32_t sender_hash,
+                         uint32_t text_hash)
+{
+    struct sms stored;
+    int64_t received;
+    int32_t i = s->senders[sender_hash & (s->sender_buckets - 1)];
+    int n;
+
+    for (n = 0; i >= 0 && n < SMS_DUP_WINDOW; i = s->entries[i].older, n++) {
+        if (s->entries[i].sender_hash != sender_hash || s->entries[i].time != msg->time ||
+            s->entries[i].text_hash != text_hash)
+            continue;
+        if (read_message(s, &s->entries[i], &stored, &received) &&
+            strcmp(stored.sender, msg->sender) == 0 && strcmp(stored.text, msg->text) == 0 &&
+            stored.ref == msg->ref && stored.part == msg->part)
+            return true;
+    }
+    return false;
+}
+
+int sms_store_append(struct sms_store *s, const struct sms *msg, int64_t received)
+{
+    char buf[RECORD_MAX];
+    struct sms_record r;
+    size_t sender_len = strnlen(msg->sender, SMS_ADDR_MAX - 1);
+    size_t text_len = strnlen(msg->text, SMS_TEXT_MAX - 1);
+    uint32_t sender_hash = fnv1a(msg->sender, sender_len);
+    uint32_t text_hash = fnv1a(msg->text, text_len);
+    size_t size = sizeof(r) + sender_len + text_len;
+    ssize_t cc;
+
+    if (is_duplicate(s, msg, sender_hash, text_hash)) {
+        s->duplicates++;
+        return 0;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.magic = SMS_RECORD_MAGIC;
+    r.text_len = text_len;
+    r.sender_len = sender_len;
+    r.flags = msg->flags;
+    r.time = msg->time;
+    r.received = received;
+    r.ref = msg->ref;
+    r.part = msg->part;
+    r.parts = msg->parts;
+    r.alphabet = msg->alphabet;
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), msg->sender, sender_len);
+    memcpy(buf + sizeof(r) + sender_len, msg->text, text_len);
+
+    // one write per record, a short one is undone
+    do {
+        cc = write(s->fd, buf, size);
+    } while (cc < 0 && errno == EINTR);
+    if (cc != (ssize_t) size) {
+        if (cc > 0 && ftruncate(s->fd, s->size) == 0)
+            s->truncated += cc;
+        return -1;
+    }
+
+    if (!add_entry(s, msg->time, s->size, sender_hash, text_hash))
+        return -1;
+    s->size += size;
+    s->unsynced = true;
+    return 1;
+}
+
+bool sms_store_sync(struct sms_store *s)
+{
+    if (!s->unsynced)
+        return true;
+    if (fdatasync(s->fd) < 0)
+        return false;
+    s->unsynced = false;
+    return true;
+}
+
+uint32_t sms_store_count(const struct sms_store *s)
+{
+    return s->count;
+}
+
+unsigned int sms_store_by_sender(struct sms_store *s, const char *sender,
+                                 sms_store_cb cb, void *user)
+{
+    uint32_t hash = fnv1a(sender, strlen(sender));
+    int32_t i = s->senders[hash & (s->sender_buckets - 1)];
+    unsigned int listed = 0;
+    struct sms msg;
+    int64_t received;
+
+    for (; i >= 0; i = s->entries[i].older) {
+        if (s->entries[i].sender_hash != hash ||
+            !read_message(s, &s->entries[i], &msg, &received) ||
+            strcmp(msg.sender, sender) != 0)
+            continue;
+        listed++;
+        if (!cb(&msg, received, user))
+            break;
+    }
+    return listed;
+}
+
+unsigned int sms_store_by_time(struct sms_store *s, int64_t from, int64_t to,
+                               sms_store_cb cb, void *user)
+{
+    uint32_t pos = time_lower_bound(s, from);
+    unsigned int listed = 0;
+    struct sms msg;
+    int64_t received;
+
+    for (; pos < s->count && s->entries[s->by_time[pos]].time < to; pos++) {
+        if (!read_message(s, &s->entries[s->by_time[pos]], &msg, &received))
+            continue;
+        listed++;
+        if (!cb(&msg, received, user))
+            break;
+    }
+    return listed;
+}
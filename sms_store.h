@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_store.h
+ * @brief Append-only message store
+ *
+ * Messages are appended to one file, each with a fixed size header, and
+ * never rewritten. The index lives in memory and is rebuilt from the
+ * file on open, in one sequential read: a hash of senders with a chain
+ * per sender (newest first) and a list ordered by time stamp. Listing a
+ * sender or a time range only reads the messages it returns.
+ *
+ * A torn record at the end (power cut while appending) is cut off on
+ * open. The same message appended twice (the SIM was read again before
+ * it could be cleared) is recognized and stored once.
+ *
+ */
+
+#ifndef HAVE_SMS_STORE_H__
+#define HAVE_SMS_STORE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sms_pdu.h"
+
+#define SMS_STORE_FILE "dialer.sms"
+
+struct sms_entry {
+    int64_t time;
+    uint64_t offset;
+    uint32_t sender_hash;
+    uint32_t text_hash;
+    int32_t older;                /* previous message of the sender, -1 ends */
+};
+
+struct sms_store {
+    int fd;
+    uint64_t size;                /* end of the last complete record */
+
+    struct sms_entry *entries;    /* in file order */
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *by_time;            /* entry numbers, oldest first */
+    int32_t *senders;             /* sender hash -> newest entry */
+    uint32_t sender_buckets;      /* power of two */
+
+    bool unsynced;                /* appended since sms_store_sync() */
+
+    /* statistics */
+    uint64_t duplicates;
+    uint64_t truncated;           /* bytes of torn record dropped on open */
+    uint64_t skipped;             /* bytes of damaged records stepped over */
+};
+
+/* stop listing by returning false */
+typedef bool (*sms_store_cb)(const struct sms *msg, int64_t received, void *user);
+
+bool sms_store_open(struct sms_store *s, const char *path);
+void sms_store_close(struct sms_store *s);
+
+/* 1 stored, 0 already there, -1 write error */
+int sms_store_append(struct sms_store *s, const struct sms *msg, int64_t received);
+
+/* On disk, not just written: only then may the SIM copy go */
+bool sms_store_sync(struct sms_store *s);
+
+uint32_t sms_store_count(const struct sms_store *s);
+
+/* A sender's messages, newest first. Returns how many were listed. */
+unsigned int sms_store_by_sender(struct sms_store *s, const char *sender,
+                                 sms_store_cb cb, void *user);
+
+/* Messages time stamped in [from, to), oldest first */
+unsigned int sms_store_by_time(struct sms_store *s, int64_t from, int64_t to,
+                               sms_store_cb cb, void *user);
+
+#endif /* HAVE_SMS_STORE_H__ */
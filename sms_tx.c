@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_tx.c
+ * @brief Bulk SMS sending
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sms_tx.h"
+
+#define LINK_COMMAND -1
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void sms_tx_init(struct sms_tx *tx, sms_tx_report_cb report, void *user)
+{
+    memset(tx, 0, sizeof(*tx));
+    tx->retry_head = tx->retry_tail = -1;
+    tx->report = report;
+    tx->user = user;
+}
+
+void sms_tx_free(struct sms_tx *tx)
+{
+    free(tx->parts);
+    tx->parts = NULL;
+    tx->count = tx->capacity = 0;
+}
+
+bool sms_tx_add(struct sms_tx *tx, const char *to, const char *text)
+{
+    struct sms_submit pdus[SMS_PARTS_MAX];
+    struct sms_tx_part *parts, *part;
+    unsigned int n, i, capacity;
+
+    n = sms_pdu_encode_submit(to, text, tx->ref + 1, pdus, SMS_PARTS_MAX);
+    if (n == 0)
+        return false;
+    if (n > 1)
+        tx->ref++;
+
+    if (tx->count + n > tx->capacity) {
+        capacity = tx->capacity ? tx->capacity * 2 : 64;
+        while (capacity < tx->count + n)
+            capacity *= 2;
+        parts = realloc(tx->parts, capacity * sizeof(*parts));
+        if (!parts)
+            return false;
+        tx->parts = parts;
+        tx->capacity = capacity;
+    }
+
+    for (i = 0; i < n; i++) {
+        part = &tx->parts[tx->count++];
+        memset(part, 0, sizeof(*part));
+        part->pdu = pdus[i];
+        snprintf(part->to, sizeof(part->to), "%s", to);
+        part->message = tx->messages;
+        part->mr = -1;
+        part->retry_next = -1;
+    }
+    tx->messages++;
+    return true;
+}
+
+static void window_push(struct sms_tx *tx, int32_t id)
+{
+    tx->window[(tx->window_head + tx->window_len++) % (SMS_TX_WINDOW + 2)] = id;
+}
+
+static int32_t window_pop(struct sms_tx *tx)
+{
+    int32_t id = tx->window[tx->window_head];
+
+    tx->window_head = (tx->window_head + 1) % (SMS_TX_WINDOW + 2);
+    tx->window_len--;
+    return id;
+}
+
+static bool all_parts_done(const struct sms_tx *tx)
+{
+    return tx->sent + tx->failed == tx->count;
+}
+
+/* the next part to submit, retries first, -1 when none */
+static int32_t take_part(struct sms_tx *tx)
+{
+    int32_t id = tx->retry_head;
+
+    if (id >= 0) {
+        tx->retry_head = tx->parts[id].retry_next;
+        if (tx->retry_head < 0)
+            tx->retry_tail = -1;
+        return id;
+    }
+    if (tx->next < tx->count)
+        return tx->next++;
+    return -1;
+}
+
+bool sms_tx_next(struct sms_tx *tx, struct sms_tx_cmd *cmd)
+{
+    struct sms_tx_part *part;
+    int32_t id;
+
+    if (tx->window_len >= SMS_TX_WINDOW)
+        return false;
+
+    if (!tx->link_held) {
+        if (tx->count == 0)
+            return false;
+        tx->link_held = true;
+        tx->started_ns = tx->last_done_ns = now_ns();
+        snprintf(cmd->text, sizeof(cmd->text), "AT+CMMS=2");
+        cmd->payload[0] = 0;
+        window_push(tx, LINK_COMMAND);
+        return true;
+    }
+
+    id = take_part(tx);
+    if (id < 0) {
+        // last one answered: nothing will follow soon, let the link go
+        if (tx->link_released || tx->window_len > 0 || !all_parts_done(tx))
+            return false;
+        tx->link_released = true;
+        snprintf(cmd->text, sizeof(cmd->text), "AT+CMMS=0");
+        cmd->payload[0] = 0;
+        window_push(tx, LINK_COMMAND);
+        return true;
+    }
+
+    part = &tx->parts[id];
+    part->state = SMS_TX_QUEUED;
+    part->attempts++;
+    part->queued_ns = now_ns();
+    snprintf(cmd->text, sizeof(cmd->text), "AT+CMGS=%u", part->pdu.tpdu_len);
+    snprintf(cmd->payload, sizeof(cmd->payload), "%s\x1a", part->pdu.hex);
+    window_push(tx, id);
+    return true;
+}
+
+void sms_tx_unsubmit(struct sms_tx *tx)
+{
+    int32_t id;
+
+    if (tx->window_len == 0)
+        return;
+    tx->window_len--;
+    id = tx->window[(tx->window_head + tx->window_len) % (SMS_TX_WINDOW + 2)];
+    if (id == LINK_COMMAND) {
+        if (tx->link_released)
+            tx->link_released = false;
+        else
+            tx->link_held = false;
+        return;
+    }
+
+    // back to the front of the line
+    tx->parts[id].state = SMS_TX_WAITING;
+    tx->parts[id].attempts--;
+    tx->parts[id].retry_next = tx->retry_head;
+    tx->retry_head = id;
+    if (tx->retry_tail < 0)
+        tx->retry_tail = id;
+}
+
+/* 27.005 3.2.5: network congestion and the like pass, a bad number or a
+ * barred subscription do not */
+static bool temporary_error(int error)
+{
+    switch (error) {
+    case 21:                      /* short message transfer rejected */
+    case 27:                      /* destination out of service */
+    case 38:                      /* network out of order */
+    case 41:                      /* temporary failure */
+    case 42:                      /* congestion */
+    case 47:                      /* resources unavailable */
+    case 300:                     /* ME failure */
+    case 331:                     /* no network service */
+    case 332:                     /* network timeout */
+    case 500:                     /* unknown error */
+        return true;
+    default:
+        return error >= 512;      /* manufacturer specific */
+    }
+}
+
+/* 27.007 9.2: the SIM or the network not being ready yet */
+static bool temporary_cme_error(int error)
+{
+    switch (error) {
+    case 14:                      /* SIM busy */
+    case 30:                      /* no network service */
+    case 31:                      /* network timeout */
+    case 100:                     /* unknown */
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* the number after prefix, -1 when there is none (or verbose text) */
+static int response_number(const char *response, const char *prefix)
+{
+    const char *s = strstr(response, prefix);
+
+    if (!s)
+        return -1;
+    for (s += strlen(prefix); *s == ' '; s++)
+        ;
+    return *s >= '0' && *s <= '9' ? atoi(s) : -1;
+}
+
+void sms_tx_done(struct sms_tx *tx, enum at_token result, const char *response,
+                 bool payload_sent)
+{
+    struct sms_tx_part *part;
+    uint64_t now = now_ns(), from;
+    int32_t id;
+    bool retry;
+
+    if (tx->window_len == 0)
+        return;
+    id = window_pop(tx);
+
+    if (id == LINK_COMMAND) {
+        // without link control every message sets up its own, still works
+        tx->last_done_ns = now;
+        if (tx->link_released)
+            tx->finished_ns = now;
+        return;
+    }
+
+    part = &tx->parts[id];
+    // the command went out when the one before it was answered
+    from = part->queued_ns > tx->last_done_ns ? part->queued_ns : tx->last_done_ns;
+    part->latency_ns = now - from;
+    tx->last_done_ns = now;
+
+    if (result == AT_TOK_OK) {
+        part->state = SMS_TX_SENT;
+        part->mr = response_number(response, "+CMGS:");
+        tx->sent++;
+        if (tx->report)
+            tx->report(part, tx->user);
+        return;
+    }
+
+    part->cme = false;
+    switch (result) {
+    case AT_TOK_CMS_ERROR:
+        part->error = response_number(response, "+CMS ERROR:");
+        if (part->error < 0)
+            part->error = 500;    /* unknown error */
+        retry = temporary_error(part->error);
+        break;
+    case AT_TOK_CME_ERROR:
+        part->cme = true;
+        part->error = response_number(response, "+CME ERROR:");
+        if (part->error < 0)
+            part->error = 100;    /* unknown */
+        retry = temporary_cme_error(part->error);
+        break;
+    case AT_TOK_UNKNOWN:
+        // timed out: once the PDU went out it may have been sent, and a
+        // retry would deliver it twice
+        part->error = -1;
+        retry = !payload_sent;
+        break;
+    default:
+        part->error = 500;        /* plain ERROR, unknown error */
+        retry = true;
+        break;
+    }
+    if (part->attempts < SMS_TX_ATTEMPTS && retry) {
+        part->state = SMS_TX_WAITING;
+        part->retry_next = -1;
+        if (tx->retry_tail >= 0)
+            tx->parts[tx->retry_tail].retry_next = id;
+        else
+            tx->retry_head = id;
+        tx->retry_tail = id;
+        tx->retries++;
+        return;
+    }
+
+    part->state = SMS_TX_FAILED;
+    tx->failed++;
+    if (tx->report)
+        tx->report(part, tx->user);
+}
+
+void sms_tx_abort(struct sms_tx *tx)
+{
+    struct sms_tx_part *part;
+    unsigned int i;
+
+    tx->next = tx->count;
+    tx->retry_head = tx->retry_tail = -1;
+    tx->window_len = 0;
+    tx->link_released = tx->link_held;
+    for (i = 0; i < tx->count; i++) {
+        part = &tx->parts[i];
+        if (part->state == SMS_TX_SENT || part->state == SMS_TX_FAILED)
+            continue;
+        part->state = SMS_TX_FAILED;
+        part->error = -1;
+        tx->failed++;
+        if (tx->report)
+            tx->report(part, tx->user);
+    }
+}
+
+bool sms_tx_finished(const struct sms_tx *tx)
+{
+    return all_parts_done(tx) && tx->window_len == 0 && (tx->link_released || !tx->link_held);
+}
+
+unsigned int sms_tx_delivered(const struct sms_tx *tx)
+{
+    unsigned int i, delivered = 0, unsent = 0;
+
+    for (i = 0; i < tx->count; i++) {
+        if (tx->parts[i].state != SMS_TX_SENT)
+            unsent++;
+        // the last part of a message
+        if (i + 1 == tx->count || tx->parts[i + 1].message != tx->parts[i].message) {
+            delivered += unsent == 0;
+            unsent = 0;
+        }
+    }
+    return delivered;
+}
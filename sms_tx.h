@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file sms_tx.h
+ * @brief Bulk SMS sending
+ *
+ * A batch of messages goes out as one sequence: AT+CMMS=2 keeps the radio
+ * link up between them, every part is encoded up front, and a few
+ * AT+CMGS are kept queued so the next one is written the moment the
+ * previous one is answered (the PDU follows the "> " prompt from inside
+ * the command queue). AT+CMMS=0 lets the link go once the last one is
+ * done. A part that fails with a temporary +CMS ERROR, or times out, is
+ * sent again, up to SMS_TX_ATTEMPTS times in all.
+ *
+ * Nothing here talks to the modem: sms_tx_next() says what to submit,
+ * sms_tx_done() takes the results, in submission order.
+ *
+ */
+
+#ifndef HAVE_SMS_TX_H__
+#define HAVE_SMS_TX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "at_parser.h"
+#include "sms_pdu.h"
+
+#define SMS_TX_WINDOW 4           /* commands queued ahead of the modem */
+#define SMS_TX_ATTEMPTS 3
+
+enum sms_tx_state {
+    SMS_TX_WAITING = 0,
+    SMS_TX_QUEUED,
+    SMS_TX_SENT,
+    SMS_TX_FAILED,
+};
+
+struct sms_tx_part {
+    struct sms_submit pdu;
+    char to[SMS_ADDR_MAX];
+    unsigned int message;         /* which sms_tx_add() it came from */
+    uint8_t state;
+    uint8_t attempts;
+    int16_t mr;                   /* TP-MR from +CMGS, -1 until sent */
+    int error;                    /* last +CMS/+CME ERROR code, -1 for timeouts */
+    bool cme;                     /* error is a +CME ERROR code */
+    int32_t retry_next;           /* retry list link, -1 ends */
+    uint64_t queued_ns;
+    uint64_t latency_ns;          /* the modem's time on the last attempt */
+};
+
+/* a part is sent or has failed for good */
+typedef void (*sms_tx_report_cb)(const struct sms_tx_part *part, void *user);
+
+struct sms_tx_cmd {
+    char text[24];                /* "AT+CMGS=23" or "AT+CMMS=2" */
+    char payload[SMS_PDU_HEX + 1]; /* PDU and Ctrl-Z, "" for none */
+};
+
+struct sms_tx {
+    struct sms_tx_part *parts;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int messages;
+    uint16_t ref;                 /* concatenation reference of the last one */
+
+    unsigned int next;            /* first part never submitted */
+    int32_t retry_head, retry_tail;
+    int32_t window[SMS_TX_WINDOW + 2]; /* submitted, oldest first; -1 AT+CMMS */
+    unsigned int window_head;
+    unsigned int window_len;
+    bool link_held;               /* AT+CMMS=2 submitted */
+    bool link_released;           /* AT+CMMS=0 submitted */
+
+    uint64_t started_ns;
+    uint64_t finished_ns;
+    uint64_t last_done_ns;
+
+    sms_tx_report_cb report;
+    void *user;
+
+    /* statistics */
+    unsigned int sent;
+    unsigned int failed;
+    unsigned int retries;
+};
+
+void sms_tx_init(struct sms_tx *tx, sms_tx_report_cb report, void *user);
+void sms_tx_free(struct sms_tx *tx);
+
+/* Queue text for to, before the first sms_tx_next(). False when the text
+ * takes more than SMS_PARTS_MAX messages or memory ran out. */
+bool sms_tx_add(struct sms_tx *tx, const char *to, const char *text);
+
+/* The next command to submit, false when the window is full or nothing is
+ * left to send. If the queue refuses it, sms_tx_unsubmit() takes it back. */
+bool sms_tx_next(struct sms_tx *tx, struct sms_tx_cmd *cmd);
+void sms_tx_unsubmit(struct sms_tx *tx);
+
+/* The final result of the oldest submitted command (AT_TOK_UNKNOWN for a
+ * timeout); payload_sent says whether the PDU was given to the modem. */
+void sms_tx_done(struct sms_tx *tx, enum at_token result, const char *response,
+                 bool payload_sent);
+
+/* The modem is gone: every part not sent yet fails (error -1) and is
+ * reported, and nothing more is submitted. What is still in the command
+ * queue is to be dropped with it. */
+void sms_tx_abort(struct sms_tx *tx);
+
+/* every part sent or failed, and the link released */
+bool sms_tx_finished(const struct sms_tx *tx);
+
+/* messages all of whose parts were sent */
+unsigned int sms_tx_delivered(const struct sms_tx *tx);
+
+#endif /* HAVE_SMS_TX_H__ */
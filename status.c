@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file status.c
+ * @brief Modem status poller
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "at_queue.h"
+#include "status.h"
+
+#define STATUS_BATCH "AT+CSQ;+CREG?;+COPS?;+CPAS"
+
+static const char *status_single[] = { "AT+CSQ", "AT+CREG?", "AT+COPS?", "AT+CPAS" };
+
+static void unknown_status(struct modem_status *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->rssi = s->ber = 99;
+    s->registration = s->act = s->activity = STATUS_UNKNOWN;
+}
+
+void status_init(struct status_poller *p, unsigned int interval_ms, const char *path)
+{
+    memset(p, 0, sizeof(*p));
+    atomic_init(&p->current, NULL);
+    p->base_ms = p->interval_ms = interval_ms ? interval_ms : STATUS_INTERVAL_DEFAULT;
+    p->max_ms = p->base_ms * STATUS_BACKOFF_MAX;
+    if (path)
+        snprintf(p->path, sizeof(p->path), "%s", path);
+}
+
+const struct modem_status *status_get(struct status_poller *p)
+{
+    return atomic_load_explicit(&p->current, memory_order_acquire);
+}
+
+unsigned int status_begin(struct status_poller *p, const char *cmds[STATUS_MAX_COMMANDS])
+{
+    const struct modem_status *last = status_get(p);
+    unsigned int n = 0, i;
+
+    if (last)
+        p->pending = *last;
+    else
+        unknown_status(&p->pending);
+
+    // identity first: when the batch is refused nothing is left in flight
+    if (!p->pending.imei[0])
+        cmds[n++] = "AT+CGSN";
+    if (!p->pending.imsi[0])
+        cmds[n++] = "AT+CIMI";
+    if (p->split) {
+        for (i = 0; i < sizeof(status_single) / sizeof(status_single[0]); i++)
+            cmds[n++] = status_single[i];
+    } else {
+        cmds[n++] = STATUS_BATCH;
+    }
+
+    p->outstanding = n;
+    return n;
+}
+
+#define STATUS_FIELDS 4
+
+/* the i-th field as a number */
+static int field_int(const struct at_field *f, int n, int i)
+{
+    int v = i < n ? at_field_int(&f[i]) : -1;
+
+    return v < 0 ? STATUS_UNKNOWN : v;
+}
+
+/* +COPS: 0,0,"Operator",7 */
+static void parse_cops(struct modem_status *s, const struct at_field *f, int n)
+{
+    size_t len;
+
+    if (n < 3) {
+        // not registered: "+COPS: 0"
+        s->operator[0] = 0;
+        s->act = STATUS_UNKNOWN;
+        return;
+    }
+    len = f[2].len;
+    if (len >= sizeof(s->operator))
+        len = sizeof(s->operator) - 1;
+    memcpy(s->operator, f[2].p, len);
+    s->operator[len] = 0;
+    s->act = field_int(f, n, 3);
+}
+
+static void copy_digits(char *dst, size_t size, const char *line, size_t len)
+{
+    if (len >= size)
+        len = size - 1;
+    memcpy(dst, line, len);
+    dst[len] = 0;
+}
+
+/* one pass over the reply lines, whichever commands they answer */
+static void parse_response(struct status_poller *p, const char *cmd, const char *response)
+{
+    struct modem_status *s = &p->pending;
+    struct at_field f[STATUS_FIELDS];
+    const char *line = response, *eol;
+    enum at_token token;
+    size_t len;
+    int n;
+
+    while (*line) {
+        eol = strchr(line, '\n');
+        len = eol ? (size_t) (eol - line) : strlen(line);
+
+        token = at_line_classify(line, len);
+        n = token == AT_TOK_UNKNOWN ? 0 : at_split_fields(line, len, f, STATUS_FIELDS);
+        switch (token) {
+        case AT_TOK_CSQ:
+            s->rssi = field_int(f, n, 0);
+            s->ber = field_int(f, n, 1);
+            break;
+        case AT_TOK_CREG:
+            // +CREG: <n>,<stat>
+            s->registration = field_int(f, n, 1);
+            break;
+        case AT_TOK_COPS:
+            parse_cops(s, f, n);
+            break;
+        case AT_TOK_CPAS:
+            s->activity = field_int(f, n, 0);
+            break;
+        case AT_TOK_UNKNOWN:
+            if (len > 0 && line[0] >= '0' && line[0] <= '9') {
+                if (strstr(cmd, "CGSN"))
+                    copy_digits(s->imei, sizeof(s->imei), line, len);
+                else if (strstr(cmd, "CIMI"))
+                    copy_digits(s->imsi, sizeof(s->imsi), line, len);
+            }
+            break;
+        default:
+            break;
+        }
+
+        line += len;
+        if (*line)
+            line++;
+    }
+}
+
+static bool same_status(const struct modem_status *a, const struct modem_status *b)
+{
+    return a->rssi == b->rssi && a->ber == b->ber && a->registration == b->registration &&
+        a->act == b->act && a->activity == b->activity &&
+        strcmp(a->operator, b->operator) == 0;
+}
+
+static void write_file(struct status_poller *p, const struct modem_status *s)
+{
+    char tmp[sizeof(p->path) + 8];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", p->path);
+    f = fopen(tmp, "w");
+    if (!f)
+        return;
+    fprintf(f, "updated=%lld\nrssi=%d\nber=%d\nregistration=%d\noperator=%s\n"
+            "act=%d\nactivity=%d\nimei=%s\nimsi=%s\n",
+            (long long) s->updated, s->rssi, s->ber, s->registration, s->operator,
+            s->act, s->activity, s->imei, s->imsi);
+    if (fclose(f) == 0)
+        rename(tmp, p->path);
+}
+
+static void publish(struct status_poller *p)
+{
+    const struct modem_status *last = status_get(p);
+    struct modem_status *s = &p->snaps[p->seq % STATUS_SNAPSHOTS];
+
+    *s = p->pending;
+    s->seq = ++p->seq;
+    s->updated = time(NULL);
+    atomic_store_explicit(&p->current, s, memory_order_release);
+
+    // back off while nothing moves
+    if (last && same_status(last, s)) {
+        p->interval_ms *= 2;
+        if (p->interval_ms > p->max_ms)
+            p->interval_ms = p->max_ms;
+    } else {
+        p->interval_ms = p->base_ms;
+    }
+
+    if (p->path[0])
+        write_file(p, s);
+}
+
+enum status_step status_response(struct status_poller *p, const char *cmd,
+                                 enum at_token result, const char *response)
+{
+    if (result == AT_TOK_OK) {
+        parse_response(p, cmd, response);
+    } else if (!p->split && strncmp(cmd, STATUS_BATCH, sizeof(STATUS_BATCH) - 1) == 0 &&
+               result != AT_RESULT_TIMEOUT) {
+        p->split = true;
+        p->outstanding = 0;
+        return STATUS_RESEND;
+    }
+    // anything else that failed keeps its values from the last snapshot
+
+    if (p->outstanding > 0)
+        p->outstanding--;
+    if (p->outstanding > 0)
+        return STATUS_PENDING;
+
+    publish(p);
+    return STATUS_PUBLISHED;
+}
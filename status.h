@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file status.h
+ * @brief Modem status poller
+ *
+ * Signal, registration, operator and activity are asked for in one
+ * command line, AT+CSQ;+CREG?;+COPS?;+CPAS, and the reply is parsed in
+ * one pass. IMEI and IMSI are asked for once. Should the modem refuse
+ * the concatenated line, the poller falls back to one command each.
+ *
+ * Every refresh fills a fresh snapshot that is published with an atomic
+ * pointer store. Snapshots are never written once published, so readers
+ * in any thread take the pointer and read without locking. The snapshot
+ * is also written to a file (atomically, through rename()) for tools
+ * that shouldn't touch the serial port.
+ *
+ * The refresh interval doubles while nothing changes, up to max_ms, and
+ * drops back to the base interval on the first change.
+ *
+ */
+
+#ifndef HAVE_STATUS_H__
+#define HAVE_STATUS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "at_parser.h"
+
+#define STATUS_FILE "dialer.status"
+#define STATUS_INTERVAL_DEFAULT 30000 /* ms */
+#define STATUS_BACKOFF_MAX 8          /* times the interval */
+
+/* a reader may hold a snapshot for this many refreshes minus one */
+#define STATUS_SNAPSHOTS 8
+
+#define STATUS_UNKNOWN -1
+#define STATUS_MAX_COMMANDS 6
+
+struct modem_status {
+    unsigned int seq;         /* 1 for the first snapshot */
+    int64_t updated;          /* unix time */
+
+    int rssi;                 /* +CSQ 0..31, 99 not known */
+    int ber;
+    int registration;         /* +CREG <stat>: 1 home, 5 roaming... */
+    int act;                  /* +COPS access technology, 7 is LTE */
+    int activity;             /* +CPAS: 0 ready, 3 ringing, 4 call */
+    char operator[64];
+    char imei[20];
+    char imsi[20];
+};
+
+struct status_poller {
+    struct modem_status snaps[STATUS_SNAPSHOTS];
+    _Atomic(const struct modem_status *) current;
+    unsigned int seq;
+
+    struct modem_status pending;
+    unsigned int outstanding; /* commands of this refresh still running */
+    bool split;               /* the modem refused the batched line */
+
+    unsigned int base_ms;
+    unsigned int max_ms;
+    unsigned int interval_ms;
+
+    char path[256];           /* "" to not publish a file */
+};
+
+enum status_step {
+    STATUS_PENDING,           /* wait for the other commands */
+    STATUS_PUBLISHED,         /* refresh done, schedule the next one */
+    STATUS_RESEND,            /* batching refused: status_begin() again */
+};
+
+void status_init(struct status_poller *p, unsigned int interval_ms, const char *path);
+
+/* The command lines of a refresh, to be submitted in order. Returns how
+ * many. */
+unsigned int status_begin(struct status_poller *p, const char *cmds[STATUS_MAX_COMMANDS]);
+
+/* Hand every completed command of the refresh here */
+enum status_step status_response(struct status_poller *p, const char *cmd,
+                                 enum at_token result, const char *response);
+
+/* latest snapshot, NULL before the first refresh */
+const struct modem_status *status_get(struct status_poller *p);
+
+#endif /* HAVE_STATUS_H__ */
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+
+/**
+ * @file tone.c
+ * @brief Rendered tone cache
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <threads.h>
+
+#include "tone.h"
+
+static struct tone_pcm cache[TONE_CACHE_SIZE];
+static mtx_t lock;
+static once_flag lock_once = ONCE_FLAG_INIT;
+static uint64_t clock_ticks;
+
+/* statistics */
+static unsigned long long hits;
+static unsigned long long misses;
+
+static void lock_init(void)
+{
+    mtx_init(&lock, mtx_plain);
+}
+
+size_t tone_frames(const struct tone_key *key)
+{
+    size_t frames = (size_t) key->duration_ms * key->rate / 1000;
+    size_t period = key->period_frames ? key->period_frames : 1;
+
+    return (frames + period - 1) / period * period;
+}
+
+size_t tone_frame_bytes(const struct tone_key *key)
+{
+    return key->channels * (key->format == TONE_S32_LE ? 4 : 2);
+}
+
+// the samples are stored as they are in memory when that is little endian
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LE 1
+#else
+#define HOST_LE 0
+#endif
+
+/* Q32 turns to radians */
+#define PHASE_RAD (2.0 * M_PI / 4294967296.0)
+
+/* e^(i 2 pi k / 2^SEED_BITS): the accumulator's top bits pick one, the
+ * rest is an angle under 2 pi / 2^SEED_BITS, short enough for a series */
+#define SEED_BITS 8
+static float seed_re[1 << SEED_BITS];
+static float seed_im[1 << SEED_BITS];
+static once_flag seed_once = ONCE_FLAG_INIT;
+
+static void seed_init(void)
+{
+    unsigned int k;
+
+    for (k = 0; k < 1 << SEED_BITS; k++) {
+        seed_re[k] = cos(2.0 * M_PI * k / (1 << SEED_BITS));
+        seed_im[k] = sin(2.0 * M_PI * k / (1 << SEED_BITS));
+    }
+}
+
+/* e^(i phase), phase in Q32 turns; within 1e-7 or so of cos() and sin() */
+static void seed(uint32_t phase, float *re, float *im)
+{
+    unsigned int k = phase >> (32 - SEED_BITS);
+    float d = (float) (phase & ((1u << (32 - SEED_BITS)) - 1)) * (float) PHASE_RAD;
+    float d2 = d * d;
+    float c = 1 - d2 * (0.5f - d2 * (1.0f / 24));
+    float s = d * (1 - d2 * (1.0f / 6));
+
+    *re = seed_re[k] * c - seed_im[k] * s;
+    *im = seed_im[k] * c + seed_re[k] * s;
+}
+
+bool tone_osc_init(struct tone_osc *osc, const double *freqs, unsigned int count,
+                   unsigned int rate)
+{
+    double w;
+    unsigned int k, j;
+
+    if (count == 0 || count > TONE_MAX || rate == 0)
+        return false;
+
+    call_once(&seed_once, seed_init);
+    memset(osc, 0, sizeof(*osc));
+    osc->count = count;
+    for (k = 0; k < count; k++) {
+        // the phasors turn by what the accumulator steps, not by freqs[k]
+        osc->inc[k] = llround(freqs[k] / rate * 4294967296.0);
+        w = osc->inc[k] * PHASE_RAD;
+        for (j = 0; j < TONE_LANES; j++) {
+            osc->lane_re[k][j] = cos(w * j);
+            osc->lane_im[k][j] = sin(w * j);
+        }
+        osc->turn_re[k] = cos(w * TONE_LANES);
+        osc->turn_im[k] = sin(w * TONE_LANES);
+        osc->amp[k] = TONE_AMPLITUDE / count;
+    }
+    return true;
+}
+
+/* n frames of the sum, in groups of TONE_LANES; the phasors start from
+ * the accumulator, which then moves on by exactly n frames */
+static void osc_block(struct tone_osc *osc, float *acc, size_t n)
+{
+    float re[TONE_LANES], im[TONE_LANES];
+    float c, s, amp, r;
+    unsigned int k, j;
+    size_t g, groups = (n + TONE_LANES - 1) / TONE_LANES;
+
+    for (g = 0; g < TONE_BLOCK; g++)
+        acc[g] = 0;
+    for (k = 0; k < osc->count; k++) {
+        seed(osc->phase[k], &c, &s);
+        for (j = 0; j < TONE_LANES; j++) {
+            re[j] = c * osc->lane_re[k][j] - s * osc->lane_im[k][j];
+            im[j] = c * osc->lane_im[k][j] + s * osc->lane_re[k][j];
+        }
+        c = osc->turn_re[k];
+        s = osc->turn_im[k];
+        amp = osc->amp[k];
+        for (g = 0; g < groups; g++, acc += TONE_LANES) {
+            for (j = 0; j < TONE_LANES; j++) {
+                acc[j] += amp * im[j];
+                r = re[j] * c - im[j] * s;
+                im[j] = re[j] * s + im[j] * c;
+                re[j] = r;
+            }
+        }
+        acc -= groups * TONE_LANES;
+        osc->phase[k] += osc->inc[k] * (uint32_t) n;
+    }
+}
+
+/* n frames of the sum as samples, the same on every channel; returns
+ * where the next frame goes. The loops convert the whole block, a fixed
+ * count the compiler vectorizes at -O2, and n of it is copied out */
+static char *osc_pack(char *out, const float *acc, size_t n, unsigned int channels,
+                      enum tone_format format)
+{
+    int16_t sample[TONE_BLOCK];
+    uint32_t word[TONE_BLOCK];
+    uint32_t pair[2 * TONE_BLOCK];
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < TONE_BLOCK; i++)
+        sample[i] = acc[i] + (acc[i] < 0 ? -0.5f : 0.5f);
+
+    // the usual cards, one loop each
+    if (HOST_LE && channels == 1 && format == TONE_S16_LE) {
+        memcpy(out, sample, n * 2);
+        return out + n * 2;
+    }
+    if (HOST_LE && channels == 2 && format == TONE_S16_LE) {
+        for (i = 0; i < TONE_BLOCK; i++)
+            word[i] = (uint32_t) (uint16_t) sample[i] << 16 | (uint16_t) sample[i];
+        memcpy(out, word, n * 4);
+        return out + n * 4;
+    }
+    if (HOST_LE && channels == 1 && format == TONE_S32_LE) {
+        for (i = 0; i < TONE_BLOCK; i++)
+            word[i] = (uint32_t) (uint16_t) sample[i] << 16;
+        memcpy(out, word, n * 4);
+        return out + n * 4;
+    }
+    if (HOST_LE && channels == 2 && format == TONE_S32_LE) {
+        for (i = 0; i < TONE_BLOCK; i++)
+            pair[2 * i] = pair[2 * i + 1] = (uint32_t) (uint16_t) sample[i] << 16;
+        memcpy(out, pair, n * 8);
+        return out + n * 8;
+    }
+
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < channels; c++) {
+            if (format == TONE_S32_LE) {
+                *out++ = 0;
+                *out++ = 0;
+            }
+            *out++ = sample[i] & 0xff;
+            *out++ = (sample[i] & 0xff00) >> 8;
+        }
+    }
+    return out;
+}
+
+void tone_osc_render(struct tone_osc *osc, char *out, size_t frames,
+                     unsigned int channels, enum tone_format format)
+{
+    float acc[TONE_BLOCK];
+    size_t n;
+
+    while (frames > 0) {
+        n = frames < TONE_BLOCK ? frames : TONE_BLOCK;
+        osc_block(osc, acc, n);
+        out = osc_pack(out, acc, n, channels, format);
+        frames -= n;
+    }
+}
+
+void tone_render(const struct tone_key *key, char *out)
+{
+    size_t frames = (size_t) key->duration_ms * key->rate / 1000;
+    size_t total = tone_frames(key);
+    double freqs[2] = { key->freq1, key->freq2 };
+    struct tone_osc osc;
+
+    // one tone, or the average of two as the per-ring code had it
+    if (tone_osc_init(&osc, freqs, key->freq2 > 0 ? 2 : 1, key->rate))
+        tone_osc_render(&osc, out, frames, key->channels, key->format);
+    else
+        frames = 0;
+    // silence up to the period boundary
+    memset(out + frames * tone_frame_bytes(key), 0, (total - frames) * tone_frame_bytes(key));
+}
+
+static bool same_key(const struct tone_key *a, const struct tone_key *b)
+{
+    return a->freq1 == b->freq1 && a->freq2 == b->freq2 &&
+        a->duration_ms == b->duration_ms && a->rate == b->rate &&
+        a->channels == b->channels && a->period_frames == b->period_frames &&
+        a->format == b->format;
+}
+
+/* an empty slot, or else the one played longest ago */
+static bool evict_first(const struct tone_pcm *a, const struct tone_pcm *b)
+{
+    if (!b->data)
+        return false;
+    return !a->data || a->last_used < b->last_used;
+}
+
+const struct tone_pcm *tone_get(const struct tone_key *key)
+{
+    struct tone_pcm *pcm = NULL, *victim = NULL;
+    char *data;
+    int i;
+
+    call_once(&lock_once, lock_init);
+    mtx_lock(&lock);
+    for (i = 0; i < TONE_CACHE_SIZE; i++) {
+        if (cache[i].data && same_key(&cache[i].key, key)) {
+            pcm = &cache[i];
+            hits++;
+            break;
+        }
+        if (!cache[i].refs && (!victim || evict_first(&cache[i], victim)))
+            victim = &cache[i];
+    }
+
+    if (!pcm) {
+        misses++;
+        if (!victim) {
+            mtx_unlock(&lock);
+            return NULL;
+        }
+        data = malloc(tone_frames(key) * tone_frame_bytes(key));
+        if (!data) {
+            mtx_unlock(&lock);
+            return NULL;
+        }
+        // rendered with the lock held: a ring is rendered once, not twice
+        tone_render(key, data);
+        free(victim->data);
+        pcm = victim;
+        pcm->key = *key;
+        pcm->data = data;
+        pcm->frames = tone_frames(key);
+        pcm->frame_bytes = tone_frame_bytes(key);
+    }
+    pcm->refs++;
+    pcm->last_used = ++clock_ticks;
+    mtx_unlock(&lock);
+
+    return pcm;
+}
+
+void tone_put(const struct tone_pcm *pcm)
+{
+    mtx_lock(&lock);
+    ((struct tone_pcm *) pcm)->refs--;
+    mtx_unlock(&lock);
+}
+
+void tone_dump_stats(FILE *out)
+{
+    size_t bytes = 0;
+    int i, n = 0;
+
+    call_once(&lock_once, lock_init);
+    mtx_lock(&lock);
+    for (i = 0; i < TONE_CACHE_SIZE; i++)
+        if (cache[i].data) {
+            n++;
+            bytes += cache[i].frames * cache[i].frame_bytes;
+        }
+    fprintf(out, "tones: %llu played from the cache, %llu rendered; %d cached, %zu bytes\n",
+            hits, misses, n, bytes);
+    mtx_unlock(&lock);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+
+/**
+ * @file tone.h
+ * @brief Rendered tone cache
+ *
+ * A ring used to compute sin() for every sample, every time RING came in.
+ * Tones (one frequency or the average of two) are now rendered once per
+ * frequency, length and output format, padded with silence to a whole
+ * number of periods, and played from memory after that. The few that are
+ * in use (ringtone, tone pairs) stay; the least recently used one goes
+ * when the cache is full.
+ *
+ * Each tone keeps a fixed point phase accumulator (32 bit, wrapping),
+ * stepped by a whole number of 1/2^32 turns per frame, so its frequency
+ * and phase never drift however long it plays. The samples themselves
+ * no longer come from a sine table indexed by that phase: the table
+ * lookup (a gather) kept the loops scalar. Instead, at the start of
+ * every TONE_BLOCK frames the accumulator seeds TONE_LANES unit
+ * phasors, one per frame of a group, which a complex multiply turns on
+ * by a group at a time. That is plain arithmetic on arrays of
+ * TONE_LANES floats, which the compiler keeps in vector registers (SSE,
+ * NEON), and so are the loops packing the sum into each sample format
+ * and channel count. Any sum of up to TONE_MAX tones (DTMF pairs, call
+ * progress tones); cheap enough to make tones on demand too.
+ *
+ */
+
+#ifndef HAVE_TONE_H__
+#define HAVE_TONE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TONE_CACHE_SIZE 8
+#define TONE_AMPLITUDE 10000
+#define TONE_MAX 4              /* tones in one sum */
+#define TONE_LANES 8            /* frames a phasor step makes */
+#define TONE_BLOCK 64           /* frames synthesized at a time, whole groups */
+
+enum tone_format {
+    TONE_S16_LE = 0,
+    TONE_S32_LE,                /* the same 16 bits, in the top half */
+};
+
+struct tone_key {
+    double freq1;
+    double freq2;               /* 0 for a single tone */
+    unsigned int duration_ms;
+    unsigned int rate;
+    unsigned int channels;      /* the same sample on each */
+    unsigned int period_frames; /* length is rounded up to a multiple */
+    enum tone_format format;
+};
+
+struct tone_pcm {
+    struct tone_key key;
+    char *data;                 /* interleaved frames */
+    size_t frames;
+    size_t frame_bytes;
+    unsigned int refs;
+    uint64_t last_used;
+};
+
+/* One oscillator per tone of a sum: the phase accumulator, each lane's
+ * offset from it within a group, and the turn from one group to the next */
+struct tone_osc {
+    unsigned int count;
+    uint32_t phase[TONE_MAX];       /* Q32 turns, at the next frame */
+    uint32_t inc[TONE_MAX];         /* Q32 turns per frame */
+    float lane_re[TONE_MAX][TONE_LANES];
+    float lane_im[TONE_MAX][TONE_LANES];
+    float turn_re[TONE_MAX];
+    float turn_im[TONE_MAX];
+    float amp[TONE_MAX];
+};
+
+/* The sum of count tones, each at TONE_AMPLITUDE / count, from phase 0.
+ * False for no tones or more than TONE_MAX. */
+bool tone_osc_init(struct tone_osc *osc, const double *freqs, unsigned int count,
+                   unsigned int rate);
+
+/* The next frames of the sum into out, interleaved, the same sample on
+ * each channel */
+void tone_osc_render(struct tone_osc *osc, char *out, size_t frames,
+                     unsigned int channels, enum tone_format format);
+
+/* Frames the rendered tone takes, padding included */
+size_t tone_frames(const struct tone_key *key);
+
+/* Bytes of one frame */
+size_t tone_frame_bytes(const struct tone_key *key);
+
+/* Render into out, tone_frames() * tone_frame_bytes() bytes */
+void tone_render(const struct tone_key *key, char *out);
+
+/* The tone from the cache, rendered on a miss. NULL when out of memory.
+ * Stays valid until tone_put(), from any thread. */
+const struct tone_pcm *tone_get(const struct tone_key *key);
+void tone_put(const struct tone_pcm *pcm);
+
+/* hits, misses and what is held */
+void tone_dump_stats(FILE *out);
+
+#endif /* HAVE_TONE_H__ */
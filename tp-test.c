@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2020 Rhizomatica <rafael@rhizomatica.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ * Rhizo-dialer is an experimental dialer for Maemo.
+ *
+ */
+
+/**
+ * @file tp-test.c
+ * @brief tp.c against a mock connection manager
+ *
+ * Starts a session bus of its own (GTestDBus) where a mock connection
+ * manager owns its ConnectionManager and Connection names, and one more
+ * manager is only installed (activatable, never started). The registry
+ * is started there and has to:
+ *
+ *  - list the running manager and its connections, not the installed one
+ *  - follow connections and managers that come and go afterwards
+ *  - answer lookups from what it has, with the one ListNames
+ *
+ * One line per check; the exit status is the number that failed.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "tp.h"
+
+#define MOCK_CM "mock"
+#define IDLE_CM "idle"            /* installed, not running */
+#define STEP_TIMEOUT_MS 5000
+#define LOG_SIZE 4096
+
+static GDBusConnection *mock_bus;
+static unsigned int mock_owned;
+
+/* "cm up" / "cm bus_name protocol up" per registry change */
+static char events[LOG_SIZE];
+
+static unsigned int checks, failures;
+
+static void log_append(char *log, const char *fmt, ...)
+{
+    size_t len = strlen(log);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(log + len, LOG_SIZE - len, fmt, ap);
+    va_end(ap);
+}
+
+static void check(const char *what, bool ok)
+{
+    checks++;
+    if (!ok)
+        failures++;
+    printf("tp: %-52s %s\n", what, ok ? "ok" : "FAILED");
+}
+
+static gboolean wake_up(gpointer data)
+{
+    return TRUE;
+}
+
+/* run the main loop until text shows up in events */
+static bool wait_for(const char *text)
+{
+    gint64 deadline = g_get_monotonic_time() + STEP_TIMEOUT_MS * 1000;
+
+    while (!strstr(events, text) && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    return strstr(events, text) != NULL;
+}
+
+static void on_owned(GDBusConnection *connection, const char *name, gpointer data)
+{
+    mock_owned++;
+}
+
+/* the mock manager takes a name and waits until it is its own */
+static guint mock_own(const char *name)
+{
+    unsigned int owned = mock_owned;
+    guint id;
+
+    id = g_bus_own_name_on_connection(mock_bus, name, G_BUS_NAME_OWNER_FLAGS_NONE,
+                                      on_owned, NULL, NULL, NULL);
+    while (mock_owned == owned)
+        g_main_context_iteration(NULL, TRUE);
+    return id;
+}
+
+/* a .service file makes IDLE_CM activatable without running it */
+static char *install_idle_cm(void)
+{
+    char *dir = g_dir_make_tmp("tp-test-XXXXXX", NULL);
+    char *path, *text;
+
+    if (!dir)
+        return NULL;
+    path = g_strdup_printf("%s/" TP_CM_BUS_NAME_BASE IDLE_CM ".service", dir);
+    text = g_strdup_printf("[D-BUS Service]\nName=" TP_CM_BUS_NAME_BASE IDLE_CM
+                           "\nExec=/bin/false\n");
+    g_file_set_contents(path, text, -1, NULL);
+    g_free(text);
+    g_free(path);
+    return dir;
+}
+
+static void remove_idle_cm(char *dir)
+{
+    char *path = g_strdup_printf("%s/" TP_CM_BUS_NAME_BASE IDLE_CM ".service", dir);
+
+    remove(path);
+    remove(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+static void on_change(const char *cm, const struct tp_connection_info *conn, bool added,
+                      void *user)
+{
+    if (conn)
+        log_append(events, "%s %s %s %s\n", cm, conn->bus_name, conn->protocol,
+                   added ? "up" : "gone");
+    else
+        log_append(events, "%s %s\n", cm, added ? "up" : "gone");
+}
+
+static bool stats_say(const char *text)
+{
+    char *out = NULL;
+    size_t len;
+    FILE *f = open_memstream(&out, &len);
+    bool found;
+
+    tp_registry_dump_stats(f);
+    fclose(f);
+    found = strstr(out, text) != NULL;
+    free(out);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tel = TP_CONN_BUS_NAME_BASE MOCK_CM ".tel.acct0";
+    const char *xmpp = TP_CONN_BUS_NAME_BASE MOCK_CM ".local_xmpp.acct1";
+    const char *tel2 = TP_CONN_BUS_NAME_BASE MOCK_CM ".tel.acct2";
+    const struct tp_connection_info * const *conns;
+    const struct tp_connection_info *conn;
+    const char * const *cms;
+    GTestDBus *dbus;
+    GError *error = NULL;
+    guint cm_name, tel_name;
+    char *services;
+    gint64 deadline;
+
+    dbus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    services = install_idle_cm();
+    if (services)
+        g_test_dbus_add_service_dir(dbus, services);
+    // sets DBUS_SESSION_BUS_ADDRESS, the bus tp.c uses
+    g_test_dbus_up(dbus);
+    g_timeout_add(20, wake_up, NULL);
+
+    mock_bus = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(dbus),
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error);
+    if (!mock_bus) {
+        fprintf(stderr, "mock connection manager: %s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    cm_name = mock_own(TP_CM_BUS_NAME_BASE MOCK_CM);
+    tel_name = mock_own(tel);
+    mock_own(xmpp);
+
+    check("registry started", tp_registry_start(on_change, NULL));
+    deadline = g_get_monotonic_time() + STEP_TIMEOUT_MS * 1000;
+    while (!tp_registry_ready() && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    check("listed", tp_registry_ready());
+
+    check("running manager listed, installed one not",
+          tp_registry_connection_managers(&cms) == 1 && strcmp(cms[0], MOCK_CM) == 0);
+    check("both connections listed", tp_registry_connections(&conns) == 2);
+    conn = tp_registry_find("tel");
+    check("tel connection found", conn && strcmp(conn->bus_name, tel) == 0 &&
+          strcmp(conn->cm, MOCK_CM) == 0);
+    check("'_' in the bus name is '-' in the protocol", tp_registry_find("local-xmpp") != NULL);
+
+    // from here on only NameOwnerChanged
+    mock_own(tel2);
+    check("new connection followed", wait_for(MOCK_CM " " TP_CONN_BUS_NAME_BASE MOCK_CM
+                                              ".tel.acct2 tel up\n") &&
+          tp_registry_connections(&conns) == 3);
+
+    g_bus_unown_name(tel_name);
+    check("connection gone followed", wait_for(MOCK_CM " " TP_CONN_BUS_NAME_BASE MOCK_CM
+                                               ".tel.acct0 tel gone\n"));
+    conn = tp_registry_find("tel");
+    check("the other tel connection found", conn && strcmp(conn->bus_name, tel2) == 0);
+
+    g_bus_unown_name(cm_name);
+    check("manager gone followed", wait_for(MOCK_CM " gone\n") &&
+          tp_registry_connection_managers(&cms) == 0);
+
+    check("one list call, lookups from the cache", stats_say("; 1 list calls,"));
+    check("installed manager never reported", !strstr(events, IDLE_CM));
+
+    if (failures)
+        printf("events:\n%s", events);
+    printf("tp: %u of %u checks passed\n", checks - failures, checks);
+    tp_registry_stop();
+    g_test_dbus_down(dbus);
+    if (services)
+        remove_idle_cm(services);
+    return failures;
+}
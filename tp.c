@@ -20,6 +20,7 @@
  *
  */
 
+
 /**
  * @file tp.c
  * @author Rafael Diniz
@@ -30,70 +31,270 @@
  *
  */
 
+#include <string.h>
+
 #include "tp.h"
 
-void got_connections (const gchar * const *bus_names,
-                 gsize n,
-                 const gchar * const *cms,
-                 const gchar * const *protocols,
-                 const GError *error,
-                 gpointer user_data,
-                 GObject *unused)
+static struct {
+    TpDBusDaemon *dbus;
+    TpProxySignalConnection *owner_changed;
+    guint generation;           /* replies to an earlier start are dropped */
+    GPtrArray *cms;             /* char * */
+    GPtrArray *conns;           /* struct tp_connection_info * */
+    bool listed;
+    tp_registry_cb on_change;
+    void *user;
+
+    /* statistics */
+    unsigned long long lookups;
+    unsigned long long changes;
+    unsigned int list_calls;
+} registry;
+
+static void connection_free(gpointer data)
 {
-    GMainLoop *mainloop = user_data;
+    struct tp_connection_info *conn = data;
 
-    if (error != NULL)
-    {
-        g_warning ("%s", error->message);
+    g_free(conn->bus_name);
+    g_free(conn->cm);
+    g_free(conn->protocol);
+    g_free(conn);
+}
+
+static int find_cm(const char *name)
+{
+    guint i;
+
+    for (i = 0; i < registry.cms->len; i++)
+        if (strcmp(g_ptr_array_index(registry.cms, i), name) == 0)
+            return i;
+    return -1;
+}
+
+static int find_connection(const char *bus_name)
+{
+    const struct tp_connection_info *conn;
+    guint i;
+
+    for (i = 0; i < registry.conns->len; i++) {
+        conn = g_ptr_array_index(registry.conns, i);
+        if (strcmp(conn->bus_name, bus_name) == 0)
+            return i;
     }
-    else
-    {
-        gsize i;
+    return -1;
+}
 
-        g_message ("Found %" G_GSIZE_FORMAT " connections:", n);
+static void add_cm(const char *name)
+{
+    if (find_cm(name) >= 0)
+        return;
+    g_ptr_array_add(registry.cms, g_strdup(name));
+    registry.changes++;
+    if (registry.on_change)
+        registry.on_change(name, NULL, true, registry.user);
+}
 
-        for (i = 0; i < n; i++)
-        {
-            g_message ("%s", bus_names[i]);
-            g_message ("- CM %s, protocol %s", cms[i], protocols[i]);
-        }
+static void remove_cm(const char *name)
+{
+    int i = find_cm(name);
 
-        /* all the arrays are also NULL-terminated */
-        g_assert (bus_names[n] == NULL && cms[n] == NULL &&
-                  protocols[n] == NULL);
+    if (i < 0)
+        return;
+    registry.changes++;
+    if (registry.on_change)
+        registry.on_change(name, NULL, false, registry.user);
+    g_ptr_array_remove_index(registry.cms, i);
+}
+
+static void add_connection(const char *bus_name, const char *cm, const char *protocol)
+{
+    struct tp_connection_info *conn;
+
+    if (find_connection(bus_name) >= 0)
+        return;
+    conn = g_new0(struct tp_connection_info, 1);
+    conn->bus_name = g_strdup(bus_name);
+    conn->cm = g_strdup(cm);
+    conn->protocol = g_strdup(protocol);
+    g_ptr_array_add(registry.conns, conn);
+    registry.changes++;
+    if (registry.on_change)
+        registry.on_change(cm, conn, true, registry.user);
+}
+
+static void remove_connection(const char *bus_name)
+{
+    const struct tp_connection_info *conn;
+    int i = find_connection(bus_name);
+
+    if (i < 0)
+        return;
+    conn = g_ptr_array_index(registry.conns, i);
+    registry.changes++;
+    if (registry.on_change)
+        registry.on_change(conn->cm, conn, false, registry.user);
+    g_ptr_array_remove_index(registry.conns, i);
+}
+
+/* <base><cm>.<protocol>.<account>, the protocol with '-' escaped as '_'
+ * (telepathy-spec, Connection bus names) */
+static void connection_appeared(const char *bus_name)
+{
+    const char *cm = bus_name + strlen(TP_CONN_BUS_NAME_BASE);
+    const char *protocol = strchr(cm, '.'), *end;
+    char *cm_name, *protocol_name, *p;
+
+    if (!protocol || !(end = strchr(protocol + 1, '.')))
+        return;
+    cm_name = g_strndup(cm, protocol - cm);
+    protocol_name = g_strndup(protocol + 1, end - protocol - 1);
+    for (p = protocol_name; *p; p++)
+        if (*p == '_')
+            *p = '-';
+    add_connection(bus_name, cm_name, protocol_name);
+    g_free(cm_name);
+    g_free(protocol_name);
+}
+
+static void follow_name(const char *name, bool added)
+{
+    if (g_str_has_prefix(name, TP_CM_BUS_NAME_BASE)) {
+        if (added)
+            add_cm(name + strlen(TP_CM_BUS_NAME_BASE));
+        else
+            remove_cm(name + strlen(TP_CM_BUS_NAME_BASE));
+    } else if (g_str_has_prefix(name, TP_CONN_BUS_NAME_BASE)) {
+        if (added)
+            connection_appeared(name);
+        else
+            remove_connection(name);
     }
+}
 
-    g_main_loop_quit (mainloop);
+// the only signal we need: every cm and connection owns a well known name
+static void name_owner_changed(TpDBusDaemon *proxy, const gchar *name, const gchar *old_owner,
+                               const gchar *new_owner, gpointer user_data, GObject *weak_object)
+{
+    follow_name(name, new_owner && new_owner[0]);
 }
 
-void got_connection_managers (GObject *source,
-    GAsyncResult *result,
-    gpointer user_data)
+/* Names owned right now, the ones NameOwnerChanged goes on from.
+ * tp_list_connection_managers() would add the installed (activatable)
+ * managers nobody started, and nothing would ever remove them. */
+static void got_names(TpDBusDaemon *proxy, const gchar **names, const GError *error,
+                      gpointer user_data, GObject *weak_object)
 {
-    GMainLoop *mainloop = user_data;
-    GList *cms;
-    GError *error = NULL;
+    if (GPOINTER_TO_UINT(user_data) != registry.generation || !registry.dbus)
+        return;
 
-    cms = tp_list_connection_managers_finish (result, &error);
     if (error != NULL)
+    {
+        g_warning ("%s", error->message);
+        return;
+    }
+
+    // names that showed up while listing are there already
+    for (; *names; names++)
+        follow_name(*names, true);
+    registry.listed = true;
+}
+
+bool tp_registry_start(tp_registry_cb on_change, void *user)
+{
+    GError *error = NULL;
+    gpointer generation;
+
+    if (registry.dbus)
+        return true;
+
+    registry.dbus = tp_dbus_daemon_dup(&error);
+    if (!registry.dbus)
     {
         g_warning ("%s", error->message);
         g_clear_error (&error);
+        return false;
     }
-    else
+
+    generation = GUINT_TO_POINTER(++registry.generation);
+    registry.cms = g_ptr_array_new_with_free_func(g_free);
+    registry.conns = g_ptr_array_new_with_free_func(connection_free);
+    registry.listed = false;
+    registry.on_change = on_change;
+    registry.user = user;
+
+    // follow changes first, so nothing falls between listing and following
+    registry.owner_changed = tp_cli_dbus_daemon_connect_to_name_owner_changed(
+        registry.dbus, name_owner_changed, NULL, NULL, NULL, &error);
+    if (!registry.owner_changed)
     {
-        g_message ("Found %u connection managers:", g_list_length (cms));
+        g_warning ("%s", error->message);
+        g_clear_error (&error);
+    }
 
-        while (cms != NULL)
-        {
-            TpConnectionManager *cm = cms->data;
+    tp_cli_dbus_daemon_call_list_names(registry.dbus, -1, got_names, generation, NULL, NULL);
+    registry.list_calls++;
+    return true;
+}
 
-            g_message ("- %s", tp_connection_manager_get_name (cm));
+void tp_registry_stop(void)
+{
+    if (!registry.dbus)
+        return;
+    if (registry.owner_changed)
+        tp_proxy_signal_connection_disconnect(registry.owner_changed);
+    registry.owner_changed = NULL;
+    g_object_unref(registry.dbus);
+    registry.dbus = NULL;
+    g_ptr_array_free(registry.cms, TRUE);
+    g_ptr_array_free(registry.conns, TRUE);
+    registry.cms = registry.conns = NULL;
+}
 
-            g_object_unref (cm);
-            cms = g_list_delete_link (cms, cms);
-        }
+bool tp_registry_ready(void)
+{
+    return registry.dbus && registry.listed;
+}
+
+unsigned int tp_registry_connection_managers(const char * const **names)
+{
+    registry.lookups++;
+    if (!registry.dbus)
+        return 0;
+    *names = (const char * const *) registry.cms->pdata;
+    return registry.cms->len;
+}
+
+unsigned int tp_registry_connections(const struct tp_connection_info * const **conns)
+{
+    registry.lookups++;
+    if (!registry.dbus)
+        return 0;
+    *conns = (const struct tp_connection_info * const *) registry.conns->pdata;
+    return registry.conns->len;
+}
+
+const struct tp_connection_info *tp_registry_find(const char *protocol)
+{
+    const struct tp_connection_info *conn;
+    guint i;
+
+    registry.lookups++;
+    if (!registry.dbus)
+        return NULL;
+    for (i = 0; i < registry.conns->len; i++) {
+        conn = g_ptr_array_index(registry.conns, i);
+        if (strcmp(conn->protocol, protocol) == 0)
+            return conn;
     }
+    return NULL;
+}
 
-    g_main_loop_quit (mainloop);
+void tp_registry_dump_stats(FILE *out)
+{
+    if (!registry.dbus)
+        return;
+    fprintf(out, "telepathy: %u connection managers, %u connections%s; %u list calls, "
+            "%llu changes followed, %llu lookups from cache\n", registry.cms->len,
+            registry.conns->len, tp_registry_ready() ? "" : " (still listing)",
+            registry.list_calls, registry.changes, registry.lookups);
 }
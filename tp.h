@@ -26,28 +26,49 @@
  * @date 07 Feb 2020
  * @brief Telepathy functions
  *
- * Telepathy functions
+ * A registry of the Telepathy connection managers and connections running
+ * on the session bus. Both are listed once at startup (one ListNames);
+ * after that the NameOwnerChanged signal keeps them current. The bus
+ * names are enough to do that (".ConnectionManager.<cm>" and
+ * ".Connection.<cm>.<proto>.x"), so lookups never cost a round trip.
  *
  */
 
 #ifndef HAVE_TP_H__
 #define HAVE_TP_H__
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+struct tp_connection_info {
+    char *bus_name;
+    char *cm;
+    char *protocol;             /* "tel" for the cellular one */
+};
+
+/* a connection manager or connection appeared (added true) or went away;
+ * conn is NULL for connection managers */
+typedef void (*tp_registry_cb)(const char *cm, const struct tp_connection_info *conn,
+                               bool added, void *user);
+
+/* Start listing and following, returns before the lists are in. False
+ * when there is no session bus. */
+bool tp_registry_start(tp_registry_cb on_change, void *user);
+void tp_registry_stop(void);
+
+/* the initial list arrived */
+bool tp_registry_ready(void);
 
-void got_connections (const gchar * const *bus_names,
-                             gsize n,
-                             const gchar * const *cms,
-                             const gchar * const *protocols,
-                             const GError *error,
-                             gpointer user_data,
-                             GObject *unused);
+/* cached, valid until the next change */
+unsigned int tp_registry_connection_managers(const char * const **names);
+unsigned int tp_registry_connections(const struct tp_connection_info * const **conns);
 
+/* first connection for protocol, NULL when there is none */
+const struct tp_connection_info *tp_registry_find(const char *protocol);
 
-void got_connection_managers (GObject *source,
-    GAsyncResult *result,
-    gpointer user_data);
+void tp_registry_dump_stats(FILE *out);
 
 #endif /* HAVE_TP_H__ */